@@ -0,0 +1,85 @@
+// Measures the latency of the first write to a watched allocation, which is what an application pays when it touches
+// a suspicious allocation, for each AccessWatcher backend available. Writers are spread over several threads to show
+// how the backends behave when faults arrive concurrently.
+//
+// Usage: bench-access-watcher [<ranges>] [<max-threads>]
+#include "memory-protector.h"
+#include "userfaultfd-watcher.h"
+#include "watched-page-slab.h"
+#include "library-context.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// Returns the mean time in nanoseconds from a write to a watched page until the write completes.
+static double nanosecondsPerFault(AccessWatcher& watcher, vector<char*>& ranges, unsigned int numThreads) {
+    for (char* memory : ranges) {
+        if (!watcher.watch(memory, environment.pageSize)) {
+            fprintf(stderr, "%s: watch() failed\n", watcher.name());
+            exit(1);
+        }
+    }
+
+    vector<double> threadNanoseconds(numThreads);
+    vector<thread> threads;
+    for (unsigned int t = 0; t < numThreads; t++) {
+        threads.emplace_back([&, t]() {
+            double total = 0;
+            for (size_t i = t; i < ranges.size(); i += numThreads) {
+                auto start = chrono::steady_clock::now();
+                static_cast<volatile char*>(ranges[i])[0] = 1;
+                total += chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+            }
+            threadNanoseconds[t] = total;
+        });
+    }
+    for (thread& t : threads)
+        t.join();
+
+    for (char* memory : ranges) {
+        if (!watcher.unwatch(memory)) {
+            fprintf(stderr, "%s: write not detected\n", watcher.name());
+            exit(1);
+        }
+    }
+    double total = 0;
+    for (double nanoseconds : threadNanoseconds)
+        total += nanoseconds;
+    return total / ranges.size();
+}
+
+int main(int argc, char** argv) {
+    size_t rangeCount = argc > 1 ? atol(argv[1]) : 10000;
+    unsigned int maxThreads = argc > 2 ? atoi(argv[2]) : 8;
+
+    vector<AccessWatcher*> watchers;
+    {
+        LibraryContext ctx;
+        watchers.push_back(MemoryProtector::create());
+        if (AccessWatcher* watcher = UserfaultfdWatcher::create())
+            watchers.push_back(watcher);
+        else
+            printf("userfaultfd write protection is not available, skipped.\n");
+    }
+
+    // Pages are populated beforehand, so that only the cost of the protection is measured.
+    vector<char*> ranges;
+    for (size_t i = 0; i < rangeCount; i++) {
+        char* memory = static_cast<char*>(WatchedPageSlab::instance().allocate(environment.pageSize, 1));
+        memset(memory, 0, environment.pageSize);
+        ranges.push_back(memory);
+    }
+
+    printf("%-12s %-8s %s\n", "backend", "threads", "ns per fault");
+    for (AccessWatcher* watcher : watchers) {
+        // Warm up the index nodes and the fault thread.
+        nanosecondsPerFault(*watcher, ranges, 1);
+        for (unsigned int numThreads = 1; numThreads <= maxThreads; numThreads *= 2)
+            printf("%-12s %-8u %.0f\n", watcher->name(), numThreads, nanosecondsPerFault(*watcher, ranges, numThreads));
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+// Measures the throughput of the instrumented malloc/free paths of AllocationTable with an increasing number of
+// threads, once with a single shard (equivalent to the old global mutex), once with the configured shard count and
+// once more with the configured shard count in deferred mode (ALLOC_DEFERRED_EVENTS).
+//
+// Usage: bench-allocation-table [<max-threads>] [<operations-per-thread>]
+#include "allocation-table.h"
+#include "comm-memory.h"
+#include "environment.h"
+#include "library-context.h"
+#include "access-watcher.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+
+static const int BatchSize = 64;
+
+static void allocateAndFree(unsigned int threadIndex, unsigned long operations) {
+    AllocationTable& table = AllocationTable::instance();
+    void* batch[BatchSize];
+    for (unsigned long done = 0; done < operations; done += BatchSize) {
+        for (int i = 0; i < BatchSize; i++) {
+            uint32_t size = 16 + (i % 8) * 16;
+            // Unsuspicious fingerprints, so that all allocations become light allocations.
+            CallstackFingerprint fingerprint = threadIndex * BatchSize + i;
+            batch[i] = table.instrumentedAllocate(size, AllocationTable::NoAlignment, fingerprint, [size]() {
+                return malloc(size);
+            }, AllocationTable::ZeroFill::Unnecessary);
+        }
+        for (int i = 0; i < BatchSize; i++) {
+            void* memory = batch[i];
+            table.instrumentedFree(memory, [memory]() {
+                free(memory);
+            });
+        }
+    }
+}
+
+static double runWithThreads(unsigned int numThreads, unsigned long operationsPerThread) {
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (unsigned int i = 0; i < numThreads; i++)
+        threads.emplace_back(allocateAndFree, i, operationsPerThread);
+    for (thread& t : threads)
+        t.join();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    // Each operation is one malloc() and one free().
+    return numThreads * operationsPerThread / elapsed.count();
+}
+
+int main(int argc, char** argv) {
+    unsigned int maxThreads = argc > 1 ? atoi(argv[1]) : 16;
+    unsigned long operationsPerThread = argc > 2 ? atol(argv[2]) : 200000;
+
+    *__commMemory = WatchState::Watching;
+    AccessWatcher::initialize();
+
+    // Stands in for the drain thread the patrol thread spawns in deferred mode.
+    atomic<bool> benchmarkFinished(false);
+    thread drainThread([&benchmarkFinished]() {
+        LibraryContext ctx;
+        while (!benchmarkFinished) {
+            usleep(environment.eventBufferDrainInterval * 1000);
+            AllocationTable::instance().patrolThreadDrainEventBuffers();
+        }
+    });
+
+    struct Configuration {
+        uint32_t shards;
+        bool deferred;
+    };
+    uint32_t configuredShards = environment.allocationTableShards;
+    printf("%8s %8s %8s %16s\n", "shards", "deferred", "threads", "malloc+free/s");
+    for (Configuration configuration : { Configuration { 1, false }, Configuration { configuredShards, false },
+                                         Configuration { configuredShards, true } }) {
+        environment.allocationTableShards = configuration.shards;
+        environment.deferredLightAllocations = configuration.deferred;
+        for (unsigned int numThreads = 1; numThreads <= maxThreads; numThreads *= 2) {
+            double opsPerSecond = runWithThreads(numThreads, operationsPerThread);
+            printf("%8u %8s %8u %16.0f\n", configuration.shards, configuration.deferred ? "yes" : "no", numThreads,
+                   opsPerSecond);
+        }
+        AllocationTable::instance().patrolThreadDrainEventBuffers();
+    }
+
+    benchmarkFinished = true;
+    drainThread.join();
+    AllocationStats stats;
+    std::tie(stats, std::ignore) = AllocationTable::instance().patrolThreadUpdateAllocationStates();
+    printf("Event buffer overflows: %lu\n", stats.eventBufferOverflowCount);
+    return 0;
+}
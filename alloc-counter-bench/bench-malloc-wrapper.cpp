@@ -0,0 +1,44 @@
+// Measures the cost of a malloc()/free() pair as seen by the application. Meant to be run with and without
+// liballoc-counter.so preloaded, before and after watching starts, e.g.:
+//
+//   bench-malloc-wrapper
+//   LD_PRELOAD=liballoc-counter.so bench-malloc-wrapper
+//   ALLOC_AUTO_START_TIME=1 LD_PRELOAD=liballoc-counter.so bench-malloc-wrapper 2000000 2
+//
+// Usage: bench-malloc-wrapper [<pairs>] [<seconds-to-wait-before-measuring>]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <initializer_list>
+#include <unistd.h>
+using namespace std;
+
+static const int BatchSize = 64;
+
+static double nanosecondsPerPair(size_t size, unsigned long pairs) {
+    void* volatile batch[BatchSize];
+    auto start = chrono::steady_clock::now();
+    for (unsigned long done = 0; done < pairs; done += BatchSize) {
+        for (int i = 0; i < BatchSize; i++)
+            batch[i] = malloc(size);
+        for (int i = 0; i < BatchSize; i++)
+            free(batch[i]);
+    }
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count() / pairs;
+}
+
+int main(int argc, char** argv) {
+    unsigned long pairs = argc > 1 ? atol(argv[1]) : 2000000;
+    unsigned int waitTime = argc > 2 ? atoi(argv[2]) : 0;
+    if (waitTime)
+        sleep(waitTime);
+
+    // Warm up the allocator and, if preloaded, the allocation table.
+    nanosecondsPerPair(64, pairs / 10);
+
+    printf("%-10s %s\n", "size", "ns per malloc+free");
+    for (size_t size : { 16, 64, 256, 4096 })
+        printf("%-10zu %.1f\n", size, nanosecondsPerPair(size, pairs));
+    return 0;
+}
@@ -0,0 +1,293 @@
+/* Symbolizes the stack traces of alloc-counter reports.
+ *
+ * The reports only carry raw return addresses, as "#<n> <address> [<module id>]+<offset>", and the list of modules
+ * they point into. This resolves each frame to a function and a source line, from the module itself or, if it was
+ * stripped, from its separate debug info file (<debug dir>/.build-id/xx/yyyy.debug). Resolved addresses are cached per
+ * build-id, so that symbolizing reports of the same binaries again doesn't need to parse their debug info. */
+#include "elf-symbolizer.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <unordered_map>
+
+struct ResolvedAddress {
+    string function;
+    uint64_t functionOffset = 0;
+    string file;
+    uint32_t line = 0;
+};
+
+// What the report says about a module.
+struct ReportedModule {
+    string path;
+    string buildId;
+};
+
+/** A module, opened lazily, with its cache of resolved addresses. */
+class Module {
+public:
+    Module(const ReportedModule& reported, const string& debugDirectory, const string& cacheDirectory)
+        : m_reported(reported), m_debugDirectory(debugDirectory), m_cacheDirectory(cacheDirectory) {
+        loadCache();
+    }
+
+    ~Module() { saveCache(); }
+
+    const string& path() const { return m_reported.path; }
+
+    const ResolvedAddress& resolve(uint64_t offset) {
+        auto cached = m_cache.find(offset);
+        if (cached != m_cache.end())
+            return cached->second;
+
+        ResolvedAddress& resolved = m_cache[offset];
+        m_cacheDirty = true;
+        openElfFiles();
+        // Return addresses point after the call: look up the call instruction itself for its line.
+        for (ElfSymbolizer* symbolizer : { m_debugInfo.get(), m_binary.get() }) {
+            if (symbolizer && resolved.function.empty())
+                resolved.function = symbolizer->functionAt(offset, &resolved.functionOffset);
+            if (symbolizer && !resolved.line)
+                symbolizer->lineAt(offset - 1, &resolved.file, &resolved.line);
+        }
+        return resolved;
+    }
+
+private:
+    void openElfFiles() {
+        if (m_opened)
+            return;
+        m_opened = true;
+        const string& buildId = m_reported.buildId;
+        if (buildId.size() > 2) {
+            m_debugInfo = ElfSymbolizer::open(m_debugDirectory + "/.build-id/" + buildId.substr(0, 2) + "/"
+                                              + buildId.substr(2) + ".debug");
+            if (m_debugInfo && m_debugInfo->buildId() != buildId)
+                m_debugInfo.reset();
+        }
+        m_binary = ElfSymbolizer::open(m_reported.path);
+        if (m_binary && !buildId.empty() && m_binary->buildId() != buildId) {
+            cerr << "alloc-counter-symbolize: " << m_reported.path << " has changed since the report was written"
+                 << " (build-id " << m_binary->buildId() << " instead of " << buildId << "), ignoring it" << endl;
+            m_binary.reset();
+        }
+    }
+
+    // Modules without a build-id can't be identified reliably, so they are not cached.
+    string cachePath() const {
+        if (m_cacheDirectory.empty() || m_reported.buildId.empty())
+            return string();
+        return m_cacheDirectory + "/" + m_reported.buildId + ".cache";
+    }
+
+    // Cache format, one line per address: "<offset in hex>\t<function offset in hex>\t<line>\t<function>\t<file>"
+    void loadCache() {
+        string path = cachePath();
+        if (path.empty())
+            return;
+        ifstream cache(path);
+        string line;
+        while (getline(cache, line)) {
+            istringstream fields(line);
+            uint64_t offset;
+            ResolvedAddress resolved;
+            fields >> hex >> offset >> resolved.functionOffset >> dec >> resolved.line;
+            if (fields.fail())
+                continue;
+            fields.ignore(1);
+            getline(fields, resolved.function, '\t');
+            getline(fields, resolved.file);
+            m_cache[offset] = resolved;
+        }
+    }
+
+    void saveCache() {
+        string path = cachePath();
+        if (path.empty() || !m_cacheDirty)
+            return;
+        // Write the whole cache to a temporary file and rename it, so that concurrent runs never see half a cache.
+        string temporaryPath = path + "." + to_string(getpid());
+        {
+            ofstream cache(temporaryPath);
+            for (auto& entry : m_cache) {
+                // Unresolved addresses are left out, in case debug info is installed later.
+                if (entry.second.function.empty() && !entry.second.line)
+                    continue;
+                cache << hex << entry.first << "\t" << entry.second.functionOffset << "\t" << dec << entry.second.line
+                      << "\t" << entry.second.function << "\t" << entry.second.file << "\n";
+            }
+            if (!cache)
+                return;
+        }
+        rename(temporaryPath.c_str(), path.c_str());
+    }
+
+    ReportedModule m_reported;
+    string m_debugDirectory;
+    string m_cacheDirectory;
+    bool m_opened = false;
+    unique_ptr<ElfSymbolizer> m_debugInfo;
+    unique_ptr<ElfSymbolizer> m_binary;
+    map<uint64_t, ResolvedAddress> m_cache;
+    bool m_cacheDirty = false;
+};
+
+static bool startsWith(const string& s, size_t position, const char* prefix) {
+    return s.compare(position, strlen(prefix), prefix) == 0;
+}
+
+// Parses "    [<id>] <start>-<end> base=<base> build-id=<hex or -> [unloaded ]<path>".
+static bool parseModuleLine(const string& line, unsigned int* id, ReportedModule* module) {
+    size_t position = line.find_first_not_of(' ');
+    if (position == string::npos || line[position] != '[')
+        return false;
+    char* end;
+    *id = strtoul(line.c_str() + position + 1, &end, 10);
+    position = end - line.c_str();
+    if (!startsWith(line, position, "] "))
+        return false;
+    size_t buildIdPosition = line.find(" build-id=", position);
+    if (line.find(" base=", position) == string::npos || buildIdPosition == string::npos)
+        return false;
+    buildIdPosition += strlen(" build-id=");
+    size_t pathPosition = line.find(' ', buildIdPosition);
+    if (pathPosition == string::npos)
+        return false;
+    module->buildId = line.substr(buildIdPosition, pathPosition - buildIdPosition);
+    if (module->buildId == "-")
+        module->buildId.clear();
+    pathPosition++;
+    if (startsWith(line, pathPosition, "unloaded "))
+        pathPosition += strlen("unloaded ");
+    module->path = line.substr(pathPosition);
+    return true;
+}
+
+// Parses "    #<n> <address> [<module id>]+0x<offset>". `prefix` is everything before the module id.
+static bool parseFrameLine(const string& line, string* prefix, unsigned int* id, uint64_t* offset) {
+    size_t position = line.find_first_not_of(' ');
+    if (position == string::npos || line[position] != '#')
+        return false;
+    size_t idPosition = line.find(" [", position);
+    if (idPosition == string::npos)
+        return false;
+    *prefix = line.substr(0, idPosition);
+    char* end;
+    *id = strtoul(line.c_str() + idPosition + 2, &end, 10);
+    if (strncmp(end, "]+0x", 4) != 0)
+        return false;
+    *offset = strtoull(end + 4, &end, 16);
+    return *end == '\0';
+}
+
+static string defaultCacheDirectory() {
+    string base;
+    if (const char* cacheHome = getenv("XDG_CACHE_HOME"))
+        base = cacheHome;
+    else if (const char* home = getenv("HOME"))
+        base = string(home) + "/.cache";
+    else
+        return string();
+    return base + "/alloc-counter-symbolize";
+}
+
+static void usage() {
+    cerr << "Usage: alloc-counter-symbolize [--no-cache] [--cache-dir <dir>] [--debug-dir <dir>] [report file...]\n"
+            "Writes the reports (or the standard input) with their stack traces symbolized to the standard output.\n"
+            "  --no-cache         don't read or write the cache of resolved addresses\n"
+            "  --cache-dir <dir>  cache directory (default: $XDG_CACHE_HOME/alloc-counter-symbolize)\n"
+            "  --debug-dir <dir>  where to look for .build-id/xx/yyyy.debug files (default: /usr/lib/debug)"
+         << endl;
+}
+
+static void symbolize(istream& input, const string& debugDirectory, const string& cacheDirectory) {
+    // The module list of a report comes before its stack traces, except in progress reports where modules are only
+    // listed again when new ones appear. Read everything first so that every frame can find its module.
+    vector<string> lines;
+    unordered_map<unsigned int, ReportedModule> reportedModules;
+    string line;
+    while (getline(input, line)) {
+        unsigned int id;
+        ReportedModule module;
+        if (parseModuleLine(line, &id, &module))
+            reportedModules[id] = module;
+        lines.push_back(move(line));
+    }
+
+    unordered_map<unsigned int, unique_ptr<Module>> modules;
+    for (const string& line : lines) {
+        string prefix;
+        unsigned int id;
+        uint64_t offset;
+        auto reported = reportedModules.end();
+        if (!parseFrameLine(line, &prefix, &id, &offset) || (reported = reportedModules.find(id)) == reportedModules.end()) {
+            cout << line << "\n";
+            continue;
+        }
+        unique_ptr<Module>& module = modules[id];
+        if (!module)
+            module.reset(new Module(reported->second, debugDirectory, cacheDirectory));
+        const ResolvedAddress& resolved = module->resolve(offset);
+
+        cout << prefix << " in " << (resolved.function.empty() ? "??" : resolved.function);
+        if (!resolved.function.empty())
+            cout << "+0x" << hex << resolved.functionOffset << dec;
+        if (resolved.line)
+            cout << " at " << resolved.file << ":" << resolved.line;
+        cout << " (" << module->path() << "+0x" << hex << offset << dec << ")\n";
+    }
+}
+
+int main(int argc, char** argv) {
+    string debugDirectory = "/usr/lib/debug";
+    string cacheDirectory = defaultCacheDirectory();
+    vector<string> reports;
+    for (int i = 1; i < argc; i++) {
+        string argument = argv[i];
+        if (argument == "--no-cache") {
+            cacheDirectory.clear();
+        } else if (argument == "--cache-dir" && i + 1 < argc) {
+            cacheDirectory = argv[++i];
+        } else if (argument == "--debug-dir" && i + 1 < argc) {
+            debugDirectory = argv[++i];
+        } else if (argument == "-h" || argument == "--help" || (argument[0] == '-' && argument != "-")) {
+            usage();
+            return argument[1] == 'h' || argument == "--help" ? 0 : 1;
+        } else {
+            reports.push_back(argument);
+        }
+    }
+
+    if (!cacheDirectory.empty()) {
+        // Creates $XDG_CACHE_HOME too if needed. Failures only mean that nothing gets cached.
+        for (size_t slash = cacheDirectory.find('/', 1); ; slash = cacheDirectory.find('/', slash + 1)) {
+            mkdir(cacheDirectory.substr(0, slash).c_str(), 0755);
+            if (slash == string::npos)
+                break;
+        }
+    }
+
+    if (reports.empty())
+        reports.push_back("-");
+    for (const string& report : reports) {
+        if (report == "-") {
+            symbolize(cin, debugDirectory, cacheDirectory);
+            continue;
+        }
+        ifstream input(report);
+        if (!input) {
+            cerr << "alloc-counter-symbolize: could not open " << report << ": " << strerror(errno) << endl;
+            return 1;
+        }
+        symbolize(input, debugDirectory, cacheDirectory);
+    }
+    cout.flush();
+    return 0;
+}
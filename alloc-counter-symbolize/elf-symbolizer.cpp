@@ -0,0 +1,510 @@
+#include "elf-symbolizer.h"
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cxxabi.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+struct Elf32Types {
+    typedef Elf32_Ehdr Ehdr;
+    typedef Elf32_Shdr Shdr;
+    typedef Elf32_Sym Sym;
+    typedef Elf32_Nhdr Nhdr;
+    static const unsigned char Class = ELFCLASS32;
+};
+
+struct Elf64Types {
+    typedef Elf64_Ehdr Ehdr;
+    typedef Elf64_Shdr Shdr;
+    typedef Elf64_Sym Sym;
+    typedef Elf64_Nhdr Nhdr;
+    static const unsigned char Class = ELFCLASS64;
+};
+
+bool hostIsLittleEndian() {
+    uint16_t word = 1;
+    return *reinterpret_cast<uint8_t*>(&word) == 1;
+}
+
+// DWARF constants, from the DWARF 5 standard.
+enum {
+    DW_LNS_copy = 1,
+    DW_LNS_advance_pc = 2,
+    DW_LNS_advance_line = 3,
+    DW_LNS_set_file = 4,
+    DW_LNS_const_add_pc = 8,
+    DW_LNS_fixed_advance_pc = 9,
+    DW_LNE_end_sequence = 1,
+    DW_LNE_set_address = 2,
+    DW_LNE_define_file = 3,
+    DW_LNCT_path = 1,
+    DW_LNCT_directory_index = 2,
+    DW_FORM_block = 0x09,
+    DW_FORM_block1 = 0x0a,
+    DW_FORM_data1 = 0x0b,
+    DW_FORM_data2 = 0x05,
+    DW_FORM_data4 = 0x06,
+    DW_FORM_data8 = 0x07,
+    DW_FORM_data16 = 0x1e,
+    DW_FORM_string = 0x08,
+    DW_FORM_strp = 0x0e,
+    DW_FORM_line_strp = 0x1f,
+    DW_FORM_udata = 0x0f,
+    DW_FORM_sdata = 0x0d,
+};
+
+} // namespace
+
+// Bounds checked reader of DWARF data. Reads past the end return zeros and clear `ok`.
+struct DwarfReader {
+    const uint8_t* position;
+    const uint8_t* end;
+    bool ok = true;
+
+    DwarfReader(const uint8_t* start, const uint8_t* end) : position(start), end(end) {}
+
+    bool atEnd() const { return position >= end; }
+
+    uint64_t fixed(unsigned int size) {
+        if (static_cast<size_t>(end - position) < size) {
+            ok = false;
+            position = end;
+            return 0;
+        }
+        uint64_t value = 0;
+        // Little endian only, which was checked when the file was opened.
+        for (unsigned int i = 0; i < size; i++)
+            value |= static_cast<uint64_t>(position[i]) << (8 * i);
+        position += size;
+        return value;
+    }
+    uint8_t u8() { return fixed(1); }
+    uint16_t u16() { return fixed(2); }
+    uint32_t u32() { return fixed(4); }
+
+    uint64_t uleb() {
+        uint64_t value = 0;
+        unsigned int shift = 0;
+        while (true) {
+            uint8_t byte = u8();
+            if (shift < 64)
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            shift += 7;
+            if (!(byte & 0x80) || !ok)
+                return value;
+        }
+    }
+
+    int64_t sleb() {
+        int64_t value = 0;
+        unsigned int shift = 0;
+        uint8_t byte;
+        do {
+            byte = u8();
+            if (shift < 64)
+                value |= static_cast<int64_t>(byte & 0x7f) << shift;
+            shift += 7;
+        } while ((byte & 0x80) && ok);
+        if (shift < 64 && (byte & 0x40))
+            value |= -(static_cast<int64_t>(1) << shift);
+        return value;
+    }
+
+    const char* string() {
+        const char* start = reinterpret_cast<const char*>(position);
+        const uint8_t* terminator = static_cast<const uint8_t*>(memchr(position, 0, end - position));
+        if (!terminator) {
+            ok = false;
+            position = end;
+            return "";
+        }
+        position = terminator + 1;
+        return start;
+    }
+
+    void skip(uint64_t size) {
+        if (static_cast<uint64_t>(end - position) < size) {
+            ok = false;
+            position = end;
+        } else {
+            position += size;
+        }
+    }
+};
+
+static const char* stringAt(const uint8_t* strings, size_t size, uint64_t offset) {
+    if (!strings || offset >= size || !memchr(strings + offset, 0, size - offset))
+        return "";
+    return reinterpret_cast<const char*>(strings + offset);
+}
+
+unique_ptr<ElfSymbolizer> ElfSymbolizer::open(const string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+    struct stat fileStat;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &fileStat) == 0 && fileStat.st_size >= static_cast<off_t>(EI_NIDENT))
+        data = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return nullptr;
+
+    unique_ptr<ElfSymbolizer> symbolizer(new ElfSymbolizer());
+    symbolizer->m_data = static_cast<const uint8_t*>(data);
+    symbolizer->m_size = fileStat.st_size;
+
+    const unsigned char* ident = symbolizer->m_data;
+    if (memcmp(ident, ELFMAG, SELFMAG) != 0
+        || ident[EI_DATA] != (hostIsLittleEndian() ? ELFDATA2LSB : ELFDATA2MSB)
+        || !hostIsLittleEndian()) // The DWARF reader only knows little endian.
+        return nullptr;
+    if (ident[EI_CLASS] == ELFCLASS64)
+        symbolizer->load<Elf64Types>();
+    else if (ident[EI_CLASS] == ELFCLASS32)
+        symbolizer->load<Elf32Types>();
+    else
+        return nullptr;
+    return symbolizer;
+}
+
+ElfSymbolizer::~ElfSymbolizer() {
+    if (m_data)
+        munmap(const_cast<uint8_t*>(m_data), m_size);
+}
+
+template <typename Types>
+void ElfSymbolizer::load() {
+    typedef typename Types::Ehdr Ehdr;
+    typedef typename Types::Shdr Shdr;
+    typedef typename Types::Sym Sym;
+    typedef typename Types::Nhdr Nhdr;
+
+    if (m_size < sizeof(Ehdr))
+        return;
+    const Ehdr* header = reinterpret_cast<const Ehdr*>(m_data);
+    if (header->e_shoff == 0 || header->e_shentsize != sizeof(Shdr)
+        || header->e_shoff + header->e_shnum * sizeof(Shdr) > m_size || header->e_shstrndx >= header->e_shnum)
+        return;
+    const Shdr* sections = reinterpret_cast<const Shdr*>(m_data + header->e_shoff);
+    auto contents = [this](const Shdr& section) -> const uint8_t* {
+        if (section.sh_type == SHT_NOBITS || section.sh_offset + section.sh_size > m_size)
+            return nullptr;
+        return m_data + section.sh_offset;
+    };
+    const Shdr& sectionNames = sections[header->e_shstrndx];
+    const uint8_t* names = contents(sectionNames);
+
+    const Shdr* symbolTable = nullptr;
+    const Shdr* dynamicSymbolTable = nullptr;
+    const Shdr* debugLine = nullptr;
+    const Shdr* debugLineStrings = nullptr;
+    const Shdr* debugStrings = nullptr;
+    for (unsigned int i = 0; i < header->e_shnum; i++) {
+        const Shdr& section = sections[i];
+        const char* name = stringAt(names, sectionNames.sh_size, section.sh_name);
+        if (section.sh_type == SHT_SYMTAB)
+            symbolTable = &section;
+        else if (section.sh_type == SHT_DYNSYM)
+            dynamicSymbolTable = &section;
+        else if (section.sh_flags & SHF_COMPRESSED)
+            continue;
+        else if (!strcmp(name, ".debug_line"))
+            debugLine = &section;
+        else if (!strcmp(name, ".debug_line_str"))
+            debugLineStrings = &section;
+        else if (!strcmp(name, ".debug_str"))
+            debugStrings = &section;
+
+        if (section.sh_type == SHT_NOTE && m_buildId.empty() && contents(section)) {
+            const uint8_t* note = contents(section);
+            const uint8_t* notesEnd = note + section.sh_size;
+            while (note + sizeof(Nhdr) <= notesEnd) {
+                const Nhdr* noteHeader = reinterpret_cast<const Nhdr*>(note);
+                const uint8_t* noteName = note + sizeof(Nhdr);
+                const uint8_t* description = noteName + ((noteHeader->n_namesz + 3) & ~3u);
+                if (description + noteHeader->n_descsz > notesEnd)
+                    break;
+                if (noteHeader->n_type == NT_GNU_BUILD_ID && noteHeader->n_namesz == 4 && !memcmp(noteName, "GNU", 4)) {
+                    static const char hexDigits[] = "0123456789abcdef";
+                    for (unsigned int j = 0; j < noteHeader->n_descsz; j++) {
+                        m_buildId += hexDigits[description[j] >> 4];
+                        m_buildId += hexDigits[description[j] & 15];
+                    }
+                    break;
+                }
+                note = description + ((noteHeader->n_descsz + 3) & ~3u);
+            }
+        }
+    }
+
+    // Stripped files only have the dynamic symbols.
+    if (!symbolTable)
+        symbolTable = dynamicSymbolTable;
+    if (symbolTable && symbolTable->sh_link < header->e_shnum && contents(*symbolTable)) {
+        const Shdr& stringTable = sections[symbolTable->sh_link];
+        const uint8_t* strings = contents(stringTable);
+        const Sym* symbols = reinterpret_cast<const Sym*>(contents(*symbolTable));
+        size_t symbolCount = symbolTable->sh_size / sizeof(Sym);
+        for (size_t i = 0; i < symbolCount; i++) {
+            const Sym& symbol = symbols[i];
+            unsigned char type = symbol.st_info & 0xf;
+            if ((type != STT_FUNC && type != STT_GNU_IFUNC) || symbol.st_shndx == SHN_UNDEF || !symbol.st_value)
+                continue;
+            const char* name = stringAt(strings, stringTable.sh_size, symbol.st_name);
+            if (*name)
+                m_functions.push_back({ symbol.st_value, symbol.st_size, name });
+        }
+        sort(m_functions.begin(), m_functions.end(), [](const Function& a, const Function& b) {
+            return a.start < b.start;
+        });
+    }
+
+    if (debugLine && contents(*debugLine)) {
+        loadLineTables(contents(*debugLine), debugLine->sh_size,
+                       debugLineStrings ? contents(*debugLineStrings) : nullptr,
+                       debugLineStrings ? debugLineStrings->sh_size : 0,
+                       debugStrings ? contents(*debugStrings) : nullptr, debugStrings ? debugStrings->sh_size : 0,
+                       Types::Class == ELFCLASS64 ? 8 : 4);
+    }
+}
+
+void ElfSymbolizer::loadLineTables(const uint8_t* debugLine, size_t debugLineSize, const uint8_t* lineStrings,
+                                   size_t lineStringsSize, const uint8_t* strings, size_t stringsSize,
+                                   unsigned int addressSize) {
+    DwarfReader reader(debugLine, debugLine + debugLineSize);
+    // One line table per compilation unit. A table that can't be parsed ends the section, as its length can't be
+    // trusted either.
+    while (!reader.atEnd()) {
+        if (!loadLineTable(reader, lineStrings, lineStringsSize, strings, stringsSize, addressSize))
+            break;
+    }
+    sort(m_lines.begin(), m_lines.end(), [](const LineRange& a, const LineRange& b) {
+        return a.start < b.start;
+    });
+}
+
+bool ElfSymbolizer::loadLineTable(DwarfReader& sectionReader, const uint8_t* lineStrings, size_t lineStringsSize,
+                                  const uint8_t* strings, size_t stringsSize, unsigned int addressSize) {
+    uint64_t unitLength = sectionReader.u32();
+    unsigned int offsetSize = 4;
+    if (unitLength == 0xffffffff) {
+        unitLength = sectionReader.fixed(8);
+        offsetSize = 8;
+    }
+    if (!sectionReader.ok || unitLength > static_cast<uint64_t>(sectionReader.end - sectionReader.position))
+        return false;
+    DwarfReader reader(sectionReader.position, sectionReader.position + unitLength);
+    sectionReader.skip(unitLength);
+
+    uint16_t version = reader.u16();
+    if (version < 2 || version > 5)
+        return true; // Unknown, skip it.
+    if (version >= 5) {
+        addressSize = reader.u8();
+        reader.u8(); // segment selector size
+    }
+    uint64_t headerLength = reader.fixed(offsetSize);
+    const uint8_t* programStart = reader.position + headerLength;
+    uint8_t minimumInstructionLength = reader.u8();
+    if (version >= 4)
+        reader.u8(); // maximum operations per instruction, only used by VLIW architectures
+    bool defaultIsStatement = reader.u8();
+    int8_t lineBase = static_cast<int8_t>(reader.u8());
+    uint8_t lineRange = reader.u8();
+    uint8_t opcodeBase = reader.u8();
+    vector<uint8_t> standardOpcodeLengths;
+    for (unsigned int i = 1; i < opcodeBase; i++)
+        standardOpcodeLengths.push_back(reader.u8());
+    if (!reader.ok || lineRange == 0)
+        return false;
+    (void) defaultIsStatement;
+
+    vector<string> directories;
+    // Indices in m_files of the files of this unit.
+    vector<uint32_t> files;
+    auto addFile = [&](const char* name, uint64_t directoryIndex) {
+        string path = name;
+        if (!path.empty() && path[0] != '/' && directoryIndex < directories.size() && !directories[directoryIndex].empty())
+            path = directories[directoryIndex] + "/" + path;
+        m_files.push_back(path);
+        files.push_back(m_files.size() - 1);
+    };
+
+    if (version < 5) {
+        // The compilation directory is implicitly directory 0, and files are numbered from 1.
+        directories.push_back("");
+        while (true) {
+            const char* directory = reader.string();
+            if (!*directory || !reader.ok)
+                break;
+            directories.push_back(directory);
+        }
+        m_files.push_back("");
+        files.push_back(m_files.size() - 1);
+        while (true) {
+            const char* name = reader.string();
+            if (!*name || !reader.ok)
+                break;
+            uint64_t directoryIndex = reader.uleb();
+            reader.uleb(); // modification time
+            reader.uleb(); // size
+            addFile(name, directoryIndex);
+        }
+    } else {
+        // Directories and files are described by a list of (content type, form) pairs.
+        auto readEntries = [&](bool areDirectories) {
+            vector<pair<uint64_t, uint64_t>> format;
+            uint8_t formatCount = reader.u8();
+            for (unsigned int i = 0; i < formatCount; i++) {
+                uint64_t contentType = reader.uleb();
+                uint64_t form = reader.uleb();
+                format.push_back(make_pair(contentType, form));
+            }
+            uint64_t count = reader.uleb();
+            for (uint64_t i = 0; i < count && reader.ok; i++) {
+                const char* path = "";
+                uint64_t directoryIndex = 0;
+                for (auto& contentTypeAndForm : format) {
+                    const char* stringValue = nullptr;
+                    uint64_t value = 0;
+                    switch (contentTypeAndForm.second) {
+                    case DW_FORM_string: stringValue = reader.string(); break;
+                    case DW_FORM_line_strp:
+                        stringValue = stringAt(lineStrings, lineStringsSize, reader.fixed(offsetSize));
+                        break;
+                    case DW_FORM_strp: stringValue = stringAt(strings, stringsSize, reader.fixed(offsetSize)); break;
+                    case DW_FORM_udata: value = reader.uleb(); break;
+                    case DW_FORM_sdata: value = reader.sleb(); break;
+                    case DW_FORM_data1: value = reader.u8(); break;
+                    case DW_FORM_data2: value = reader.u16(); break;
+                    case DW_FORM_data4: value = reader.u32(); break;
+                    case DW_FORM_data8: value = reader.fixed(8); break;
+                    case DW_FORM_data16: reader.skip(16); break;
+                    case DW_FORM_block: reader.skip(reader.uleb()); break;
+                    case DW_FORM_block1: reader.skip(reader.u8()); break;
+                    default:
+                        // Forms needing other sections (e.g. DW_FORM_strx) are not supported.
+                        reader.ok = false;
+                    }
+                    if (contentTypeAndForm.first == DW_LNCT_path && stringValue)
+                        path = stringValue;
+                    else if (contentTypeAndForm.first == DW_LNCT_directory_index)
+                        directoryIndex = value;
+                }
+                if (areDirectories)
+                    directories.push_back(path);
+                else
+                    addFile(path, directoryIndex);
+            }
+        };
+        readEntries(true);
+        readEntries(false);
+    }
+    if (!reader.ok || programStart > reader.end)
+        return true; // This unit is lost, but the next one can still be read.
+
+    // The line number program.
+    reader.position = programStart;
+    uint64_t address = 0;
+    uint64_t file = 1;
+    int64_t line = 1;
+    bool sequenceStarted = false;
+    uint64_t rowAddress = 0;
+    uint64_t rowFile = 0;
+    int64_t rowLine = 0;
+    auto emitRow = [&](bool endSequence) {
+        // Each row covers the instructions up to the next one in the sequence.
+        if (sequenceStarted && address > rowAddress && rowFile < files.size() && rowLine > 0)
+            m_lines.push_back({ rowAddress, address, files[rowFile], static_cast<uint32_t>(rowLine) });
+        sequenceStarted = !endSequence;
+        rowAddress = address;
+        rowFile = file;
+        rowLine = line;
+    };
+
+    while (!reader.atEnd() && reader.ok) {
+        uint8_t opcode = reader.u8();
+        if (opcode >= opcodeBase) {
+            uint8_t adjustedOpcode = opcode - opcodeBase;
+            address += (adjustedOpcode / lineRange) * minimumInstructionLength;
+            line += lineBase + adjustedOpcode % lineRange;
+            emitRow(false);
+        } else if (opcode == 0) {
+            uint64_t length = reader.uleb();
+            const uint8_t* instructionEnd = reader.position + length;
+            if (length == 0 || length > static_cast<uint64_t>(reader.end - reader.position))
+                break;
+            uint8_t extendedOpcode = reader.u8();
+            if (extendedOpcode == DW_LNE_end_sequence) {
+                emitRow(true);
+                address = 0;
+                file = 1;
+                line = 1;
+            } else if (extendedOpcode == DW_LNE_set_address) {
+                address = reader.fixed(min<uint64_t>(length - 1, addressSize));
+            } else if (extendedOpcode == DW_LNE_define_file) {
+                const char* name = reader.string();
+                uint64_t directoryIndex = reader.uleb();
+                addFile(name, directoryIndex);
+            }
+            reader.position = instructionEnd;
+        } else if (opcode == DW_LNS_copy) {
+            emitRow(false);
+        } else if (opcode == DW_LNS_advance_pc) {
+            address += reader.uleb() * minimumInstructionLength;
+        } else if (opcode == DW_LNS_advance_line) {
+            line += reader.sleb();
+        } else if (opcode == DW_LNS_set_file) {
+            file = reader.uleb();
+        } else if (opcode == DW_LNS_const_add_pc) {
+            address += ((255 - opcodeBase) / lineRange) * minimumInstructionLength;
+        } else if (opcode == DW_LNS_fixed_advance_pc) {
+            address += reader.u16();
+        } else {
+            // Column, statement and block flags, ISA... Their operands are ULEB128s.
+            for (unsigned int i = 0; i < standardOpcodeLengths[opcode - 1]; i++)
+                reader.uleb();
+        }
+    }
+    return true;
+}
+
+string ElfSymbolizer::functionAt(uint64_t address, uint64_t* offsetInFunction) const {
+    auto next = upper_bound(m_functions.begin(), m_functions.end(), address, [](uint64_t address, const Function& f) {
+        return address < f.start;
+    });
+    if (next == m_functions.begin())
+        return string();
+    const Function& function = *(next - 1);
+    // Functions without a size (e.g. hand written assembly) extend up to the next one.
+    if (function.size && address >= function.start + function.size)
+        return string();
+    *offsetInFunction = address - function.start;
+
+    int status;
+    char* demangled = abi::__cxa_demangle(function.name, nullptr, nullptr, &status);
+    string name = status == 0 && demangled ? demangled : function.name;
+    free(demangled);
+    return name;
+}
+
+bool ElfSymbolizer::lineAt(uint64_t address, string* file, uint32_t* line) const {
+    auto next = upper_bound(m_lines.begin(), m_lines.end(), address, [](uint64_t address, const LineRange& range) {
+        return address < range.start;
+    });
+    if (next == m_lines.begin())
+        return false;
+    const LineRange& range = *(next - 1);
+    if (address >= range.end)
+        return false;
+    *file = m_files[range.file];
+    *line = range.line;
+    return true;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+using namespace std;
+
+/** Resolves the addresses of an ELF file (executable, shared library or separate debug info file) to function names,
+ * from its symbol table, and to source lines, from its DWARF line tables (.debug_line, versions 2 to 5).
+ *
+ * Addresses are ELF virtual addresses, that is, the offsets from the load base written in the reports. Compressed
+ * debug sections are not supported: files using them only get function names. */
+class ElfSymbolizer {
+public:
+    // Returns nullptr if the file can't be read or is not an ELF file of the same byte order as the host.
+    static unique_ptr<ElfSymbolizer> open(const string& path);
+    ~ElfSymbolizer();
+
+    // Hex, empty if the file has no GNU build-id note.
+    const string& buildId() const { return m_buildId; }
+    bool hasLineInfo() const { return !m_lines.empty(); }
+
+    // Demangled name of the function containing `address`, or an empty string.
+    string functionAt(uint64_t address, uint64_t* offsetInFunction) const;
+    // Source location of the instruction at `address`. Returns false if unknown.
+    bool lineAt(uint64_t address, string* file, uint32_t* line) const;
+
+private:
+    ElfSymbolizer() {}
+
+    template <typename Types> void load();
+    void loadLineTables(const uint8_t* debugLine, size_t debugLineSize, const uint8_t* lineStrings,
+                        size_t lineStringsSize, const uint8_t* strings, size_t stringsSize, unsigned int addressSize);
+    bool loadLineTable(struct DwarfReader& reader, const uint8_t* lineStrings, size_t lineStringsSize,
+                       const uint8_t* strings, size_t stringsSize, unsigned int addressSize);
+
+    struct Function {
+        uint64_t start;
+        uint64_t size;
+        const char* name; // in the mapped file
+    };
+    // Instructions in [start, end) come from line `line` of m_files[file].
+    struct LineRange {
+        uint64_t start;
+        uint64_t end;
+        uint32_t file;
+        uint32_t line;
+    };
+
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+    string m_buildId;
+    vector<Function> m_functions; // sorted by start
+    vector<LineRange> m_lines; // sorted by start
+    vector<string> m_files;
+};
@@ -0,0 +1,169 @@
+#include "memory-protector.h"
+#include "userfaultfd-watcher.h"
+#include "soft-dirty-watcher.h"
+#include "watched-page-slab.h"
+#include "library-context.h"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+// Every test runs on each backend available. Backends only have to see writes, and only after the update() that follows
+// watch().
+class AccessWatcherTest: public ::testing::TestWithParam<const char*> {
+protected:
+    void SetUp() override {
+        if (!strcmp(GetParam(), "mprotect")) {
+            watcher = MemoryProtector::create();
+        } else if (!strcmp(GetParam(), "userfaultfd")) {
+            static UserfaultfdWatcher* userfaultfdWatcher = [] {
+                LibraryContext ctx;
+                return UserfaultfdWatcher::create();
+            }();
+            watcher = userfaultfdWatcher;
+        } else {
+            static SoftDirtyWatcher* softDirtyWatcher = [] {
+                LibraryContext ctx;
+                return SoftDirtyWatcher::create();
+            }();
+            // Soft-dirty bits are cleared once per watch period at most, and each test needs a clear.
+            if (softDirtyWatcher)
+                softDirtyWatcher->allowClearingSoftDirty();
+            watcher = softDirtyWatcher;
+        }
+        if (!watcher)
+            GTEST_SKIP() << GetParam() << " is not available";
+    }
+
+    AccessWatcher* watcher = nullptr;
+    WatchedPageSlab& slab = WatchedPageSlab::instance();
+    size_t pageSize = environment.pageSize;
+};
+
+TEST_P(AccessWatcherTest, UntouchedRangeIsNotAccessed) {
+    char* memory = static_cast<char*>(slab.allocate(2 * pageSize, 1));
+    memset(memory, 1, 2 * pageSize);
+    ASSERT_TRUE(watcher->watch(memory, 2 * pageSize));
+    watcher->update();
+    EXPECT_TRUE(watcher->isWatched(memory));
+    EXPECT_TRUE(watcher->isWatched(memory + pageSize));
+    EXPECT_FALSE(watcher->unwatch(memory));
+    EXPECT_FALSE(watcher->isWatched(memory));
+    // Unprotected again.
+    memory[0] = 1;
+    slab.free(memory);
+}
+
+TEST_P(AccessWatcherTest, WriteIsDetectedAndAllowed) {
+    char* memory = static_cast<char*>(slab.allocate(3 * pageSize, 1));
+    memset(memory, 1, 3 * pageSize);
+    ASSERT_TRUE(watcher->watch(memory, 3 * pageSize));
+    watcher->update();
+    // A write on the last page faults, which unprotects the whole range.
+    static_cast<volatile char*>(memory)[2 * pageSize + 10] = 42;
+    memory[0] = 7;
+    EXPECT_TRUE(watcher->unwatch(memory));
+    EXPECT_EQ(memory[0], 7);
+    EXPECT_EQ(memory[2 * pageSize + 10], 42);
+    slab.free(memory);
+}
+
+TEST_P(AccessWatcherTest, FirstTouchIsDetected) {
+    // Fresh slab slots have no pages yet.
+    char* memory = static_cast<char*>(slab.allocate(pageSize, 1));
+    ASSERT_TRUE(watcher->watch(memory, pageSize));
+    watcher->update();
+    static_cast<volatile char*>(memory)[5] = 5;
+    EXPECT_TRUE(watcher->unwatch(memory));
+    EXPECT_EQ(memory[5], 5);
+    slab.free(memory);
+}
+
+TEST_P(AccessWatcherTest, HeapMemoryCanBeWatched) {
+    // Allocations that did not fit in the slab come from memalign().
+    char* memory = static_cast<char*>(slab.allocate(32 * pageSize, 1));
+    ASSERT_FALSE(slab.owns(memory));
+    memset(memory, 0, 32 * pageSize);
+    ASSERT_TRUE(watcher->watch(memory, 32 * pageSize));
+    watcher->update();
+    memory[31 * pageSize] = 1;
+    EXPECT_TRUE(watcher->unwatch(memory));
+    slab.free(memory);
+}
+
+TEST_P(AccessWatcherTest, ConcurrentWritesToTheSameRange) {
+    char* memory = static_cast<char*>(slab.allocate(4 * pageSize, 1));
+    memset(memory, 0, 4 * pageSize);
+    ASSERT_TRUE(watcher->watch(memory, 4 * pageSize));
+    watcher->update();
+    vector<thread> threads;
+    for (size_t i = 0; i < 8; i++) {
+        threads.emplace_back([&, i]() {
+            static_cast<volatile char*>(memory)[(i % 4) * pageSize + i] = 1;
+        });
+    }
+    for (thread& t : threads)
+        t.join();
+    EXPECT_TRUE(watcher->unwatch(memory));
+    for (size_t i = 0; i < 8; i++)
+        EXPECT_EQ(memory[(i % 4) * pageSize + i], 1);
+    slab.free(memory);
+}
+
+TEST_P(AccessWatcherTest, UnwatchingUnknownMemoryDoesNothing) {
+    char* memory = static_cast<char*>(slab.allocate(pageSize, 1));
+    EXPECT_FALSE(watcher->isWatched(memory));
+    EXPECT_FALSE(watcher->unwatch(memory));
+    slab.free(memory);
+}
+
+TEST(MemoryProtectorTest, ReadIsDetected) {
+    AccessWatcher* watcher = MemoryProtector::create();
+    char* memory = static_cast<char*>(WatchedPageSlab::instance().allocate(environment.pageSize, 1));
+    memory[3] = 3;
+    ASSERT_TRUE(watcher->watch(memory, environment.pageSize));
+    watcher->update();
+    EXPECT_EQ(static_cast<volatile char*>(memory)[3], 3);
+    EXPECT_TRUE(watcher->unwatch(memory));
+    WatchedPageSlab::instance().free(memory);
+}
+
+TEST(SoftDirtyWatcherTest, RangeNeverCheckedCountsAsAccessed) {
+    static SoftDirtyWatcher* watcher = [] {
+        LibraryContext ctx;
+        return SoftDirtyWatcher::create();
+    }();
+    if (!watcher)
+        GTEST_SKIP() << "softdirty is not available";
+    char* memory = static_cast<char*>(WatchedPageSlab::instance().allocate(environment.pageSize, 1));
+    ASSERT_TRUE(watcher->watch(memory, environment.pageSize));
+    // Unwatched before any update(): whether it's in use is unknown, so it must not look leaked.
+    EXPECT_TRUE(watcher->unwatch(memory));
+    WatchedPageSlab::instance().free(memory);
+}
+
+TEST(WatchedPageIndexTest, RemovedRangesLeaveTombstones) {
+    WatchedPageIndex index;
+    char* memory = reinterpret_cast<char*>(0x10000000);
+    size_t pageSize = environment.pageSize;
+    void* rangeStart;
+    uint32_t rangePages;
+    ASSERT_TRUE(index.add(memory, 2));
+    EXPECT_FALSE(index.remove(memory));
+    EXPECT_FALSE(index.contains(memory));
+    EXPECT_EQ(index.rangePagesAt(memory), 0u);
+    // A fault raised before the removal is still recognized.
+    EXPECT_EQ(index.markAccessed(memory + pageSize, &rangeStart, &rangePages), WatchedPageIndex::AccessResult::Removed);
+    EXPECT_FALSE(index.remove(memory));
+
+    // A range added over the tombstones is not forgotten with them.
+    ASSERT_TRUE(index.add(memory + pageSize, 1));
+    index.forget(memory, 2);
+    EXPECT_EQ(index.markAccessed(memory, &rangeStart, &rangePages), WatchedPageIndex::AccessResult::NotWatched);
+    EXPECT_EQ(index.markAccessed(memory + pageSize, &rangeStart, &rangePages),
+              WatchedPageIndex::AccessResult::FirstAccess);
+    EXPECT_TRUE(index.remove(memory + pageSize));
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, AccessWatcherTest, ::testing::Values("mprotect", "userfaultfd", "softdirty"));
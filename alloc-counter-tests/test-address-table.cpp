@@ -0,0 +1,191 @@
+#include "address-table.h"
+#include <gtest/gtest.h>
+#include <vector>
+#include <algorithm>
+
+class AddressTableTest: public ::testing::Test {
+};
+
+static void* pointer(uintptr_t address) {
+    return reinterpret_cast<void*>(address);
+}
+
+TEST_F(AddressTableTest, EntriesAreStored) {
+    AddressTable table;
+    EXPECT_EQ(table.find(pointer(0x1000)), nullptr);
+    AddressTable::Entry& entry = table.insert(pointer(0x1000), AddressTable::Kind::Light, 30);
+    entry.setValue(0x1234567800000040);
+    EXPECT_EQ(table.size(), 1);
+
+    AddressTable::Entry* found = table.find(pointer(0x1000));
+    ASSERT_NE(found, nullptr);
+    EXPECT_EQ(found->memory(), pointer(0x1000));
+    EXPECT_EQ(found->kind(), AddressTable::Kind::Light);
+    EXPECT_EQ(found->deadline(), 30);
+    EXPECT_EQ(found->value(), 0x1234567800000040u);
+    EXPECT_EQ(table.find(pointer(0x1008)), nullptr);
+}
+
+TEST_F(AddressTableTest, HighPointersAreCompressedLosslessly) {
+    AddressTable table;
+    void* high = pointer(0x7ffff7a3c010);
+    table.insert(high, AddressTable::Kind::CloselyWatched, 0);
+    AddressTable::Entry* found = table.find(high);
+    ASSERT_NE(found, nullptr);
+    EXPECT_EQ(found->memory(), high);
+    EXPECT_EQ(found->kind(), AddressTable::Kind::CloselyWatched);
+}
+
+TEST_F(AddressTableTest, FiveLevelPagingPointersAreStored) {
+    AddressTable table;
+    void* high = pointer(0xff7ffff7a3c010);
+    EXPECT_TRUE(AddressTable::canStore(high));
+    table.insert(high, AddressTable::Kind::Light, 0);
+    ASSERT_NE(table.find(high), nullptr);
+    EXPECT_EQ(table.find(high)->memory(), high);
+    EXPECT_FALSE(AddressTable::canStore(pointer(0x0a00007ff7a3c010)));
+}
+
+TEST_F(AddressTableTest, UnalignedPointersCannotBeStored) {
+    EXPECT_FALSE(AddressTable::canStore(pointer(0x1001)));
+    EXPECT_TRUE(AddressTable::canStore(pointer(0x1008)));
+    AddressTable table;
+    table.insert(pointer(0x1000), AddressTable::Kind::Light, 0);
+    EXPECT_EQ(table.find(pointer(0x1001)), nullptr);
+}
+
+TEST_F(AddressTableTest, InsertingTwiceReplacesTheKind) {
+    AddressTable table;
+    table.insert(pointer(0x1000), AddressTable::Kind::Light, 0);
+    table.insert(pointer(0x1000), AddressTable::Kind::CloselyWatched, 0);
+    EXPECT_EQ(table.size(), 1);
+    EXPECT_EQ(table.find(pointer(0x1000))->kind(), AddressTable::Kind::CloselyWatched);
+}
+
+TEST_F(AddressTableTest, ErasedEntriesAreNotFound) {
+    AddressTable table;
+    table.insert(pointer(0x1000), AddressTable::Kind::Light, 0);
+    table.insert(pointer(0x2000), AddressTable::Kind::Light, 0);
+    table.erase(*table.find(pointer(0x1000)));
+    EXPECT_EQ(table.size(), 1);
+    EXPECT_EQ(table.find(pointer(0x1000)), nullptr);
+    EXPECT_NE(table.find(pointer(0x2000)), nullptr);
+}
+
+TEST_F(AddressTableTest, SurvivesGrowthAndChurn) {
+    AddressTable table;
+    const uintptr_t count = 100000;
+    for (uintptr_t i = 1; i <= count; i++)
+        table.insert(pointer(i * 16), AddressTable::Kind::Light, 0).setValue(i);
+    EXPECT_EQ(table.size(), count);
+
+    // Erase the odd ones and insert new ones, so that deleted entries pile up and force rehashes.
+    for (uintptr_t i = 1; i <= count; i += 2) {
+        table.erase(*table.find(pointer(i * 16)));
+        table.insert(pointer((count + i) * 16), AddressTable::Kind::Light, 0).setValue(count + i);
+    }
+    EXPECT_EQ(table.size(), count);
+    for (uintptr_t i = 1; i <= count; i++) {
+        AddressTable::Entry* found = table.find(pointer(i * 16));
+        if (i % 2) {
+            EXPECT_EQ(found, nullptr);
+        } else {
+            ASSERT_NE(found, nullptr);
+            EXPECT_EQ(found->value(), i);
+        }
+    }
+
+    uintptr_t visited = 0;
+    table.forEach([&](AddressTable::Entry& entry) {
+        visited++;
+        table.erase(entry);
+    });
+    EXPECT_EQ(visited, count);
+    EXPECT_EQ(table.size(), 0);
+}
+
+static vector<uintptr_t> expire(AddressTable& table, uint32_t now) {
+    vector<uintptr_t> expired;
+    table.forEachExpired(now, [&](AddressTable::Entry& entry) {
+        expired.push_back(reinterpret_cast<uintptr_t>(entry.memory()));
+        table.erase(entry);
+    });
+    std::sort(expired.begin(), expired.end());
+    return expired;
+}
+
+TEST_F(AddressTableTest, OnlyExpiredEntriesAreVisited) {
+    AddressTable table;
+    expire(table, 1000);
+    table.insert(pointer(0x1000), AddressTable::Kind::Light, 1010);
+    table.insert(pointer(0x2000), AddressTable::Kind::Light, 1020);
+    table.insert(pointer(0x3000), AddressTable::Kind::CloselyWatched, 1010);
+    // Shares its slot with the ones above, but a whole turn later.
+    table.insert(pointer(0x4000), AddressTable::Kind::Light, 1010 + AddressTable::WheelSlots);
+
+    EXPECT_EQ(expire(table, 1010), vector<uintptr_t>());
+    EXPECT_EQ(expire(table, 1011), vector<uintptr_t>({ 0x1000, 0x3000 }));
+    EXPECT_EQ(expire(table, 1015), vector<uintptr_t>());
+    EXPECT_EQ(expire(table, 1100), vector<uintptr_t>({ 0x2000 }));
+    EXPECT_EQ(table.size(), 1);
+    EXPECT_EQ(expire(table, 2000), vector<uintptr_t>({ 0x4000 }));
+    EXPECT_EQ(table.size(), 0);
+}
+
+TEST_F(AddressTableTest, ErasedAndRescheduledEntriesLeaveTheirSlot) {
+    AddressTable table;
+    expire(table, 1000);
+    for (uintptr_t i = 1; i <= 4; i++)
+        table.insert(pointer(i * 0x1000), AddressTable::Kind::Light, 1010);
+    table.erase(*table.find(pointer(0x2000)));
+    table.setDeadline(*table.find(pointer(0x3000)), 1050);
+    EXPECT_EQ(expire(table, 1011), vector<uintptr_t>({ 0x1000, 0x4000 }));
+    EXPECT_EQ(expire(table, 1051), vector<uintptr_t>({ 0x3000 }));
+}
+
+TEST_F(AddressTableTest, PastDeadlinesExpireOnTheNextCall) {
+    AddressTable table;
+    expire(table, 1000);
+    table.insert(pointer(0x1000), AddressTable::Kind::Light, 900);
+    EXPECT_EQ(expire(table, 1001), vector<uintptr_t>({ 0x1000 }));
+}
+
+TEST_F(AddressTableTest, NextDeadlineIsTheFirstUsedSlot) {
+    AddressTable table;
+    expire(table, 1000);
+    EXPECT_EQ(table.nextDeadline(), 1000 + AddressTable::WheelSlots);
+    table.insert(pointer(0x1000), AddressTable::Kind::Light, 1020);
+    table.insert(pointer(0x2000), AddressTable::Kind::Light, 1010 + AddressTable::WheelSlots);
+    EXPECT_EQ(table.nextDeadline(), 1010);
+    expire(table, 1011);
+    EXPECT_EQ(table.nextDeadline(), 1020);
+    expire(table, 1021);
+    EXPECT_EQ(table.nextDeadline(), 1010 + AddressTable::WheelSlots);
+}
+
+TEST_F(AddressTableTest, RehashingKeepsTheWheel) {
+    AddressTable table;
+    expire(table, 1000);
+    const uintptr_t count = 10000;
+    for (uintptr_t i = 1; i <= count; i++)
+        table.insert(pointer(i * 16), AddressTable::Kind::Light, 1000 + i % 100);
+    for (uintptr_t i = 1; i <= count; i += 2)
+        table.erase(*table.find(pointer(i * 16)));
+
+    uintptr_t expired = 0;
+    for (uint32_t now = 1001; now <= 1100; now++) {
+        table.forEachExpired(now, [&](AddressTable::Entry& entry) {
+            EXPECT_LT(entry.deadline(), now);
+            EXPECT_EQ(reinterpret_cast<uintptr_t>(entry.memory()) / 16 % 2, 0);
+            expired++;
+            table.erase(entry);
+        });
+    }
+    EXPECT_EQ(expired, count / 2);
+    EXPECT_EQ(table.size(), 0);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,52 @@
+#include "allocation-sampler.h"
+#include <gtest/gtest.h>
+#include <cmath>
+
+class AllocationSamplerTest: public ::testing::Test {
+protected:
+    void TearDown() override {
+        environment.sampleRate = 0;
+    }
+
+    // Adds up the weights of the sampled allocations, which should be close to the number of allocations made.
+    static double estimateAllocationCount(uint32_t size, uint32_t count) {
+        double estimate = 0;
+        for (uint32_t i = 0; i < count; i++)
+            estimate += AllocationSampler::sample(size);
+        return estimate;
+    }
+};
+
+TEST_F(AllocationSamplerTest, EverythingIsSampledWhenDisabled) {
+    environment.sampleRate = 0;
+    for (uint32_t size : { 0, 1, 100, 1 << 20 })
+        EXPECT_EQ(AllocationSampler::sample(size), 1);
+}
+
+TEST_F(AllocationSamplerTest, BigAllocationsAreAlwaysSampled) {
+    environment.sampleRate = 1024;
+    for (int i = 0; i < 100; i++)
+        EXPECT_FLOAT_EQ(AllocationSampler::sample(1 << 20), 1);
+}
+
+TEST_F(AllocationSamplerTest, EstimatesAreUnbiased) {
+    environment.sampleRate = 4096;
+    const uint32_t count = 2000000;
+    for (uint32_t size : { 16, 512, 4096, 20000 }) {
+        // The number of samples is binomial, allow 5 standard deviations of relative error so that this never fails
+        // by chance.
+        double probability = -expm1(-(double) size / environment.sampleRate);
+        double tolerance = 5 * sqrt((1 - probability) / (count * probability));
+        EXPECT_NEAR(estimateAllocationCount(size, count) / count, 1.0, tolerance) << "size = " << size;
+    }
+}
+
+TEST_F(AllocationSamplerTest, SmallAllocationsAreMostlySkipped) {
+    environment.sampleRate = 4096;
+    uint32_t sampled = 0;
+    for (int i = 0; i < 100000; i++)
+        sampled += AllocationSampler::sample(16) != 0;
+    // The expected number is 100000 * (1 - exp(-16 / 4096)) ~= 390.
+    EXPECT_GT(sampled, 250u);
+    EXPECT_LT(sampled, 550u);
+}
@@ -0,0 +1,86 @@
+#include "allocation-table.h"
+#include "access-watcher.h"
+#include "coarse-clock.h"
+#include "comm-memory.h"
+#include "watched-page-slab.h"
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+class AllocationTableTest: public ::testing::Test {
+protected:
+    void SetUp() override {
+        *__commMemory = WatchState::Watching;
+        environment.timeForAllocationToBecomeSuspicious = 0;
+        AccessWatcher::initialize();
+    }
+
+    void TearDown() override {
+        *__commMemory = WatchState::NotWatching;
+        environment.timeForAllocationToBecomeSuspicious = m_savedTimeSuspicious;
+    }
+
+    void* allocate(CallstackFingerprint fingerprint, uint32_t size) {
+        return table.instrumentedAllocate(size, AllocationTable::NoAlignment, fingerprint, [size]() {
+            return malloc(size);
+        }, AllocationTable::ZeroFill::Unnecessary);
+    }
+
+    // Lets a light allocation with `fingerprint` outlive its deadline, so that the next ones are closely watched.
+    void makeSuspicious(CallstackFingerprint fingerprint) {
+        void* memory = allocate(fingerprint, 16);
+        usleep(2 * environment.clockResolution * 1000);
+        CoarseClock::advance();
+        table.patrolThreadUpdateAllocationStates();
+        table.instrumentedFree(memory, [memory]() {
+            free(memory);
+        });
+    }
+
+    size_t liveSlabAllocations() {
+        return WatchedPageSlab::instance().stats().liveSlabAllocations;
+    }
+
+    AllocationTable& table = AllocationTable::instance();
+    uint32_t m_savedTimeSuspicious = environment.timeForAllocationToBecomeSuspicious;
+};
+
+// Any LD_PRELOADed child process resets the shared watch state, so the slab must be used until the end.
+TEST_F(AllocationTableTest, SlabMemoryIsFreedToTheSlabAfterWatchingStopped) {
+    makeSuspicious(0xf5ee);
+    size_t liveBefore = liveSlabAllocations();
+    void* memory = allocate(0xf5ee, 100);
+    ASSERT_TRUE(WatchedPageSlab::instance().owns(memory));
+    EXPECT_EQ(liveSlabAllocations(), liveBefore + 1);
+
+    *__commMemory = WatchState::NotWatching;
+    table.instrumentedFree(memory, []() {
+        ADD_FAILURE() << "Slab memory passed to the real free()";
+    });
+    EXPECT_EQ(liveSlabAllocations(), liveBefore);
+}
+
+TEST_F(AllocationTableTest, SlabMemoryIsReallocatedAfterWatchingStopped) {
+    makeSuspicious(0xa11c);
+    size_t liveBefore = liveSlabAllocations();
+    char* memory = static_cast<char*>(allocate(0xa11c, 100));
+    ASSERT_TRUE(WatchedPageSlab::instance().owns(memory));
+    memset(memory, 'x', 100);
+
+    *__commMemory = WatchState::NotWatching;
+    char* newMemory = static_cast<char*>(table.instrumentedReallocate(memory, 3 * environment.pageSize, []() -> void* {
+        ADD_FAILURE() << "Slab memory passed to the real realloc()";
+        return nullptr;
+    }));
+    ASSERT_NE(newMemory, nullptr);
+    for (int i = 0; i < 100; i++)
+        ASSERT_EQ(newMemory[i], 'x');
+    // Still closely watched, in a bigger slot.
+    EXPECT_TRUE(WatchedPageSlab::instance().owns(newMemory));
+    EXPECT_EQ(WatchedPageSlab::instance().usableSize(newMemory), 3 * environment.pageSize);
+    table.instrumentedFree(newMemory, [newMemory]() {
+        free(newMemory);
+    });
+    EXPECT_EQ(liveSlabAllocations(), liveBefore);
+}
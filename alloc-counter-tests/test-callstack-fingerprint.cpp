@@ -0,0 +1,87 @@
+#include "callstack-fingerprint.h"
+#include <gtest/gtest.h>
+
+namespace {
+
+// Computes the fingerprint as the malloc() wrappers do, with this function in the place of malloc().
+__attribute__((noinline)) CallstackFingerprint fingerprintHere() {
+    int stackTop;
+    return computeCallstackFingerprint(&stackTop, __builtin_return_address(0), __builtin_frame_address(0), 64);
+}
+
+// Two code paths sharing the call to "malloc()".
+__attribute__((noinline)) CallstackFingerprint sharedCaller() {
+    CallstackFingerprint fingerprint = fingerprintHere();
+    asm volatile("" ::: "memory"); // No tail call.
+    return fingerprint;
+}
+
+__attribute__((noinline)) CallstackFingerprint firstPath() {
+    CallstackFingerprint fingerprint = sharedCaller();
+    asm volatile("" ::: "memory");
+    return fingerprint;
+}
+
+__attribute__((noinline)) CallstackFingerprint secondPath() {
+    CallstackFingerprint fingerprint = sharedCaller();
+    asm volatile("" ::: "memory");
+    return fingerprint;
+}
+
+} // namespace
+
+class CallstackFingerprintTest: public ::testing::Test {
+protected:
+    ~CallstackFingerprintTest() {
+        environment.fingerprintDepth = m_savedDepth;
+    }
+
+    uint32_t m_savedDepth = environment.fingerprintDepth;
+};
+
+TEST_F(CallstackFingerprintTest, SizeClassesSpanAtMostAQuarter) {
+    uint32_t classStart = 1;
+    uint32_t previousClass = callstackFingerprintSizeClass(1);
+    for (uint32_t size = 2; size < (1u << 22); size++) {
+        uint32_t sizeClass = callstackFingerprintSizeClass(size);
+        ASSERT_GE(sizeClass, previousClass);
+        if (sizeClass != previousClass)
+            classStart = size;
+        ASSERT_LE(size - classStart, classStart / 4) << size;
+        previousClass = sizeClass;
+    }
+    EXPECT_EQ(callstackFingerprintSizeClass(100), 100u);
+    EXPECT_NE(callstackFingerprintSizeClass(1000), callstackFingerprintSizeClass(2000));
+}
+
+TEST_F(CallstackFingerprintTest, SamePathSameFingerprint) {
+    environment.fingerprintDepth = 3;
+    // From a single call site, as the third return address is the one into this function.
+    CallstackFingerprint fingerprints[2];
+    for (CallstackFingerprint& fingerprint : fingerprints)
+        fingerprint = firstPath();
+    EXPECT_EQ(fingerprints[0], fingerprints[1]);
+}
+
+TEST_F(CallstackFingerprintTest, DeeperFingerprintsTellCallersApart) {
+    environment.fingerprintDepth = 3;
+    EXPECT_NE(firstPath(), secondPath());
+}
+
+TEST_F(CallstackFingerprintTest, BrokenFrameChainsEndTheWalk) {
+    int stackTop;
+    void* returnAddress = reinterpret_cast<void*>(0x401234);
+    environment.fingerprintDepth = 1;
+    CallstackFingerprint shallow = computeCallstackFingerprint(&stackTop, returnAddress, nullptr, 64);
+
+    // Frame records pointing down the stack, outside of it or misaligned are not followed.
+    uintptr_t frames[][2] = {
+        { reinterpret_cast<uintptr_t>(&stackTop) - 64, 0x401000 },
+        { 0x10, 0x401000 },
+        { ~uintptr_t(0) - 8, 0x401000 },
+        { reinterpret_cast<uintptr_t>(&frames) + 1, 0x401000 },
+    };
+    environment.fingerprintDepth = 8;
+    for (auto& frame : frames)
+        EXPECT_EQ(computeCallstackFingerprint(&stackTop, returnAddress, frame, 64), shallow);
+}
@@ -0,0 +1,51 @@
+#include "elf-symbolizer.h"
+#include <gtest/gtest.h>
+#include <link.h>
+
+namespace {
+
+// The tests are built with debug info (-g), so this line is in the line table.
+static const uint32_t symbolizedFunctionLine = __LINE__ + 1;
+__attribute__((noinline)) int symbolizedFunction(int x) {
+    return x * 3 + 1;
+}
+
+// ELF virtual address of a function of the test executable.
+uint64_t executableAddressOf(void* function) {
+    uintptr_t base = 0;
+    // The executable comes first.
+    dl_iterate_phdr([](struct dl_phdr_info* info, size_t, void* data) {
+        *static_cast<uintptr_t*>(data) = info->dlpi_addr;
+        return 1;
+    }, &base);
+    return reinterpret_cast<uintptr_t>(function) - base;
+}
+
+bool endsWith(const string& s, const string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+} // namespace
+
+TEST(ElfSymbolizerTest, ResolvesFunctionsAndLines) {
+    unique_ptr<ElfSymbolizer> symbolizer = ElfSymbolizer::open("/proc/self/exe");
+    ASSERT_NE(symbolizer, nullptr);
+    ASSERT_TRUE(symbolizer->hasLineInfo());
+    uint64_t address = executableAddressOf(reinterpret_cast<void*>(&symbolizedFunction));
+
+    uint64_t offset = 1234;
+    EXPECT_EQ(symbolizer->functionAt(address + 2, &offset), "(anonymous namespace)::symbolizedFunction(int)");
+    EXPECT_EQ(offset, 2u);
+
+    string file;
+    uint32_t line = 0;
+    ASSERT_TRUE(symbolizer->lineAt(address, &file, &line));
+    EXPECT_TRUE(endsWith(file, "alloc-counter-tests/test-elf-symbolizer.cpp")) << file;
+    EXPECT_EQ(line, symbolizedFunctionLine);
+    EXPECT_EQ(symbolizedFunction(1), 4);
+}
+
+TEST(ElfSymbolizerTest, RejectsNonElfFiles) {
+    EXPECT_EQ(ElfSymbolizer::open("/proc/self/cmdline"), nullptr);
+    EXPECT_EQ(ElfSymbolizer::open("/nonexistent"), nullptr);
+}
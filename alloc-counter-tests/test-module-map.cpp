@@ -0,0 +1,32 @@
+#include "module-map.h"
+#include <gtest/gtest.h>
+#include <dlfcn.h>
+#include <link.h>
+
+static void functionInTheExecutable() {}
+
+TEST(ModuleMapTest, ExecutableIsKnownAfterUpdate) {
+    uint32_t generation = ModuleMap::instance().update();
+    EXPECT_EQ(ModuleMap::instance().generation(), generation);
+    ModuleMap::Module module;
+    ASSERT_TRUE(ModuleMap::instance().find(reinterpret_cast<void*>(&functionInTheExecutable), generation, module));
+    EXPECT_NE(module.path.find("alloc-counter-tests"), string::npos);
+}
+
+// The patrol thread updates the map, so traces captured just after a dlopen() carry the previous generation.
+TEST(ModuleMapTest, ModuleLoadedBeforeTheUpdateIsFound) {
+    uint32_t generation = ModuleMap::instance().update();
+    void* handle = dlopen("libresolv.so.2", RTLD_NOW | RTLD_LOCAL);
+    if (!handle)
+        GTEST_SKIP() << "libresolv.so.2 is not available";
+    struct link_map* linkMap = nullptr;
+    ASSERT_EQ(dlinfo(handle, RTLD_DI_LINKMAP, &linkMap), 0);
+    EXPECT_EQ(ModuleMap::instance().generation(), generation);
+
+    ModuleMap::instance().update();
+    ModuleMap::Module module;
+    ASSERT_TRUE(ModuleMap::instance().find(linkMap->l_ld, generation, module));
+    EXPECT_NE(module.path.find("libresolv"), string::npos);
+    EXPECT_GT(module.loadedGeneration, generation);
+    dlclose(handle);
+}
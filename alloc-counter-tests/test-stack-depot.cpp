@@ -0,0 +1,81 @@
+#include "stack-depot.h"
+#include <gtest/gtest.h>
+#include <memory>
+#include <thread>
+#include <vector>
+
+class StackDepotTest: public ::testing::Test {
+protected:
+    // A depot of its own, so that the IDs are predictable.
+    unique_ptr<StackDepot> m_depot { new StackDepot() };
+
+    static vector<void*> makeTrace(uintptr_t seed, size_t size) {
+        vector<void*> frames;
+        for (size_t i = 0; i < size; i++)
+            frames.push_back(reinterpret_cast<void*>(0x400000 + seed * 0x1000 + i * 8));
+        return frames;
+    }
+
+    StackId put(const vector<void*>& frames) { return m_depot->put(frames.data(), frames.size()); }
+};
+
+TEST_F(StackDepotTest, SameTraceSameId) {
+    vector<void*> trace = makeTrace(1, 10);
+    StackId id = put(trace);
+    EXPECT_NE(id, StackDepot::NoStack);
+    EXPECT_EQ(put(trace), id);
+    EXPECT_EQ(m_depot->stackCount(), 1u);
+}
+
+TEST_F(StackDepotTest, DifferentTracesDifferentIds) {
+    vector<void*> trace = makeTrace(1, 10);
+    vector<void*> shorter(trace.begin(), trace.end() - 1);
+    vector<void*> otherFrame = trace;
+    otherFrame[5] = reinterpret_cast<void*>(0x1234);
+    StackId id = put(trace);
+    EXPECT_NE(put(shorter), id);
+    EXPECT_NE(put(otherFrame), id);
+    EXPECT_NE(put(shorter), put(otherFrame));
+    EXPECT_EQ(m_depot->stackCount(), 3u);
+}
+
+TEST_F(StackDepotTest, GetReturnsTheFrames) {
+    vector<StackId> ids;
+    for (uintptr_t i = 0; i < 1000; i++)
+        ids.push_back(put(makeTrace(i, i % 40)));
+    for (uintptr_t i = 0; i < 1000; i++) {
+        StackDepot::Frames frames = m_depot->get(ids[i]);
+        EXPECT_EQ(vector<void*>(frames.begin(), frames.end()), makeTrace(i, i % 40));
+    }
+    EXPECT_GT(m_depot->memoryFootprint(), 0u);
+}
+
+TEST_F(StackDepotTest, ConcurrentPutsAgree) {
+    const unsigned int threadCount = 8;
+    const uintptr_t traceCount = 2000;
+    vector<vector<StackId>> ids(threadCount);
+    vector<thread> threads;
+    for (unsigned int t = 0; t < threadCount; t++) {
+        threads.emplace_back([&, t] {
+            // Each thread adds the same traces, in a different order.
+            ids[t].resize(traceCount);
+            for (uintptr_t i = 0; i < traceCount; i++) {
+                uintptr_t trace = (i * 7 + t * 131) % traceCount;
+                ids[t][trace] = put(makeTrace(trace, 16));
+            }
+        });
+    }
+    for (thread& thread : threads)
+        thread.join();
+    for (unsigned int t = 1; t < threadCount; t++)
+        EXPECT_EQ(ids[t], ids[0]);
+    EXPECT_EQ(m_depot->stackCount(), traceCount);
+}
+
+TEST_F(StackDepotTest, CaptureIsDeduplicated) {
+    vector<StackId> ids;
+    for (int i = 0; i < 2; i++)
+        ids.push_back(m_depot->capture());
+    EXPECT_EQ(ids[0], ids[1]);
+    EXPECT_GT(m_depot->get(ids[0]).size(), 0u);
+}
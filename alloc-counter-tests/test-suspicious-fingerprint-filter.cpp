@@ -0,0 +1,51 @@
+#include "suspicious-fingerprint-filter.h"
+#include <gtest/gtest.h>
+#include <vector>
+
+class SuspiciousFingerprintFilterTest: public ::testing::Test {
+protected:
+    // Publishes `count` more fingerprints, as the patrol thread does after adding them to the table.
+    void addFingerprints(uint32_t count) {
+        vector<CallstackFingerprint> added;
+        for (uint32_t i = 0; i < count; i++) {
+            CallstackFingerprint fingerprint = m_next * 2654435761u;
+            m_next++;
+            added.push_back(fingerprint);
+            m_all.push_back(fingerprint);
+        }
+        m_filter.publish(added, [this](auto function) {
+            for (CallstackFingerprint fingerprint : m_all)
+                function(fingerprint);
+        });
+    }
+
+    SuspiciousFingerprintFilter m_filter;
+    vector<CallstackFingerprint> m_all;
+    uint32_t m_next = 1;
+};
+
+TEST_F(SuspiciousFingerprintFilterTest, EmptyFilterContainsNothing) {
+    EXPECT_FALSE(m_filter.mayContain(0));
+    EXPECT_FALSE(m_filter.mayContain(1234));
+    EXPECT_EQ(m_filter.memoryFootprint(), 0);
+}
+
+TEST_F(SuspiciousFingerprintFilterTest, NoFalseNegativesAcrossGrowth) {
+    for (int round = 0; round < 20; round++) {
+        addFingerprints(1000);
+        for (CallstackFingerprint fingerprint : m_all)
+            ASSERT_TRUE(m_filter.mayContain(fingerprint));
+    }
+}
+
+TEST_F(SuspiciousFingerprintFilterTest, FalsePositivesAreRare) {
+    addFingerprints(20000);
+    uint32_t falsePositives = 0;
+    const uint32_t probes = 100000;
+    for (uint32_t i = 0; i < probes; i++) {
+        // Odd multiples of a different constant, which are never published.
+        if (m_filter.mayContain((i * 2 + 1) * 40503u + 7))
+            falsePositives++;
+    }
+    EXPECT_LT(falsePositives, probes / 100);
+}
@@ -0,0 +1,92 @@
+#include "watched-page-slab.h"
+#include <gtest/gtest.h>
+#include <sys/mman.h>
+#include <cstring>
+#include <vector>
+
+class WatchedPageSlabTest: public ::testing::Test {
+protected:
+    WatchedPageSlab& slab = WatchedPageSlab::instance();
+    size_t pageSize = environment.pageSize;
+};
+
+TEST_F(WatchedPageSlabTest, SameSizeAllocationsAreAdjacent) {
+    char* a = static_cast<char*>(slab.allocate(100, 1));
+    char* b = static_cast<char*>(slab.allocate(200, 1));
+    ASSERT_TRUE(slab.owns(a));
+    ASSERT_TRUE(slab.owns(b));
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(a) % pageSize, 0u);
+    EXPECT_EQ(b - a, static_cast<ptrdiff_t>(pageSize));
+    EXPECT_EQ(slab.usableSize(a), pageSize);
+    slab.free(a);
+    slab.free(b);
+}
+
+TEST_F(WatchedPageSlabTest, FreedSlotsAreReusedZeroFilled) {
+    char* a = static_cast<char*>(slab.allocate(3 * pageSize, 1));
+    memset(a, 0xff, 3 * pageSize);
+    slab.free(a);
+    char* b = static_cast<char*>(slab.allocate(3 * pageSize, 1));
+    EXPECT_EQ(a, b);
+    for (size_t i = 0; i < 3 * pageSize; i++)
+        ASSERT_EQ(b[i], 0);
+    slab.free(b);
+}
+
+TEST_F(WatchedPageSlabTest, BigOrOveralignedAllocationsFallBackToTheHeap) {
+    void* big = slab.allocate(64 * pageSize, 1);
+    void* overaligned = slab.allocate(100, 4 * pageSize);
+    ASSERT_NE(big, nullptr);
+    ASSERT_NE(overaligned, nullptr);
+    EXPECT_FALSE(slab.owns(big));
+    EXPECT_FALSE(slab.owns(overaligned));
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(overaligned) % (4 * pageSize), 0u);
+    EXPECT_EQ(slab.stats().liveFallbackAllocations, 2u);
+    slab.free(big);
+    slab.free(overaligned);
+    EXPECT_EQ(slab.stats().liveFallbackAllocations, 0u);
+}
+
+TEST_F(WatchedPageSlabTest, NeighbouringProtectionsShareVmas) {
+    std::vector<void*> allocations;
+    for (int i = 0; i < 8; i++)
+        allocations.push_back(slab.allocate(5 * pageSize, 1));
+    // Unprotected regions share a single VMA.
+    size_t vmasBefore = slab.stats().vmaCount;
+
+    // Protecting a run of neighbours adds two VMA boundaries, not one per allocation.
+    for (int i = 2; i < 6; i++)
+        EXPECT_TRUE(slab.protect(allocations[i], 5 * pageSize, PROT_NONE));
+    EXPECT_EQ(slab.stats().vmaCount, vmasBefore + 2);
+
+    EXPECT_TRUE(slab.protect(allocations[3], 5 * pageSize, PROT_READ | PROT_WRITE));
+    EXPECT_EQ(slab.stats().vmaCount, vmasBefore + 4);
+
+    for (void* memory : allocations)
+        slab.free(memory);
+    EXPECT_EQ(slab.stats().vmaCount, vmasBefore);
+}
+
+TEST_F(WatchedPageSlabTest, FallbackAllocationsAreKnownUntilFreed) {
+    void* big = slab.allocate(64 * pageSize + 1, 1);
+    void* heap = aligned_alloc(pageSize, pageSize);
+    EXPECT_TRUE(slab.isAllocation(big));
+    EXPECT_EQ(slab.usableSize(big), 65 * pageSize);
+    EXPECT_FALSE(slab.isAllocation(heap));
+    EXPECT_EQ(slab.usableSize(heap), 0u);
+
+    slab.free(big);
+    EXPECT_FALSE(slab.isAllocation(big));
+    EXPECT_EQ(slab.stats().liveFallbackAllocations, 0u);
+    free(heap);
+}
+
+TEST_F(WatchedPageSlabTest, OnlyPointersInUsedRegionsAreOwned) {
+    char* memory = static_cast<char*>(slab.allocate(100, 1));
+    uint32_t regionCount = slab.stats().regionCount;
+    EXPECT_TRUE(slab.owns(memory));
+    EXPECT_FALSE(slab.owns(memory + regionCount * WatchedPageSlab::RegionSize));
+    EXPECT_FALSE(slab.owns(memory - regionCount * WatchedPageSlab::RegionSize));
+    EXPECT_FALSE(slab.owns(nullptr));
+    slab.free(memory);
+}
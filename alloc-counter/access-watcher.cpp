@@ -0,0 +1,31 @@
+#include "access-watcher.h"
+#include "memory-protector.h"
+#include "userfaultfd-watcher.h"
+#include "soft-dirty-watcher.h"
+#include "watched-page-slab.h"
+#include "environment.h"
+#include <cstdio>
+
+AccessWatcher* AccessWatcher::s_instance = nullptr;
+
+void AccessWatcher::initialize() {
+    if (s_instance)
+        return;
+    if (environment.accessWatcherBackend == Environment::AccessWatcherBackend::Userfaultfd) {
+        s_instance = UserfaultfdWatcher::create();
+        if (!s_instance)
+            fprintf(stderr, "alloc-counter: userfaultfd write protection is not available, using mprotect() instead\n");
+    } else if (environment.accessWatcherBackend == Environment::AccessWatcherBackend::SoftDirty) {
+        s_instance = SoftDirtyWatcher::create();
+        if (!s_instance)
+            fprintf(stderr, "alloc-counter: soft-dirty bits are not available, using mprotect() instead\n");
+    }
+    if (!s_instance)
+        s_instance = MemoryProtector::create();
+}
+
+size_t AccessWatcher::watchedSize(void* memory, size_t size) {
+    if (size_t slotSize = WatchedPageSlab::instance().usableSize(memory))
+        return slotSize;
+    return size;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <cstddef>
+using namespace std;
+
+/** Detects accesses to suspicious closely watched allocations.
+ *
+ * The patrol thread starts watching an allocation when it becomes suspicious and stops when its deadline passes, at
+ * which point it asks whether it was accessed in the meantime. Backends:
+ *
+ * - MemoryProtector (ALLOC_ACCESS_WATCHER=mprotect, the default): mprotect() and a SIGSEGV handler. Sees reads and
+ *   writes, but replaces the application's SIGSEGV handler.
+ * - UserfaultfdWatcher (ALLOC_ACCESS_WATCHER=userfaultfd): userfaultfd write protection, serviced by a dedicated
+ *   thread. Leaves signal handlers alone, but only sees writes (and the first access to pages never touched).
+ * - SoftDirtyWatcher (ALLOC_ACCESS_WATCHER=softdirty): samples the idle page (or else soft-dirty) bits of the watched
+ *   pages on every patrol tick. No faults, but accesses are only seen with the granularity of the patrol ticks. */
+class AccessWatcher {
+public:
+    // Creates the backend chosen in the environment, or MemoryProtector if it's not available on this kernel.
+    static void initialize();
+    static AccessWatcher& instance() { return *s_instance; }
+
+    virtual ~AccessWatcher() {}
+
+    /** Starts watching [memory, memory + size). `memory` must be page aligned and the range must not overlap another
+     * watched range. Returns false if the range could not be watched. */
+    virtual bool watch(void* memory, size_t size) = 0;
+
+    /** Stops watching a range passed to watch(). Returns true if it was accessed since then. Does nothing (and returns
+     * false) if the range is not watched. */
+    virtual bool unwatch(void* memory) = 0;
+
+    virtual bool isWatched(void* memory) const = 0;
+
+    // Called by the patrol thread before it checks the deadlines of the allocations, for backends that poll.
+    virtual void update() {}
+
+    virtual const char* name() const = 0;
+
+protected:
+    // Size of the range to watch for an allocation: slab slots are watched whole, since they are protected whole.
+    static size_t watchedSize(void* memory, size_t size);
+
+private:
+    static AccessWatcher* s_instance;
+};
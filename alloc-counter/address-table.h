@@ -0,0 +1,289 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/mman.h>
+using namespace std;
+
+/** Open addressing hash table with linear probing, keyed by the address of an allocation.
+ *
+ * Each shard of the allocation table keeps both its light and its closely watched allocations here, so a free() needs
+ * a single lookup. Entries are 28 bytes: the pointer is compressed to 56 bits (allocations are at least 8 byte aligned,
+ * and user space addresses fit in 56 bits even with 5-level page tables), deadlines and links are 32 bits, and sizes
+ * are not stored, as only closely watched allocations need theirs. Rehashing leaves the table at most 60% full and
+ * it's rehashed again past 80%, so a live allocation takes 35 to 70 bytes.
+ *
+ * Entries are also linked by deadline in a hashed timer wheel of WheelSlots slots, one per clock tick, so that finding
+ * the expired entries only touches those, and erasing an entry unlinks it in O(1). The links are entry indices, so they
+ * are rebuilt when the table is rehashed. Deadlines further than WheelSlots ticks away share a slot with closer ones
+ * and are just skipped each time the wheel passes over them. Times are compared modulo 2^32, so that clocks can wrap.
+ *
+ * The storage is mmap'ed directly, so inserting does not allocate from the heap we are instrumenting and there is no
+ * per-node overhead. */
+class AddressTable {
+public:
+    enum class Kind : uint8_t {
+        Empty = 0,
+        Deleted = 1,
+        Light = 2,
+        CloselyWatched = 3
+    };
+
+    struct Entry {
+        // Light allocations: the callstack fingerprint.
+        // Closely watched allocations: the index of their CloselyWatchedAllocation record in the shard.
+        // Kept in two halves, as 8 byte alignment would pad the entry to 32 bytes.
+        uint64_t value() const { return static_cast<uint64_t>(m_valueHigh) << 32 | m_valueLow; }
+        void setValue(uint64_t value) {
+            m_valueLow = static_cast<uint32_t>(value);
+            m_valueHigh = static_cast<uint32_t>(value >> 32);
+        }
+
+        Kind kind() const { return m_kind; }
+        void* memory() const {
+            return reinterpret_cast<void*>(static_cast<uintptr_t>(keyOf(*this) << AlignmentBits));
+        }
+        // Changed with AddressTable::setDeadline(), which moves the entry in the timer wheel.
+        uint32_t deadline() const { return m_deadline; }
+
+    private:
+        friend class AddressTable;
+        uint32_t m_valueLow;
+        uint32_t m_valueHigh;
+        uint32_t m_deadline;
+        uint32_t m_keyLow;
+        uint16_t m_keyMiddle;
+        uint8_t m_keyHigh;
+        Kind m_kind;
+        // Neighbours in the list of the wheel slot, as index + 1 (0 meaning none).
+        uint32_t m_previous;
+        uint32_t m_next;
+    };
+
+    AddressTable() {}
+    AddressTable(const AddressTable&) = delete;
+    ~AddressTable() {
+        if (m_entries)
+            munmap(m_entries, m_capacity * sizeof(Entry));
+    }
+
+    // False for unaligned pointers and for those with tag bits above the 59 bits of an address.
+    static bool canStore(void* memory) {
+        uintptr_t address = reinterpret_cast<uintptr_t>(memory);
+        return !(address & AlignmentMask) && !(address >> (AlignmentBits + KeyBits));
+    }
+
+    // Tells once on stderr that allocations are left untracked because canStore() refused them.
+    static void warnCannotStore(void* memory) {
+        static atomic<bool> warned(false);
+        if (!warned.exchange(true, memory_order_relaxed))
+            fprintf(stderr, "alloc-counter: allocations at addresses like %p can't be tracked, they will be ignored\n",
+                    memory);
+    }
+
+    Entry* find(void* memory) {
+        if (!m_entries || !canStore(memory))
+            return nullptr;
+        uint64_t key = keyFor(memory);
+        for (uint32_t i = indexFor(key); ; i = (i + 1) & (m_capacity - 1)) {
+            Entry& entry = m_entries[i];
+            if (entry.m_kind == Kind::Empty)
+                return nullptr;
+            if (entry.m_kind != Kind::Deleted && keyOf(entry) == key)
+                return &entry;
+        }
+    }
+
+    // Returns the entry for `memory`, created if needed, with its kind and deadline set. The caller fills in the rest.
+    // `memory` must pass canStore().
+    Entry& insert(void* memory, Kind kind, uint32_t deadline) {
+        if (!canStore(memory)) {
+            fprintf(stderr, "AddressTable: can't store %p\n", memory);
+            abort();
+        }
+        assert(kind == Kind::Light || kind == Kind::CloselyWatched);
+        if (Entry* existing = find(memory)) {
+            existing->m_kind = kind;
+            setDeadline(*existing, deadline);
+            return *existing;
+        }
+
+        if ((m_size + m_deleted + 1) * 10 > m_capacity * 8)
+            rehash();
+
+        uint64_t key = keyFor(memory);
+        uint32_t i = indexFor(key);
+        while (m_entries[i].m_kind != Kind::Empty && m_entries[i].m_kind != Kind::Deleted)
+            i = (i + 1) & (m_capacity - 1);
+        Entry& entry = m_entries[i];
+        if (entry.m_kind == Kind::Deleted)
+            m_deleted--;
+        entry.m_keyLow = static_cast<uint32_t>(key);
+        entry.m_keyMiddle = static_cast<uint16_t>(key >> 32);
+        entry.m_keyHigh = static_cast<uint8_t>(key >> 48);
+        entry.m_kind = kind;
+        entry.m_deadline = deadline;
+        link(i);
+        m_size++;
+        return entry;
+    }
+
+    void erase(Entry& entry) {
+        assert(entry.m_kind == Kind::Light || entry.m_kind == Kind::CloselyWatched);
+        unlink(indexOf(entry));
+        entry.m_kind = Kind::Deleted;
+        m_size--;
+        m_deleted++;
+    }
+
+    void setDeadline(Entry& entry, uint32_t deadline) {
+        uint32_t index = indexOf(entry);
+        unlink(index);
+        entry.m_deadline = deadline;
+        link(index);
+    }
+
+    /** Calls `function(Entry&)` for every entry whose deadline is before `now`, visiting only the wheel slots of the
+     * ticks elapsed since the last call. The function may erase the entry it receives or change its deadline, but
+     * must not insert entries. */
+    template <typename Function>
+    void forEachExpired(uint32_t now, Function function) {
+        int32_t elapsed = m_wheelTime ? static_cast<int32_t>(now - m_wheelTime) : static_cast<int32_t>(WheelSlots);
+        if (elapsed <= 0)
+            return; // The clock has not advanced (or went backwards).
+        // A full turn visits every slot.
+        uint32_t ticks = static_cast<uint32_t>(elapsed) < WheelSlots ? static_cast<uint32_t>(elapsed) : WheelSlots;
+        if (m_entries) {
+            for (uint32_t tick = now - ticks; tick != now; tick++) {
+                uint32_t next = m_wheel[tick & (WheelSlots - 1)];
+                while (next) {
+                    Entry& entry = m_entries[next - 1];
+                    next = entry.m_next;
+                    if (static_cast<int32_t>(entry.m_deadline - now) < 0)
+                        function(entry);
+                }
+            }
+        }
+        m_wheelTime = now;
+    }
+
+    /** Earliest tick an entry may have its deadline at, as of the last call to forEachExpired(): that of the first
+     * wheel slot with entries from there. Entries of later turns share slots with closer deadlines, so it's only a
+     * lower bound. If the wheel is empty, returns a full turn later. */
+    uint32_t nextDeadline() const {
+        for (uint32_t tick = m_wheelTime; tick != m_wheelTime + WheelSlots; tick++) {
+            if (m_wheel[tick & (WheelSlots - 1)])
+                return tick;
+        }
+        return m_wheelTime + WheelSlots;
+    }
+
+    // Calls `function(Entry&)` for every entry. The function may erase the entry it receives.
+    template <typename Function>
+    void forEach(Function function) {
+        for (uint32_t i = 0; i < m_capacity; i++) {
+            Entry& entry = m_entries[i];
+            if (entry.m_kind == Kind::Light || entry.m_kind == Kind::CloselyWatched)
+                function(entry);
+        }
+    }
+
+    uint32_t size() const { return m_size; }
+    size_t memoryFootprint() const { return m_capacity * sizeof(Entry) + sizeof(m_wheel); }
+
+    // With the default 100 ms clock resolution, the default 30 s timeout fits in a turn.
+    static const uint32_t WheelSlots = 512;
+
+private:
+    static const unsigned AlignmentBits = 3;
+    static const uintptr_t AlignmentMask = (1 << AlignmentBits) - 1;
+    static const unsigned KeyBits = 56;
+    static const uint32_t InitialCapacity = 1024;
+
+    static uint32_t slotFor(uint32_t deadline) { return deadline & (WheelSlots - 1); }
+    uint32_t indexOf(const Entry& entry) const { return static_cast<uint32_t>(&entry - m_entries); }
+
+    void link(uint32_t index) {
+        Entry& entry = m_entries[index];
+        // A deadline in a slot the wheel has already passed would not be seen until the next turn. Such entries are
+        // due, so they are moved to the next slot to be visited, which is still in the past for the next call.
+        if (m_wheelTime && static_cast<int32_t>(entry.m_deadline - m_wheelTime) < 0)
+            entry.m_deadline = m_wheelTime;
+        uint32_t& head = m_wheel[slotFor(entry.m_deadline)];
+        entry.m_previous = 0;
+        entry.m_next = head;
+        if (head)
+            m_entries[head - 1].m_previous = index + 1;
+        head = index + 1;
+    }
+
+    void unlink(uint32_t index) {
+        Entry& entry = m_entries[index];
+        if (entry.m_previous)
+            m_entries[entry.m_previous - 1].m_next = entry.m_next;
+        else
+            m_wheel[slotFor(entry.m_deadline)] = entry.m_next;
+        if (entry.m_next)
+            m_entries[entry.m_next - 1].m_previous = entry.m_previous;
+    }
+
+    static uint64_t keyFor(void* memory) { return reinterpret_cast<uintptr_t>(memory) >> AlignmentBits; }
+    static uint64_t keyOf(const Entry& entry) {
+        return static_cast<uint64_t>(entry.m_keyHigh) << 48 | static_cast<uint64_t>(entry.m_keyMiddle) << 32
+            | entry.m_keyLow;
+    }
+
+    uint32_t indexFor(uint64_t key) const {
+        // Fibonacci hashing: the high bits of the product are well mixed. The low bits of the addresses are also
+        // used to pick the shard, so they can't be used directly here.
+        return static_cast<uint32_t>((key * 0x9E3779B97F4A7C15ull) >> 32) & (m_capacity - 1);
+    }
+
+    void rehash() {
+        // Leave the table 60% full at most, so that erasing and inserting as many entries doesn't rehash again right
+        // away. Depending on how many entries were deleted, it may grow, shrink or just drop the deleted ones.
+        uint32_t newCapacity = InitialCapacity;
+        while ((m_size + 1) * 10 > newCapacity * 6)
+            newCapacity *= 2;
+
+        Entry* oldEntries = m_entries;
+        uint32_t oldCapacity = m_capacity;
+        // Anonymous memory is zero filled, that is, every entry is Kind::Empty.
+        void* memory = mmap(nullptr, newCapacity * sizeof(Entry), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            perror("AddressTable: mmap");
+            abort();
+        }
+        m_entries = static_cast<Entry*>(memory);
+        m_capacity = newCapacity;
+        m_deleted = 0;
+        std::fill(m_wheel, m_wheel + WheelSlots, 0);
+
+        for (uint32_t i = 0; i < oldCapacity; i++) {
+            const Entry& oldEntry = oldEntries[i];
+            if (oldEntry.m_kind != Kind::Light && oldEntry.m_kind != Kind::CloselyWatched)
+                continue;
+            uint32_t j = indexFor(keyOf(oldEntry));
+            while (m_entries[j].m_kind != Kind::Empty)
+                j = (j + 1) & (m_capacity - 1);
+            m_entries[j] = oldEntry;
+            link(j);
+        }
+        if (oldEntries)
+            munmap(oldEntries, oldCapacity * sizeof(Entry));
+    }
+
+    Entry* m_entries = nullptr;
+    uint32_t m_capacity = 0;
+    uint32_t m_size = 0;
+    uint32_t m_deleted = 0;
+    // Heads of the lists of the timer wheel, as index + 1 (0 meaning empty).
+    uint32_t m_wheel[WheelSlots] = {};
+    // Every deadline before this time has already been passed to forEachExpired(). Zero until it's first called.
+    uint32_t m_wheelTime = 0;
+};
+
+static_assert(sizeof(AddressTable::Entry) == 28, "AddressTable::Entry should be packed in 28 bytes");
@@ -0,0 +1,55 @@
+#include "allocation-event-ring.h"
+#include "environment.h"
+#include <pthread.h>
+#include <sys/mman.h>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+thread_local AllocationEventRing* AllocationEventRing::t_ring = nullptr;
+atomic<AllocationEventRing*> AllocationEventRing::s_first(nullptr);
+
+static pthread_key_t ringReleaseKey;
+static pthread_once_t ringReleaseKeyOnce = PTHREAD_ONCE_INIT;
+
+AllocationEventRing* AllocationEventRing::acquire() {
+    pthread_once(&ringReleaseKeyOnce, []() {
+        pthread_key_create(&ringReleaseKey, AllocationEventRing::release);
+    });
+
+    // Adopt the ring of a thread that has already exited, if any. Its pending events will still be consumed in order.
+    AllocationEventRing* ring;
+    for (ring = first(); ring; ring = ring->next()) {
+        bool inUse = false;
+        if (!ring->m_inUse.load(memory_order_relaxed) && ring->m_inUse.compare_exchange_strong(inUse, true))
+            break;
+    }
+
+    if (!ring) {
+        // The events are the bulk of the memory, so they are mmap'ed instead of being taken from the heap we are
+        // instrumenting.
+        uint32_t capacity = environment.eventBufferCapacity;
+        size_t length = sizeof(AllocationEventRing) + capacity * sizeof(AllocationEvent);
+        void* memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            perror("AllocationEventRing: mmap");
+            abort();
+        }
+        AllocationEvent* events = reinterpret_cast<AllocationEvent*>(static_cast<char*>(memory) + sizeof(AllocationEventRing));
+        ring = new (memory) AllocationEventRing(capacity, events);
+
+        AllocationEventRing* head = s_first.load(memory_order_relaxed);
+        do {
+            ring->m_next = head;
+        } while (!s_first.compare_exchange_weak(head, ring, memory_order_release, memory_order_relaxed));
+    }
+
+    pthread_setspecific(ringReleaseKey, ring);
+    return ring;
+}
+
+void AllocationEventRing::release(void* ring) {
+    // Should the exiting thread allocate again (e.g. from another destructor), it will acquire a ring again.
+    t_ring = nullptr;
+    static_cast<AllocationEventRing*>(ring)->m_inUse.store(false, memory_order_release);
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <time.h>
+#include "callstack-fingerprint.h"
+using namespace std;
+
+// Compact record of a light allocation or free, used when environment.deferredLightAllocations is enabled.
+struct AllocationEvent {
+    // On equal timestamps, events of different threads are applied in this order. Those of one thread are applied in
+    // the order they were made.
+    enum class Type : uint32_t {
+        Free = 0,
+        ReallocateFrom = 1,
+        ReallocateTo = 2,
+        Allocate = 3
+    };
+
+    uint64_t timestamp; // CLOCK_MONOTONIC, in nanoseconds
+    void* memory;
+    CallstackFingerprint fingerprint;
+    Type type;
+
+    static uint64_t now() {
+        timespec tv;
+        clock_gettime(CLOCK_MONOTONIC, &tv);
+        return tv.tv_sec * 1000000000ull + tv.tv_nsec;
+    }
+
+    bool operator<(const AllocationEvent& other) const {
+        if (timestamp != other.timestamp)
+            return timestamp < other.timestamp;
+        return type < other.type;
+    }
+};
+
+/** Single-producer single-consumer ring buffer of allocation events.
+ *
+ * Each thread owns one ring (the producer side). The consumer side is whoever holds the drain mutex of the
+ * allocation table: usually the drain thread, sometimes a producer whose ring overflowed.
+ *
+ * Rings are never freed. When a thread exits its ring is released and it is adopted by the next thread that needs
+ * one, so that the number of rings is bounded by the maximum number of threads alive at the same time. */
+class AllocationEventRing {
+public:
+    // Returns the ring owned by the calling thread, creating one if needed. Must be called in library context.
+    static AllocationEventRing* forCurrentThread() {
+        if (!t_ring)
+            t_ring = acquire();
+        return t_ring;
+    }
+
+    // Linked list of all the rings ever created. Rings are only ever added to the head.
+    static AllocationEventRing* first() { return s_first.load(memory_order_acquire); }
+    AllocationEventRing* next() const { return m_next; }
+
+    // Producer side.
+    uint32_t freeSlots() const {
+        return m_capacity - (m_tail.load(memory_order_relaxed) - m_head.load(memory_order_acquire));
+    }
+
+    bool tryPush(const AllocationEvent& event) {
+        uint32_t tail = m_tail.load(memory_order_relaxed);
+        if (tail - m_head.load(memory_order_acquire) == m_capacity)
+            return false;
+        m_events[tail & (m_capacity - 1)] = event;
+        m_tail.store(tail + 1, memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Pops the events older than `cutoff`. Events of a ring are always pushed in timestamp order.
+    template <typename Function>
+    void consumeOlderThan(uint64_t cutoff, Function function) {
+        uint32_t head = m_head.load(memory_order_relaxed);
+        uint32_t tail = m_tail.load(memory_order_acquire);
+        while (head != tail) {
+            const AllocationEvent& event = m_events[head & (m_capacity - 1)];
+            if (event.timestamp >= cutoff)
+                break;
+            function(event);
+            ++head;
+        }
+        m_head.store(head, memory_order_release);
+    }
+
+private:
+    AllocationEventRing(uint32_t capacity, AllocationEvent* events)
+        : m_capacity(capacity), m_events(events)
+    {}
+
+    static AllocationEventRing* acquire();
+    static void release(void* ring); // pthread key destructor, runs in the exiting thread
+
+    alignas(64) atomic<uint32_t> m_head { 0 };
+    alignas(64) atomic<uint32_t> m_tail { 0 };
+    const uint32_t m_capacity;
+    AllocationEvent* const m_events;
+    atomic<bool> m_inUse { true };
+    AllocationEventRing* m_next = nullptr;
+
+    static thread_local AllocationEventRing* t_ring;
+    static atomic<AllocationEventRing*> s_first;
+};
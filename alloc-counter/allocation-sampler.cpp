@@ -0,0 +1,15 @@
+#include "allocation-sampler.h"
+#include "allocation-event-ring.h"
+
+thread_local AllocationSampler::ThreadState AllocationSampler::t_state;
+atomic<unsigned long> AllocationSampler::s_unsampledAllocationCount(0);
+
+void AllocationSampler::ThreadState::initialize(uint32_t sampleRate) {
+    // Threads must not sample in lockstep. Any mix of time and an address unique to the thread will do, as long as
+    // it's not zero, the only state xorshift can't leave.
+    random = AllocationEvent::now() ^ (reinterpret_cast<uintptr_t>(this) * 0x9E3779B97F4A7C15ull);
+    if (!random)
+        random = 1;
+    bytesUntilSample = nextInterval(sampleRate);
+    initialized = true;
+}
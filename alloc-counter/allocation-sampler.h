@@ -0,0 +1,77 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include "environment.h"
+using namespace std;
+
+/** Byte-based Poisson sampler of allocations, enabled by environment.sampleRate (ALLOC_SAMPLE_RATE).
+ *
+ * Sample points are laid over the bytes allocated by each thread with exponentially distributed gaps of mean
+ * `sampleRate` bytes, as tcmalloc's heap sampler does. An allocation is sampled if it covers a sample point, which
+ * happens with probability 1 - exp(-size / sampleRate), no matter how the thread allocated before. Big allocations are
+ * almost always sampled, small ones rarely.
+ *
+ * Each sampled allocation stands for 1 / that probability allocations of its size. That's its weight. */
+class AllocationSampler {
+public:
+    // Returns 0 if the allocation should not be instrumented at all, otherwise its weight (1 if sampling is disabled).
+    static float sample(uint32_t size) {
+        uint32_t sampleRate = environment.sampleRate;
+        if (!sampleRate)
+            return 1;
+
+        ThreadState& state = t_state;
+        if (!state.initialized)
+            state.initialize(sampleRate);
+        if (state.bytesUntilSample > size) {
+            state.bytesUntilSample -= size;
+            if (++state.pendingUnsampledAllocations == FlushUnsampledAllocationsEvery) {
+                s_unsampledAllocationCount.fetch_add(state.pendingUnsampledAllocations, memory_order_relaxed);
+                state.pendingUnsampledAllocations = 0;
+            }
+            return 0;
+        }
+        // Memoryless: the bytes of this allocation past the sample point don't count towards the next one.
+        state.bytesUntilSample = state.nextInterval(sampleRate);
+        return weight(size, sampleRate);
+    }
+
+    static float weight(uint32_t size, uint32_t sampleRate) {
+        // A zero sized allocation is never sampled. Should it be, count it as one byte rather than divide by zero.
+        double probability = -expm1(-(double) std::max(size, 1u) / sampleRate);
+        return 1 / probability;
+    }
+
+    // Approximate: each thread adds its count every FlushUnsampledAllocationsEvery allocations.
+    static unsigned long unsampledAllocationCount() {
+        return s_unsampledAllocationCount.load(memory_order_relaxed);
+    }
+
+private:
+    static const uint32_t FlushUnsampledAllocationsEvery = 1024;
+
+    // Must be trivially constructible so that it can be used from malloc() in any thread, even exiting ones.
+    struct ThreadState {
+        bool initialized;
+        uint32_t pendingUnsampledAllocations;
+        uint64_t bytesUntilSample;
+        uint64_t random;
+
+        void initialize(uint32_t sampleRate);
+
+        uint64_t nextInterval(uint32_t sampleRate) {
+            // xorshift64*
+            random ^= random >> 12;
+            random ^= random << 25;
+            random ^= random >> 27;
+            // Uniform in (0, 1], so that the logarithm is finite.
+            double uniform = ((random * 0x2545F4914F6CDD1Dull >> 11) + 1) * (1.0 / (1ull << 53));
+            return (uint64_t) (-log(uniform) * sampleRate) + 1;
+        }
+    };
+
+    static thread_local ThreadState t_state;
+    static atomic<unsigned long> s_unsampledAllocationCount;
+};
@@ -1,9 +1,7 @@
 #include "allocation-stats.h"
-#include <time.h>
+#include "coarse-clock.h"
 #include <cassert>
 
 double AllocationStats::getTime() {
-    timespec tv;
-    clock_gettime(CLOCK_MONOTONIC, &tv);
-    return tv.tv_sec + tv.tv_nsec / 1e9;
+    return CoarseClock::toSeconds(CoarseClock::now());
 }
@@ -1,6 +1,7 @@
 #pragma once
 #include <atomic>
 #include <mutex>
+#include <cstddef>
 using namespace std;
 
 class AllocationStats {
@@ -9,6 +10,13 @@ public:
     unsigned long allocationWithSuspiciousFingerprintCount = 0;
     unsigned long freeCount = 0;
     unsigned long reallocCount = 0;
+    // Number of times a thread found its event ring buffer full and had to use the synchronous path.
+    unsigned long eventBufferOverflowCount = 0;
+    // Allocations skipped by the sampler. They are not part of allocationCount. Only set in the statistics returned to
+    // the patrol thread.
+    unsigned long unsampledAllocationCount = 0;
+    // Memory used by the records of the allocation table. Only set in the statistics returned to the patrol thread.
+    size_t allocationTableMemory = 0;
 
     double timeWatchEnabled = -1;
     bool enabled = false;
@@ -21,4 +29,20 @@ public:
             timeWatchEnabled = getTime();
         }
     }
+
+    // Used to merge the statistics of the allocation table shards.
+    AllocationStats& operator+=(const AllocationStats& other) {
+        allocationCount += other.allocationCount;
+        allocationWithSuspiciousFingerprintCount += other.allocationWithSuspiciousFingerprintCount;
+        freeCount += other.freeCount;
+        reallocCount += other.reallocCount;
+        eventBufferOverflowCount += other.eventBufferOverflowCount;
+        unsampledAllocationCount += other.unsampledAllocationCount;
+        allocationTableMemory += other.allocationTableMemory;
+        if (other.enabled && (!enabled || other.timeWatchEnabled < timeWatchEnabled)) {
+            enabled = true;
+            timeWatchEnabled = other.timeWatchEnabled;
+        }
+        return *this;
+    }
 };
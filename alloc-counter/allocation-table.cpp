@@ -1,3 +1,6 @@
 #include "allocation-table.h"
+#include <new>
 
-AllocationTable AllocationTable::s_allocationTable;
+aligned_storage<sizeof(AllocationTable), alignof(AllocationTable)>::type allocationTableStorage;
+static AllocationTable* constructedAllocationTable = new (&allocationTableStorage) AllocationTable;
+const uint32_t AllocationTable::MaxShards;
@@ -1,10 +1,10 @@
 #include <cstdint>
+#include <type_traits>
 #include <unordered_map>
 #include <mutex>
 #include <memory>
 #include <set>
 #include <algorithm>
-#include <functional>
 #include <time.h>
 #include <cassert>
 #include <malloc.h>
@@ -12,21 +12,27 @@
 #include <string.h>
 #include "callstack-fingerprint.h"
 #include "environment.h"
-#include "stack-trace.h"
+#include "stack-depot.h"
 #include "watched-stack-trace-info.h"
 #include "allocation-stats.h"
 #include "library-context.h"
 #include "comm-memory.h"
+#include "allocation-event-ring.h"
+#include "address-table.h"
+#include "allocation-sampler.h"
+#include "coarse-clock.h"
+#include "suspicious-fingerprint-filter.h"
+#include "watched-page-slab.h"
+#include "access-watcher.h"
 using namespace std;
 
 struct Allocation {
     void* memory;
-    uint32_t requestedSize;
-    // This is the time when, if reached, the allocation moves to a more suspicious state:
+    // This is the time (in CoarseClock ticks) when, if reached, the allocation moves to a more suspicious state:
     // If it's a LightAllocation, the fast fingerprint will be marked as suspicious.
     // If it's a CloselyWatchedAllocation, it depends on its state:
     // -> If it is in NotYetSuspicious state, it will become Suspicious.
-    // -> If it is in Suspicious state, it will be declared a leak.
+    // -> If it is in Suspicious state, it will be declared a leak unless the AccessWatcher saw an access.
     uint32_t deadline;
 
 protected:
@@ -44,7 +50,12 @@ struct CloselyWatchedAllocation : public Allocation {
     };
 
     State state = State::NotYetSuspicious;
-    uint32_t allocationTime;
+    uint32_t requestedSize;
+    // Needed to find the fingerprint shard owning watchedStackTraceInfo.
+    CallstackFingerprint fingerprint;
+    uint32_t allocationTime; // CoarseClock ticks
+    // Number of allocations this one stands for, see AllocationSampler.
+    float samplingWeight;
     WatchedStackTraceInfo* watchedStackTraceInfo;
 
     uint32_t actualSize() const {
@@ -52,19 +63,23 @@ struct CloselyWatchedAllocation : public Allocation {
     }
 };
 
-class SuspiciousStackTracesTable : public unordered_map<StackTrace, WatchedStackTraceInfo> {
+class SuspiciousStackTracesTable : public unordered_map<StackId, WatchedStackTraceInfo> {
 public:
-    WatchedStackTraceInfo& getOrCreate(const StackTrace& trace) {
-        auto emplaceRet = this->emplace(std::piecewise_construct, std::forward_as_tuple(trace), std::forward_as_tuple(trace));
+    WatchedStackTraceInfo& getOrCreate(StackId stackId) {
+        auto emplaceRet = this->emplace(std::piecewise_construct, std::forward_as_tuple(stackId), std::forward_as_tuple(stackId));
         return emplaceRet.first->second;
     }
+
+    // Full stack traces taken for allocations with this fingerprint. The fewer distinct traces a fingerprint stands
+    // for, the fewer of them are taken for allocations that turn out not to leak.
+    uint64_t unwindCount = 0;
 };
 
 class SuspiciousFingerprintTable : public unordered_map<CallstackFingerprint, SuspiciousStackTracesTable> {
 public:
-    void addSuspiciousFingerprint(CallstackFingerprint fingerprint) {
-        // no-operation if the fingerprint already exists
-        this->emplace(std::piecewise_construct, make_tuple(fingerprint), make_tuple());
+    // Returns false (and does nothing) if the fingerprint was already suspicious.
+    bool addSuspiciousFingerprint(CallstackFingerprint fingerprint) {
+        return this->emplace(std::piecewise_construct, make_tuple(fingerprint), make_tuple()).second;
     }
 
     SuspiciousStackTracesTable* getSuspiciousStackTracesTable(CallstackFingerprint fingerprint) {
@@ -78,7 +93,7 @@ public:
 class AllocationTable {
 public:
     AllocationTable() {}
-    static AllocationTable& instance() { return s_allocationTable; }
+    static AllocationTable& instance();
 
     enum class ZeroFill {
         Unnecessary,
@@ -87,219 +102,407 @@ public:
 
     static const uint32_t NoAlignment = 1;
 
+    // Upper bound for environment.allocationTableShards.
+    static const uint32_t MaxShards = 64;
+
+    /** Whether the calling thread should go through the instrumented entry points below. The malloc wrappers check
+     * this first and call the real functions directly otherwise, so that until watching starts they cost little more
+     * than the PLT hop. The entry points check it again, so calling them anyway is harmless.
+     *
+     * The exception is memory of the slab of closely watched allocations, which must never reach the real free() or
+     * realloc(): watching may have stopped since it was allocated (any LD_PRELOADed child process resets the shared
+     * watch state). The wrappers pass it to instrumentedFree() and instrumentedReallocate() whatever this returns. */
+    static bool shouldInstrument() {
+        return !LibraryContext::inLibrary() && getWatchState() != WatchState::NotWatching;
+    }
+
+    // Whether `memory` comes from WatchedPageSlab::allocate(), be it in a slot or fallen back to the heap. Only page
+    // aligned pointers need the lookup in the slab.
+    static bool inWatchedPageSlab(void* memory) {
+        return !(reinterpret_cast<uintptr_t>(memory) & (environment.pageSize - 1)) && WatchedPageSlab::instance().isAllocation(memory);
+    }
+
     /** The malloc wrapper must call this *instead* of allocating the memory itself, as an special allocator may be
-     * required for closely watched allocations. */
-    void* instrumentedAllocate(uint32_t size, uint32_t alignment, CallstackFingerprint fingerprint, function<void*()> preferredAllocator, ZeroFill zeroFill) {
-        if (LibraryContext::inLibrary() || getWatchState() == WatchState::NotWatching)
+     * required for closely watched allocations.
+     *
+     * The callables are template parameters rather than std::function so that the wrappers' lambdas are inlined. */
+    template <typename Allocator>
+    void* instrumentedAllocate(uint32_t size, uint32_t alignment, CallstackFingerprint fingerprint, Allocator preferredAllocator, ZeroFill zeroFill) {
+        if (!shouldInstrument())
+            return preferredAllocator();
+
+        // Unsampled allocations are not recorded anywhere, so there is no point in looking up their fingerprint.
+        float samplingWeight = AllocationSampler::sample(size);
+        if (!samplingWeight)
             return preferredAllocator();
 
         LibraryContext ctx;
 
-        lock_guard<mutex> lock(m_mutex);
-        m_stats.ensureEnabled();
-        ++m_stats.allocationCount;
-        SuspiciousStackTracesTable* stackTraceTable = m_suspiciousFingerprints.getSuspiciousStackTracesTable(fingerprint);
-        if (!stackTraceTable) {
-            // Unsuspicious fingerprint
-            void* memory = preferredAllocator();
-            if (!memory) {
-                return nullptr;
+        // Lock order: an address shard may be locked before a fingerprint shard, never the other way around. Here the
+        // fingerprint shard is released before the address shard of the new memory is taken.
+        void* memory;
+        WatchedStackTraceInfo* watchedStackTraceInfo = nullptr;
+        bool hasSuspiciousFingerprint = false;
+        if (!m_suspiciousFingerprintFilter.mayContain(fingerprint)) {
+            // Unsuspicious fingerprint, known without locking.
+            memory = preferredAllocator();
+        } else {
+            FingerprintShard& fingerprintShard = fingerprintShardFor(fingerprint);
+            lock_guard<mutex> lock(fingerprintShard.shardMutex);
+            SuspiciousStackTracesTable* stackTraceTable = fingerprintShard.suspiciousFingerprints.getSuspiciousStackTracesTable(fingerprint);
+            StackId stackId = StackDepot::NoStack;
+            if (stackTraceTable) {
+                stackId = StackDepot::instance().capture();
+                stackTraceTable->unwindCount++;
+            }
+            if (!stackTraceTable) {
+                // Unsuspicious fingerprint, but a false positive of the filter.
+                memory = preferredAllocator();
+            } else if (stackId == StackDepot::NoStack) {
+                // Suspicious, but the stack depot is full: it can't be watched.
+                hasSuspiciousFingerprint = true;
+                memory = preferredAllocator();
+            } else {
+                hasSuspiciousFingerprint = true;
+                WatchedStackTraceInfo& info = stackTraceTable->getOrCreate(stackId);
+                if (!info.needsMoreCloselyWatchedAllocations()) {
+                    // Suspicious stack, but we don't need to watch it (e.g. we have enough instances of that stack
+                    // already). No tracking is done at all in this case (there is no use on even using a
+                    // LightAllocation... as the purpose of a LightAllocation is becoming a CloselyWatchedAllocation if
+                    // unfreed, and this has already happened.
+                    info.countSkippedAllocations++;
+                    info.estimatedTotalAllocations += samplingWeight;
+                    memory = preferredAllocator();
+                } else {
+                    // Allocation coming from a suspicious stack we should watch.
+                    memory = WatchedPageSlab::instance().allocate(size, alignment);
+                    if (memory) {
+                        if (zeroFill == ZeroFill::Needed)
+                            bzero(memory, size);
+
+                        info.countLiveCloselyWatchedAllocations++;
+                        info.countLiveCloselyWatchedAllocationsAllTraces++;
+                        info.countTotalCloselyWatchedAllocationsEverCreated++;
+                        info.estimatedTotalAllocations += samplingWeight;
+                        info.estimatedTotalCloselyWatchedAllocations += samplingWeight;
+                        watchedStackTraceInfo = &info;
+                    }
+                }
             }
-            LightAllocation& alloc = m_lightAllocationsByAddress[memory];
-            alloc.fingerprint = fingerprint;
-            alloc.memory = memory;
-            alloc.requestedSize = size;
-            alloc.deadline = time(nullptr) + environment.timeForAllocationToBecomeSuspicious;
-            return memory;
         }
 
-        ++m_stats.allocationWithSuspiciousFingerprintCount;
-        StackTrace stackTrace;
-        WatchedStackTraceInfo& watchedStackTraceInfo = stackTraceTable->getOrCreate(stackTrace);
-        if (!watchedStackTraceInfo.needsMoreCloselyWatchedAllocations()) {
-            // Suspicious stack, but we don't need to watch it (e.g. we have enough instances of that stack already).
-            // No tracking is done at all in this case (there is no use on even using a LightAllocation... as the
-            // purpose of a LightAllocation is becoming a CloselyWatchedAllocation if unfreed, and this has already
-            // happened.
-            watchedStackTraceInfo.countSkippedAllocations++;
-            return preferredAllocator();
+        if (memory && !hasSuspiciousFingerprint && environment.deferredLightAllocations
+                && deferEvent({ AllocationEvent::now(), memory, fingerprint, AllocationEvent::Type::Allocate })) {
+            return memory;
         }
 
-        // Allocation coming from a suspicious stack we should watch.
-        // memalign() will round `alignment` to the next power of two if necessary (unlikely) -- at least in glibc.
-        void* memory = memalign(std::max(alignment, environment.pageSize), environment.roundUpToPageMultiple(size));
+        AddressShard& shard = addressShardFor(memory);
+        lock_guard<mutex> lock(shard.shardMutex);
+        shard.stats.ensureEnabled();
+        ++shard.stats.allocationCount;
+        if (hasSuspiciousFingerprint)
+            ++shard.stats.allocationWithSuspiciousFingerprintCount;
         if (!memory)
             return nullptr;
 
-        if (zeroFill == ZeroFill::Needed)
-            bzero(memory, size);
-
-        watchedStackTraceInfo.countLiveCloselyWatchedAllocations++;
-        watchedStackTraceInfo.countLiveCloselyWatchedAllocationsAllTraces++;
-        watchedStackTraceInfo.countTotalCloselyWatchedAllocationsEverCreated++;
-
-        CloselyWatchedAllocation& alloc = m_closelyWatchedAllocationsByAddress[memory];
-        alloc.memory = memory;
-        alloc.requestedSize = size; // less or equal the size actually allocated
-        alloc.allocationTime = time(nullptr);
-        alloc.deadline = alloc.allocationTime + environment.timeForAllocationToBecomeSuspicious;
-        alloc.state = CloselyWatchedAllocation::State::NotYetSuspicious;
-        alloc.watchedStackTraceInfo = &watchedStackTraceInfo;
+        if (!hasSuspiciousFingerprint) {
+            recordLightAllocation(shard, memory, fingerprint, CoarseClock::now());
+        } else if (watchedStackTraceInfo) {
+            CloselyWatchedAllocation alloc;
+            alloc.memory = memory;
+            alloc.requestedSize = size; // less or equal the size actually allocated
+            alloc.fingerprint = fingerprint;
+            alloc.allocationTime = CoarseClock::now();
+            alloc.deadline = alloc.allocationTime + CoarseClock::fromSeconds(environment.timeForAllocationToBecomeSuspicious);
+            alloc.state = CloselyWatchedAllocation::State::NotYetSuspicious;
+            alloc.samplingWeight = samplingWeight;
+            alloc.watchedStackTraceInfo = watchedStackTraceInfo;
+            shard.insertCloselyWatched(alloc);
+        }
         return memory;
     }
 
-    void* instrumentedReallocate(void* oldMemory, size_t newRequestedSize, function<void*()> preferredReallocator) {
-        if (LibraryContext::inLibrary() || getWatchState() == WatchState::NotWatching)
-            return preferredReallocator();
+    template <typename Reallocator>
+    void* instrumentedReallocate(void* oldMemory, size_t newRequestedSize, Reallocator preferredReallocator) {
+        if (!shouldInstrument()) {
+            if (!inWatchedPageSlab(oldMemory))
+                return preferredReallocator();
+            // This thread may hold a shard lock already, so the table is left alone. If the allocation is still in it,
+            // its entry stays there until the slot is reused.
+            if (LibraryContext::inLibrary())
+                return reallocateOutOfWatchedPageSlab(oldMemory, newRequestedSize);
+            // Watching stopped: the allocation goes through the usual path, so that it leaves the table.
+        }
 
         LibraryContext ctx;
 
-        lock_guard<mutex> lock(m_mutex);
-        m_stats.ensureEnabled();
-        ++m_stats.reallocCount;
-
-        {
-            auto it = m_lightAllocationsByAddress.find(oldMemory);
-            if (it != m_lightAllocationsByAddress.end()) {
-                // Realloc LightAllocation
-                LightAllocation& alloc = it->second;
-                alloc.requestedSize = newRequestedSize;
+        if (environment.deferredLightAllocations && !isCloselyWatched(oldMemory)) {
+            // The old memory is released by the real realloc(), so ReallocateFrom must be pushed before calling it.
+            AllocationEventRing* ring = AllocationEventRing::forCurrentThread();
+            if (ring->freeSlots() >= 2) {
+                ring->tryPush({ AllocationEvent::now(), oldMemory, 0, AllocationEvent::Type::ReallocateFrom });
                 void* newMemory = preferredReallocator();
-                if (newMemory != oldMemory) {
-                    alloc.memory = newMemory;
-                    m_lightAllocationsByAddress.insert(make_pair(newMemory, alloc));
-                    m_lightAllocationsByAddress.erase(it);
-                }
+                // A null pointer tells the drain that the realloc() failed and the old memory is still valid.
+                ring->tryPush({ AllocationEvent::now(), newMemory, 0, AllocationEvent::Type::ReallocateTo });
                 return newMemory;
             }
+            handleEventBufferOverflow(oldMemory);
         }
 
-        {
-            auto it = m_closelyWatchedAllocationsByAddress.find(oldMemory);
-            if (it != m_closelyWatchedAllocationsByAddress.end()) {
-                // Realloc CloselyWatchedAllocation
-                CloselyWatchedAllocation& alloc = it->second;
-                size_t oldActualSize = environment.roundUpToPageMultiple(alloc.requestedSize);
-                size_t newActualSize = environment.roundUpToPageMultiple(newRequestedSize);
-                if (newActualSize != oldActualSize) {
-                    // TODO Remove watchpoint
-                    // Unfortunately, there is no function to realloc aligned memory and keep the alignment, so we have
-                    // to make a new allocation and copy memory.
-                    void* newMemory = memalign(environment.pageSize, newActualSize);
-                    memcpy(newMemory, oldMemory, alloc.requestedSize);
-                    alloc.requestedSize = newRequestedSize;
-                    alloc.memory = newMemory;
-                    m_closelyWatchedAllocationsByAddress.insert(make_pair(newMemory, alloc));
-                    m_closelyWatchedAllocationsByAddress.erase(it);
-                    return newMemory;
-                } else {
-                    // The underlying size in pages is the same, so skip allocation.
-                    alloc.requestedSize = newRequestedSize;
-                    return oldMemory;
+        AddressShard& oldShard = addressShardFor(oldMemory);
+        unique_lock<mutex> oldLock(oldShard.shardMutex);
+        oldShard.stats.ensureEnabled();
+        ++oldShard.stats.reallocCount;
+
+        AddressTable::Entry* entry = oldShard.allocationsByAddress.find(oldMemory);
+        if (entry && entry->kind() == AddressTable::Kind::Light) {
+            // Realloc LightAllocation
+            void* newMemory = preferredReallocator();
+            if (!newMemory) {
+                // realloc() failed, the old memory is still valid.
+                return nullptr;
+            }
+            if (newMemory == oldMemory)
+                return newMemory;
+            LightAllocation alloc = AddressShard::lightAllocation(*entry);
+            alloc.memory = newMemory;
+            oldShard.allocationsByAddress.erase(*entry);
+            oldLock.unlock();
+
+            // The new memory is not visible to the application yet, so nobody can free it in the meantime.
+            AddressShard& newShard = addressShardFor(newMemory);
+            lock_guard<mutex> newLock(newShard.shardMutex);
+            newShard.insertLight(alloc);
+            return newMemory;
+        }
+
+        if (entry && entry->kind() == AddressTable::Kind::CloselyWatched) {
+            // Realloc CloselyWatchedAllocation
+            CloselyWatchedAllocation alloc = oldShard.closelyWatched(*entry);
+            size_t oldActualSize = environment.roundUpToPageMultiple(alloc.requestedSize);
+            size_t newActualSize = environment.roundUpToPageMultiple(newRequestedSize);
+            if (newActualSize != oldActualSize) {
+                // Unwatched before the copy reads it. The allocation is being used anyway: like a suspicious one
+                // accessed, it rests before being watched again, whether it's moved or realloc() fails.
+                AccessWatcher::instance().unwatch(oldMemory);
+                CloselyWatchedAllocation& oldAlloc = oldShard.closelyWatched(*entry);
+                if (oldAlloc.state == CloselyWatchedAllocation::State::Suspicious) {
+                    oldAlloc.state = CloselyWatchedAllocation::State::NotYetSuspicious;
+                    oldShard.setCloselyWatchedDeadline(*entry, CoarseClock::now() + CoarseClock::fromSeconds(environment.closelyWatchedAllocationsRestTime));
+                    alloc = oldAlloc;
                 }
+                void* newMemory = WatchedPageSlab::instance().allocate(newActualSize, environment.pageSize);
+                if (!newMemory)
+                    return nullptr;
+                memcpy(newMemory, oldMemory, std::min(alloc.requestedSize, (uint32_t) newRequestedSize));
+                alloc.requestedSize = newRequestedSize;
+                alloc.memory = newMemory;
+                oldShard.eraseCloselyWatched(*entry);
+                oldLock.unlock();
+                WatchedPageSlab::instance().free(oldMemory);
+
+                AddressShard& newShard = addressShardFor(newMemory);
+                lock_guard<mutex> newLock(newShard.shardMutex);
+                newShard.insertCloselyWatched(alloc);
+                return newMemory;
+            } else {
+                // The underlying size in pages is the same, so skip allocation.
+                oldShard.closelyWatched(*entry).requestedSize = newRequestedSize;
+                return oldMemory;
             }
         }
 
         // Realloc uninstrumented allocation
+        oldLock.unlock();
+        if (inWatchedPageSlab(oldMemory)) {
+            // A closely watched allocation that was declared a leak, and so is no longer in the table.
+            return reallocateOutOfWatchedPageSlab(oldMemory, newRequestedSize);
+        }
         return preferredReallocator();
     }
 
-    void instrumentedFree(void* memory, std::function<void()> freeFunction) {
+    template <typename FreeFunction>
+    void instrumentedFree(void* memory, FreeFunction freeFunction) {
         if (!memory) {
             // Nothing to do with free(NULL);
             return;
         }
 
-        if (LibraryContext::inLibrary() || getWatchState() == WatchState::NotWatching) {
-            freeFunction();
-            return;
+        if (!shouldInstrument()) {
+            if (!inWatchedPageSlab(memory)) {
+                freeFunction();
+                return;
+            }
+            // Same as in instrumentedReallocate().
+            if (LibraryContext::inLibrary()) {
+                WatchedPageSlab::instance().free(memory);
+                return;
+            }
         }
 
         LibraryContext ctx;
 
-        lock_guard<mutex> lock(m_mutex);
-        m_stats.ensureEnabled();
-        ++m_stats.freeCount;
-
-        {
-            auto it = m_lightAllocationsByAddress.find(memory);
-            if (it != m_lightAllocationsByAddress.end()) {
-                m_lightAllocationsByAddress.erase(it);
-                goto freeAndReturn;
-            }
+        if (environment.deferredLightAllocations && !isCloselyWatched(memory)
+                && deferEvent({ AllocationEvent::now(), memory, 0, AllocationEvent::Type::Free })) {
+            // The event is pushed before the memory is actually freed so that the drain never sees a later allocation
+            // reusing the same address before this free.
+            freeFunction();
+            return;
         }
 
+        bool closelyWatched = false;
         {
-            auto it = m_closelyWatchedAllocationsByAddress.find(memory);
-            if (it != m_closelyWatchedAllocationsByAddress.end()) {
-                CloselyWatchedAllocation& alloc = it->second;
-                alloc.watchedStackTraceInfo->countLiveCloselyWatchedAllocations--;
-                alloc.watchedStackTraceInfo->countLiveCloselyWatchedAllocationsAllTraces--;
-                // TODO Remove watchpoint
-                m_closelyWatchedAllocationsByAddress.erase(it);
+            AddressShard& shard = addressShardFor(memory);
+            lock_guard<mutex> lock(shard.shardMutex);
+            shard.stats.ensureEnabled();
+            ++shard.stats.freeCount;
+
+            AddressTable::Entry* entry = shard.allocationsByAddress.find(memory);
+            if (entry && entry->kind() == AddressTable::Kind::Light) {
+                shard.allocationsByAddress.erase(*entry);
+            } else if (entry && entry->kind() == AddressTable::Kind::CloselyWatched) {
+                CloselyWatchedAllocation& alloc = shard.closelyWatched(*entry);
+                {
+                    lock_guard<mutex> fingerprintLock(fingerprintShardFor(alloc.fingerprint).shardMutex);
+                    alloc.watchedStackTraceInfo->countLiveCloselyWatchedAllocations--;
+                    alloc.watchedStackTraceInfo->countLiveCloselyWatchedAllocationsAllTraces--;
+                }
+                AccessWatcher::instance().unwatch(memory);
+                shard.eraseCloselyWatched(*entry);
+                closelyWatched = true;
             }
         }
 
-freeAndReturn:
-        freeFunction();
+        // Allocations declared leaks are no longer in the table, but may still be in the slab.
+        if (closelyWatched || inWatchedPageSlab(memory))
+            WatchedPageSlab::instance().free(memory);
+        else
+            freeFunction();
     }
 
     struct FoundLeak {
-        StackTrace* stackTrace;
+        StackId stackId;
+        uint32_t moduleGeneration;
         void* memory;
         uint32_t size;
     };
 
+    // To be called from the Patrol Thread and its drain helper thread only.
+    void patrolThreadDrainEventBuffers() {
+        lock_guard<mutex> lock(m_drainMutex);
+        drainEventBuffers();
+    }
+
     // To be called from Patrol Thread only
     std::tuple<AllocationStats, vector<FoundLeak>> patrolThreadUpdateAllocationStates() {
-        uint32_t now = time(nullptr);
-        lock_guard<mutex> lock(m_mutex);
+        if (environment.deferredLightAllocations)
+            patrolThreadDrainEventBuffers();
+
+        // Before any shard is locked, as unwatch() is called with a shard locked.
+        AccessWatcher::instance().update();
+
+        uint32_t now = CoarseClock::now();
+        m_nextDeadline = now + AddressTable::WheelSlots;
+        AllocationStats stats;
         vector<FoundLeak> foundLeaks;
+        vector<CallstackFingerprint> expiredFingerprints;
+        vector<CallstackFingerprint> newSuspiciousFingerprints;
+
+        // Shards are visited one at a time so that only the allocators hashing to the shard being scanned are blocked.
+        for (uint32_t shardIndex = 0; shardIndex < shardCount(); ++shardIndex) {
+            AddressShard& shard = m_addressShards[shardIndex];
+            expiredFingerprints.clear();
+            {
+                lock_guard<mutex> lock(shard.shardMutex);
+                stats += shard.stats;
+                stats.allocationTableMemory += shard.allocationsByAddress.memoryFootprint()
+                    + shard.closelyWatchedAllocations.capacity() * sizeof(CloselyWatchedAllocation);
+
+                // Only the allocations whose deadline has passed are visited.
+                shard.allocationsByAddress.forEachExpired(now, [&](AddressTable::Entry& entry) {
+                    if (entry.kind() == AddressTable::Kind::Light) {
+                        expiredFingerprints.push_back(entry.value());
+                        shard.allocationsByAddress.erase(entry);
+                        return;
+                    }
 
-        for (auto it = m_lightAllocationsByAddress.begin(); it != m_lightAllocationsByAddress.end(); ) {
-            LightAllocation& alloc = it->second;
-            if (alloc.deadline < now) {
-                m_suspiciousFingerprints.addSuspiciousFingerprint(alloc.fingerprint);
-                it = m_lightAllocationsByAddress.erase(it);
-            } else {
-                ++it;
+                    CloselyWatchedAllocation& alloc = shard.closelyWatched(entry);
+                    switch (alloc.state) {
+                    case CloselyWatchedAllocation::State::NotYetSuspicious:
+                        if (AccessWatcher::instance().watch(alloc.memory, alloc.requestedSize)) {
+                            alloc.state = CloselyWatchedAllocation::State::Suspicious;
+                            shard.setCloselyWatchedDeadline(entry, now + CoarseClock::fromSeconds(environment.closelyWatchedAllocationsAccessMaxInterval));
+                        } else {
+                            // Could not protect it (e.g. out of VMAs), try again later.
+                            shard.setCloselyWatchedDeadline(entry, now + CoarseClock::fromSeconds(environment.closelyWatchedAllocationsRestTime));
+                        }
+                        break;
+                    case CloselyWatchedAllocation::State::Suspicious: {
+                        if (AccessWatcher::instance().unwatch(alloc.memory)) {
+                            // Accessed while suspicious: still in use. Let it rest before watching it again.
+                            alloc.state = CloselyWatchedAllocation::State::NotYetSuspicious;
+                            shard.setCloselyWatchedDeadline(entry, now + CoarseClock::fromSeconds(environment.closelyWatchedAllocationsRestTime));
+                            break;
+                        }
+                        lock_guard<mutex> fingerprintLock(fingerprintShardFor(alloc.fingerprint).shardMutex);
+                        alloc.watchedStackTraceInfo->countLeakedCloselyWatchedAllocations++;
+                        alloc.watchedStackTraceInfo->countLiveCloselyWatchedAllocations--;
+                        alloc.watchedStackTraceInfo->countLiveCloselyWatchedAllocationsAllTraces--;
+                        alloc.watchedStackTraceInfo->countTotalLeakedMemory += alloc.requestedSize;
+                        alloc.watchedStackTraceInfo->estimatedTotalLeakedMemory += alloc.requestedSize * alloc.samplingWeight;
+                        foundLeaks.push_back({ alloc.watchedStackTraceInfo->stackId, alloc.watchedStackTraceInfo->moduleGeneration,
+                                              alloc.memory, alloc.requestedSize });
+                        shard.eraseCloselyWatched(entry);
+                    }
+                    }
+                });
+                uint32_t shardNextDeadline = shard.allocationsByAddress.nextDeadline();
+                if (CoarseClock::before(shardNextDeadline, m_nextDeadline))
+                    m_nextDeadline = shardNextDeadline;
             }
-        }
 
-        for (auto it = m_closelyWatchedAllocationsByAddress.begin(); it != m_closelyWatchedAllocationsByAddress.end(); ) {
-            CloselyWatchedAllocation& alloc = it->second;
-            if (alloc.deadline < now) {
-                switch (alloc.state) {
-                case CloselyWatchedAllocation::State::NotYetSuspicious:
-                    alloc.state = CloselyWatchedAllocation::State::Suspicious;
-                    alloc.deadline = now + environment.closelyWatchedAllocationsAccessMaxInterval;
-                    // TODO add MemoryProtector watch
-                    ++it;
-                    break;
-                case CloselyWatchedAllocation::State::Suspicious:
-                    alloc.watchedStackTraceInfo->countLeakedCloselyWatchedAllocations++;
-                    alloc.watchedStackTraceInfo->countLiveCloselyWatchedAllocations--;
-                    alloc.watchedStackTraceInfo->countLiveCloselyWatchedAllocationsAllTraces--;
-                    alloc.watchedStackTraceInfo->countTotalLeakedMemory += alloc.requestedSize;
-                    foundLeaks.push_back({ &alloc.watchedStackTraceInfo->stackTrace, alloc.memory, alloc.requestedSize });
-                    it = m_closelyWatchedAllocationsByAddress.erase(it);
-                }
-            } else {
-                ++it;
+            for (CallstackFingerprint fingerprint : expiredFingerprints) {
+                FingerprintShard& fingerprintShard = fingerprintShardFor(fingerprint);
+                lock_guard<mutex> lock(fingerprintShard.shardMutex);
+                if (fingerprintShard.suspiciousFingerprints.addSuspiciousFingerprint(fingerprint))
+                    newSuspiciousFingerprints.push_back(fingerprint);
             }
         }
-        return make_tuple(m_stats, foundLeaks);
+
+        // Allocations only look up their fingerprint in the table if the filter says it may be there.
+        m_suspiciousFingerprintFilter.publish(newSuspiciousFingerprints, [this](auto function) {
+            for (uint32_t shardIndex = 0; shardIndex < shardCount(); ++shardIndex) {
+                FingerprintShard& fingerprintShard = m_fingerprintShards[shardIndex];
+                lock_guard<mutex> lock(fingerprintShard.shardMutex);
+                for (auto& fingerprintPair : fingerprintShard.suspiciousFingerprints)
+                    function(fingerprintPair.first);
+            }
+        });
+        stats.allocationTableMemory += m_suspiciousFingerprintFilter.memoryFootprint();
+        stats.unsampledAllocationCount = AllocationSampler::unsampledAllocationCount();
+        return make_tuple(stats, foundLeaks);
+    }
+
+    // Earliest tick an allocation may have its deadline at, as of the last patrolThreadUpdateAllocationStates(). New
+    // allocations get theirs ALLOC_TIME_SUSPICIOUS after they are made. To be called from Patrol Thread only.
+    uint32_t patrolThreadNextDeadline() const {
+        return m_nextDeadline;
     }
 
     struct LeakReport {
         struct Leak {
-            StackTrace* stackTrace;
+            StackId stackId;
+            uint32_t moduleGeneration;
             float leakRatio;
             float lostAllocationsEstimated;
             float lostBytesEstimated;
         };
         float ratioAllocationHasSuspiciousFingerprint;
         float averageStackTracesPerFingerprint;
+        uint32_t maxStackTracesPerFingerprint;
+        // Suspicious fingerprints standing for 1, 2-3, 4-7 and 8 or more stack traces.
+        uint32_t fingerprintsByStackTraceCount[4];
+        uint64_t unwindCount;
         float ratioLeakyStacks;
         float ratioNonLeakyStacks;
         float ratioMaybeLeakyStats;
@@ -308,22 +511,31 @@ freeAndReturn:
 
     LeakReport patrolThreadMakeLeakReport() {
         LeakReport report;
+        report.maxStackTracesPerFingerprint = 0;
+        fill(begin(report.fingerprintsByStackTraceCount), end(report.fingerprintsByStackTraceCount), 0);
+        report.unwindCount = 0;
         uint32_t countFingerprints = 0;
         uint32_t countStacks = 0;
         uint32_t countLeakyStacks = 0;
         uint32_t countNonLeakyStacks = 0;
         uint32_t countMaybeLeakyStacks = 0;
-        {
-            lock_guard<mutex> lock(m_mutex);
-            for (auto& fingerprintPair : m_suspiciousFingerprints) {
+        for (uint32_t shardIndex = 0; shardIndex < shardCount(); ++shardIndex) {
+            FingerprintShard& fingerprintShard = m_fingerprintShards[shardIndex];
+            lock_guard<mutex> lock(fingerprintShard.shardMutex);
+            for (auto& fingerprintPair : fingerprintShard.suspiciousFingerprints) {
                 countFingerprints++;
+                uint32_t stackTraceCount = fingerprintPair.second.size();
+                report.maxStackTracesPerFingerprint = max(report.maxStackTracesPerFingerprint, stackTraceCount);
+                if (stackTraceCount)
+                    report.fingerprintsByStackTraceCount[min(31 - __builtin_clz(stackTraceCount), 3)]++;
+                report.unwindCount += fingerprintPair.second.unwindCount;
                 for (auto& watchedTracePair: fingerprintPair.second) {
                     countStacks++;
                     WatchedStackTraceInfo& trace = watchedTracePair.second;
                     switch (trace.hasLeaks()) {
                     case Trilean::True:
                         countLeakyStacks++;
-                        report.leaks.push_back({ &trace.stackTrace, trace.leakRatio(),
+                        report.leaks.push_back({ trace.stackId, trace.moduleGeneration, trace.leakRatio(),
                                                  trace.lostAllocationsEstimated(), trace.lostBytesEstimated() });
                         break;
                     case Trilean::False:
@@ -334,9 +546,15 @@ freeAndReturn:
                     }
                 }
             }
-            report.ratioAllocationHasSuspiciousFingerprint =
-                    (float) m_stats.allocationWithSuspiciousFingerprintCount / m_stats.allocationCount;
         }
+        AllocationStats stats;
+        for (uint32_t shardIndex = 0; shardIndex < shardCount(); ++shardIndex) {
+            AddressShard& shard = m_addressShards[shardIndex];
+            lock_guard<mutex> lock(shard.shardMutex);
+            stats += shard.stats;
+        }
+        report.ratioAllocationHasSuspiciousFingerprint =
+                (float) stats.allocationWithSuspiciousFingerprintCount / stats.allocationCount;
         report.averageStackTracesPerFingerprint = (float) countStacks / countFingerprints;
         report.ratioLeakyStacks = (float) countLeakyStacks / countStacks;
         report.ratioNonLeakyStacks = (float) countNonLeakyStacks / countStacks;
@@ -349,11 +567,245 @@ freeAndReturn:
     }
 
 private:
-    static AllocationTable s_allocationTable;
+    // Light and closely watched allocations, together with the counters of the calls that touched them, are sharded
+    // by memory address.
+    struct alignas(64) AddressShard {
+        mutex shardMutex;
+        // Light allocations are stored entirely in their AddressTable entry. Closely watched allocations are much
+        // fewer and need more data, so their entries point to a CloselyWatchedAllocation record in a pool.
+        AddressTable allocationsByAddress;
+        vector<CloselyWatchedAllocation> closelyWatchedAllocations;
+        vector<uint32_t> freeCloselyWatchedAllocations;
+        AllocationStats stats;
+
+        static LightAllocation lightAllocation(const AddressTable::Entry& entry) {
+            LightAllocation alloc;
+            alloc.memory = entry.memory();
+            alloc.deadline = entry.deadline();
+            alloc.fingerprint = entry.value();
+            return alloc;
+        }
+
+        void insertLight(const LightAllocation& alloc) {
+            if (!AddressTable::canStore(alloc.memory)) {
+                AddressTable::warnCannotStore(alloc.memory);
+                return;
+            }
+            AddressTable::Entry& entry = allocationsByAddress.insert(alloc.memory, AddressTable::Kind::Light, alloc.deadline);
+            entry.setValue(alloc.fingerprint);
+        }
+
+        CloselyWatchedAllocation& closelyWatched(const AddressTable::Entry& entry) {
+            assert(entry.kind() == AddressTable::Kind::CloselyWatched);
+            return closelyWatchedAllocations[entry.value()];
+        }
+
+        void insertCloselyWatched(const CloselyWatchedAllocation& alloc) {
+            uint32_t index;
+            if (!freeCloselyWatchedAllocations.empty()) {
+                index = freeCloselyWatchedAllocations.back();
+                freeCloselyWatchedAllocations.pop_back();
+                closelyWatchedAllocations[index] = alloc;
+            } else {
+                index = closelyWatchedAllocations.size();
+                closelyWatchedAllocations.push_back(alloc);
+            }
+            // The deadline is duplicated in the entry, as that's what the timer wheel of the table is sorted by.
+            AddressTable::Entry& entry = allocationsByAddress.insert(alloc.memory, AddressTable::Kind::CloselyWatched, alloc.deadline);
+            entry.setValue(index);
+        }
+
+        void setCloselyWatchedDeadline(AddressTable::Entry& entry, uint32_t deadline) {
+            closelyWatched(entry).deadline = deadline;
+            allocationsByAddress.setDeadline(entry, deadline);
+        }
+
+        void eraseCloselyWatched(AddressTable::Entry& entry) {
+            assert(entry.kind() == AddressTable::Kind::CloselyWatched);
+            freeCloselyWatchedAllocations.push_back(entry.value());
+            allocationsByAddress.erase(entry);
+        }
+    };
+
+    // Suspicious fingerprints are sharded by fingerprint. The mutex of a fingerprint shard also protects the
+    // WatchedStackTraceInfo objects it owns.
+    struct alignas(64) FingerprintShard {
+        mutex shardMutex;
+        SuspiciousFingerprintTable suspiciousFingerprints;
+    };
+
+    static uint32_t shardCount() {
+        return std::min(environment.allocationTableShards, MaxShards);
+    }
+
+    AddressShard& addressShardFor(void* memory) {
+        // Allocations are at least 8 byte aligned, so the lowest bits carry no information.
+        uintptr_t hash = reinterpret_cast<uintptr_t>(memory) >> 4;
+        hash ^= hash >> 7;
+        hash ^= hash >> 13;
+        return m_addressShards[hash & (shardCount() - 1)];
+    }
+
+    FingerprintShard& fingerprintShardFor(CallstackFingerprint fingerprint) {
+        return m_fingerprintShards[(fingerprint ^ (fingerprint >> 16)) & (shardCount() - 1)];
+    }
+
+    static void recordLightAllocation(AddressShard& shard, void* memory, CallstackFingerprint fingerprint,
+                                      uint32_t allocationTime) {
+        LightAllocation alloc;
+        alloc.fingerprint = fingerprint;
+        alloc.memory = memory;
+        alloc.deadline = allocationTime + CoarseClock::fromSeconds(environment.timeForAllocationToBecomeSuspicious);
+        shard.insertLight(alloc);
+    }
+
+    // Moves memory of the slab that is no longer in the table back to the heap, as the real realloc() can't take it.
+    static void* reallocateOutOfWatchedPageSlab(void* oldMemory, size_t newRequestedSize) {
+        void* newMemory = malloc(newRequestedSize);
+        if (!newMemory)
+            return nullptr;
+        memcpy(newMemory, oldMemory, std::min(WatchedPageSlab::instance().usableSize(oldMemory), newRequestedSize));
+        WatchedPageSlab::instance().free(oldMemory);
+        return newMemory;
+    }
+
+    // Closely watched allocations (and former ones, declared leaks) are always handled synchronously. All of them come
+    // from the slab, which also knows those that fell back to the heap, so no shard needs to be locked.
+    bool isCloselyWatched(void* memory) {
+        return inWatchedPageSlab(memory);
+    }
+
+    // Returns false if the ring of the calling thread is full. In that case the caller must continue in the
+    // synchronous path.
+    bool deferEvent(const AllocationEvent& event) {
+        if (AllocationEventRing::forCurrentThread()->tryPush(event))
+            return true;
+        handleEventBufferOverflow(event.memory);
+        return false;
+    }
+
+    void handleEventBufferOverflow(void* memory) {
+        // The pending events must be applied before the synchronous path touches the table, otherwise an older
+        // allocation event could be applied after a newer free of the same memory.
+        {
+            lock_guard<mutex> lock(m_drainMutex);
+            drainEventBuffers();
+        }
+        AddressShard& shard = addressShardFor(memory);
+        lock_guard<mutex> lock(shard.shardMutex);
+        ++shard.stats.eventBufferOverflowCount;
+    }
+
+    // Events consumed from one ring, in the order they were pushed.
+    struct PendingRun {
+        size_t next;
+        size_t end;
+        AllocationEventRing* ring;
+    };
 
-    mutex m_mutex;
-    unordered_map<void*, LightAllocation> m_lightAllocationsByAddress;
-    unordered_map<void*, CloselyWatchedAllocation> m_closelyWatchedAllocationsByAddress;
-    SuspiciousFingerprintTable m_suspiciousFingerprints;
-    AllocationStats m_stats;
+    // m_drainMutex must be held.
+    void drainEventBuffers() {
+        // Every event older than the cutoff is already in its ring: frees are pushed before the memory is released
+        // and allocations are pushed before the memory is returned to the application. Therefore, as long as events
+        // are applied in timestamp order, no event is applied before another one it depends on.
+        uint64_t cutoff = AllocationEvent::now();
+        uint32_t cutoffTime = CoarseClock::now();
+        m_pendingEvents.clear();
+        m_pendingRuns.clear();
+        for (AllocationEventRing* ring = AllocationEventRing::first(); ring; ring = ring->next()) {
+            size_t begin = m_pendingEvents.size();
+            ring->consumeOlderThan(cutoff, [this](const AllocationEvent& event) {
+                m_pendingEvents.push_back(event);
+            });
+            if (m_pendingEvents.size() != begin)
+                m_pendingRuns.push_back({ begin, m_pendingEvents.size(), ring });
+        }
+
+        // The runs are merged, rather than all the events sorted, so that the events of a thread keep their order
+        // when their timestamps are equal: a malloc() and a free() of the same memory may read the same time.
+        auto laterHead = [this](const PendingRun& a, const PendingRun& b) {
+            return m_pendingEvents[b.next] < m_pendingEvents[a.next];
+        };
+        std::make_heap(m_pendingRuns.begin(), m_pendingRuns.end(), laterHead);
+        while (!m_pendingRuns.empty()) {
+            std::pop_heap(m_pendingRuns.begin(), m_pendingRuns.end(), laterHead);
+            PendingRun& run = m_pendingRuns.back();
+            applyEvent(m_pendingEvents[run.next], run.ring, cutoff, cutoffTime);
+            if (++run.next == run.end)
+                m_pendingRuns.pop_back();
+            else
+                std::push_heap(m_pendingRuns.begin(), m_pendingRuns.end(), laterHead);
+        }
+    }
+
+    // m_drainMutex must be held.
+    void applyEvent(const AllocationEvent& event, AllocationEventRing* ring, uint64_t cutoff, uint32_t cutoffTime) {
+        switch (event.type) {
+        case AllocationEvent::Type::Allocate: {
+            AddressShard& shard = addressShardFor(event.memory);
+            lock_guard<mutex> lock(shard.shardMutex);
+            shard.stats.ensureEnabled();
+            ++shard.stats.allocationCount;
+            uint32_t allocationTime = cutoffTime - CoarseClock::fromNanoseconds(cutoff - event.timestamp);
+            recordLightAllocation(shard, event.memory, event.fingerprint, allocationTime);
+            break;
+        }
+        case AllocationEvent::Type::Free: {
+            AddressShard& shard = addressShardFor(event.memory);
+            lock_guard<mutex> lock(shard.shardMutex);
+            shard.stats.ensureEnabled();
+            ++shard.stats.freeCount;
+            AddressTable::Entry* entry = shard.allocationsByAddress.find(event.memory);
+            if (entry && entry->kind() == AddressTable::Kind::Light)
+                shard.allocationsByAddress.erase(*entry);
+            break;
+        }
+        case AllocationEvent::Type::ReallocateFrom: {
+            AddressShard& shard = addressShardFor(event.memory);
+            lock_guard<mutex> lock(shard.shardMutex);
+            shard.stats.ensureEnabled();
+            ++shard.stats.reallocCount;
+            AddressTable::Entry* entry = shard.allocationsByAddress.find(event.memory);
+            if (entry && entry->kind() == AddressTable::Kind::Light) {
+                m_reallocationsInFlight.insert(make_pair(ring, AddressShard::lightAllocation(*entry)));
+                shard.allocationsByAddress.erase(*entry);
+            }
+            break;
+        }
+        case AllocationEvent::Type::ReallocateTo: {
+            // The matching ReallocateFrom may have been applied by an earlier drain.
+            auto it = m_reallocationsInFlight.find(ring);
+            if (it == m_reallocationsInFlight.end())
+                break; // Uninstrumented memory
+            LightAllocation alloc = it->second;
+            m_reallocationsInFlight.erase(it);
+            if (event.memory)
+                alloc.memory = event.memory;
+            AddressShard& shard = addressShardFor(alloc.memory);
+            lock_guard<mutex> lock(shard.shardMutex);
+            shard.insertLight(alloc);
+            break;
+        }
+        }
+    }
+
+    AddressShard m_addressShards[MaxShards];
+    FingerprintShard m_fingerprintShards[MaxShards];
+    SuspiciousFingerprintFilter m_suspiciousFingerprintFilter;
+    // Only used by the Patrol Thread, see patrolThreadNextDeadline().
+    uint32_t m_nextDeadline = 0;
+
+    // Deferred mode state. Consuming the rings and applying their events is serialized by m_drainMutex.
+    mutex m_drainMutex;
+    vector<AllocationEvent> m_pendingEvents;
+    vector<PendingRun> m_pendingRuns;
+    unordered_map<AllocationEventRing*, LightAllocation> m_reallocationsInFlight;
 };
+
+// Constructed when the library is loaded, and never destroyed: the application may keep allocating and freeing while
+// the process exits, and its destructor would hand the memory of the table to free(), which looks it up in the table.
+extern aligned_storage<sizeof(AllocationTable), alignof(AllocationTable)>::type allocationTableStorage;
+
+inline AllocationTable& AllocationTable::instance() {
+    return *reinterpret_cast<AllocationTable*>(&allocationTableStorage);
+}
@@ -0,0 +1,21 @@
+#include "callstack-fingerprint.h"
+#include "library-context.h"
+#include <pthread.h>
+
+static thread_local uintptr_t t_stackEnd = 0;
+
+uintptr_t callstackFingerprintStackEnd() {
+    if (!t_stackEnd && !LibraryContext::inLibrary()) {
+        // pthread_getattr_np() may allocate (it reads /proc/self/maps for the main thread).
+        LibraryContext ctx;
+        pthread_attr_t attributes;
+        void* stackAddress;
+        size_t stackSize;
+        if (pthread_getattr_np(pthread_self(), &attributes) != 0)
+            return 0;
+        if (pthread_attr_getstack(&attributes, &stackAddress, &stackSize) == 0)
+            t_stackEnd = reinterpret_cast<uintptr_t>(stackAddress) + stackSize;
+        pthread_attr_destroy(&attributes);
+    }
+    return t_stackEnd;
+}
@@ -1,27 +1,59 @@
 #pragma once
 #include <cstdint>
-#include <set>
+#include "environment.h"
 using namespace std;
 
-typedef uint32_t CallstackFingerprint;
+typedef uint64_t CallstackFingerprint;
 
-// This is lossy in 64-bit systems.
-uint32_t inline pointerToInt(void * pointer) {
-    return static_cast<uint32_t>(reinterpret_cast<unsigned long>(pointer));
+/** Size classes mixed in the fingerprint: sizes below 128 bytes are their own class, bigger sizes get 4 classes per
+ * power of two, so that a class spans at most 25% of its sizes. */
+inline uint32_t callstackFingerprintSizeClass(uint32_t allocationSize) {
+    if (allocationSize < 128)
+        return allocationSize;
+    unsigned int log2 = 31 - __builtin_clz(allocationSize);
+    return 128 + (log2 - 7) * 4 + ((allocationSize >> (log2 - 2)) & 3);
 }
 
-inline CallstackFingerprint computeCallstackFingerprint(void* approximateStackPointer,
-                                                        void* returnAddress, uint32_t allocationSize)
-{
-    uint32_t sizeClass;
-    if (allocationSize < 100)
-        sizeClass = allocationSize;
-    else if (allocationSize < 2048)
-        sizeClass = 769; // arbitrary value (it just needs to be different than other size classes)
-    else
-        sizeClass = 49157;
+inline uint64_t mixIntoCallstackFingerprint(uint64_t fingerprint, uint64_t word) {
+    word *= 0x87c37b91114253d5ull;
+    word ^= word >> 31;
+    fingerprint = (fingerprint ^ word) * 0x4cf5ad432745937full;
+    return fingerprint ^ (fingerprint >> 29);
+}
+
+// Highest address of the stack of the calling thread, or 0 if unknown. Computed once per thread.
+uintptr_t callstackFingerprintStackEnd();
 
-    return (pointerToInt(approximateStackPointer) << 1)
-        ^ pointerToInt(returnAddress)
-        ^ (sizeClass * 786433);
+/** Cheap identifier of the code path of an allocation, computed on every allocation (see "Callstack fingerprints" in
+ * the README).
+ *
+ * It mixes the stack pointer, the return address of malloc(), the size class and, if environment.fingerprintDepth is
+ * more than 1, the return addresses of up to fingerprintDepth - 1 more callers, read from the chain of saved frame
+ * pointers starting at `framePointer` (the frame of malloc()). The walk stops at the first frame record that is not
+ * further up in the stack of the thread, which is where code built without frame pointers usually breaks the chain,
+ * but not always: that code may leave in the frame pointer register any value pointing further up the stack, whose
+ * words are then mixed in as if they were return addresses. Hence the walk is off by default. */
+inline __attribute__((always_inline)) CallstackFingerprint computeCallstackFingerprint(
+        void* approximateStackPointer, void* returnAddress, const void* framePointer, uint32_t allocationSize) {
+    uint64_t fingerprint = mixIntoCallstackFingerprint(0, reinterpret_cast<uintptr_t>(approximateStackPointer));
+    fingerprint = mixIntoCallstackFingerprint(fingerprint, reinterpret_cast<uintptr_t>(returnAddress));
+    fingerprint = mixIntoCallstackFingerprint(fingerprint, callstackFingerprintSizeClass(allocationSize));
+#if defined(__x86_64__) || defined(__aarch64__)
+    // Frame records are the saved frame pointer of the caller followed by the return address into it.
+    if (environment.fingerprintDepth > 1 && framePointer) {
+        uintptr_t stackEnd = callstackFingerprintStackEnd();
+        const uintptr_t* frame = static_cast<const uintptr_t*>(framePointer);
+        for (uint32_t i = 1; i < environment.fingerprintDepth; i++) {
+            const uintptr_t* caller = reinterpret_cast<const uintptr_t*>(frame[0]);
+            if (caller <= frame || reinterpret_cast<uintptr_t>(caller) % sizeof(uintptr_t)
+                || reinterpret_cast<uintptr_t>(caller + 2) > stackEnd)
+                break;
+            fingerprint = mixIntoCallstackFingerprint(fingerprint, caller[1]);
+            frame = caller;
+        }
+    }
+#else
+    (void) framePointer;
+#endif
+    return fingerprint;
 }
@@ -0,0 +1,24 @@
+#include "coarse-clock.h"
+#include <time.h>
+#include <unistd.h>
+
+atomic<uint32_t> CoarseClock::s_now(1);
+
+static uint64_t monotonicNanoseconds() {
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec * 1000000000ull + tv.tv_nsec;
+}
+
+static const uint64_t s_startTime = monotonicNanoseconds();
+
+void CoarseClock::advance() {
+    s_now.store(1 + fromNanoseconds(monotonicNanoseconds() - s_startTime), memory_order_relaxed);
+}
+
+void CoarseClock::tickerMain() {
+    while (true) {
+        usleep(environment.clockResolution * 1000);
+        advance();
+    }
+}
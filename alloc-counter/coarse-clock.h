@@ -0,0 +1,45 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include "environment.h"
+using namespace std;
+
+/** Process-wide clock with a resolution of environment.clockResolution milliseconds.
+ *
+ * The allocation hooks need a timestamp for every allocation, but not a precise one. Instead of calling time() or
+ * clock_gettime() each time, they read a word that a ticker thread of the patrol thread advances.
+ *
+ * Time is counted in ticks since the library was loaded, starting at 1. 32 bits of ticks last for about 13 years at the
+ * default resolution of 100 ms, but only 49 days at 1 ms, so ticks should be compared with before(), which tolerates
+ * wrapping around. */
+class CoarseClock {
+public:
+    static uint32_t now() {
+        return s_now.load(memory_order_relaxed);
+    }
+
+    static uint32_t fromSeconds(uint32_t seconds) {
+        return seconds * 1000ull / environment.clockResolution;
+    }
+
+    static uint32_t fromNanoseconds(uint64_t nanoseconds) {
+        return nanoseconds / (environment.clockResolution * 1000000ull);
+    }
+
+    static double toSeconds(uint32_t ticks) {
+        return ticks * (environment.clockResolution / 1000.0);
+    }
+
+    static bool before(uint32_t a, uint32_t b) {
+        return static_cast<int32_t>(a - b) < 0;
+    }
+
+    // Recomputes the current tick from CLOCK_MONOTONIC, so that the ticker doesn't drift when it oversleeps.
+    static void advance();
+
+    // Body of the ticker thread.
+    static void tickerMain();
+
+private:
+    static atomic<uint32_t> s_now;
+};
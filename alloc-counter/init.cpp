@@ -1,6 +1,8 @@
 #include "library-context.h"
 #include "patrol-thread.h"
 #include "comm-memory.h"
+#include "access-watcher.h"
+#include "module-map.h"
 
 __attribute__((constructor)) void allocCounterInit(void) {
     // Note: initRealMallocFunctions() does not need to be called here, by the time this function is called malloc
@@ -9,5 +11,8 @@ __attribute__((constructor)) void allocCounterInit(void) {
     LibraryContext ctx;
 
     initCommMemory();
+    AccessWatcher::initialize();
+    // The modules loaded with the executable, for the traces captured before the patrol thread's first round.
+    ModuleMap::instance().update();
     PatrolThread::spawn();
 }
@@ -1,3 +1,112 @@
 #include "memory-protector.h"
+#include "watched-page-slab.h"
+#include <sys/mman.h>
+#include <cstdio>
+#include <cstdlib>
 
 MemoryProtector* MemoryProtector::s_instance = nullptr;
+
+MemoryProtector* MemoryProtector::create() {
+    if (s_instance)
+        return s_instance;
+    // Must be called in library context, as any allocation made here.
+    s_instance = new MemoryProtector();
+
+    struct sigaction newSigAction;
+    newSigAction.sa_sigaction = MemoryProtector::segfaultHandler;
+    newSigAction.sa_flags = SA_SIGINFO | SA_NODEFER | SA_RESTART;
+    // If our segfault handler has a bug, we want to catch it as usual, but otherwise we want no signals to interrupt
+    // the signal handler.
+    sigfillset(&newSigAction.sa_mask);
+    sigdelset(&newSigAction.sa_mask, SIGILL);
+    sigdelset(&newSigAction.sa_mask, SIGBUS);
+    sigdelset(&newSigAction.sa_mask, SIGFPE);
+    sigdelset(&newSigAction.sa_mask, SIGSEGV);
+    sigdelset(&newSigAction.sa_mask, SIGPIPE);
+#ifdef SIGSTKFLT
+    sigdelset(&newSigAction.sa_mask, SIGSTKFLT);
+#endif
+
+    if (0 != sigaction(SIGSEGV, &newSigAction, &s_instance->m_oldSigAction)) {
+        perror("MemoryProtector: could not set up signal handler");
+        abort();
+    }
+    return s_instance;
+}
+
+bool MemoryProtector::setProtection(void* memory, size_t size, bool protect) {
+    int protection = protect ? PROT_NONE : PROT_READ | PROT_WRITE;
+    // The slab keeps track of the protected slots to count its VMAs.
+    if (WatchedPageSlab::instance().owns(memory))
+        return WatchedPageSlab::instance().protect(memory, size, protection);
+    return mprotect(memory, size, protection) == 0;
+}
+
+bool MemoryProtector::watch(void* memory, size_t size) {
+    uint32_t rangePages = (watchedSize(memory, size) + environment.pageSize - 1) / environment.pageSize;
+    // The entries must be in place before the protection, so that any fault on the range finds them.
+    if (!m_index.add(memory, rangePages))
+        return false;
+    if (!setProtection(memory, rangePages * environment.pageSize, true)) {
+        m_index.remove(memory);
+        return false;
+    }
+    return true;
+}
+
+bool MemoryProtector::unwatch(void* memory) {
+    uint32_t rangePages = m_index.rangePagesAt(memory);
+    if (!rangePages)
+        return false;
+    // The protection must be lifted before the entries are removed, so that no fault on the range goes unhandled.
+    setProtection(memory, rangePages * environment.pageSize, false);
+    bool accessed = m_index.remove(memory);
+    lock_guard<mutex> lock(m_removedRangesMutex);
+    m_recentlyRemovedRanges.emplace_back(memory, rangePages);
+    return accessed;
+}
+
+void MemoryProtector::update() {
+    // The tombstones of a range are cleared one tick after the one it was removed in at the earliest, which leaves
+    // plenty of time to the handlers of the faults raised before.
+    lock_guard<mutex> lock(m_removedRangesMutex);
+    for (const auto& range : m_removedRanges)
+        m_index.forget(range.first, range.second);
+    m_removedRanges.swap(m_recentlyRemovedRanges);
+    m_recentlyRemovedRanges.clear();
+}
+
+bool MemoryProtector::handleAccess(void* accessedAddress) {
+    void* rangeStart;
+    uint32_t rangePages;
+    switch (m_index.markAccessed(accessedAddress, &rangeStart, &rangePages)) {
+    case WatchedPageIndex::AccessResult::NotWatched:
+        return false;
+    case WatchedPageIndex::AccessResult::FirstAccess:
+        // Raw mprotect() on purpose: the slab's bookkeeping takes a lock. It's updated by unwatch().
+        mprotect(rangeStart, rangePages * environment.pageSize, PROT_READ | PROT_WRITE);
+        return true;
+    case WatchedPageIndex::AccessResult::AlreadyAccessed:
+    case WatchedPageIndex::AccessResult::Removed:
+        // Another thread is lifting the protection (or unwatch() just did). Either way, returning restarts the access,
+        // which faults again until the protection is gone.
+        return true;
+    }
+    return false;
+}
+
+void MemoryProtector::segfaultHandler(int signum, siginfo_t* siginfo, void* context) {
+    if (s_instance->handleAccess(siginfo->si_addr))
+        return;
+
+    // Never a watched page: an actual bug in the application (or in this library). Let the previous handler deal with
+    // it or, if there was none, get the default action (core dump) by restoring it and restarting the access.
+    const struct sigaction& old = s_instance->m_oldSigAction;
+    if ((old.sa_flags & SA_SIGINFO) && old.sa_sigaction) {
+        old.sa_sigaction(signum, siginfo, context);
+    } else if (old.sa_handler != SIG_DFL && old.sa_handler != SIG_IGN) {
+        old.sa_handler(signum);
+    } else {
+        signal(SIGSEGV, SIG_DFL);
+    }
+}
@@ -0,0 +1,175 @@
+#include "module-map.h"
+#include <link.h>
+#include <elf.h>
+#include <unistd.h>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+ModuleMap ModuleMap::s_instance;
+
+namespace {
+
+struct LoadCounters {
+    unsigned long long adds;
+    unsigned long long subs;
+};
+
+struct LoadedModule {
+    uintptr_t base;
+    uintptr_t start;
+    uintptr_t end;
+    string path;
+    string buildId;
+};
+
+string buildIdOf(const struct dl_phdr_info* info) {
+    static const char hexDigits[] = "0123456789abcdef";
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)& header = info->dlpi_phdr[i];
+        if (header.p_type != PT_NOTE)
+            continue;
+        const char* note = reinterpret_cast<const char*>(info->dlpi_addr + header.p_vaddr);
+        const char* notesEnd = note + header.p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= notesEnd) {
+            const ElfW(Nhdr)* noteHeader = reinterpret_cast<const ElfW(Nhdr)*>(note);
+            const char* name = note + sizeof(ElfW(Nhdr));
+            const unsigned char* description =
+                reinterpret_cast<const unsigned char*>(name + ((noteHeader->n_namesz + 3) & ~3u));
+            if (noteHeader->n_type == NT_GNU_BUILD_ID && noteHeader->n_namesz == 4 && !memcmp(name, "GNU", 4)) {
+                string buildId;
+                for (unsigned int j = 0; j < noteHeader->n_descsz; j++) {
+                    buildId += hexDigits[description[j] >> 4];
+                    buildId += hexDigits[description[j] & 15];
+                }
+                return buildId;
+            }
+            note = reinterpret_cast<const char*>(description) + ((noteHeader->n_descsz + 3) & ~3u);
+        }
+    }
+    return string();
+}
+
+string executablePath() {
+    char path[PATH_MAX];
+    ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    return length > 0 ? string(path, length) : string();
+}
+
+// Libraries given by a relative path (e.g. LD_PRELOAD=./lib.so) are relative to the working directory of the process,
+// which the report reader doesn't know.
+string absolutePath(const string& path) {
+    char resolved[PATH_MAX];
+    if (path.empty() || path[0] == '/' || !realpath(path.c_str(), resolved))
+        return path;
+    return resolved;
+}
+
+} // namespace
+
+uint32_t ModuleMap::update() {
+    // dl_iterate_phdr() passes the counters with every module, so one is enough.
+    LoadCounters counters = { 0, 0 };
+    dl_iterate_phdr([](struct dl_phdr_info* info, size_t, void* data) {
+        *static_cast<LoadCounters*>(data) = { info->dlpi_adds, info->dlpi_subs };
+        return 1;
+    }, &counters);
+    if (counters.adds == m_adds.load(memory_order_acquire) && counters.subs == m_subs.load(memory_order_acquire))
+        return m_generation.load(memory_order_acquire);
+
+    lock_guard<mutex> lock(m_mutex);
+    vector<LoadedModule> loaded;
+    dl_iterate_phdr([](struct dl_phdr_info* info, size_t, void* data) {
+        LoadedModule module = { info->dlpi_addr, UINTPTR_MAX, 0, info->dlpi_name ? info->dlpi_name : "", buildIdOf(info) };
+        for (int i = 0; i < info->dlpi_phnum; i++) {
+            const ElfW(Phdr)& header = info->dlpi_phdr[i];
+            if (header.p_type != PT_LOAD)
+                continue;
+            module.start = min(module.start, static_cast<uintptr_t>(info->dlpi_addr + header.p_vaddr));
+            module.end = max(module.end, static_cast<uintptr_t>(info->dlpi_addr + header.p_vaddr + header.p_memsz));
+        }
+        if (module.start < module.end)
+            static_cast<vector<LoadedModule>*>(data)->push_back(module);
+        return 0;
+    }, &loaded);
+
+    // The counters may have changed again in the meantime, that's fine: the next update will find them different.
+    m_adds.store(counters.adds, memory_order_relaxed);
+    m_subs.store(counters.subs, memory_order_relaxed);
+    uint32_t generation = m_generation.load(memory_order_relaxed) + 1;
+
+    vector<bool> stillLoaded(m_modules.size(), false);
+    for (LoadedModule& module : loaded) {
+        // The executable is the module without a name.
+        if (module.path.empty())
+            module.path = executablePath();
+        else
+            module.path = absolutePath(module.path);
+        bool known = false;
+        for (size_t i = 0; i < m_modules.size() && !known; i++) {
+            const Module& other = m_modules[i];
+            if (other.unloadedGeneration == StillLoaded && other.base == module.base && other.start == module.start
+                && other.path == module.path) {
+                stillLoaded[i] = known = true;
+            }
+        }
+        if (!known) {
+            m_modules.push_back({ static_cast<uint32_t>(m_modules.size()), module.base, module.start, module.end,
+                                  module.path, module.buildId, generation, StillLoaded });
+            stillLoaded.push_back(true);
+        }
+    }
+    for (size_t i = 0; i < m_modules.size(); i++) {
+        if (!stillLoaded[i] && m_modules[i].unloadedGeneration == StillLoaded)
+            m_modules[i].unloadedGeneration = generation;
+    }
+
+    m_generation.store(generation, memory_order_release);
+    return generation;
+}
+
+const ModuleMap::Module* ModuleMap::findLocked(uintptr_t address, uint32_t generation) const {
+    const Module* loadedLater = nullptr;
+    for (const Module& module : m_modules) {
+        if (module.start > address || address >= module.end)
+            continue;
+        if (module.loadedGeneration <= generation && generation < module.unloadedGeneration)
+            return &module;
+        if (module.loadedGeneration > generation
+            && (!loadedLater || module.loadedGeneration < loadedLater->loadedGeneration))
+            loadedLater = &module;
+    }
+    return loadedLater;
+}
+
+bool ModuleMap::find(const void* address, uint32_t generation, Module& module) const {
+    lock_guard<mutex> lock(m_mutex);
+    const Module* found = findLocked(reinterpret_cast<uintptr_t>(address), generation);
+    if (found)
+        module = *found;
+    return found;
+}
+
+void ModuleMap::write(ostream& os) const {
+    lock_guard<mutex> lock(m_mutex);
+    for (const Module& module : m_modules) {
+        os << "    [" << module.id << "] " << reinterpret_cast<void*>(module.start) << "-"
+           << reinterpret_cast<void*>(module.end) << " base=" << reinterpret_cast<void*>(module.base)
+           << " build-id=" << (module.buildId.empty() ? "-" : module.buildId) << " "
+           << (module.unloadedGeneration != StillLoaded ? "unloaded " : "") << module.path << endl;
+    }
+}
+
+void ModuleMap::writeStackTrace(ostream& os, StackDepot::Frames frames, uint32_t generation) const {
+    lock_guard<mutex> lock(m_mutex);
+    int frameNumber = 0;
+    for (void* returnAddress : frames) {
+        uintptr_t address = reinterpret_cast<uintptr_t>(returnAddress);
+        os << "    #" << frameNumber << " " << returnAddress;
+        if (const Module* module = findLocked(address, generation))
+            os << " [" << module->id << "]+0x" << hex << address - module->base << dec;
+        os << endl;
+        frameNumber++;
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "stack-depot.h"
+using namespace std;
+
+/** Record of the modules (executable and shared libraries) loaded in the process, so that reports can carry raw
+ * return addresses and leave symbolization to alloc-counter-symbolize, out of the process.
+ *
+ * Modules are never removed from the map: an unloaded module keeps its entry, with the generation it was unloaded at,
+ * so that the stack traces captured while it was loaded can still be resolved, even if another module is loaded at the
+ * same address later. A generation number identifies each set of loaded modules. */
+class ModuleMap {
+public:
+    static ModuleMap& instance() { return s_instance; }
+
+    static const uint32_t StillLoaded = UINT32_MAX;
+
+    struct Module {
+        uint32_t id;
+        // Addresses in the module are (ELF virtual address + base).
+        uintptr_t base;
+        // Span of the loadable segments.
+        uintptr_t start;
+        uintptr_t end;
+        string path;
+        string buildId; // hex, empty if the module has none
+        uint32_t loadedGeneration;
+        uint32_t unloadedGeneration;
+    };
+
+    /** Brings the map up to date if modules were loaded or unloaded since the last call, and returns the current
+     * generation. The patrol thread calls it on every round: dl_iterate_phdr() takes the dynamic loader's lock, too
+     * costly in the allocation hooks. */
+    uint32_t update();
+
+    // Generation as of the last update(), to tag the stack traces being captured.
+    uint32_t generation() const { return m_generation.load(memory_order_acquire); }
+
+    /** Copies the module containing `address` at `generation` to `module`. Returns false if there is none.
+     *
+     * A trace may be captured after a module is loaded but before the patrol thread updates the map, so if no module
+     * contains the address at `generation`, the first one loaded later that does is taken. */
+    bool find(const void* address, uint32_t generation, Module& module) const;
+
+    // Writes one line per module: "[<id>] <start>-<end> base=<base> build-id=<hex or -> [unloaded ]<path>"
+    void write(ostream& os) const;
+
+    // Writes the frames of a trace captured at `generation` as "#<n> <address> [<module id>]+<offset from base>".
+    void writeStackTrace(ostream& os, StackDepot::Frames frames, uint32_t generation) const;
+
+private:
+    static ModuleMap s_instance;
+
+    const Module* findLocked(uintptr_t address, uint32_t generation) const;
+
+    mutable mutex m_mutex;
+    vector<Module> m_modules;
+    // dl_iterate_phdr() counters of modules loaded and unloaded, as of the last update.
+    atomic<unsigned long long> m_adds { 0 };
+    atomic<unsigned long long> m_subs { 0 };
+    atomic<uint32_t> m_generation { 0 };
+};
@@ -3,18 +3,29 @@
 #include "comm-memory.h"
 #include "allocation-stats.h"
 #include "allocation-table.h"
+#include "coarse-clock.h"
+#include "watched-page-slab.h"
+#include "module-map.h"
+#include "stack-depot.h"
 #include "environment.h"
 #include <unistd.h>
 #include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <tuple>
 #include <string>
 #include <sstream>
 #include <cmath>
+#include <array>
 
 PatrolThread* PatrolThread::s_instance = nullptr;
 
+// The patrol thread waits at least this many times as long as its last check of the allocation table took.
+static const double ScanCostRatio = 20;
+// Seconds between two writes of the statistics to the progress report.
+static const double ProgressReportInterval = 5;
+
 static string humanSize(double size) {
     static const array<const char*, 4> units {{"bytes", "kiB", "MiB", "GiB"}};
     const char* unit;
@@ -31,6 +42,64 @@ static string humanSize(double size) {
 
 void PatrolThread::spawn() {
     s_instance = new PatrolThread;
+    s_instance->m_clockThread = thread(CoarseClock::tickerMain);
+    if (environment.deferredLightAllocations) {
+        s_instance->m_drainThread = thread([]() {
+            s_instance->drainMain();
+        });
+    }
+    // Registered after the allocation table and the other globals are constructed, so it runs before they are
+    // destroyed.
+    atexit([]() {
+        s_instance->tearDown();
+    });
+}
+
+void PatrolThread::tearDown() {
+    if (getpid() != m_pid)
+        return;
+    {
+        lock_guard<mutex> lock(m_mutex);
+        if (m_should_tear_down)
+            return;
+        m_should_tear_down = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+    if (m_drainThread.joinable())
+        m_drainThread.join();
+    // The clock keeps ticking: the threads still running may allocate until the process is gone.
+}
+
+bool PatrolThread::sleepFor(chrono::duration<double> duration) {
+    unique_lock<mutex> lock(m_mutex);
+    return !m_cv.wait_for(lock, duration, [this]() {
+        return m_should_tear_down;
+    });
+}
+
+double PatrolThread::nextPeriod(double scanCost, double timeToLeakReport) {
+    // Allocations expire on the first tick after their deadline, and new ones get deadlines ALLOC_TIME_SUSPICIOUS
+    // later at the earliest. One more tick is waited for, as CoarseClock lags behind by up to one.
+    uint32_t now = CoarseClock::now();
+    uint32_t due = AllocationTable::instance().patrolThreadNextDeadline() + 1;
+    uint32_t newAllocationsDue = now + CoarseClock::fromSeconds(environment.timeForAllocationToBecomeSuspicious) + 1;
+    if (CoarseClock::before(newAllocationsDue, due))
+        due = newAllocationsDue;
+    double period = CoarseClock::before(now, due) ? CoarseClock::toSeconds(due - now + 1) : 0;
+    period = min(period, timeToLeakReport);
+
+    double maxPeriod = environment.patrolMaxPeriod / 1000.0;
+    double minPeriod = min(max(environment.patrolMinPeriod / 1000.0, scanCost * ScanCostRatio), maxPeriod);
+    return max(minPeriod, min(period, maxPeriod));
+}
+
+void PatrolThread::drainMain() {
+    LibraryContext ctx;
+
+    // The event rings are small, so they need to be drained much more often than the patrol checks deadlines.
+    while (sleepFor(chrono::milliseconds(environment.eventBufferDrainInterval)))
+        AllocationTable::instance().patrolThreadDrainEventBuffers();
 }
 
 void PatrolThread::monitorMain() {
@@ -41,38 +110,69 @@ void PatrolThread::monitorMain() {
     progressStream << "Patrol Thread Hello\n";
 
     if (environment.autoStartTime != 0) {
-        sleep(environment.autoStartTime);
+        if (!sleepFor(chrono::seconds(environment.autoStartTime)))
+            return;
         *__commMemory = WatchState::Watching;
     }
 
-    unordered_map<StackTrace, unsigned int> stackTraceToOccurrences;
+    unordered_map<StackId, unsigned int> stackTraceToOccurrences;
     double timeNextLeakReport = 0;
+    double timeNextProgressReport = 0;
+    // Generation of the module map last written to the progress report. Modules are never removed from the map, so it
+    // covers the traces of older generations as well.
+    uint32_t moduleGenerationWritten = 0;
 
+    // Checks the allocation table as soon as the next deadline passes, so that leaks are found
+    // ALLOC_TIME_SUSPICIOUS + ALLOC_MAX_ACCESS_INTERVAL after they are made, within a clock tick or two.
     while (true) {
-        sleep(5);
+        // Here rather than when traces are captured, in the allocation hooks.
+        ModuleMap::instance().update();
+
         AllocationStats stats;
         std::vector<AllocationTable::FoundLeak> leaks;
+        auto scanStart = chrono::steady_clock::now();
         std::tie(stats, leaks) = AllocationTable::instance().patrolThreadUpdateAllocationStates();
+        double scanCost = chrono::duration<double>(chrono::steady_clock::now() - scanStart).count();
         double reportTime = AllocationStats::getTime();
 
         // At least 1 second should pass before statistics are given, to avoid disproportionate values
-        if (stats.enabled && reportTime - stats.timeWatchEnabled >= 1.0) {
+        if (stats.enabled && reportTime - stats.timeWatchEnabled >= 1.0 && reportTime >= timeNextProgressReport) {
+            timeNextProgressReport = reportTime + ProgressReportInterval;
             double t = reportTime - stats.timeWatchEnabled;
-            progressStream << "Allocs per second: " << stats.allocationCount / t << endl;
+            progressStream << "Allocs per second: " << (stats.allocationCount + stats.unsampledAllocationCount) / t << endl;
+            if (environment.sampleRate)
+                progressStream << "Sampled allocs per second: " << stats.allocationCount / t << endl;
             progressStream << "Frees per second: " << stats.freeCount / t << endl;
             progressStream << "Reallocs per second: " << stats.reallocCount / t << endl;
+            progressStream << "Allocation table memory: " << humanSize(stats.allocationTableMemory) << endl;
+            if (environment.deferredLightAllocations)
+                progressStream << "Event buffer overflows: " << stats.eventBufferOverflowCount << endl;
+            WatchedPageSlab::Stats slabStats = WatchedPageSlab::instance().stats();
+            progressStream << "Closely watched allocations: " << slabStats.liveSlabAllocations << " in "
+                           << slabStats.regionCount << " slab regions (" << slabStats.vmaCount << " VMAs), "
+                           << slabStats.liveFallbackAllocations << " in the heap" << endl;
+            progressStream << "Stack depot: " << StackDepot::instance().stackCount() << " stack traces in "
+                           << humanSize(StackDepot::instance().memoryFootprint()) << endl;
         }
 
         for (auto& leak : leaks) {
-            auto& occurrencePair = *stackTraceToOccurrences.insert(make_pair(*leak.stackTrace, 0)).first;
+            auto& occurrencePair = *stackTraceToOccurrences.insert(make_pair(leak.stackId, 0)).first;
             ++occurrencePair.second;
 
             if (occurrencePair.second == 1) {
-                progressStream << "[Callstack " << leak.stackTrace << "] Found new leak: lost "
+                progressStream << "[Callstack " << leak.stackId << "] Found new leak: lost "
                        << leak.memory << " (" << leak.size << " bytes)" << endl;
-                progressStream << *leak.stackTrace << endl;
+                ModuleMap::instance().writeStackTrace(progressStream, StackDepot::instance().get(leak.stackId),
+                                                      leak.moduleGeneration);
+                progressStream << endl;
+                if (leak.moduleGeneration > moduleGenerationWritten) {
+                    progressStream << "Modules:" << endl;
+                    ModuleMap::instance().write(progressStream);
+                    progressStream << endl;
+                    moduleGenerationWritten = leak.moduleGeneration;
+                }
             } else {
-                progressStream << "[Callstack " << leak.stackTrace << "] Lost "
+                progressStream << "[Callstack " << leak.stackId << "] Lost "
                        << leak.memory << " (" << leak.size << " bytes), "
                        << occurrencePair.second << " times again." << endl;
             }
@@ -94,6 +194,11 @@ void PatrolThread::monitorMain() {
             if (!isnan(leakReport.averageStackTracesPerFingerprint)) {
                 leakStream << "Average number of stack traces per suspicious fingerprint: " <<
                               leakReport.averageStackTracesPerFingerprint << endl;
+                const uint32_t* histogram = leakReport.fingerprintsByStackTraceCount;
+                leakStream << "Suspicious fingerprints by number of stack traces (1/2-3/4-7/8+): " << histogram[0]
+                           << " / " << histogram[1] << " / " << histogram[2] << " / " << histogram[3]
+                           << " (max " << leakReport.maxStackTracesPerFingerprint << ")" << endl;
+                leakStream << "Full stack unwinds: " << leakReport.unwindCount << endl;
             }
             if (!isnan(leakReport.ratioLeakyStacks)) {
                 leakStream << "Leaky stack traces ratio (non-leaky/maybe/leaky): " <<
@@ -101,11 +206,18 @@ void PatrolThread::monitorMain() {
                               " / " << leakReport.ratioLeakyStacks << endl << endl;
             }
 
+            // Stack traces are written as raw addresses, see alloc-counter-symbolize.
+            leakStream << "Modules:" << endl;
+            ModuleMap::instance().write(leakStream);
+            leakStream << endl;
+
             for (AllocationTable::LeakReport::Leak& leak : leakReport.leaks) {
-                leakStream << "[Callstack " << leak.stackTrace << "] lost ~" << humanSize(leak.lostBytesEstimated) <<
+                leakStream << "[Callstack " << leak.stackId << "] lost ~" << humanSize(leak.lostBytesEstimated) <<
                               " in ~" << leak.lostAllocationsEstimated << " allocations (leak ratio = " << leak.leakRatio <<
                               ")" << endl;
-                leakStream << *leak.stackTrace << endl;
+                ModuleMap::instance().writeStackTrace(leakStream, StackDepot::instance().get(leak.stackId),
+                                                      leak.moduleGeneration);
+                leakStream << endl;
             }
             leakStream << "End of leak report." << endl;
             leakStream.flush();
@@ -113,5 +225,8 @@ void PatrolThread::monitorMain() {
             // Schedule the next periodical leak report.
             timeNextLeakReport = reportTime + environment.leakReportInterval;
         }
+
+        if (!sleepFor(chrono::duration<double>(nextPeriod(scanCost, timeNextLeakReport - reportTime))))
+            break;
     }
 }
@@ -1,6 +1,8 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
+#include <unistd.h>
 using namespace std;
 
 class PatrolThread {
@@ -8,6 +10,7 @@ public:
     static void spawn();
     static PatrolThread* instance() { return s_instance; }
 
+    // Stops the patrol thread and its drain helper, letting them close their reports. Called at exit.
     void tearDown();
 
 private:
@@ -19,11 +22,25 @@ private:
     ~PatrolThread();
     static PatrolThread* s_instance;
 
-    thread m_thread;
+    // Declared before the threads, which use them as soon as they start.
     mutex m_mutex;
     condition_variable m_cv;
     bool m_should_tear_down = false;
+    // Forked children get a copy of the instance, but not its threads.
+    pid_t m_pid = getpid();
+
+    thread m_thread;
+    // Only spawned when environment.deferredLightAllocations is set.
+    thread m_drainThread;
+    // Advances CoarseClock.
+    thread m_clockThread;
+
+    // Returns false if the thread is being torn down.
+    bool sleepFor(chrono::duration<double> duration);
+    // Time until the next check of the allocation table, in seconds.
+    double nextPeriod(double scanCost, double timeToLeakReport);
 
     void monitorMain();
+    void drainMain();
     void migrateAllocationsToOldSuspicious();
 };
@@ -0,0 +1,205 @@
+#include "soft-dirty-watcher.h"
+#include "environment.h"
+#include "coarse-clock.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+SoftDirtyWatcher* SoftDirtyWatcher::create() {
+    int pagemapFd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    int clearRefsFd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    int pageIdleFd = open("/sys/kernel/mm/page_idle/bitmap", O_RDWR | O_CLOEXEC);
+    SoftDirtyWatcher* watcher = nullptr;
+    if (pagemapFd >= 0) {
+        // Must be called in library context, as any allocation made here.
+        watcher = new SoftDirtyWatcher(pagemapFd, clearRefsFd, pageIdleFd);
+
+        void* probe = mmap(nullptr, environment.pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        uint64_t entry = 0;
+        bool supported = false;
+        if (probe != MAP_FAILED) {
+            uintptr_t page = reinterpret_cast<uintptr_t>(probe) / environment.pageSize;
+            *static_cast<volatile char*>(probe) = 1;
+            // Without CAP_SYS_ADMIN, the frame numbers read from the pagemap are 0.
+            uint64_t idleBits;
+            if (pageIdleFd >= 0 && watcher->readPagemap(page, 1, &entry) && (entry & PagemapFrameMask)
+                && pread(pageIdleFd, &idleBits, sizeof(idleBits), (entry & PagemapFrameMask) / 64 * sizeof(uint64_t))
+                    == sizeof(idleBits)) {
+                supported = true;
+            } else if (pageIdleFd >= 0) {
+                close(pageIdleFd);
+                watcher->m_pageIdleFd = pageIdleFd = -1;
+            }
+            // Kernels without CONFIG_MEM_SOFT_DIRTY accept the writes to clear_refs, but never set the bit.
+            if (!supported && clearRefsFd >= 0 && watcher->clearSoftDirty()) {
+                *static_cast<volatile char*>(probe) = 1;
+                supported = watcher->readPagemap(page, 1, &entry) && (entry & PagemapSoftDirty);
+            }
+            munmap(probe, environment.pageSize);
+        }
+        if (supported)
+            return watcher;
+        delete watcher;
+    }
+    for (int fd : { pagemapFd, clearRefsFd, pageIdleFd }) {
+        if (fd >= 0)
+            close(fd);
+    }
+    return nullptr;
+}
+
+bool SoftDirtyWatcher::readPagemap(uintptr_t firstPage, uint32_t pages, uint64_t* entries) {
+    size_t size = pages * sizeof(uint64_t);
+    return pread(m_pagemapFd, entries, size, firstPage * sizeof(uint64_t)) == static_cast<ssize_t>(size);
+}
+
+bool SoftDirtyWatcher::accessedSince(Range& range, const uint64_t* entries) {
+    if (!usesIdlePages()) {
+        // New pages are soft-dirty too, so the first touch of a page never populated counts.
+        return anySoftDirty(entries, range.pages);
+    }
+    uint32_t presentPages = countPresent(entries, range.pages);
+    bool populated = presentPages > range.presentPages;
+    range.presentPages = presentPages;
+    if (populated)
+        return true;
+    for (uint32_t i = 0; i < range.pages; i++) {
+        uint64_t frame = entries[i] & PagemapFrameMask;
+        if ((entries[i] & PagemapPresent) && frame) {
+            uint64_t idleBits;
+            if (pread(m_pageIdleFd, &idleBits, sizeof(idleBits), frame / 64 * sizeof(uint64_t)) == sizeof(idleBits)
+                && !(idleBits & (1ull << (frame % 64))))
+                return true;
+        }
+    }
+    return false;
+}
+
+void SoftDirtyWatcher::arm(Range& range, uint32_t now) {
+    range.armed = true;
+    range.armedLate = CoarseClock::before(range.watchTime
+        + CoarseClock::fromSeconds(environment.closelyWatchedAllocationsAccessMaxInterval) / 2, now);
+}
+
+bool SoftDirtyWatcher::anySoftDirty(const uint64_t* entries, uint32_t pages) {
+    for (uint32_t i = 0; i < pages; i++) {
+        if (entries[i] & PagemapSoftDirty)
+            return true;
+    }
+    return false;
+}
+
+uint32_t SoftDirtyWatcher::countPresent(const uint64_t* entries, uint32_t pages) {
+    uint32_t present = 0;
+    for (uint32_t i = 0; i < pages; i++) {
+        if (entries[i] & PagemapPresent)
+            present++;
+    }
+    return present;
+}
+
+void SoftDirtyWatcher::markIdle(const uint64_t* entries, uint32_t pages) {
+    for (uint32_t i = 0; i < pages; i++) {
+        uint64_t frame = entries[i] & PagemapFrameMask;
+        if ((entries[i] & PagemapPresent) && frame) {
+            // Only the bits set are written, the rest of the word is left alone.
+            uint64_t idleBits = 1ull << (frame % 64);
+            pwrite(m_pageIdleFd, &idleBits, sizeof(idleBits), frame / 64 * sizeof(uint64_t));
+        }
+    }
+}
+
+bool SoftDirtyWatcher::clearSoftDirty() {
+    // "4" clears the soft-dirty bits of every page of the process.
+    return pwrite(m_clearRefsFd, "4", 1, 0) == 1;
+}
+
+bool SoftDirtyWatcher::watch(void* memory, size_t size) {
+    uint32_t pages = (watchedSize(memory, size) + environment.pageSize - 1) / environment.pageSize;
+    lock_guard<mutex> lock(m_mutex);
+    return m_ranges.emplace(reinterpret_cast<uintptr_t>(memory) / environment.pageSize, Range { pages, 0, CoarseClock::now(), false, false, false })
+        .second;
+}
+
+bool SoftDirtyWatcher::unwatch(void* memory) {
+    lock_guard<mutex> lock(m_mutex);
+    auto iter = m_ranges.find(reinterpret_cast<uintptr_t>(memory) / environment.pageSize);
+    if (iter == m_ranges.end())
+        return false;
+    Range& range = iter->second;
+    // Catch the accesses made since the last update().
+    if (range.armed && !range.accessed) {
+        m_entries.resize(range.pages);
+        range.accessed = readPagemap(iter->first, range.pages, m_entries.data())
+            && accessedSince(range, m_entries.data());
+    }
+    // Never checked long enough: the allocation may well be in use, it should not be reported as leaked.
+    bool accessed = range.accessed || !range.armed || range.armedLate;
+    m_ranges.erase(iter);
+    return accessed;
+}
+
+bool SoftDirtyWatcher::isWatched(void* memory) const {
+    uintptr_t page = reinterpret_cast<uintptr_t>(memory) / environment.pageSize;
+    lock_guard<mutex> lock(m_mutex);
+    auto iter = m_ranges.upper_bound(page);
+    if (iter == m_ranges.begin())
+        return false;
+    --iter;
+    return page < iter->first + iter->second.pages;
+}
+
+void SoftDirtyWatcher::update() {
+    lock_guard<mutex> lock(m_mutex);
+    if (m_ranges.empty())
+        return;
+    uint32_t now = CoarseClock::now();
+    bool waitingForClear = false;
+    // Watched ranges are mostly slab slots next to each other, so the pagemap is read for runs of neighbouring ranges.
+    for (auto runStart = m_ranges.begin(); runStart != m_ranges.end(); ) {
+        auto runEnd = runStart;
+        uint32_t runPages = 0;
+        do {
+            runPages += runEnd->second.pages;
+            ++runEnd;
+        } while (runEnd != m_ranges.end() && runEnd->first == runStart->first + runPages);
+
+        m_entries.resize(runPages);
+        if (readPagemap(runStart->first, runPages, m_entries.data())) {
+            const uint64_t* entries = m_entries.data();
+            for (auto iter = runStart; iter != runEnd; ++iter) {
+                Range& range = iter->second;
+                if (range.armed) {
+                    if (!range.accessed)
+                        range.accessed = accessedSince(range, entries);
+                } else if (usesIdlePages()) {
+                    range.presentPages = countPresent(entries, range.pages);
+                    arm(range, now);
+                } else if (!anySoftDirty(entries, range.pages)) {
+                    arm(range, now);
+                } else {
+                    waitingForClear = true;
+                }
+                entries += range.pages;
+            }
+            if (usesIdlePages())
+                markIdle(m_entries.data(), runPages);
+        }
+        runStart = runEnd;
+    }
+
+    // Clearing the soft-dirty bits costs every thread of the process a fault, so it's only done when a range needs it,
+    // and no more than once per watch period. Ranges watched since the last clear will have waited for one period at
+    // most.
+    if (waitingForClear && (!m_softDirtyClearedOnce || !CoarseClock::before(now, m_softDirtyClearTime
+            + CoarseClock::fromSeconds(environment.closelyWatchedAllocationsAccessMaxInterval)))) {
+        if (clearSoftDirty()) {
+            m_softDirtyClearTime = now;
+            m_softDirtyClearedOnce = true;
+            for (auto& iter : m_ranges) {
+                if (!iter.second.armed)
+                    arm(iter.second, now);
+            }
+        }
+    }
+}
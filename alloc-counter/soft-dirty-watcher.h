@@ -0,0 +1,89 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+#include "access-watcher.h"
+using namespace std;
+
+/** Detects accesses to suspicious closely watched allocations without faults, by sampling page table bits.
+ *
+ * Every update() (once per patrol tick) reads the /proc/self/pagemap entries of all the watched pages in bulk, one
+ * pread() per run of neighbouring ranges. A range is checked once it is armed, using one of two signals:
+ *
+ * - Idle page tracking, if available (/sys/kernel/mm/page_idle/bitmap, needs CAP_SYS_ADMIN to get the page frame
+ *   numbers). Arming a range marks its pages idle, and any read or write clears the idle bit. Pages populated since
+ *   then count as accessed too. Only the watched pages are touched, so this is done on every tick.
+ * - Otherwise, soft-dirty bits, which the kernel sets on every write. They can only be cleared for the whole process
+ *   (/proc/self/clear_refs), which makes the next write to every page of the process take a minor fault in the kernel.
+ *   So a range is armed as soon as none of its pages is soft-dirty, and the bits are cleared at most once per
+ *   ALLOC_MAX_ACCESS_INTERVAL, only if some range is still waiting for it.
+ *
+ * Accesses made before a range is armed are not seen, nor are those made while update() runs. A range still not armed
+ * when it is unwatched, or armed more than half a watch period late, is reported as accessed, so that the allocation
+ * is watched again later rather than reported as leaked after being checked for too short a time.
+ *
+ * Both signals have false negatives, i.e. unused allocations that look accessed:
+ * - The kernel marks a whole VMA soft-dirty (VM_SOFTDIRTY) when it is created, expanded, merged with a neighbour or
+ *   moved by mremap(), e.g. when the slab adds a region. All the pages of that VMA then look written until the next
+ *   clear, and ranges watched in it wait for that clear to be armed.
+ * - A page whose frame changes (reclaim, migration, KSM, transparent huge pages) is not idle on its new frame.
+ * No application thread is ever stopped by alloc-counter.
+ *
+ * Requires a kernel built with CONFIG_MEM_SOFT_DIRTY or CONFIG_IDLE_PAGE_TRACKING. */
+class SoftDirtyWatcher : public AccessWatcher {
+public:
+    // Returns nullptr if soft-dirty bits are not available.
+    static SoftDirtyWatcher* create();
+
+    bool watch(void* memory, size_t size) override;
+    bool unwatch(void* memory) override;
+    bool isWatched(void* memory) const override;
+    void update() override;
+    const char* name() const override { return "softdirty"; }
+
+    // For tests: lets the next update() clear the soft-dirty bits whatever the time of the last clear.
+    void allowClearingSoftDirty() { m_softDirtyClearedOnce = false; }
+
+private:
+    SoftDirtyWatcher(int pagemapFd, int clearRefsFd, int pageIdleFd)
+        : m_pagemapFd(pagemapFd), m_clearRefsFd(clearRefsFd), m_pageIdleFd(pageIdleFd) {}
+
+    struct Range {
+        uint32_t pages;
+        // Pages present when the range was last checked, to see those populated since then with idle page tracking.
+        uint32_t presentPages;
+        uint32_t watchTime;
+        // Whether the range can be checked: its pages were marked idle, or had no soft-dirty bit, since watch().
+        bool armed;
+        // Armed more than half a watch period after watch(), too late for the range to be checked long enough.
+        bool armedLate;
+        bool accessed;
+    };
+
+    static const uint64_t PagemapPresent = 1ull << 63;
+    static const uint64_t PagemapSoftDirty = 1ull << 55;
+    static const uint64_t PagemapFrameMask = (1ull << 55) - 1;
+
+    // Reads the pagemap entries of `pages` pages from `firstPage`. Returns false on error.
+    bool readPagemap(uintptr_t firstPage, uint32_t pages, uint64_t* entries);
+    void arm(Range& range, uint32_t now);
+    // Whether an armed range was accessed since it was last checked. Updates range.presentPages.
+    bool accessedSince(Range& range, const uint64_t* entries);
+    static bool anySoftDirty(const uint64_t* entries, uint32_t pages);
+    static uint32_t countPresent(const uint64_t* entries, uint32_t pages);
+    void markIdle(const uint64_t* entries, uint32_t pages);
+    bool clearSoftDirty();
+    bool usesIdlePages() const { return m_pageIdleFd >= 0; }
+
+    mutable mutex m_mutex;
+    // Indexed by the first page of the range.
+    map<uintptr_t, Range> m_ranges;
+    vector<uint64_t> m_entries;
+    int m_pagemapFd;
+    int m_clearRefsFd;
+    int m_pageIdleFd; // -1 if idle page tracking is not available
+    // CoarseClock tick of the last clear of the soft-dirty bits.
+    uint32_t m_softDirtyClearTime = 0;
+    bool m_softDirtyClearedOnce = false;
+};
@@ -0,0 +1,128 @@
+#include "stack-depot.h"
+#include "stack-trace.h"
+#include <sys/mman.h>
+#include <sched.h>
+#include <cstring>
+
+StackDepot StackDepot::s_instance;
+const StackId StackDepot::NoStack;
+
+StackDepot::StackDepot() {
+    for (size_t i = 0; i < BucketCount; i++)
+        m_buckets[i].store(0, memory_order_relaxed);
+    for (auto& idPage : m_idPages)
+        idPage.store(nullptr, memory_order_relaxed);
+}
+
+uint64_t StackDepot::hashFrames(void* const* frames, uint32_t size) {
+    // Frames are mixed one by one so that traces differing in a single frame differ in every bit.
+    uint64_t hash = size * 0x9e3779b97f4a7c15ull;
+    for (uint32_t i = 0; i < size; i++) {
+        uint64_t frame = reinterpret_cast<uintptr_t>(frames[i]);
+        frame *= 0x87c37b91114253d5ull;
+        frame ^= frame >> 31;
+        hash = (hash ^ frame) * 0x4cf5ad432745937full;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+StackDepot::Record* StackDepot::find(Record* record, uint64_t hash, void* const* frames, uint32_t size) {
+    for (; record; record = record->next) {
+        if (record->hash == hash && record->size == size && !memcmp(record->frames, frames, size * sizeof(void*)))
+            return record;
+    }
+    return nullptr;
+}
+
+StackDepot::Record* StackDepot::allocateRecord(uint32_t size) {
+    size_t recordSize = sizeof(Record) + size * sizeof(void*);
+    lock_guard<mutex> lock(m_allocationMutex);
+    uint32_t id = m_nextId.load(memory_order_relaxed);
+    // id is 0 once all the IDs are taken.
+    if (id == 0 || recordSize > ChunkSize)
+        return nullptr;
+
+    atomic<atomic<Record*>*>& idPageSlot = m_idPages[id >> IdPageBits];
+    atomic<Record*>* idPage = idPageSlot.load(memory_order_relaxed);
+    if (!idPage) {
+        void* memory = mmap(nullptr, IdPageSize * sizeof(atomic<Record*>), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return nullptr;
+        idPage = static_cast<atomic<Record*>*>(memory);
+        idPageSlot.store(idPage, memory_order_release);
+        m_memoryFootprint += IdPageSize * sizeof(atomic<Record*>);
+    }
+
+    if (static_cast<size_t>(m_chunkEnd - m_chunkPosition) < recordSize) {
+        // The end of the previous chunk is wasted, which is at most one record.
+        void* memory = mmap(nullptr, ChunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return nullptr;
+        m_chunkPosition = static_cast<char*>(memory);
+        m_chunkEnd = m_chunkPosition + ChunkSize;
+        m_memoryFootprint += ChunkSize;
+    }
+    Record* record = reinterpret_cast<Record*>(m_chunkPosition);
+    m_chunkPosition += (recordSize + alignof(Record) - 1) & ~(alignof(Record) - 1);
+
+    record->id = id;
+    record->size = size;
+    m_nextId.store(id + 1, memory_order_relaxed);
+    return record;
+}
+
+StackId StackDepot::put(void* const* frames, uint32_t size) {
+    uint64_t hash = hashFrames(frames, size);
+    atomic<uintptr_t>& bucket = m_buckets[hash & (BucketCount - 1)];
+
+    // Known traces are found without locking: records are fully written before they are published in their bucket,
+    // and never change after.
+    Record* head = reinterpret_cast<Record*>(bucket.load(memory_order_acquire) & ~BucketLocked);
+    if (Record* record = find(head, hash, frames, size))
+        return record->id;
+
+    uintptr_t headValue;
+    while (true) {
+        headValue = bucket.load(memory_order_relaxed);
+        if (!(headValue & BucketLocked)
+            && bucket.compare_exchange_weak(headValue, headValue | BucketLocked, memory_order_acquire))
+            break;
+        sched_yield();
+    }
+    // Another thread may have added it while we were not holding the lock.
+    head = reinterpret_cast<Record*>(headValue);
+    Record* record = find(head, hash, frames, size);
+    if (record) {
+        bucket.store(headValue, memory_order_release);
+        return record->id;
+    }
+
+    record = allocateRecord(size);
+    if (!record) {
+        bucket.store(headValue, memory_order_release);
+        return NoStack;
+    }
+    record->hash = hash;
+    record->next = head;
+    memcpy(record->frames, frames, size * sizeof(void*));
+    m_idPages[record->id >> IdPageBits].load(memory_order_relaxed)[record->id & (IdPageSize - 1)]
+        .store(record, memory_order_release);
+    // Publishes the record and unlocks the bucket.
+    bucket.store(reinterpret_cast<uintptr_t>(record), memory_order_release);
+    return record->id;
+}
+
+StackDepot::Frames StackDepot::get(StackId id) const {
+    const Record* record = m_idPages[id >> IdPageBits].load(memory_order_acquire)[id & (IdPageSize - 1)]
+        .load(memory_order_acquire);
+    return Frames(record->frames, record->size);
+}
+
+__attribute__((noinline)) StackId StackDepot::capture(int numSkipCalls) {
+    void* frames[StackTrace::MaxReturnAddresses];
+    // One more call to skip: the return address into this function.
+    size_t size = StackTrace::capture(frames, StackTrace::MaxReturnAddresses, numSkipCalls + 1);
+    return put(frames, size);
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+using namespace std;
+
+typedef uint32_t StackId;
+
+/** Append-only store of the stack traces captured by alloc-counter, deduplicated, that hands out a compact ID for
+ * each distinct trace.
+ *
+ * Tables key on StackId instead of holding copies of the traces: comparing two traces is comparing two integers, and
+ * each distinct trace is stored once, its frames contiguous in mmap'ed chunks instead of a vector on the heap. Traces
+ * are never removed, so the frames returned by get() stay valid for the lifetime of the process.
+ *
+ * Looking up a trace (in put() when it is already there, and in get()) takes no lock. Adding a new trace locks its hash
+ * bucket only, with a bit of the bucket head, so that two threads adding the same trace can't both add it. */
+class StackDepot {
+public:
+    StackDepot();
+    static StackDepot& instance() { return s_instance; }
+
+    static const StackId NoStack = 0;
+
+    // Frames of a trace in the depot, top (recent) calls first.
+    class Frames {
+    public:
+        Frames(void* const* frames, uint32_t size) : m_frames(frames), m_size(size) {}
+        void* const* begin() const { return m_frames; }
+        void* const* end() const { return m_frames + m_size; }
+        uint32_t size() const { return m_size; }
+
+    private:
+        void* const* m_frames;
+        uint32_t m_size;
+    };
+
+    /** Returns the ID of the trace made of `frames`, adding it if it's new. Returns NoStack if there is no memory left
+     * for it. */
+    StackId put(void* const* frames, uint32_t size);
+
+    // `id` must have been returned by put().
+    Frames get(StackId id) const;
+
+    // Captures the stack of the calling thread (see StackTrace::capture()) and puts it in the depot.
+    StackId capture(int numSkipCalls = 0);
+
+    size_t stackCount() const { return m_nextId.load(memory_order_relaxed) - 1; }
+    size_t memoryFootprint() const { return m_memoryFootprint.load(memory_order_relaxed); }
+
+private:
+    static StackDepot s_instance;
+
+    struct Record {
+        Record* next; // in the bucket
+        uint64_t hash;
+        StackId id;
+        uint32_t size;
+        void* frames[];
+    };
+
+    static uint64_t hashFrames(void* const* frames, uint32_t size);
+    static Record* find(Record* record, uint64_t hash, void* const* frames, uint32_t size);
+    // Returns a record for `size` frames with a new ID, registered in m_idPages, or nullptr if out of memory.
+    Record* allocateRecord(uint32_t size);
+
+    // The low bit of a bucket head is set while a thread is adding a record to the bucket.
+    static const uintptr_t BucketLocked = 1;
+    static const size_t BucketCount = size_t(1) << 16;
+    atomic<uintptr_t> m_buckets[BucketCount];
+
+    // ID -> record, in pages mmap'ed on demand.
+    static const unsigned IdPageBits = 16;
+    static const size_t IdPageSize = size_t(1) << IdPageBits;
+    atomic<atomic<Record*>*> m_idPages[size_t(1) << (32 - IdPageBits)];
+    atomic<uint32_t> m_nextId { 1 };
+
+    // Records are bump allocated from chunks of ChunkSize bytes.
+    static const size_t ChunkSize = 64 << 10;
+    mutex m_allocationMutex;
+    char* m_chunkPosition = nullptr;
+    char* m_chunkEnd = nullptr;
+    atomic<size_t> m_memoryFootprint { 0 };
+};
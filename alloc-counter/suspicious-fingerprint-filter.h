@@ -0,0 +1,113 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "callstack-fingerprint.h"
+using namespace std;
+
+/** Bloom filter of the suspicious fingerprints of the allocation table, readable without locking.
+ *
+ * Most allocations only need to learn that their fingerprint is not suspicious. They test this filter first and only
+ * take the lock of the fingerprint shard if it may contain the fingerprint.
+ *
+ * Only the patrol thread writes it, right after adding fingerprints to the table, so that a hit always finds the
+ * fingerprint in the table (false positives are possible, false negatives are not). Fingerprints never stop being
+ * suspicious, so bits are only ever set. When a filter gets too full for a low false positive rate, a new one twice as
+ * big is built and published RCU-style: readers keep using whichever filter they loaded. Old filters are never freed,
+ * since readers are not tracked; being half the size each, they add up to less than the current one. */
+class SuspiciousFingerprintFilter {
+public:
+    SuspiciousFingerprintFilter() {}
+    SuspiciousFingerprintFilter(const SuspiciousFingerprintFilter&) = delete;
+
+    bool mayContain(CallstackFingerprint fingerprint) const {
+        const Filter* filter = m_current.load(memory_order_acquire);
+        return filter && filter->test(fingerprint);
+    }
+
+    /** To be called from the patrol thread only, after `addedFingerprints` have been added to the table.
+     * `forEachSuspiciousFingerprint(function)` must call `function(CallstackFingerprint)` for all the suspicious
+     * fingerprints in the table, and is only used when a bigger filter has to be built. */
+    template <typename ForEachSuspiciousFingerprint>
+    void publish(const vector<CallstackFingerprint>& addedFingerprints, ForEachSuspiciousFingerprint forEachSuspiciousFingerprint) {
+        if (addedFingerprints.empty())
+            return;
+        Filter* current = m_current.load(memory_order_relaxed);
+        size_t count = (current ? current->count : 0) + addedFingerprints.size();
+        if (current && count * BitsPerFingerprint <= current->bitCount()) {
+            for (CallstackFingerprint fingerprint : addedFingerprints)
+                current->set(fingerprint);
+            current->count = count;
+            return;
+        }
+
+        unsigned bitsLog2 = current ? current->bitsLog2 : InitialBitsLog2 - 1;
+        do {
+            bitsLog2++;
+        } while (count * BitsPerFingerprint > (size_t(1) << bitsLog2));
+        Filter* filter = new Filter(bitsLog2);
+        forEachSuspiciousFingerprint([filter](CallstackFingerprint fingerprint) {
+            filter->set(fingerprint);
+        });
+        filter->count = count;
+        m_current.store(filter, memory_order_release);
+        if (current)
+            m_retired.push_back(current);
+    }
+
+    size_t memoryFootprint() const {
+        size_t size = 0;
+        if (const Filter* filter = m_current.load(memory_order_relaxed))
+            size += filter->bitCount() / 8;
+        for (const Filter* filter : m_retired)
+            size += filter->bitCount() / 8;
+        return size;
+    }
+
+private:
+    // With 3 hash functions this gives a false positive rate of 0.5% at worst.
+    static const unsigned BitsPerFingerprint = 16;
+    static const unsigned HashCount = 3;
+    static const unsigned InitialBitsLog2 = 16; // 8 kiB
+
+    struct Filter {
+        explicit Filter(unsigned bitsLog2)
+            : bitsLog2(bitsLog2), words(new atomic<uint64_t>[(size_t(1) << bitsLog2) / 64])
+        {
+            for (size_t i = 0; i < bitCount() / 64; i++)
+                words[i].store(0, memory_order_relaxed);
+        }
+
+        size_t bitCount() const { return size_t(1) << bitsLog2; }
+
+        static uint64_t hash(CallstackFingerprint fingerprint, unsigned i) {
+            static const uint64_t multipliers[HashCount] = {
+                0x9E3779B97F4A7C15ull, 0xBF58476D1CE4E5B9ull, 0x94D049BB133111EBull
+            };
+            return (fingerprint + 1ull) * multipliers[i];
+        }
+
+        bool test(CallstackFingerprint fingerprint) const {
+            for (unsigned i = 0; i < HashCount; i++) {
+                uint64_t bit = hash(fingerprint, i) >> (64 - bitsLog2);
+                if (!(words[bit / 64].load(memory_order_relaxed) & (1ull << (bit % 64))))
+                    return false;
+            }
+            return true;
+        }
+
+        void set(CallstackFingerprint fingerprint) {
+            for (unsigned i = 0; i < HashCount; i++) {
+                uint64_t bit = hash(fingerprint, i) >> (64 - bitsLog2);
+                words[bit / 64].fetch_or(1ull << (bit % 64), memory_order_relaxed);
+            }
+        }
+
+        const unsigned bitsLog2;
+        size_t count = 0;
+        atomic<uint64_t>* const words;
+    };
+
+    atomic<Filter*> m_current { nullptr };
+    vector<Filter*> m_retired;
+};
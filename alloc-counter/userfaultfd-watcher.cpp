@@ -0,0 +1,143 @@
+#include "userfaultfd-watcher.h"
+#include "library-context.h"
+#include <linux/userfaultfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+
+static int openUserfaultfd() {
+    // Unprivileged processes could still get a UFFD_USER_MODE_ONLY one, but the accesses made by the kernel to watched
+    // pages would then fail with EFAULT (e.g. read() into a watched buffer), so mprotect() is used instead.
+    return syscall(SYS_userfaultfd, O_CLOEXEC);
+}
+
+UserfaultfdWatcher* UserfaultfdWatcher::create() {
+    // The features must be requested in the only UFFDIO_API call allowed per file descriptor, so query the supported
+    // ones in a throwaway one first.
+    int probeFd = openUserfaultfd();
+    if (probeFd < 0)
+        return nullptr;
+    struct uffdio_api api = { UFFD_API, 0, 0 };
+    bool supported = ioctl(probeFd, UFFDIO_API, &api) == 0 && (api.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP);
+    close(probeFd);
+    if (!supported)
+        return nullptr;
+
+    uint64_t features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+#ifdef UFFD_FEATURE_WP_UNPOPULATED
+    // Lets pages never touched be write protected too, so that reading them doesn't count as an access.
+    features |= api.features & UFFD_FEATURE_WP_UNPOPULATED;
+#endif
+    int fd = openUserfaultfd();
+    if (fd < 0)
+        return nullptr;
+    api = { UFFD_API, features, 0 };
+    if (ioctl(fd, UFFDIO_API, &api) != 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    // Must be called in library context, as any allocation made here.
+    UserfaultfdWatcher* watcher = new UserfaultfdWatcher(fd);
+    watcher->m_faultThread = thread([watcher]() {
+        watcher->faultThreadMain();
+    });
+    return watcher;
+}
+
+bool UserfaultfdWatcher::writeProtect(void* memory, size_t size, bool protect) {
+    // Lifting the protection also wakes the threads blocked on it.
+    struct uffdio_writeprotect writeProtect;
+    writeProtect.range = { reinterpret_cast<uintptr_t>(memory), size };
+    writeProtect.mode = protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+    return ioctl(m_fd, UFFDIO_WRITEPROTECT, &writeProtect) == 0;
+}
+
+void UserfaultfdWatcher::wake(void* memory, size_t size) {
+    struct uffdio_range range = { reinterpret_cast<uintptr_t>(memory), size };
+    ioctl(m_fd, UFFDIO_WAKE, &range);
+}
+
+bool UserfaultfdWatcher::watch(void* memory, size_t size) {
+    uint32_t rangePages = (watchedSize(memory, size) + environment.pageSize - 1) / environment.pageSize;
+    size = rangePages * environment.pageSize;
+    // The entries must be in place before the protection, so that any fault on the range finds them.
+    if (!m_index.add(memory, rangePages))
+        return false;
+
+    struct uffdio_register registration;
+    registration.range = { reinterpret_cast<uintptr_t>(memory), size };
+    registration.mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP;
+    if (ioctl(m_fd, UFFDIO_REGISTER, &registration) != 0) {
+        m_index.remove(memory);
+        return false;
+    }
+    if (!writeProtect(memory, size, true)) {
+        ioctl(m_fd, UFFDIO_UNREGISTER, &registration.range);
+        m_index.remove(memory);
+        return false;
+    }
+    return true;
+}
+
+bool UserfaultfdWatcher::unwatch(void* memory) {
+    uint32_t rangePages = m_index.rangePagesAt(memory);
+    if (!rangePages)
+        return false;
+    size_t size = rangePages * environment.pageSize;
+    // Any thread blocked on the range is woken by both, the fault thread will find nothing to do for it.
+    writeProtect(memory, size, false);
+    struct uffdio_range range = { reinterpret_cast<uintptr_t>(memory), size };
+    ioctl(m_fd, UFFDIO_UNREGISTER, &range);
+    // Faults of the range queued before are handled as those of an unwatched range, so no tombstone is needed.
+    bool accessed = m_index.remove(memory);
+    m_index.forget(memory, rangePages);
+    return accessed;
+}
+
+void UserfaultfdWatcher::handleFault(void* address, bool writeProtectFault) {
+    void* page = reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(address) & ~(uintptr_t) (environment.pageSize - 1));
+    void* rangeStart;
+    uint32_t rangePages;
+    WatchedPageIndex::AccessResult result = m_index.markAccessed(address, &rangeStart, &rangePages);
+    if (result == WatchedPageIndex::AccessResult::FirstAccess)
+        writeProtect(rangeStart, rangePages * environment.pageSize, false);
+
+    if (!writeProtectFault && result != WatchedPageIndex::AccessResult::NotWatched) {
+        // A page never touched: it has to be populated for the access to succeed. Zero filled, like the kernel would.
+        struct uffdio_zeropage zeroPage;
+        zeroPage.range = { reinterpret_cast<uintptr_t>(page), environment.pageSize };
+        zeroPage.mode = 0;
+        if (ioctl(m_fd, UFFDIO_ZEROPAGE, &zeroPage) == 0)
+            return;
+        // EEXIST: another thread faulted on the same page and got it populated first.
+    }
+    // Lifting the protection already woke the faulting thread, but a fault on a range that was being unwatched (or
+    // that another fault just unprotected) needs an explicit wake up. Waking twice is harmless.
+    wake(page, environment.pageSize);
+}
+
+void UserfaultfdWatcher::faultThreadMain() {
+    LibraryContext ctx;
+
+    struct uffd_msg messages[MaxBatchSize];
+    while (true) {
+        // Faults from all the application threads queue up while the previous batch is handled.
+        ssize_t bytesRead = read(m_fd, messages, sizeof(messages));
+        if (bytesRead < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            perror("UserfaultfdWatcher: read");
+            return;
+        }
+        for (size_t i = 0; i < bytesRead / sizeof(struct uffd_msg); i++) {
+            if (messages[i].event != UFFD_EVENT_PAGEFAULT)
+                continue;
+            handleFault(reinterpret_cast<void*>(messages[i].arg.pagefault.address),
+                        messages[i].arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP);
+        }
+    }
+}
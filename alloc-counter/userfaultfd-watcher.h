@@ -0,0 +1,45 @@
+#pragma once
+#include <thread>
+#include "access-watcher.h"
+#include "watched-page-index.h"
+using namespace std;
+
+/** Detects writes to suspicious closely watched allocations with userfaultfd write protection.
+ *
+ * Watched ranges are registered with a userfaultfd in write-protect and missing modes and write protected. A write to
+ * a watched page (or any access to a page that was never populated) blocks the faulting thread and queues a message,
+ * which a dedicated fault thread reads in batches: it marks the range as accessed in a WatchedPageIndex, lifts the
+ * write protection of the whole range and wakes the faulting threads.
+ *
+ * Unlike MemoryProtector, the application's SIGSEGV handler is left alone, and accesses made by the kernel on behalf
+ * of the application (e.g. read() into a watched buffer) are seen instead of failing with EFAULT. On the other hand,
+ * reads of populated pages are not seen, so allocations that are only ever read will be reported as leaks.
+ *
+ * Requires write protection of anonymous memory (Linux 5.7) and permission to use userfaultfd, which unprivileged
+ * processes only have if the vm.unprivileged_userfaultfd sysctl is set. Userfaultfds limited to user mode faults are
+ * not used, since they would make the kernel accesses fail with EFAULT. */
+class UserfaultfdWatcher : public AccessWatcher {
+public:
+    // Returns nullptr if userfaultfd write protection is not available.
+    static UserfaultfdWatcher* create();
+
+    bool watch(void* memory, size_t size) override;
+    bool unwatch(void* memory) override;
+    bool isWatched(void* memory) const override { return m_index.contains(memory); }
+    const char* name() const override { return "userfaultfd"; }
+
+private:
+    UserfaultfdWatcher(int fd) : m_fd(fd) {}
+
+    void faultThreadMain();
+    void handleFault(void* address, bool writeProtectFault);
+    bool writeProtect(void* memory, size_t size, bool protect);
+    void wake(void* memory, size_t size);
+
+    // Faults are read from the userfaultfd this many at a time.
+    static const int MaxBatchSize = 64;
+
+    WatchedPageIndex m_index;
+    int m_fd;
+    thread m_faultThread;
+};
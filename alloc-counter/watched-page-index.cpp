@@ -0,0 +1,108 @@
+#include "watched-page-index.h"
+#include <sys/mman.h>
+
+WatchedPageIndex::WatchedPageIndex() {
+    for (size_t i = 0; i < NodeSize; i++)
+        m_root[i].store(nullptr, memory_order_relaxed);
+}
+
+template <typename Node>
+static Node* getOrCreateNode(atomic<Node*>& slot, bool create) {
+    Node* node = slot.load(memory_order_acquire);
+    if (node || !create)
+        return node;
+    // Anonymous memory is zero filled: every pointer is null and every entry is State::NotWatched.
+    void* memory = mmap(nullptr, sizeof(Node), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return nullptr;
+    Node* newNode = static_cast<Node*>(memory);
+    if (slot.compare_exchange_strong(node, newNode, memory_order_acq_rel, memory_order_acquire))
+        return newNode;
+    // Another thread created it first.
+    munmap(memory, sizeof(Node));
+    return node;
+}
+
+atomic<uint64_t>* WatchedPageIndex::entryFor(uintptr_t page, bool create) const {
+    if (page >> (3 * LevelBits))
+        return nullptr; // Beyond the address space we index.
+    Middle* middle = getOrCreateNode(m_root[page >> (2 * LevelBits)], create);
+    if (!middle)
+        return nullptr;
+    Leaf* leaf = getOrCreateNode(middle->leaves[(page >> LevelBits) & (NodeSize - 1)], create);
+    if (!leaf)
+        return nullptr;
+    return &leaf->entries[page & (NodeSize - 1)];
+}
+
+bool WatchedPageIndex::add(void* memory, uint32_t rangePages) {
+    uintptr_t firstPage = pageOf(memory);
+    for (uint32_t i = 0; i < rangePages; i++) {
+        atomic<uint64_t>* entry = entryFor(firstPage + i, true);
+        if (!entry) {
+            for (uint32_t j = 0; j < i; j++)
+                entryFor(firstPage + j, false)->store(0, memory_order_release);
+            return false;
+        }
+        entry->store(makeEntry(State::Protected, i, rangePages), memory_order_release);
+    }
+    return true;
+}
+
+uint32_t WatchedPageIndex::rangePagesAt(void* memory) const {
+    atomic<uint64_t>* firstEntry = entryFor(pageOf(memory), false);
+    uint64_t entry = firstEntry ? firstEntry->load(memory_order_acquire) : 0;
+    if (!isWatched(entry) || pagesFromStartOf(entry) != 0)
+        return 0;
+    return rangePagesOf(entry);
+}
+
+bool WatchedPageIndex::remove(void* memory) {
+    uintptr_t firstPage = pageOf(memory);
+    atomic<uint64_t>* firstEntry = entryFor(firstPage, false);
+    if (!firstEntry)
+        return false;
+    // A fault handler may be marking the range as accessed right now, hence the compare-and-swap.
+    uint64_t entry = firstEntry->load(memory_order_acquire);
+    do {
+        if (!isWatched(entry))
+            return false;
+    } while (!firstEntry->compare_exchange_weak(entry, makeEntry(State::Removed, 0, rangePagesOf(entry)),
+                                                memory_order_acq_rel, memory_order_acquire));
+    for (uint32_t i = 1; i < rangePagesOf(entry); i++)
+        entryFor(firstPage + i, false)->store(makeEntry(State::Removed, i, rangePagesOf(entry)), memory_order_release);
+    return stateOf(entry) == State::Accessed;
+}
+
+void WatchedPageIndex::forget(void* memory, uint32_t rangePages) {
+    uintptr_t firstPage = pageOf(memory);
+    for (uint32_t i = 0; i < rangePages; i++) {
+        uint64_t tombstone = makeEntry(State::Removed, i, rangePages);
+        entryFor(firstPage + i, false)->compare_exchange_strong(tombstone, 0, memory_order_acq_rel);
+    }
+}
+
+WatchedPageIndex::AccessResult WatchedPageIndex::markAccessed(void* address, void** rangeStart, uint32_t* rangePages) {
+    uintptr_t page = pageOf(address);
+    atomic<uint64_t>* pageEntry = entryFor(page, false);
+    uint64_t entry = pageEntry ? pageEntry->load(memory_order_acquire) : 0;
+    if (stateOf(entry) == State::NotWatched)
+        return AccessResult::NotWatched;
+    if (stateOf(entry) == State::Removed)
+        return AccessResult::Removed;
+
+    uintptr_t firstPage = page - pagesFromStartOf(entry);
+    *rangeStart = reinterpret_cast<void*>(firstPage * environment.pageSize);
+    *rangePages = rangePagesOf(entry);
+    atomic<uint64_t>* firstEntry = entryFor(firstPage, false);
+    uint64_t first = firstEntry->load(memory_order_acquire);
+    if (stateOf(first) == State::Protected
+        && firstEntry->compare_exchange_strong(first, makeEntry(State::Accessed, 0, *rangePages), memory_order_acq_rel))
+        return AccessResult::FirstAccess;
+    return AccessResult::AlreadyAccessed;
+}
+
+bool WatchedPageIndex::contains(void* memory) const {
+    atomic<uint64_t>* entry = entryFor(pageOf(memory), false);
+    return entry && isWatched(entry->load(memory_order_acquire));
+}
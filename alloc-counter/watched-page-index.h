@@ -0,0 +1,90 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include "environment.h"
+using namespace std;
+
+/** Page number indexed table of the ranges watched by an AccessWatcher.
+ *
+ * Pages are indexed in a three level radix tree whose nodes are mmap'ed and never freed, so that a fault handler can
+ * look up the faulting page without locking, allocating or scanning the watched ranges: it is async-signal-safe and
+ * takes a few memory loads.
+ *
+ * Each page entry holds its distance in pages to the start of its range and the length of the range. The entry of the
+ * first page also holds the state of the range, which markAccessed() changes with a compare-and-swap so that only one
+ * of several threads faulting on the same range lifts the protection.
+ *
+ * Removed ranges leave tombstones until forget() is called for them, so that a fault raised just before the range was
+ * removed (and its protection lifted) is still known to be on a watched page.
+ *
+ * Ranges must not overlap, and a range is only added and removed by one thread at a time. */
+class WatchedPageIndex {
+public:
+    WatchedPageIndex();
+
+    // Adds a range of `rangePages` pages starting at the page aligned `memory`. Returns false if the tree nodes could
+    // not be allocated.
+    bool add(void* memory, uint32_t rangePages);
+
+    // Length in pages of the range starting at `memory`, or 0 if no watched range starts there.
+    uint32_t rangePagesAt(void* memory) const;
+
+    // Removes the range starting at `memory`, leaving a tombstone. Returns true if it was accessed since it was added.
+    bool remove(void* memory);
+
+    // Clears the tombstones left by the removal of a range, unless they were replaced by another range since.
+    void forget(void* memory, uint32_t rangePages);
+
+    enum class AccessResult {
+        NotWatched,
+        // The caller is the first to see an access to the range, and should lift its protection.
+        FirstAccess,
+        AlreadyAccessed,
+        // The range was removed since the fault, so its protection is gone.
+        Removed
+    };
+    // Async-signal-safe. Sets *rangeStart and *rangePages unless the address is not watched.
+    AccessResult markAccessed(void* address, void** rangeStart, uint32_t* rangePages);
+
+    bool contains(void* memory) const;
+
+private:
+    enum class State : uint64_t {
+        NotWatched = 0,
+        Protected = 1,
+        Accessed = 2,
+        // Tombstone, see forget().
+        Removed = 3
+    };
+
+    // Page entry: | range length in pages (32 bits) | pages since the start of the range (30 bits) | state (2 bits) |
+    static uint64_t makeEntry(State state, uint32_t pagesFromStart, uint32_t rangePages) {
+        return (uint64_t) rangePages << 32 | (uint64_t) pagesFromStart << 2 | (uint64_t) state;
+    }
+    static State stateOf(uint64_t entry) { return static_cast<State>(entry & 3); }
+    static uint32_t pagesFromStartOf(uint64_t entry) { return static_cast<uint32_t>(entry) >> 2; }
+    static uint32_t rangePagesOf(uint64_t entry) { return entry >> 32; }
+    static bool isWatched(uint64_t entry) {
+        return stateOf(entry) == State::Protected || stateOf(entry) == State::Accessed;
+    }
+
+    // 12 bits per level cover page numbers of 36 bits, that is 48 bit addresses with 4 kiB pages.
+    static const unsigned LevelBits = 12;
+    static const size_t NodeSize = size_t(1) << LevelBits;
+
+    struct Leaf {
+        atomic<uint64_t> entries[NodeSize];
+    };
+    struct Middle {
+        atomic<Leaf*> leaves[NodeSize];
+    };
+
+    // Returns nullptr if the page has no entry and `create` is false (or nodes could not be allocated).
+    atomic<uint64_t>* entryFor(uintptr_t page, bool create) const;
+    uintptr_t pageOf(const void* memory) const {
+        return reinterpret_cast<uintptr_t>(memory) / environment.pageSize;
+    }
+
+    mutable atomic<Middle*> m_root[NodeSize];
+};
@@ -0,0 +1,217 @@
+#include "watched-page-slab.h"
+#include <sys/mman.h>
+#include <malloc.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+WatchedPageSlab WatchedPageSlab::s_instance;
+thread_local bool WatchedPageSlab::t_changingFallbackAllocations = false;
+
+// Sizes are rounded up to one of these, wasting 20% of the pages at most.
+const uint32_t WatchedPageSlab::SizeClassPages[] = { 1, 2, 3, 4, 5, 6, 8, 10, 12, 14, 16 };
+const uint32_t WatchedPageSlab::SizeClassCount = sizeof(SizeClassPages) / sizeof(SizeClassPages[0]);
+
+void* WatchedPageSlab::allocate(size_t size, size_t alignment) {
+    size_t pages = (size + environment.pageSize - 1) / environment.pageSize;
+    if (!pages)
+        pages = 1;
+    uint32_t sizeClass = 0;
+    while (sizeClass < SizeClassCount && SizeClassPages[sizeClass] < pages)
+        sizeClass++;
+
+    if (sizeClass < SizeClassCount && alignment <= environment.pageSize) {
+        lock_guard<mutex> lock(m_mutex);
+        uint32_t slotSize = SizeClassPages[sizeClass] * environment.pageSize;
+        // Fill the oldest regions first, so that the newest ones can become empty again.
+        Region* region = nullptr;
+        uint32_t regionCount = m_regionCount.load(memory_order_relaxed);
+        for (uint32_t i = 0; i < regionCount && !region; i++) {
+            if (m_regions[i].slotSize == slotSize && m_regions[i].usedSlotCount < m_regions[i].slotCount)
+                region = &m_regions[i];
+        }
+        if (!region)
+            region = addRegion(slotSize);
+
+        if (region) {
+            for (uint32_t word = 0; ; word++) {
+                if (!~region->usedSlots[word])
+                    continue;
+                uint32_t slot = word * 64 + __builtin_ctzll(~region->usedSlots[word]);
+                setBit(region->usedSlots, slot, true);
+                region->usedSlotCount++;
+                m_liveSlabAllocations++;
+                return region->base + slot * static_cast<size_t>(slotSize);
+            }
+        }
+        // Out of regions: fall back to the heap.
+    }
+
+    // Not under the lock: the allocator may call back into the wrappers, which look up isAllocation().
+    size_t fallbackSize = pages * environment.pageSize;
+    void* memory = memalign(std::max(alignment, static_cast<size_t>(environment.pageSize)), fallbackSize);
+    if (memory) {
+        lock_guard<mutex> lock(m_mutex);
+        if (!m_fallbackAllocations)
+            m_fallbackAllocations = new unordered_map<void*, size_t>;
+        t_changingFallbackAllocations = true;
+        m_fallbackAllocations->insert(make_pair(memory, fallbackSize));
+        t_changingFallbackAllocations = false;
+        m_fallbackAllocationCount.fetch_add(1, memory_order_relaxed);
+    }
+    return memory;
+}
+
+void WatchedPageSlab::free(void* memory) {
+    Region* region = regionFor(memory);
+    if (!region) {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            t_changingFallbackAllocations = true;
+            m_fallbackAllocations->erase(memory);
+            t_changingFallbackAllocations = false;
+            m_fallbackAllocationCount.fetch_sub(1, memory_order_relaxed);
+        }
+        ::free(memory);
+        return;
+    }
+
+    lock_guard<mutex> lock(m_mutex);
+
+    uint32_t slot = (static_cast<char*>(memory) - region->base) / region->slotSize;
+    // The slot may be reused by an allocation that needs it zero filled (calloc()), and is otherwise unused. Let the
+    // kernel take the pages back, they will be zero filled on the next access.
+    if (testBit(region->protectedSlots, slot)) {
+        mprotect(memory, region->slotSize, PROT_READ | PROT_WRITE);
+        setProtected(*region, slot, false);
+    }
+    madvise(memory, region->slotSize, MADV_DONTNEED);
+    setBit(region->usedSlots, slot, false);
+    region->usedSlotCount--;
+    m_liveSlabAllocations--;
+}
+
+bool WatchedPageSlab::protect(void* memory, size_t size, int protection) {
+    lock_guard<mutex> lock(m_mutex);
+    Region* region = regionFor(memory);
+    if (region) {
+        // Protect the whole slot, so that it merges with its neighbours.
+        size = region->slotSize;
+        uint32_t slot = (static_cast<char*>(memory) - region->base) / region->slotSize;
+        setProtected(*region, slot, protection != (PROT_READ | PROT_WRITE));
+    }
+    return mprotect(memory, size, protection) == 0;
+}
+
+bool WatchedPageSlab::isAllocation(void* memory) {
+    if (regionFor(memory))
+        return true;
+    if (!m_fallbackAllocationCount.load(memory_order_relaxed) || t_changingFallbackAllocations)
+        return false;
+    lock_guard<mutex> lock(m_mutex);
+    return m_fallbackAllocations->count(memory) != 0;
+}
+
+size_t WatchedPageSlab::usableSize(void* memory) {
+    if (const Region* region = regionFor(memory))
+        return region->slotSize;
+    if (!m_fallbackAllocationCount.load(memory_order_relaxed) || t_changingFallbackAllocations)
+        return 0;
+    lock_guard<mutex> lock(m_mutex);
+    auto it = m_fallbackAllocations->find(memory);
+    return it != m_fallbackAllocations->end() ? it->second : 0;
+}
+
+WatchedPageSlab::Stats WatchedPageSlab::stats() {
+    lock_guard<mutex> lock(m_mutex);
+    Stats stats;
+    stats.regionCount = m_regionCount.load(memory_order_relaxed);
+    stats.liveSlabAllocations = m_liveSlabAllocations;
+    stats.liveFallbackAllocations = m_fallbackAllocationCount.load(memory_order_relaxed);
+    if (stats.regionCount)
+        stats.vmaCount = 1 + m_protectionChanges + (stats.regionCount < MaxRegions ? 1 : 0);
+    else
+        stats.vmaCount = 0;
+    return stats;
+}
+
+void WatchedPageSlab::setProtected(Region& region, uint32_t slot, bool slotProtected) {
+    if (testBit(region.protectedSlots, slot) == slotProtected)
+        return;
+    m_protectionChanges -= protectionChangesAround(region, slot);
+    setBit(region.protectedSlots, slot, slotProtected);
+    m_protectionChanges += protectionChangesAround(region, slot);
+}
+
+uint32_t WatchedPageSlab::protectionChangesAround(const Region& region, uint32_t slot) const {
+    uint32_t regionIndex = &region - m_regions;
+    uint32_t regionCount = m_regionCount.load(memory_order_relaxed);
+    bool slotProtected = testBit(region.protectedSlots, slot);
+    uint32_t changes = 0;
+    if (slot > 0) {
+        if (testBit(region.protectedSlots, slot - 1) != slotProtected)
+            changes++;
+    } else if (regionIndex > 0 && endsProtected(m_regions[regionIndex - 1]) != slotProtected) {
+        changes++;
+    }
+    if (slot + 1 < region.slotCount) {
+        if (testBit(region.protectedSlots, slot + 1) != slotProtected)
+            changes++;
+    } else if (region.slotCount * static_cast<size_t>(region.slotSize) < RegionSize) {
+        if (slotProtected)
+            changes++;
+    } else if (regionIndex + 1 < regionCount && testBit(m_regions[regionIndex + 1].protectedSlots, 0) != slotProtected) {
+        changes++;
+    }
+    return changes;
+}
+
+bool WatchedPageSlab::endsProtected(const Region& region) {
+    return region.slotCount * static_cast<size_t>(region.slotSize) == RegionSize
+        && testBit(region.protectedSlots, region.slotCount - 1);
+}
+
+const WatchedPageSlab::Region* WatchedPageSlab::regionFor(void* memory) const {
+    uint32_t regionCount = m_regionCount.load(memory_order_acquire);
+    if (!regionCount)
+        return nullptr;
+    // Wraps around for pointers below the reservation.
+    uintptr_t offset = reinterpret_cast<uintptr_t>(memory) - reinterpret_cast<uintptr_t>(m_reservation);
+    if (offset >= regionCount * RegionSize)
+        return nullptr;
+    return &m_regions[offset / RegionSize];
+}
+
+WatchedPageSlab::Region* WatchedPageSlab::addRegion(uint32_t slotSize) {
+    uint32_t regionCount = m_regionCount.load(memory_order_relaxed);
+    if (regionCount == MaxRegions)
+        return nullptr;
+    if (!m_reservation) {
+        // Address space only: nothing is committed until a region is made accessible.
+        void* reservation = mmap(nullptr, MaxRegions * RegionSize, PROT_NONE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (reservation == MAP_FAILED)
+            return nullptr;
+        m_reservation = static_cast<char*>(reservation);
+    }
+    char* base = m_reservation + regionCount * RegionSize;
+    if (mprotect(base, RegionSize, PROT_READ | PROT_WRITE) != 0)
+        return nullptr;
+
+    Region& region = m_regions[regionCount];
+    region.base = base;
+    region.slotSize = slotSize;
+    region.slotCount = RegionSize / slotSize;
+    region.usedSlotCount = 0;
+    memset(region.usedSlots, 0, sizeof(region.usedSlots));
+    memset(region.protectedSlots, 0, sizeof(region.protectedSlots));
+    // Slots past slotCount are marked as used, so that the search for a free slot never returns them.
+    for (uint32_t slot = region.slotCount; slot < MaxSlotsPerRegion; slot++)
+        setBit(region.usedSlots, slot, true);
+    // The new region is unprotected.
+    if (regionCount > 0 && endsProtected(m_regions[regionCount - 1]))
+        m_protectionChanges++;
+    m_regionCount.store(regionCount + 1, memory_order_release);
+    return &region;
+}
@@ -0,0 +1,118 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <unordered_map>
+#include "environment.h"
+using namespace std;
+
+/** Page granular allocator for closely watched allocations.
+ *
+ * Closely watched allocations take whole pages so that the memory protector can mprotect() them. Taking them from the
+ * heap with memalign() wastes a header and most of a page per allocation, fragments the heap and scatters the watched
+ * pages, so that every protected allocation splits the heap mapping in up to three VMAs (the kernel limits a process
+ * to about 65k of them).
+ *
+ * Instead, allocations of up to MaxSlabPages pages are rounded up to a size class and placed in a slot of a region
+ * of RegionSize bytes dedicated to that size class. The lowest free slot is always used, so live allocations are
+ * packed together and protections on neighbouring allocations merge into fewer VMAs. Bigger or more strictly aligned
+ * allocations fall back to memalign().
+ *
+ * Regions are made accessible one after the other in a single address range reserved for MaxRegions of them, so that
+ * telling whether a pointer is in the slab, which free() does for every page aligned pointer, is a bounds check. They
+ * are never unmapped, but the pages of free slots are given back to the kernel with MADV_DONTNEED. Protection changes
+ * must go through protect(), so that the number of VMAs used can be counted as they happen. */
+class WatchedPageSlab {
+public:
+    static WatchedPageSlab& instance() { return s_instance; }
+
+    static const size_t RegionSize = 4 << 20;
+
+    // Returns page aligned memory for at least `size` bytes, or nullptr.
+    void* allocate(size_t size, size_t alignment);
+    // `memory` must come from allocate().
+    void free(void* memory);
+    // Sets the protection of an allocation made by allocate(). Returns false if mprotect() fails.
+    bool protect(void* memory, size_t size, int protection);
+
+    // Whether `memory` is in a slot of the slab (allocations that fell back to memalign() are not).
+    bool owns(void* memory) const {
+        return regionFor(memory) != nullptr;
+    }
+
+    // Whether `memory` is in a slot of the slab or is a live allocation that fell back to memalign(): either way, it
+    // must be released with free(). Only takes the lock if some allocation fell back to memalign().
+    bool isAllocation(void* memory);
+
+    // Usable size of an allocation made by allocate(), or 0 if `memory` is not one.
+    size_t usableSize(void* memory);
+
+    struct Stats {
+        uint32_t regionCount;
+        size_t liveSlabAllocations;
+        size_t liveFallbackAllocations;
+        // VMAs used by the reserved range: one for the regions, one more for every change of protection between
+        // neighbouring slots, and one for the rest of the reservation. Each fallback allocation also uses one or (if
+        // protected and in the middle of the heap) up to three VMAs.
+        size_t vmaCount;
+    };
+    Stats stats();
+
+private:
+    static WatchedPageSlab s_instance;
+
+    static const uint32_t MaxRegions = 256;
+    static const uint32_t MaxSlabPages = 16;
+    static const uint32_t SizeClassPages[];
+    static const uint32_t SizeClassCount;
+    // Enough for the smallest page size we expect (4 kiB) and the smallest size class (1 page).
+    static const uint32_t MaxSlotsPerRegion = RegionSize / 4096;
+
+    struct Region {
+        char* base;
+        uint32_t slotSize; // in bytes
+        uint32_t slotCount;
+        uint32_t usedSlotCount;
+        uint64_t usedSlots[MaxSlotsPerRegion / 64];
+        uint64_t protectedSlots[MaxSlotsPerRegion / 64];
+    };
+
+    const Region* regionFor(void* memory) const;
+    Region* regionFor(void* memory) {
+        return const_cast<Region*>(static_cast<const WatchedPageSlab*>(this)->regionFor(memory));
+    }
+    Region* addRegion(uint32_t slotSize);
+    // Changes the protected bit of a slot and updates m_protectionChanges.
+    void setProtected(Region& region, uint32_t slot, bool slotProtected);
+    // Protection changes between the slot and its neighbours, which may be in the neighbouring regions, each of them
+    // a VMA boundary.
+    uint32_t protectionChangesAround(const Region& region, uint32_t slot) const;
+    // Whether the last page of the region is protected. Any space after the last slot is not.
+    static bool endsProtected(const Region& region);
+    static bool testBit(const uint64_t* bits, uint32_t index) { return bits[index / 64] & (1ull << (index % 64)); }
+    static void setBit(uint64_t* bits, uint32_t index, bool value) {
+        if (value)
+            bits[index / 64] |= 1ull << (index % 64);
+        else
+            bits[index / 64] &= ~(1ull << (index % 64));
+    }
+
+    mutex m_mutex;
+    // Regions are only ever appended. Entries below m_regionCount are immutable but for their bitmaps and counters, so
+    // owns() can find them without locking.
+    Region m_regions[MaxRegions];
+    atomic<uint32_t> m_regionCount { 0 };
+    // Start of the range reserved for the regions, set before the first region is published.
+    char* m_reservation = nullptr;
+    // Running counters for stats().
+    size_t m_liveSlabAllocations = 0;
+    size_t m_protectionChanges = 0;
+    // Allocations that fell back to memalign(), with their size. Created on first use and never destroyed, since it may
+    // be looked up by free() until the process is gone.
+    unordered_map<void*, size_t>* m_fallbackAllocations = nullptr;
+    atomic<size_t> m_fallbackAllocationCount { 0 };
+    // Set while this thread changes m_fallbackAllocations under m_mutex. The memory the map frees then goes through the
+    // free() wrapper, which must not lock m_mutex again to look it up: it is never a fallback allocation.
+    static thread_local bool t_changingFallbackAllocations;
+};
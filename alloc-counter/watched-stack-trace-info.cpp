@@ -1,3 +1,3 @@
 #include "watched-stack-trace-info.h"
 
-uint32_t WatchedStackTraceInfo::countLiveCloselyWatchedAllocationsAllTraces(0);
+atomic<uint32_t> WatchedStackTraceInfo::countLiveCloselyWatchedAllocationsAllTraces(0);
@@ -1,6 +1,7 @@
 #pragma once
-#include "stack-trace.h"
+#include "stack-depot.h"
 #include "environment.h"
+#include "module-map.h"
 #include <atomic>
 #include <mutex>
 using namespace std;
@@ -12,10 +13,14 @@ enum class Trilean {
 };
 
 struct WatchedStackTraceInfo {
-    explicit WatchedStackTraceInfo(StackTrace stackTrace)
-        : stackTrace(stackTrace)
+    explicit WatchedStackTraceInfo(StackId stackId)
+        : stackId(stackId)
+        , moduleGeneration(ModuleMap::instance().generation())
     {}
-    StackTrace stackTrace;
+    // In StackDepot.
+    StackId stackId;
+    // The modules loaded when the trace was captured, to resolve its addresses later.
+    uint32_t moduleGeneration;
 
     // Statistics for this stack trace:
     uint32_t countTotalCloselyWatchedAllocationsEverCreated = 0;
@@ -24,10 +29,17 @@ struct WatchedStackTraceInfo {
     size_t   countTotalLeakedMemory = 0;
     uint64_t countSkippedAllocations = 0;
 
+    // Same as above, but each allocation counts as many as it stands for when sampling (see AllocationSampler).
+    // Without sampling these are equal to the counts above.
+    double estimatedTotalAllocations = 0;
+    double estimatedTotalCloselyWatchedAllocations = 0;
+    double estimatedTotalLeakedMemory = 0;
+
     // Global statistics:
     // There is a limit on the number of closely watched allocations because
     // the number of sections we can mprotect() is limited (65k in Linux x86_64).
-    static uint32_t countLiveCloselyWatchedAllocationsAllTraces;
+    // Atomic because traces living in different fingerprint shards of the allocation table update it concurrently.
+    static atomic<uint32_t> countLiveCloselyWatchedAllocationsAllTraces;
 
     // 1.0 -> leaks always, 0.0 -> never leaks, NaN -> no info
     float leakRatio() const {
@@ -56,20 +68,16 @@ struct WatchedStackTraceInfo {
     float lostAllocationsEstimated() const {
         if (countFinishedWatchedAllocations() == 0)
             return 0;
-        return countTotalAllocations() * leakRatio();
+        return estimatedTotalAllocations * leakRatio();
     }
 
     float lostBytesEstimated() const {
-        return countTotalLeakedMemory / watchRate();
+        return estimatedTotalLeakedMemory / watchRate();
     }
 
 private:
     float watchRate() const {
-        return (float) countTotalCloselyWatchedAllocationsEverCreated / countTotalAllocations();
-    }
-
-    uint32_t countTotalAllocations() const {
-        return countSkippedAllocations + countTotalCloselyWatchedAllocationsEverCreated;
+        return estimatedTotalCloselyWatchedAllocations / estimatedTotalAllocations;
     }
 
     uint32_t countFinishedWatchedAllocations() const {
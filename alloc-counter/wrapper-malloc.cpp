@@ -19,17 +19,22 @@ static void* (*real_aligned_alloc)(size_t, size_t) = nullptr;
 static void* (*real_valloc)(size_t) = nullptr;
 static void* (*real_memalign)(size_t, size_t) = nullptr;
 static void* (*real_pvalloc)(size_t) = nullptr;
+static size_t (*real_malloc_usable_size)(void*) = nullptr;
 
 CallstackFingerprint inline __attribute__((always_inline)) makeCallstackFingerprint(uint32_t allocationSize) {
-    // This function must be always_inline so that we can get the return address of malloc(), not of this function.
+    // This function must be always_inline so that we can get the return address and frame of malloc(), not of this
+    // function.
     int stackTop;
-    return computeCallstackFingerprint(&stackTop, __builtin_return_address(0), allocationSize);
+    return computeCallstackFingerprint(&stackTop, __builtin_return_address(0), __builtin_frame_address(0),
+                                       allocationSize);
 }
 
 void* malloc(size_t size) {
     if (!real_malloc) {
         real_malloc = (void*(*)(size_t)) dlsym(RTLD_NEXT, "malloc");
     }
+    if (!AllocationTable::shouldInstrument())
+        return real_malloc(size);
 
     return AllocationTable::instance().instrumentedAllocate(size, AllocationTable::NoAlignment, makeCallstackFingerprint(size), [size]() {
         return real_malloc(size);
@@ -48,6 +53,9 @@ void* calloc(size_t numMembers, size_t memberSize) {
         real_calloc = (void*(*)(size_t, size_t)) dlsym(RTLD_NEXT, "calloc");
     }
 
+    if (!AllocationTable::shouldInstrument())
+        return real_calloc(numMembers, memberSize);
+
     size_t size = numMembers * memberSize;
     return AllocationTable::instance().instrumentedAllocate(size, AllocationTable::NoAlignment, makeCallstackFingerprint(size), [numMembers, memberSize]() {
         return real_calloc(numMembers, memberSize);
@@ -58,6 +66,8 @@ int posix_memalign(void **memptr, size_t alignment, size_t size) {
     if (!real_posix_memalign) {
         real_posix_memalign = (int(*)(void**, size_t, size_t)) dlsym(RTLD_NEXT, "posix_memalign");
     }
+    if (!AllocationTable::shouldInstrument())
+        return real_posix_memalign(memptr, alignment, size);
 
     int errorCode = 0; // Success
     void *memory = AllocationTable::instance().instrumentedAllocate(size, alignment, makeCallstackFingerprint(size), [size, alignment, &errorCode]() {
@@ -76,6 +86,8 @@ void *aligned_alloc(size_t alignment, size_t size) {
     if (!real_aligned_alloc) {
         real_aligned_alloc = (void*(*)(size_t, size_t)) dlsym(RTLD_NEXT, "aligned_alloc");
     }
+    if (!AllocationTable::shouldInstrument())
+        return real_aligned_alloc(alignment, size);
 
     return AllocationTable::instance().instrumentedAllocate(size, alignment, makeCallstackFingerprint(size), [alignment, size]() {
         return real_aligned_alloc(alignment, size);
@@ -86,6 +98,8 @@ void *valloc(size_t size) {
     if (!real_valloc) {
         real_valloc = (void*(*)(size_t)) dlsym(RTLD_NEXT, "valloc");
     }
+    if (!AllocationTable::shouldInstrument())
+        return real_valloc(size);
 
     return AllocationTable::instance().instrumentedAllocate(size, environment.pageSize, makeCallstackFingerprint(size), [size]() {
         return real_valloc(size);
@@ -96,6 +110,8 @@ void *memalign(size_t alignment, size_t size) {
     if (!real_memalign) {
         real_memalign = (void*(*)(size_t, size_t)) dlsym(RTLD_NEXT, "memalign");
     }
+    if (!AllocationTable::shouldInstrument())
+        return real_memalign(alignment, size);
 
     return AllocationTable::instance().instrumentedAllocate(size, alignment, makeCallstackFingerprint(size), [alignment, size]() {
         return real_memalign(alignment, size);
@@ -106,15 +122,33 @@ void *pvalloc(size_t size) {
     if (!real_pvalloc) {
         real_pvalloc = (void*(*)(size_t)) dlsym(RTLD_NEXT, "pvalloc");
     }
+    if (!AllocationTable::shouldInstrument())
+        return real_pvalloc(size);
 
     return AllocationTable::instance().instrumentedAllocate(size, environment.pageSize, makeCallstackFingerprint(size), [size]() {
         return real_pvalloc(size);
     }, AllocationTable::ZeroFill::Unnecessary);
 }
 
+size_t malloc_usable_size(void* memory) {
+    if (!real_malloc_usable_size)
+        real_malloc_usable_size = (size_t(*)(void*)) dlsym(RTLD_NEXT, "malloc_usable_size");
+
+    // Closely watched allocations are not in the heap. They are page aligned, which rules out most heap pointers.
+    if (!((uintptr_t) memory & (environment.pageSize - 1))) {
+        if (size_t size = WatchedPageSlab::instance().usableSize(memory))
+            return size;
+    }
+    return real_malloc_usable_size(memory);
+}
+
 void free(void* memory) {
     if (!real_free)
         real_free = (void(*)(void*)) dlsym(RTLD_NEXT, "free");
+    if (!AllocationTable::shouldInstrument() && !AllocationTable::inWatchedPageSlab(memory)) {
+        real_free(memory);
+        return;
+    }
 
     AllocationTable::instance().instrumentedFree(memory, [memory]() {
         real_free(memory);
@@ -124,6 +158,8 @@ void free(void* memory) {
 void* realloc(void* oldMemory, size_t newSize) {
     if (!real_realloc)
         real_realloc = (void*(*)(void*, size_t)) dlsym(RTLD_NEXT, "realloc");
+    if (!AllocationTable::shouldInstrument() && !AllocationTable::inWatchedPageSlab(oldMemory))
+        return real_realloc(oldMemory, newSize);
 
     // Surprising fact: realloc() is multipurpose (see man realloc)
     if (!oldMemory) {
@@ -131,7 +167,8 @@ void* realloc(void* oldMemory, size_t newSize) {
             return real_realloc(nullptr, newSize);
         }, AllocationTable::ZeroFill::Unnecessary);
     } else if (newSize == 0) {
-        void* ret;
+        // Closely watched memory is freed without calling the lambda.
+        void* ret = nullptr;
         AllocationTable::instance().instrumentedFree(oldMemory, [oldMemory, &ret]() {
             // man realloc: If size was equal to 0, either NULL or a pointer suitable to be passed to free() is returned.
             ret = real_realloc(oldMemory, 0);
@@ -147,6 +184,8 @@ void* realloc(void* oldMemory, size_t newSize) {
 void* reallocarray(void* oldMemory, size_t newNumElements, size_t newElementSize) {
     if (!real_reallocarray)
         real_reallocarray = (void*(*)(void*, size_t, size_t)) dlsym(RTLD_NEXT, "reallocarray");
+    if (!AllocationTable::shouldInstrument() && !AllocationTable::inWatchedPageSlab(oldMemory))
+        return real_reallocarray(oldMemory, newNumElements, newElementSize);
 
     size_t newSize = newNumElements * newElementSize;
 
@@ -157,7 +196,7 @@ void* reallocarray(void* oldMemory, size_t newNumElements, size_t newElementSize
             return real_reallocarray(nullptr, newNumElements, newElementSize);
         }, AllocationTable::ZeroFill::Unnecessary);
     } else if (newSize == 0) {
-        void* ret;
+        void* ret = nullptr;
         AllocationTable::instance().instrumentedFree(oldMemory, [oldMemory, newNumElements, newElementSize, &ret]() {
             // man realloc: If size was equal to 0, either NULL or a pointer suitable to be passed to free() is returned.
             ret = real_reallocarray(oldMemory, newNumElements, newElementSize);
@@ -1,6 +1,8 @@
 #include "environment.h"
 #include <unistd.h>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
 
 Environment environment;
 
@@ -15,3 +17,19 @@ unsigned int Environment::parseEnvironIntGreaterThanZero(const char *name, int d
 
     return defaultValue;
 }
+
+unsigned int Environment::parseEnvironChoice(const char* name, initializer_list<const char*> choices) {
+    char* envString = getenv(name);
+    if (!envString)
+        return 0;
+
+    unsigned int index = 0;
+    for (const char* choice : choices) {
+        if (!strcmp(envString, choice))
+            return index;
+        index++;
+    }
+
+    fprintf(stderr, "alloc-counter: unknown %s=%s, using %s\n", name, envString, *choices.begin());
+    return 0;
+}
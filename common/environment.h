@@ -3,6 +3,9 @@
 #include <unistd.h>
 #include <sys/utsname.h>
 #include <string>
+#include <initializer_list>
+#include <algorithm>
+#include <cstdlib>
 using namespace std;
 
 struct Environment {
@@ -25,9 +28,7 @@ struct Environment {
     /** Once a closely watched allocation enters suspicious state it has this
      * many second to receive an access and become non suspicious again.
      * Otherwise, it will be declared a leak. */
-    // TODO This iss et to 1 because the memory protector is not integrated yet, so we'd rather consider it a leak at
-    // this point rather than wait for an event that won't happen because it's not coded.
-    uint32_t closelyWatchedAllocationsAccessMaxInterval = parseEnvironIntGreaterThanZero("ALLOC_MAX_ACCESS_INTERVAL", 1);
+    uint32_t closelyWatchedAllocationsAccessMaxInterval = parseEnvironIntGreaterThanZero("ALLOC_MAX_ACCESS_INTERVAL", 30);
 
     /**
      * @brief closelyWatchedAllocationsRestTime
@@ -51,6 +52,117 @@ struct Environment {
 
     uint32_t pageSize = sysconf(_SC_PAGESIZE);
 
+    /** Number of independently locked shards the allocation table is split into, so that threads
+     * allocating and freeing unrelated pointers don't serialize on a single mutex. Rounded down to a
+     * power of two and capped by AllocationTable::MaxShards. Set to 1 to get the old single-lock behavior. */
+    uint32_t allocationTableShards = roundDownToPowerOfTwo(parseEnvironIntGreaterThanZero("ALLOC_TABLE_SHARDS", 16));
+
+    /** When enabled, light allocations and frees are not recorded in the allocation table by the thread calling
+     * malloc()/free(). Instead, each thread appends an event to its own ring buffer and a helper thread of the patrol
+     * thread applies them to the table in batches. Closely watched allocations are still handled synchronously. */
+    bool deferredLightAllocations = parseEnvironIntGreaterThanZero("ALLOC_DEFERRED_EVENTS", 0) != 0;
+
+    /** Capacity of each per-thread event ring buffer, in events. Rounded down to a power of two. When a ring is full
+     * the calling thread drains all the rings itself and falls back to the synchronous path. */
+    uint32_t eventBufferCapacity = roundDownToPowerOfTwo(parseEnvironIntGreaterThanZero("ALLOC_EVENT_BUFFER_SIZE", 4096));
+
+    /** Milliseconds between two drains of the event ring buffers. */
+    uint32_t eventBufferDrainInterval = parseEnvironIntGreaterThanZero("ALLOC_EVENT_DRAIN_INTERVAL_MS", 20);
+
+    /** Mean number of allocated bytes between two sampled allocations. Zero (the default) disables sampling and every
+     * allocation is instrumented. Otherwise an allocation of `size` bytes is instrumented with probability
+     * 1 - exp(-size / ALLOC_SAMPLE_RATE) and the rest skip the allocation table entirely. The leak report scales the
+     * estimates back up. */
+    uint32_t sampleRate = parseEnvironIntGreaterThanZero("ALLOC_SAMPLE_RATE", 0);
+
+    /** Resolution of the clock used to timestamp allocations and compute their deadlines, in milliseconds. Deadlines
+     * are still configured in seconds (ALLOC_TIME_SUSPICIOUS etc.), but are checked with this granularity. */
+    uint32_t clockResolution = parseEnvironIntGreaterThanZero("ALLOC_CLOCK_RESOLUTION_MS", 100);
+
+    /** Bounds of the period of the patrol thread, in milliseconds. It checks the allocation table when the next
+     * deadline passes, but not sooner than ALLOC_PATROL_MIN_PERIOD_MS after the last check, and not later than
+     * ALLOC_PATROL_MAX_PERIOD_MS. Up to that, it also waits 20 times as long as the last check took, so that big
+     * tables don't keep it busy. */
+    uint32_t patrolMinPeriod = parseEnvironIntGreaterThanZero("ALLOC_PATROL_MIN_PERIOD_MS", 100);
+    uint32_t patrolMaxPeriod = max(patrolMinPeriod, parseEnvironIntGreaterThanZero("ALLOC_PATROL_MAX_PERIOD_MS", 5000));
+
+    /** How accesses to suspicious allocations are detected, see AccessWatcher: "mprotect" (the default),
+     * "userfaultfd" or "softdirty". */
+    enum class AccessWatcherBackend {
+        Mprotect,
+        Userfaultfd,
+        SoftDirty
+    };
+    AccessWatcherBackend accessWatcherBackend = static_cast<AccessWatcherBackend>(
+        parseEnvironChoice("ALLOC_ACCESS_WATCHER", { "mprotect", "userfaultfd", "softdirty" }));
+
+    /** How StackTrace walks the stack: "libunwind" (the default) steps a libunwind cursor, "backtrace" calls
+     * unw_backtrace(), which caches the unwind info, and "framepointer" follows the chain of saved frame pointers. The
+     * latter is the fastest, but only gets complete traces if all the code in the stack was built with
+     * -fno-omit-frame-pointer. */
+    enum class Unwinder {
+        Libunwind,
+        Backtrace,
+        FramePointer
+    };
+    Unwinder unwinder = static_cast<Unwinder>(
+        parseEnvironChoice("ALLOC_UNWINDER", { "libunwind", "backtrace", "framepointer" }));
+
+    /** Number of return addresses mixed in the callstack fingerprint of each allocation: the one of malloc() and
+     * ALLOC_FINGERPRINT_DEPTH - 1 more, read from the frame pointers of the callers. Deeper fingerprints tell apart
+     * more code paths sharing a call to malloc(), so fewer full stack traces are needed for allocations that don't
+     * leak, but the extra return addresses are only found in code built with frame pointers: in code built without
+     * them, the walk reads whatever the frame pointer register holds, so deeper fingerprints are opt-in. */
+    uint32_t fingerprintDepth = parseEnvironIntGreaterThanZero("ALLOC_FINGERPRINT_DEPTH", 1);
+
+    /** Capacity of the ring buffer of the mmap-counter event log, in records. Rounded down to a power of two. When it
+     * is full, the thread calling mmap() writes the buffered records to the log file itself. */
+    uint32_t mmapLogBufferCapacity = roundDownToPowerOfTwo(parseEnvironIntGreaterThanZero("MMAP_LOG_BUFFER_SIZE", 65536));
+
+    /** Milliseconds between two writes of the mmap-counter event log to disk. */
+    uint32_t mmapLogFlushInterval = parseEnvironIntGreaterThanZero("MMAP_LOG_FLUSH_INTERVAL_MS", 200);
+
+    /** When enabled, mappings made again from a known call site of mmap(), with a similar size, reuse its stack trace
+     * instead of walking the stack, see CallSiteCache. Faster, but mappings reached from other callers through the
+     * same call site get the wrong stack trace, so it's off by default. */
+    bool mmapCallSiteCache = parseEnvironIntGreaterThanZero("MMAP_CALL_SITE_CACHE", 0) != 0;
+
+    /** Number of mmap() call sites whose stack trace is remembered by the call site cache. */
+    uint32_t mmapCallSiteCacheCapacity = parseEnvironIntGreaterThanZero("MMAP_CALL_SITE_CACHE_SIZE", 4096);
+
+    /** Milliseconds between two samples of mallinfo-log. At least 10. */
+    uint32_t mallinfoLogInterval = max(10u, parseEnvironIntGreaterThanZero("MALLINFO_LOG_INTERVAL_MS", 5000));
+
+    /** Minimum milliseconds between two reads of /proc/self/smaps_rollup by mallinfo-log, for PSS and swap. Reading it
+     * walks the page tables of the whole process, which is too slow to do on every sample of short intervals. */
+    uint32_t mallinfoLogRollupInterval = parseEnvironIntGreaterThanZero("MALLINFO_LOG_ROLLUP_INTERVAL_MS", 1000);
+
+    /** When set, mallinfo-log fits the trend of RSS, anonymous RSS, used malloc chunks (uordblks) and free malloc
+     * chunks (fordblks, fragmentation) over a sliding window, and raises an alert when one of them grows faster than
+     * this many bytes per hour. Zero (the default) disables the alerts. */
+    uint32_t mallinfoLogAlertSlope = parseEnvironIntGreaterThanZero("MALLINFO_LOG_ALERT_BYTES_PER_HOUR", 0);
+
+    /** Length of the sliding window of the trends of mallinfo-log, in seconds. */
+    uint32_t mallinfoLogTrendWindow = parseEnvironIntGreaterThanZero("MALLINFO_LOG_TREND_WINDOW_S", 600);
+
+    /** Seconds after the start of the process whose samples are left out of the trends, since memory usually grows
+     * while the application initializes. */
+    uint32_t mallinfoLogWarmUp = parseEnvironIntGreaterThanZero("MALLINFO_LOG_WARMUP_S", 120);
+
+    /** Shell command run by mallinfo-log on every alert, with the name of the series, its growth in bytes per hour
+     * and its last value in bytes as arguments ($1, $2, $3). */
+    std::string mallinfoLogAlertHook = []() {
+        const char* hook = getenv("MALLINFO_LOG_ALERT_HOOK");
+        return std::string(hook ? hook : "");
+    }();
+
+    /** Milliseconds between two analyses of the malloc arenas by mallinfo-log, with malloc_info(). */
+    uint32_t mallinfoLogArenaInterval = parseEnvironIntGreaterThanZero("MALLINFO_LOG_ARENA_INTERVAL_MS", 60000);
+
+    /** When set, mallinfo-log calls malloc_trim() after an analysis of the arenas finds more than this many megabytes
+     * in free chunks. Zero (the default) never trims. */
+    uint32_t mallinfoLogTrimThreshold = parseEnvironIntGreaterThanZero("MALLINFO_LOG_TRIM_THRESHOLD_MB", 0);
+
     /** Once this much time passes (in seconds) memory checks will begin. At this point all application initialization
      * should have completed (to avoid reporting false leaks on startup artifacts.
      * Zero means auto start is disabled, memory checks will start when `alloc-counter-start` is invoked. */
@@ -72,6 +184,15 @@ struct Environment {
 
 private:
     static unsigned int parseEnvironIntGreaterThanZero(const char* name, int defaultValue);
+    // Index of the value of the variable in `choices`. The first choice is the default.
+    static unsigned int parseEnvironChoice(const char* name, initializer_list<const char*> choices);
+
+    static uint32_t roundDownToPowerOfTwo(uint32_t value) {
+        uint32_t powerOfTwo = 1;
+        while (powerOfTwo <= value / 2)
+            powerOfTwo *= 2;
+        return powerOfTwo;
+    }
 };
 
 extern Environment environment;
@@ -3,32 +3,121 @@
 #include <libunwind.h>
 #include <dlfcn.h>
 #include <cassert>
+#include <algorithm>
+#include <pthread.h>
 #include "environment.h"
 
 static_assert(sizeof(unw_word_t) >= sizeof(void*), "unw_word_t should be able to fit a pointer");
 
 // For best performance, set this as environment variable: UNW_ARM_UNWIND_METHOD=UNW_ARM_METHOD_EXIDX
 
-StackTrace::StackTrace(int numSkipCalls) noexcept {
+const size_t StackTrace::MaxReturnAddresses;
+
+// The unwinders are inlined in capture(), so that the frames they walk are the same.
+__attribute__((always_inline)) inline size_t StackTrace::libunwindBacktrace(void** returnAddresses,
+                                                                            size_t maxReturnAddresses) {
     unw_cursor_t cursor;
     unw_context_t context;
 
     unw_getcontext(&context);
     unw_init_local(&cursor, &context);
 
-    m_hash = 0;
-    std::hash<uintptr_t> hashWord;
-    while (unw_step(&cursor)) {
+    size_t count = 0;
+    while (count < maxReturnAddresses && unw_step(&cursor) > 0) {
         unw_word_t ip;
         unw_get_reg(&cursor, UNW_REG_IP, &ip);
+        returnAddresses[count++] = reinterpret_cast<void*>(ip);
+    }
+    return count;
+}
 
-        if (numSkipCalls == 0) {
-            m_returnAddresses.push_back(reinterpret_cast<void*>(ip));
-            m_hash = (m_hash << 1) ^ hashWord(static_cast<uintptr_t>(ip));
-        } else {
-            numSkipCalls--;
-        }
+__attribute__((always_inline)) inline size_t StackTrace::unwBacktrace(void** returnAddresses,
+                                                                      size_t maxReturnAddresses) {
+    // unw_backtrace() also returns the address in capture(), which it was inlined into.
+    void* buffer[MaxReturnAddresses + 1];
+    int count = unw_backtrace(buffer, min(maxReturnAddresses, MaxReturnAddresses) + 1);
+    if (count <= 1)
+        return 0;
+    copy(buffer + 1, buffer + count, returnAddresses);
+    return count - 1;
+}
+
+#if defined(__x86_64__) || defined(__aarch64__)
+// Highest address of the stack of the current thread.
+static thread_local uintptr_t t_stackEnd = 0;
+
+static uintptr_t stackEnd() {
+    if (!t_stackEnd) {
+        pthread_attr_t attributes;
+        void* stackAddress;
+        size_t stackSize;
+        if (pthread_getattr_np(pthread_self(), &attributes) != 0)
+            return 0;
+        if (pthread_attr_getstack(&attributes, &stackAddress, &stackSize) == 0)
+            t_stackEnd = reinterpret_cast<uintptr_t>(stackAddress) + stackSize;
+        pthread_attr_destroy(&attributes);
     }
+    return t_stackEnd;
+}
+
+__attribute__((always_inline)) inline size_t StackTrace::framePointerBacktrace(void** returnAddresses,
+                                                                               size_t maxReturnAddresses) {
+    // Each frame record is the saved frame pointer of the caller followed by the return address into it. Records are
+    // only read while they lie in the stack, above the previous one, so garbage left by code built without frame
+    // pointers ends the walk instead of crashing it.
+    const uintptr_t* frame = static_cast<const uintptr_t*>(__builtin_frame_address(0));
+    uintptr_t end = stackEnd();
+    size_t count = 0;
+    while (count < maxReturnAddresses) {
+        uintptr_t address = reinterpret_cast<uintptr_t>(frame);
+        if (address % sizeof(uintptr_t) || address + 2 * sizeof(uintptr_t) > end || !frame[1])
+            break;
+        returnAddresses[count++] = reinterpret_cast<void*>(frame[1]);
+        const uintptr_t* caller = reinterpret_cast<const uintptr_t*>(frame[0]);
+        if (caller <= frame)
+            break;
+        frame = caller;
+    }
+    return count;
+}
+#else
+// Frame records are not laid out the same way everywhere (e.g. on 32 bit ARM), use libunwind.
+__attribute__((always_inline)) inline size_t StackTrace::framePointerBacktrace(void** returnAddresses,
+                                                                               size_t maxReturnAddresses) {
+    return libunwindBacktrace(returnAddresses, maxReturnAddresses);
+}
+#endif
+
+__attribute__((noinline)) size_t StackTrace::capture(void** returnAddresses, size_t maxReturnAddresses,
+                                                     int numSkipCalls) noexcept {
+    void* buffer[MaxReturnAddresses];
+    size_t count;
+    switch (environment.unwinder) {
+    case Environment::Unwinder::Backtrace:
+        count = unwBacktrace(buffer, MaxReturnAddresses);
+        break;
+    case Environment::Unwinder::FramePointer:
+        count = framePointerBacktrace(buffer, MaxReturnAddresses);
+        break;
+    default:
+        count = libunwindBacktrace(buffer, MaxReturnAddresses);
+    }
+
+    size_t skip = min(count, static_cast<size_t>(max(numSkipCalls, 0)));
+    count = min(count - skip, maxReturnAddresses);
+    copy(buffer + skip, buffer + skip + count, returnAddresses);
+    return count;
+}
+
+StackTrace::StackTrace(int numSkipCalls) noexcept {
+    void* returnAddresses[MaxReturnAddresses];
+    // One more call to skip: the return address into this constructor.
+    size_t count = capture(returnAddresses, MaxReturnAddresses, numSkipCalls + 1);
+    m_returnAddresses.assign(returnAddresses, returnAddresses + count);
+    m_hash = 0;
+    std::hash<uintptr_t> hashWord;
+    for (void* returnAddress : m_returnAddresses)
+        m_hash = (m_hash << 1) ^ hashWord(reinterpret_cast<uintptr_t>(returnAddress));
 }
 
 bool StackTrace::operator==(const StackTrace &other) const noexcept
@@ -7,16 +7,33 @@ using namespace std;
 
 class StackTrace {
 public:
-    // Creates an stacktrace with the current stack. The topmost `numSkipCalls` are omitted (so that this
+    // Deeper stacks are truncated.
+    static const size_t MaxReturnAddresses = 256;
+
+    // Creates an stacktrace with the current stack. The topmost `numSkipCalls` calls are omitted. The stack is walked
+    // with the unwinder chosen in environment.unwinder.
     StackTrace(int numSkipCalls = 0) noexcept;
     size_t hash() const { return m_hash; }
 
+    /** Writes the return addresses of the current stack to `returnAddresses`, top first, without allocating memory.
+     * The topmost `numSkipCalls` calls are omitted: with 0, the first one is the return address into the caller of
+     * capture(). Returns how many were written. */
+    static size_t capture(void** returnAddresses, size_t maxReturnAddresses, int numSkipCalls = 0) noexcept;
+
+    const vector<void*>& returnAddresses() const { return m_returnAddresses; }
+
     bool operator==(const StackTrace& other) const noexcept;
 
 private:
     friend ostream& operator<<(ostream& os, const StackTrace& st);
     friend struct std::hash<StackTrace>;
 
+    // Unwinders, inlined into capture(). They write the return addresses of the callers of capture(), top first, and
+    // return how many.
+    static size_t libunwindBacktrace(void** returnAddresses, size_t maxReturnAddresses);
+    static size_t unwBacktrace(void** returnAddresses, size_t maxReturnAddresses);
+    static size_t framePointerBacktrace(void** returnAddresses, size_t maxReturnAddresses);
+
     vector<void*> m_returnAddresses; // top (recent) calls first
     size_t m_hash;
 };
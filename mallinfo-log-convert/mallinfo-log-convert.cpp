@@ -0,0 +1,70 @@
+/* Converts the binary memory report of mallinfo-log to the TSV read by mallinfo-plot:
+ *
+ *   mallinfo-log-convert /tmp/memory-<program>-<pid>.bin > memory-report
+ *
+ * The columns of the text report written by older versions come first, in the same order, so that the plots keep
+ * working. Values that couldn't be read are written as NaN, which gnuplot skips. */
+#include "mallinfo-record.h"
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+
+static void printValue(uint64_t value) {
+    if (value == MallinfoUnknown)
+        printf("\tNaN");
+    else
+        printf("\t%" PRIu64, value);
+}
+
+static void printRecord(const MallinfoRecord& record) {
+    printf("%.6f", record.timestamp / 1e9);
+    for (uint64_t value : { record.rss, record.rssAnon, record.arena, record.ordblks, record.hblks, record.hblkhd,
+                            record.uordblks, record.fordblks, record.keepcost, record.pss, record.swap })
+        printValue(value);
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: mallinfo-log-convert <memory report>\n");
+        return 1;
+    }
+    FILE* file = fopen(argv[1], "rb");
+    if (!file) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    MallinfoLogHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, MallinfoLogMagic, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s: not a mallinfo-log memory report\n", argv[1]);
+        return 1;
+    }
+    if (header.version != MallinfoLogVersion || header.recordSize != sizeof(MallinfoRecord)) {
+        fprintf(stderr, "%s: unsupported version %u (record size %u)\n", argv[1], header.version, header.recordSize);
+        return 1;
+    }
+
+    printf("#Time\t"
+           "Total RSS\t"
+           "Total Anon RSS\t"
+           "Arenas size\t"
+           "Num free chunks\t"
+           "Num mmap chunks\t"
+           "mmaps size\t"
+           "Used chunks size\t"
+           "Free chunks size\t"
+           "Top chunk size\t"
+           "PSS\t"
+           "Swap\n");
+    static MallinfoRecord records[1024];
+    size_t count;
+    while ((count = fread(records, sizeof(MallinfoRecord), sizeof(records) / sizeof(records[0]), file)) > 0) {
+        for (size_t i = 0; i < count; i++)
+            printRecord(records[i]);
+    }
+    // A truncated record at the end means the application was killed while it was being written.
+    fclose(file);
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include "malloc-arena-stats.h"
+#include <gtest/gtest.h>
+#include <cstdlib>
+
+// Written by glibc 2.36, shortened.
+static const char mallocInfo[] = R"(<malloc version="1">
+<heap nr="0">
+<sizes>
+  <size from="1089" to="1137" total="4452" count="4"/>
+  <size from="7681" to="8017" total="172678" count="22"/>
+  <unsorted from="769" to="769" total="769" count="1"/>
+</sizes>
+<total type="fast" count="3" size="96"/>
+<total type="rest" count="437" size="2076660"/>
+<system type="current" size="4206592"/>
+<system type="max" size="4206592"/>
+<aspace type="total" size="4206592"/>
+<aspace type="mprotect" size="4206592"/>
+</heap>
+<heap nr="1">
+<sizes>
+  <size from="209" to="209" total="209" count="1"/>
+</sizes>
+<total type="fast" count="0" size="0"/>
+<total type="rest" count="2" size="42769"/>
+<aspace type="total" size="135168"/>
+<aspace type="mprotect" size="135168"/>
+<aspace type="subheaps" size="1"/>
+</heap>
+<total type="fast" count="3" size="96"/>
+<total type="rest" count="439" size="2119429"/>
+<total type="mmap" count="1" size="1052672"/>
+<system type="current" size="4341760"/>
+<system type="max" size="4341760"/>
+<aspace type="total" size="4341760"/>
+<aspace type="mprotect" size="4341760"/>
+</malloc>
+)";
+
+TEST(MallocArenaStatsTest, ParsesArenasAndBins) {
+    vector<MallocArenaStats> arenas;
+    ASSERT_TRUE(parseMallocInfo(mallocInfo, arenas));
+    ASSERT_EQ(arenas.size(), 2u);
+
+    EXPECT_EQ(arenas[0].number, 0u);
+    EXPECT_EQ(arenas[0].fastCount, 3u);
+    EXPECT_EQ(arenas[0].fastBytes, 96u);
+    EXPECT_EQ(arenas[0].restCount, 437u);
+    EXPECT_EQ(arenas[0].freeBytes(), 2076756u);
+    EXPECT_EQ(arenas[0].addressSpace, 4206592u);
+    ASSERT_EQ(arenas[0].bins.size(), 3u);
+    EXPECT_EQ(arenas[0].bins[1].from, 7681u);
+    EXPECT_EQ(arenas[0].bins[1].to, 8017u);
+    EXPECT_EQ(arenas[0].bins[1].total, 172678u);
+    EXPECT_EQ(arenas[0].bins[1].count, 22u);
+    EXPECT_FALSE(arenas[0].bins[1].unsorted);
+    EXPECT_TRUE(arenas[0].bins[2].unsorted);
+
+    // The totals of all the arenas are not an arena.
+    EXPECT_EQ(arenas[1].number, 1u);
+    EXPECT_EQ(arenas[1].freeBytes(), 42769u);
+    EXPECT_EQ(arenas[1].addressSpace, 135168u);
+    EXPECT_EQ(arenas[1].bins.size(), 1u);
+}
+
+TEST(MallocArenaStatsTest, RejectsOtherDocuments) {
+    vector<MallocArenaStats> arenas;
+    EXPECT_FALSE(parseMallocInfo("", arenas));
+    EXPECT_FALSE(parseMallocInfo("<html></html>", arenas));
+    // Truncated.
+    EXPECT_FALSE(parseMallocInfo("<malloc version=\"1\">\n<heap nr=\"0\">\n", arenas));
+}
+
+TEST(MallocArenaStatsTest, ReadsThisProcess) {
+    // Free chunks between used ones stay in the bins of the main arena.
+    vector<void*> allocations;
+    for (int i = 0; i < 200; i++)
+        allocations.push_back(malloc(2000));
+    for (size_t i = 0; i < allocations.size(); i += 2)
+        free(allocations[i]);
+
+    vector<MallocArenaStats> arenas;
+    ASSERT_TRUE(readMallocArenaStats(arenas));
+    ASSERT_FALSE(arenas.empty());
+    EXPECT_EQ(arenas[0].number, 0u);
+    EXPECT_GE(arenas[0].freeBytes(), 100 * 2000u);
+    EXPECT_GT(arenas[0].addressSpace, arenas[0].freeBytes());
+
+    for (size_t i = 1; i < allocations.size(); i += 2)
+        free(allocations[i]);
+}
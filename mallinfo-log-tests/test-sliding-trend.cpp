@@ -0,0 +1,60 @@
+#include "sliding-trend.h"
+#include <gtest/gtest.h>
+
+TEST(SlidingTrendTest, NoSlopeWithoutTwoSamples) {
+    SlidingTrend trend(60, 100);
+    EXPECT_EQ(trend.slope(), 0);
+    trend.add(1, 10);
+    EXPECT_EQ(trend.slope(), 0);
+    trend.add(1, 20);
+    EXPECT_EQ(trend.slope(), 0);
+}
+
+TEST(SlidingTrendTest, SlopeOfALine) {
+    SlidingTrend trend(60, 100);
+    for (int i = 0; i < 30; i++)
+        trend.add(1000 + i, 5000 + 3 * i);
+    EXPECT_NEAR(trend.slope(), 3, 1e-9);
+    EXPECT_FALSE(trend.full());
+}
+
+TEST(SlidingTrendTest, OnlyTheWindowCounts) {
+    SlidingTrend trend(10, 1000);
+    // Growth first, then flat: once the growth is out of the window, the slope is 0.
+    for (int i = 0; i <= 100; i++)
+        trend.add(i, i * 1000.0);
+    for (int i = 101; i < 110; i++) {
+        trend.add(i, 100000);
+        EXPECT_GT(trend.slope(), 0);
+    }
+    trend.add(110, 100000);
+    EXPECT_TRUE(trend.full());
+    EXPECT_NEAR(trend.slope(), 0, 1e-9);
+    EXPECT_EQ(trend.size(), 11u);
+}
+
+TEST(SlidingTrendTest, CapacityBoundsTheSamples) {
+    SlidingTrend trend(1000, 16);
+    for (int i = 0; i < 100; i++)
+        trend.add(i, i < 84 ? 0 : 2 * i);
+    EXPECT_EQ(trend.size(), 16u);
+    EXPECT_NEAR(trend.slope(), 2, 1e-9);
+}
+
+TEST(SlidingTrendTest, StaysAccurateOverLongRuns) {
+    // A day of samples every 10 ms over a 10 minute window, with big values: the sums are recomputed as the window
+    // slides, so they don't drift.
+    SlidingTrend trend(600, 60001);
+    double slope = 1e6 / 3600; // 1 MB/hour
+    for (long i = 0; i < 8640000; i++) {
+        double time = 3600 + i * 0.01;
+        trend.add(time, 4e9 + slope * time + (i % 2 ? 4096 : -4096));
+    }
+    EXPECT_TRUE(trend.full());
+    EXPECT_NEAR(trend.slope(), slope, slope * 1e-3);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
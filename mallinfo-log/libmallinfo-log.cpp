@@ -1,84 +1,327 @@
 #include <thread>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <cerrno>
 #include <cinttypes>
-#include <fstream>
 #include <sstream>
+#include <memory>
+#include <vector>
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <malloc.h>
+#include "environment.h"
+#include "mallinfo-record.h"
+#include "sliding-trend.h"
+#include "malloc-arena-stats.h"
 using namespace std;
 
-static double getTime() {
+static uint64_t monotonicTimeNs() {
     timespec tv;
     clock_gettime(CLOCK_MONOTONIC, &tv);
-    return tv.tv_sec + tv.tv_nsec / 1e9;
+    return tv.tv_sec * 1000000000ull + tv.tv_nsec;
 }
 
-struct ProcessStatus {
-    // These are values read from /proc/self/status
-    uint64_t VmRSS = UINT64_MAX; // kiB
-    uint64_t RssAnon = UINT64_MAX; // kiB
-};
+/** Reads the memory usage of the process. The /proc files are opened once and read again with pread(), into a buffer
+ * on the stack: with sampling intervals of a few milliseconds, the sampler must not allocate or open files itself. */
+class ProcessMemoryReader {
+public:
+    ProcessMemoryReader()
+        : m_statmFd(open("/proc/self/statm", O_RDONLY | O_CLOEXEC))
+        , m_smapsRollupFd(open("/proc/self/smaps_rollup", O_RDONLY | O_CLOEXEC))
+        , m_pageSize(sysconf(_SC_PAGESIZE))
+    {
+        if (m_statmFd < 0) {
+            perror("open(/proc/self/statm)");
+            exit(1);
+        }
+        // Linux 4.14 and newer.
+        if (m_smapsRollupFd < 0)
+            perror("mallinfo-log: open(/proc/self/smaps_rollup), PSS and swap won't be reported");
+    }
+
+    void readStatm(MallinfoRecord& record) {
+        char buffer[256];
+        ssize_t length = pread(m_statmFd, buffer, sizeof(buffer) - 1, 0);
+        uint64_t size, resident, shared;
+        if (length <= 0)
+            length = 0;
+        buffer[length] = '\0';
+        // The "shared" pages are the file and shmem pages, the rest of the resident ones are anonymous.
+        if (sscanf(buffer, "%" SCNu64 " %" SCNu64 " %" SCNu64, &size, &resident, &shared) != 3) {
+            record.rss = record.rssAnon = MallinfoUnknown;
+            return;
+        }
+        record.rss = resident * m_pageSize;
+        record.rssAnon = (resident - shared) * m_pageSize;
+    }
 
-static ProcessStatus readProcessStatus() {
-    ProcessStatus ret;
-    FILE* fp = fopen("/proc/self/status", "r");
-    if (!fp) {
-        perror("open(/proc/self/status)");
-        exit(1);
+    void readSmapsRollup(MallinfoRecord& record) {
+        record.pss = record.swap = MallinfoUnknown;
+        if (m_smapsRollupFd < 0)
+            return;
+        char buffer[4096];
+        ssize_t length = pread(m_smapsRollupFd, buffer, sizeof(buffer) - 1, 0);
+        if (length <= 0)
+            return;
+        buffer[length] = '\0';
+        record.pss = field(buffer, "\nPss:");
+        record.swap = field(buffer, "\nSwap:");
     }
 
-    char* line = nullptr;
-    size_t size = 0;
-    int nread;
-    while ((nread = getline(&line, &size, fp)) != -1) {
-        sscanf(line, "VmRSS: %" PRIu64 " kB", &ret.VmRSS);
-        sscanf(line, "RssAnon: %" PRIu64 " kB", &ret.RssAnon);
+private:
+    // Value of a "Name:   <n> kB" line, in bytes.
+    static uint64_t field(const char* buffer, const char* name) {
+        const char* line = strstr(buffer, name);
+        if (!line)
+            return MallinfoUnknown;
+        return strtoull(line + strlen(name), nullptr, 10) * 1024;
     }
-    free(line);
-    fclose(fp);
 
-    if (ret.RssAnon == UINT64_MAX || ret.VmRSS == UINT64_MAX)
-        throw std::runtime_error("Could not parse /proc/self/status.");
-    return ret;
+    int m_statmFd;
+    int m_smapsRollupFd;
+    uint64_t m_pageSize;
+};
+
+static void readMallinfo(MallinfoRecord& record) {
+#if __GLIBC_PREREQ(2, 33)
+    struct mallinfo2 info = mallinfo2();
+#else
+    // The fields of mallinfo() are ints, which wrap past 2 GiB.
+    struct mallinfo info = mallinfo();
+#endif
+    record.arena = info.arena;
+    record.ordblks = info.ordblks;
+    record.hblks = info.hblks;
+    record.hblkhd = info.hblkhd;
+    record.uordblks = info.uordblks;
+    record.fordblks = info.fordblks;
+    record.keepcost = info.keepcost;
 }
 
-static string buildMemoryReportPath() {
+/** Fits the trends of the series that show leaks and fragmentation over a sliding window of the last samples, and
+ * raises an alert when one of them grows faster than MALLINFO_LOG_ALERT_BYTES_PER_HOUR: a line on the standard
+ * error, and the MALLINFO_LOG_ALERT_HOOK command if any. An alert is raised again once the growth of the series has
+ * gone below the threshold and then above it again. */
+class GrowthAlerts {
+public:
+    explicit GrowthAlerts(uint64_t startTime)
+        : m_warmUpEnd(startTime + environment.mallinfoLogWarmUp * 1000000000ull)
+        , m_threshold(environment.mallinfoLogAlertSlope / 3600.0)
+    {
+        size_t capacity = environment.mallinfoLogTrendWindow * 1000ull / environment.mallinfoLogInterval + 1;
+        for (Series& series : m_series)
+            series.trend.reset(new SlidingTrend(environment.mallinfoLogTrendWindow, capacity));
+    }
+
+    void add(const MallinfoRecord& record) {
+        reapHooks();
+        if (record.timestamp < m_warmUpEnd)
+            return;
+        for (Series& series : m_series) {
+            uint64_t value = record.*series.field;
+            if (value == MallinfoUnknown)
+                continue;
+            series.trend->add(record.timestamp / 1e9, value);
+            // Short windows after the warm-up would extrapolate a few samples.
+            if (!series.trend->full())
+                continue;
+            double slope = series.trend->slope();
+            if (slope <= m_threshold) {
+                series.alerting = false;
+            } else if (!series.alerting) {
+                series.alerting = true;
+                alert(series.name, slope, value);
+            }
+        }
+    }
+
+private:
+    struct Series {
+        const char* name;
+        uint64_t MallinfoRecord::* field;
+        unique_ptr<SlidingTrend> trend;
+        bool alerting;
+    };
+
+    void alert(const char* name, double slope, uint64_t value) {
+        fprintf(stderr, "mallinfo-log: ALERT: %s grows %.2f MB/hour over the last %u s (now %.2f MB)\n", name,
+                slope * 3600 / 1e6, environment.mallinfoLogTrendWindow, value / 1e6);
+        if (environment.mallinfoLogAlertHook.empty())
+            return;
+
+        char slopeArgument[32];
+        char valueArgument[32];
+        snprintf(slopeArgument, sizeof(slopeArgument), "%.0f", slope * 3600);
+        snprintf(valueArgument, sizeof(valueArgument), "%" PRIu64, value);
+        const char* arguments[] = { "sh", "-c", environment.mallinfoLogAlertHook.c_str(), "mallinfo-log-alert", name,
+                                    slopeArgument, valueArgument, nullptr };
+        // The hook must not be sampled itself.
+        vector<char*> hookEnvironment;
+        for (char** variable = environ; *variable; variable++) {
+            if (strncmp(*variable, "LD_PRELOAD=", strlen("LD_PRELOAD=")) != 0)
+                hookEnvironment.push_back(*variable);
+        }
+        hookEnvironment.push_back(nullptr);
+        pid_t pid;
+        int error = posix_spawn(&pid, "/bin/sh", nullptr, nullptr, const_cast<char**>(arguments), hookEnvironment.data());
+        if (error)
+            fprintf(stderr, "mallinfo-log: could not run the alert hook: %s\n", strerror(error));
+        else
+            m_hooks.push_back(pid);
+    }
+
+    void reapHooks() {
+        for (size_t i = 0; i < m_hooks.size();) {
+            if (waitpid(m_hooks[i], nullptr, WNOHANG) != 0) {
+                m_hooks[i] = m_hooks.back();
+                m_hooks.pop_back();
+            } else {
+                i++;
+            }
+        }
+    }
+
+    uint64_t m_warmUpEnd;
+    double m_threshold; // bytes/s
+    Series m_series[4] = {
+        { "RSS", &MallinfoRecord::rss, nullptr, false },
+        { "Anon RSS", &MallinfoRecord::rssAnon, nullptr, false },
+        { "Used chunks size", &MallinfoRecord::uordblks, nullptr, false },
+        { "Free chunks size", &MallinfoRecord::fordblks, nullptr, false },
+    };
+    vector<pid_t> m_hooks;
+};
+
+/** Breaks the free memory of malloc down per arena and per bin, from malloc_info(), into
+ * /tmp/memory-<program>-<pid>.arenas. With MALLINFO_LOG_TRIM_THRESHOLD_MB, calls malloc_trim() when the arenas hold
+ * more free memory than that, and logs how much RSS it gave back. */
+class ArenaAnalysis {
+public:
+    ArenaAnalysis(FILE* log, ProcessMemoryReader& processMemoryReader)
+        : m_log(log)
+        , m_processMemoryReader(processMemoryReader)
+        , m_trimThreshold(environment.mallinfoLogTrimThreshold * 1000000ull)
+    {
+        fprintf(m_log,
+                "# arena\t<time>\t<arena>\t<address space>\t<free bytes>\t<free chunks>\t<fastbin bytes>\t<free ratio>\n"
+                "# bin\t<time>\t<arena>\t<from>\t<to>\t<free chunks>\t<free bytes>\n"
+                "# trim\t<time>\t<free bytes>\t<RSS before>\t<RSS after>\t<reclaimed>\n");
+        fflush(m_log);
+    }
+
+    void run(uint64_t timestamp) {
+        if (!readMallocArenaStats(m_arenas)) {
+            fprintf(stderr, "mallinfo-log: could not parse malloc_info()\n");
+            return;
+        }
+        double time = timestamp / 1e9;
+        uint64_t freeBytes = 0;
+        for (const MallocArenaStats& arena : m_arenas) {
+            freeBytes += arena.freeBytes();
+            fprintf(m_log, "arena\t%.6f\t%u\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%.3f\n", time,
+                    arena.number, arena.addressSpace, arena.freeBytes(), arena.freeCount(), arena.fastBytes,
+                    arena.addressSpace ? static_cast<double>(arena.freeBytes()) / arena.addressSpace : 0);
+            for (const MallocBinStats& bin : arena.bins) {
+                fprintf(m_log, "bin\t%.6f\t%u\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "%s\n", time,
+                        arena.number, bin.from, bin.to, bin.count, bin.total, bin.unsorted ? "\tunsorted" : "");
+            }
+        }
+
+        // Free chunks are not all resident, so this overestimates what a trim can give back, but only the chunks
+        // malloc_trim() finds resident are released (MADV_DONTNEED), and the reclaimed RSS is measured. Trimmed
+        // chunks stay free, so the next trim waits for as much free memory again.
+        if (freeBytes < m_trimmedFreeBytes)
+            m_trimmedFreeBytes = freeBytes;
+        if (m_trimThreshold && freeBytes - m_trimmedFreeBytes >= m_trimThreshold) {
+            MallinfoRecord before, after;
+            m_processMemoryReader.readStatm(before);
+            malloc_trim(0);
+            m_processMemoryReader.readStatm(after);
+            int64_t reclaimed = static_cast<int64_t>(before.rss) - static_cast<int64_t>(after.rss);
+            fprintf(m_log, "trim\t%.6f\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRId64 "\n", time, freeBytes,
+                    before.rss, after.rss, reclaimed);
+            m_trimmedFreeBytes = freeBytes;
+        }
+        fflush(m_log);
+    }
+
+private:
+    FILE* m_log;
+    ProcessMemoryReader& m_processMemoryReader;
+    uint64_t m_trimThreshold;
+    uint64_t m_trimmedFreeBytes = 0; // Free memory after the last trim.
+    vector<MallocArenaStats> m_arenas;
+};
+
+static string buildMemoryReportPath(const char* extension) {
     stringstream ss;
-    ss << "/tmp/memory-" << program_invocation_short_name << "-" << getpid();
+    ss << "/tmp/memory-" << program_invocation_short_name << "-" << getpid() << extension;
     return ss.str();
 }
 
 static void mallinfoThreadMain() {
-    ofstream memoryUsageStream(buildMemoryReportPath(), ofstream::trunc);
-    memoryUsageStream
-        << "#Time\t"
-        "Total RSS\t"
-        "Total Anon RSS\t"
-        "Arenas size\t"
-        "Num free chunks\t"
-        "Num mmap chunks\t"
-        "mmaps size\t"
-        "Used chunks size\t"
-        "Free chunks size\t"
-        "Top chunk size" << endl;
+    int fd = open(buildMemoryReportPath(".bin").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("mallinfo-log: open memory report");
+        return;
+    }
+    MallinfoLogHeader header;
+    memcpy(header.magic, MallinfoLogMagic, sizeof(header.magic));
+    header.version = MallinfoLogVersion;
+    header.recordSize = sizeof(MallinfoRecord);
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+        perror("mallinfo-log: write memory report");
+        return;
+    }
 
+    ProcessMemoryReader processMemoryReader;
+    unique_ptr<GrowthAlerts> growthAlerts;
+    if (environment.mallinfoLogAlertSlope)
+        growthAlerts.reset(new GrowthAlerts(monotonicTimeNs()));
+    unique_ptr<ArenaAnalysis> arenaAnalysis;
+    if (FILE* arenaLog = fopen(buildMemoryReportPath(".arenas").c_str(), "we"))
+        arenaAnalysis.reset(new ArenaAnalysis(arenaLog, processMemoryReader));
+    else
+        perror("mallinfo-log: open arena report");
+    const uint64_t arenaInterval = environment.mallinfoLogArenaInterval * 1000000ull;
+    uint64_t nextArenaAnalysis = monotonicTimeNs() + arenaInterval;
+    MallinfoRecord record;
+    const uint64_t interval = environment.mallinfoLogInterval * 1000000ull;
+    const uint64_t rollupInterval = environment.mallinfoLogRollupInterval * 1000000ull;
+    uint64_t nextRollup = 0;
+    // Samples are taken at absolute deadlines, so that the time spent sampling doesn't shift the next ones.
+    timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
     while (true) {
-        sleep(5);
-        double time = getTime();
-        struct mallinfo info = mallinfo();
-        ProcessStatus processStatus = readProcessStatus();
-        memoryUsageStream
-            << time << "\t"
-            << 1024 * processStatus.VmRSS << "\t"
-            << 1024 * processStatus.RssAnon << "\t"
-            << info.arena << "\t"
-            << info.ordblks << "\t"
-            << info.hblks << "\t"
-            << info.hblkhd << "\t"
-            << info.uordblks << "\t"
-            << info.fordblks << "\t"
-            << info.keepcost << endl;
+        deadline.tv_nsec += interval % 1000000000;
+        deadline.tv_sec += interval / 1000000000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR) {}
+
+        record.timestamp = monotonicTimeNs();
+        processMemoryReader.readStatm(record);
+        // smaps_rollup walks the page tables of the whole process: the last values are repeated in between.
+        if (record.timestamp >= nextRollup) {
+            processMemoryReader.readSmapsRollup(record);
+            nextRollup = record.timestamp + rollupInterval;
+        }
+        readMallinfo(record);
+        if (growthAlerts)
+            growthAlerts->add(record);
+        // malloc_info() locks every arena in turn: it's run much less often than the rest.
+        if (arenaAnalysis && record.timestamp >= nextArenaAnalysis) {
+            arenaAnalysis->run(record.timestamp);
+            nextArenaAnalysis = record.timestamp + arenaInterval;
+        }
+        // One write() per record: samples are not lost if the process is killed.
+        if (write(fd, &record, sizeof(record)) != sizeof(record)) {
+            perror("mallinfo-log: write memory report");
+            return;
+        }
     }
 }
 
@@ -86,4 +329,5 @@ static thread* mallinfoThread = nullptr;
 
 __attribute__((constructor)) void mallinfoLogInit(void) {
     mallinfoThread = new thread(mallinfoThreadMain);
+    pthread_setname_np(mallinfoThread->native_handle(), "mallinfo-log");
 }
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstdint>
+using namespace std;
+
+/** Binary format of the memory report of mallinfo-log (/tmp/memory-<program>-<pid>.bin): a MallinfoLogHeader
+ * followed by one MallinfoRecord per sample, in the byte order of the host. mallinfo-log-convert turns it into the
+ * TSV read by mallinfo-plot. */
+
+static const char MallinfoLogMagic[8] = { 'M', 'A', 'L', 'L', 'I', 'N', 'F', 'O' };
+static const uint32_t MallinfoLogVersion = 1;
+
+struct MallinfoLogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+};
+
+// Values that couldn't be read, e.g. PSS on kernels without /proc/self/smaps_rollup.
+static const uint64_t MallinfoUnknown = UINT64_MAX;
+
+struct MallinfoRecord {
+    uint64_t timestamp; // CLOCK_MONOTONIC, in nanoseconds
+
+    // From /proc/self/statm, in bytes.
+    uint64_t rss;
+    uint64_t rssAnon;
+    // From /proc/self/smaps_rollup, in bytes. Read less often than the rest, see MALLINFO_LOG_ROLLUP_INTERVAL_MS.
+    uint64_t pss;
+    uint64_t swap;
+
+    // From mallinfo2().
+    uint64_t arena; // Size of the arenas
+    uint64_t ordblks; // Number of free chunks
+    uint64_t hblks; // Number of mmap'ed chunks
+    uint64_t hblkhd; // Size of the mmap'ed chunks
+    uint64_t uordblks; // Size of the used chunks
+    uint64_t fordblks; // Size of the free chunks
+    uint64_t keepcost; // Size of the top chunk
+};
+
+static_assert(sizeof(MallinfoRecord) == 96, "MallinfoRecord should be packed in 96 bytes");
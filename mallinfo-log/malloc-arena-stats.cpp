@@ -0,0 +1,115 @@
+#include "malloc-arena-stats.h"
+#include <malloc.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+// One element of the XML of malloc_info(): "<name attribute="value" .../>", or "</name>". The format is simple and
+// fixed, without text content, escapes or comments.
+struct Tag {
+    const char* name;
+    size_t nameLength;
+    bool closing;
+    const char* attributes;
+    const char* end;
+
+    bool is(const char* expected) const {
+        return strlen(expected) == nameLength && !memcmp(name, expected, nameLength);
+    }
+
+    // Value of a numeric attribute, or 0.
+    uint64_t number(const char* attribute) const {
+        const char* value = this->value(attribute);
+        return value ? strtoull(value, nullptr, 10) : 0;
+    }
+
+    bool has(const char* attribute, const char* expected) const {
+        const char* value = this->value(attribute);
+        size_t length = strlen(expected);
+        return value && !strncmp(value, expected, length) && value[length] == '"';
+    }
+
+private:
+    const char* value(const char* attribute) const {
+        size_t length = strlen(attribute);
+        for (const char* position = attributes; position < end; position++) {
+            position = strstr(position, attribute);
+            if (!position || position >= end)
+                return nullptr;
+            if (position[-1] == ' ' && position[length] == '=' && position[length + 1] == '"')
+                return position + length + 2;
+        }
+        return nullptr;
+    }
+};
+
+bool nextTag(const char*& position, Tag* tag) {
+    const char* start = strchr(position, '<');
+    if (!start)
+        return false;
+    const char* end = strchr(start, '>');
+    if (!end)
+        return false;
+    tag->closing = start[1] == '/';
+    tag->name = start + 1 + tag->closing;
+    tag->nameLength = strcspn(tag->name, " />");
+    tag->attributes = tag->name + tag->nameLength;
+    tag->end = end;
+    position = end + 1;
+    return true;
+}
+
+}
+
+bool parseMallocInfo(const char* xml, vector<MallocArenaStats>& arenas) {
+    arenas.clear();
+    const char* position = xml;
+    Tag tag;
+    if (!nextTag(position, &tag) || !tag.is("malloc"))
+        return false;
+    MallocArenaStats* arena = nullptr;
+    while (nextTag(position, &tag)) {
+        if (tag.is("heap")) {
+            if (tag.closing) {
+                arena = nullptr;
+            } else {
+                arenas.emplace_back();
+                arena = &arenas.back();
+                arena->number = tag.number("nr");
+            }
+        } else if (tag.is("malloc") && tag.closing) {
+            return true;
+        } else if (!arena || tag.closing) {
+            // The totals of all the arenas follow them.
+            continue;
+        } else if (tag.is("size") || tag.is("unsorted")) {
+            arena->bins.push_back(MallocBinStats { tag.number("from"), tag.number("to"), tag.number("total"),
+                                                   tag.number("count"), tag.is("unsorted") });
+        } else if (tag.is("total") && tag.has("type", "fast")) {
+            arena->fastCount = tag.number("count");
+            arena->fastBytes = tag.number("size");
+        } else if (tag.is("total") && tag.has("type", "rest")) {
+            arena->restCount = tag.number("count");
+            arena->restBytes = tag.number("size");
+        } else if (tag.is("aspace") && tag.has("type", "total")) {
+            arena->addressSpace = tag.number("size");
+        }
+    }
+    // Truncated.
+    return false;
+}
+
+bool readMallocArenaStats(vector<MallocArenaStats>& arenas) {
+    char* xml = nullptr;
+    size_t size = 0;
+    FILE* stream = open_memstream(&xml, &size);
+    if (!stream)
+        return false;
+    bool ok = malloc_info(0, stream) == 0;
+    fclose(stream);
+    ok = ok && parseMallocInfo(xml, arenas);
+    free(xml);
+    return ok;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+using namespace std;
+
+// Free chunks of one bin, or of the unsorted bin, of an arena.
+struct MallocBinStats {
+    uint64_t from; // Chunk sizes, in bytes
+    uint64_t to;
+    uint64_t total; // Bytes in the free chunks
+    uint64_t count;
+    bool unsorted;
+};
+
+/** Statistics of one glibc malloc arena, as reported by malloc_info(). Chunks cached in the tcache of a thread count
+ * as used. */
+struct MallocArenaStats {
+    unsigned number = 0;
+    uint64_t fastCount = 0; // Free chunks in fastbins
+    uint64_t fastBytes = 0;
+    uint64_t restCount = 0; // Free chunks in the other bins, and the top chunk
+    uint64_t restBytes = 0;
+    uint64_t addressSpace = 0; // Memory mapped for the arena
+    vector<MallocBinStats> bins;
+
+    uint64_t freeBytes() const { return fastBytes + restBytes; }
+    uint64_t freeCount() const { return fastCount + restCount; }
+};
+
+/** Parses the XML written by malloc_info(). Returns false if it's not in the format of glibc. */
+bool parseMallocInfo(const char* xml, vector<MallocArenaStats>& arenas);
+
+// Calls malloc_info() and parses what it writes.
+bool readMallocArenaStats(vector<MallocArenaStats>& arenas);
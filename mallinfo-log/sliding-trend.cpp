@@ -0,0 +1,47 @@
+#include "sliding-trend.h"
+
+SlidingTrend::SlidingTrend(double window, size_t capacity)
+    : m_window(window)
+    , m_capacity(capacity < 2 ? 2 : capacity)
+    , m_samples(new Sample[m_capacity])
+{}
+
+void SlidingTrend::include(const Sample& sample, double sign) {
+    double time = sample.time - m_origin;
+    m_sumTime += sign * time;
+    m_sumValue += sign * sample.value;
+    m_sumTimeSquared += sign * time * time;
+    m_sumTimeValue += sign * time * sample.value;
+}
+
+void SlidingTrend::recompute() {
+    m_origin = m_samples[m_first].time;
+    m_sumTime = m_sumValue = m_sumTimeSquared = m_sumTimeValue = 0;
+    for (size_t i = 0; i < m_count; i++)
+        include(m_samples[(m_first + i) % m_capacity], 1);
+    m_droppedSinceRecompute = 0;
+}
+
+void SlidingTrend::add(double time, double value) {
+    while (m_count && (m_count == m_capacity || time - m_samples[m_first].time > m_window)) {
+        include(m_samples[m_first], -1);
+        m_first = (m_first + 1) % m_capacity;
+        m_count--;
+        m_droppedSinceRecompute++;
+    }
+    Sample& sample = m_samples[(m_first + m_count) % m_capacity];
+    sample = Sample { time, value };
+    if (!m_count++)
+        m_origin = time;
+    include(sample, 1);
+    if (m_droppedSinceRecompute >= m_count)
+        recompute();
+}
+
+double SlidingTrend::slope() const {
+    double count = m_count;
+    double denominator = count * m_sumTimeSquared - m_sumTime * m_sumTime;
+    if (m_count < 2 || denominator <= 0)
+        return 0;
+    return (count * m_sumTimeValue - m_sumTime * m_sumValue) / denominator;
+}
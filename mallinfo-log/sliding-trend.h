@@ -0,0 +1,46 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+
+/** Least-squares line of a series over a sliding time window, like the trend mallinfo-plot fits over a whole report,
+ * updated incrementally on every sample.
+ *
+ * The sums of the regression are kept relative to an origin within the window, and computed again from the samples
+ * every time the window has been replaced, so that rounding errors don't pile up over days. Samples are kept in a
+ * ring allocated upfront. */
+class SlidingTrend {
+public:
+    // `capacity` is the most samples the window can hold: older ones are dropped even if they're within it.
+    SlidingTrend(double window, size_t capacity);
+
+    void add(double time, double value);
+
+    // Units per second. 0 until there are two samples at different times.
+    double slope() const;
+    // Whether the samples cover the whole window.
+    bool full() const { return m_count && m_samples[newest()].time - m_samples[m_first].time >= m_window * 0.99; }
+    size_t size() const { return m_count; }
+
+private:
+    struct Sample {
+        double time;
+        double value;
+    };
+
+    size_t newest() const { return (m_first + m_count - 1) % m_capacity; }
+    void include(const Sample& sample, double sign);
+    void recompute();
+
+    double m_window;
+    size_t m_capacity;
+    std::unique_ptr<Sample[]> m_samples;
+    size_t m_first = 0;
+    size_t m_count = 0;
+    size_t m_droppedSinceRecompute = 0;
+
+    double m_origin = 0;
+    double m_sumTime = 0;
+    double m_sumValue = 0;
+    double m_sumTimeSquared = 0;
+    double m_sumTimeValue = 0;
+};
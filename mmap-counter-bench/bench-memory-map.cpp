@@ -0,0 +1,120 @@
+// Measures MemoryMap on synthetic streams of mapping changes shaped like those of big applications, with an
+// increasing number of live mappings:
+//
+// * tiles: fixed size mappings (64 KiB) unmapped and mapped again at other addresses, like compositor tiles.
+// * js-heap: big regions (1 MiB) getting pages unmapped and mapped back inside them, like a garbage collected heap
+//   giving back and reusing its pages, which keeps splitting slices.
+// * remap: mappings growing with mremap(), sometimes moving, like realloc() of big buffers.
+//
+// No memory is actually mapped, only MemoryMap is exercised.
+//
+// Usage: bench-memory-map [<operations>]
+#include "memory-map.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+using namespace std;
+
+static const intptr_t PageSize = 4096;
+static const intptr_t Base = 0x100000000000;
+
+static MMapAllocation allocation(intptr_t start, size_t size) {
+    // Stack traces would dominate the measure.
+    return MMapAllocation(start, size, NoStackTrace());
+}
+
+static void tiles(MemoryMap& map, size_t liveMappings, size_t operations, mt19937_64& random) {
+    const intptr_t tileSize = 16 * PageSize;
+    // Twice as many slots as live tiles, so that new tiles don't always land where the last one was unmapped.
+    vector<bool> mapped(2 * liveMappings);
+    for (size_t i = 0; i < liveMappings; i++) {
+        map.registerMap(allocation(Base + 2 * i * tileSize, tileSize));
+        mapped[2 * i] = true;
+    }
+    for (size_t i = 0; i < operations; i++) {
+        size_t slot;
+        do {
+            slot = random() % mapped.size();
+        } while (!mapped[slot]);
+        map.registerUnmap(Base + slot * tileSize, tileSize);
+        mapped[slot] = false;
+        do {
+            slot = random() % mapped.size();
+        } while (mapped[slot]);
+        map.registerMap(allocation(Base + slot * tileSize, tileSize));
+        mapped[slot] = true;
+    }
+}
+
+static void jsHeap(MemoryMap& map, size_t liveMappings, size_t operations, mt19937_64& random) {
+    const intptr_t regionPages = 256;
+    for (size_t i = 0; i < liveMappings; i++)
+        map.registerMap(allocation(Base + i * regionPages * PageSize, regionPages * PageSize));
+    for (size_t i = 0; i < operations; i++) {
+        intptr_t region = random() % liveMappings;
+        intptr_t pages = 1 + random() % 4;
+        intptr_t start = Base + (region * regionPages + random() % (regionPages - pages)) * PageSize;
+        map.registerUnmap(start, pages * PageSize);
+        // Pages are mapped back (MAP_FIXED) elsewhere in the region, as the heap grows again.
+        start = Base + (region * regionPages + random() % (regionPages - pages)) * PageSize;
+        map.registerMap(allocation(start, pages * PageSize));
+    }
+}
+
+static void remap(MemoryMap& map, size_t liveMappings, size_t operations, mt19937_64& random) {
+    // Mappings grow from 4 to at most 64 pages in slots of 64 pages. Full ones move to a free slot, starting again.
+    const intptr_t slotPages = 64;
+    vector<intptr_t> sizes(2 * liveMappings);
+    for (size_t i = 0; i < liveMappings; i++) {
+        sizes[2 * i] = 4;
+        map.registerMap(allocation(Base + 2 * i * slotPages * PageSize, 4 * PageSize));
+    }
+    for (size_t i = 0; i < operations; i++) {
+        size_t slot;
+        do {
+            slot = random() % sizes.size();
+        } while (!sizes[slot]);
+        intptr_t oldStart = Base + slot * slotPages * PageSize;
+        intptr_t oldSize = sizes[slot] * PageSize;
+        if (sizes[slot] < slotPages) {
+            intptr_t newPages = min(slotPages, sizes[slot] * 2);
+            map.registerRemap(oldStart, oldSize, oldStart, newPages * PageSize, false);
+            map.registerMap(allocation(oldStart + oldSize, (newPages - sizes[slot]) * PageSize));
+            sizes[slot] = newPages;
+        } else {
+            size_t newSlot;
+            do {
+                newSlot = random() % sizes.size();
+            } while (sizes[newSlot]);
+            map.registerRemap(oldStart, oldSize, Base + newSlot * slotPages * PageSize, 4 * PageSize, false);
+            sizes[slot] = 0;
+            sizes[newSlot] = 4;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t operations = argc > 1 ? atol(argv[1]) : 200000;
+
+    struct Stream {
+        const char* name;
+        void (*run)(MemoryMap&, size_t, size_t, mt19937_64&);
+    };
+    Stream streams[] = { { "tiles", tiles }, { "js-heap", jsHeap }, { "remap", remap } };
+
+    printf("%8s %8s %8s %12s\n", "stream", "mappings", "slices", "ns/op");
+    for (const Stream& stream : streams) {
+        for (size_t liveMappings : { 1000, 10000, 100000 }) {
+            mt19937_64 random(42);
+            MemoryMap map;
+            auto start = chrono::steady_clock::now();
+            stream.run(map, liveMappings, operations, random);
+            double nanoseconds = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+            printf("%8s %8zu %8zu %12.1f\n", stream.name, liveMappings, map.size(),
+                   nanoseconds / (liveMappings + operations));
+        }
+    }
+    return 0;
+}
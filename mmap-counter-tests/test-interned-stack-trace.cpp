@@ -0,0 +1,109 @@
+#include "interned-stack-trace.h"
+#include "call-site-cache.h"
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+__attribute__((noinline)) static InternedStackTrace captureFromA() {
+    InternedStackTrace stackTrace;
+    asm volatile("" ::: "memory");
+    return stackTrace;
+}
+
+__attribute__((noinline)) static InternedStackTrace captureFromB() {
+    InternedStackTrace stackTrace;
+    asm volatile("" ::: "memory");
+    return stackTrace;
+}
+
+TEST(InternedStackTraceTest, SameStackIsShared) {
+    size_t internedBefore = InternedStackTrace::internedCount();
+    {
+        std::vector<InternedStackTrace> stackTraces;
+        for (int i = 0; i < 2; i++)
+            stackTraces.push_back(captureFromA());
+        EXPECT_EQ(&stackTraces[0].get(), &stackTraces[1].get());
+        EXPECT_EQ(InternedStackTrace::internedCount(), internedBefore + 1);
+    }
+    // Dropped from the table with the last reference.
+    EXPECT_EQ(InternedStackTrace::internedCount(), internedBefore);
+}
+
+TEST(InternedStackTraceTest, DifferentStacksAreNotShared) {
+    InternedStackTrace a = captureFromA();
+    InternedStackTrace b = captureFromB();
+    EXPECT_NE(&a.get(), &b.get());
+    EXPECT_FALSE(a.get() == b.get());
+}
+
+TEST(InternedStackTraceTest, CopiesKeepTheTraceInterned) {
+    size_t internedBefore = InternedStackTrace::internedCount();
+    std::unique_ptr<InternedStackTrace> copy;
+    {
+        InternedStackTrace original = captureFromA();
+        copy.reset(new InternedStackTrace(original));
+        EXPECT_EQ(&copy->get(), &original.get());
+    }
+    EXPECT_EQ(InternedStackTrace::internedCount(), internedBefore + 1);
+    copy.reset();
+    EXPECT_EQ(InternedStackTrace::internedCount(), internedBefore);
+}
+
+TEST(InternedStackTraceTest, ConcurrentCaptures) {
+    size_t internedBefore = InternedStackTrace::internedCount();
+    std::vector<std::unique_ptr<InternedStackTrace>> firstTraces(8);
+    std::vector<int> mismatches(firstTraces.size());
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < firstTraces.size(); t++) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < 1000; i++) {
+                // Traces of B keep being added to and dropped from the table by all the threads.
+                InternedStackTrace a = captureFromA();
+                InternedStackTrace b = captureFromB();
+                if (!firstTraces[t])
+                    firstTraces[t].reset(new InternedStackTrace(a));
+                if (&a.get() != &firstTraces[t]->get() || &a.get() == &b.get())
+                    mismatches[t]++;
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+    for (size_t t = 0; t < firstTraces.size(); t++) {
+        EXPECT_EQ(mismatches[t], 0);
+        // All the threads were started the same way, so their stacks are the same.
+        EXPECT_EQ(&firstTraces[t]->get(), &firstTraces[0]->get());
+    }
+    EXPECT_EQ(InternedStackTrace::internedCount(), internedBefore + 1);
+}
+
+TEST(CallSiteCacheTest, FingerprintsTellSizeClassesApart) {
+    static int callSite;
+    EXPECT_EQ(CallSiteCache::fingerprint(&callSite, 4096), CallSiteCache::fingerprint(&callSite, 8191));
+    EXPECT_NE(CallSiteCache::fingerprint(&callSite, 4096), CallSiteCache::fingerprint(&callSite, 8192));
+    EXPECT_NE(CallSiteCache::fingerprint(&callSite, 4096), CallSiteCache::fingerprint(&callSite + 1, 4096));
+}
+
+TEST(CallSiteCacheTest, KnownCallSitesShareTheirTrace) {
+    CallSiteCache cache(64);
+    static int callSite;
+    uint64_t fingerprint = CallSiteCache::fingerprint(&callSite, 4096);
+    EXPECT_TRUE(cache.find(fingerprint).empty());
+
+    InternedStackTrace stackTrace = captureFromA();
+    cache.insert(fingerprint, stackTrace);
+    EXPECT_EQ(cache.size(), 1);
+    InternedStackTrace found = cache.find(fingerprint);
+    ASSERT_FALSE(found.empty());
+    EXPECT_EQ(&found.get(), &stackTrace.get());
+    EXPECT_TRUE(cache.find(CallSiteCache::fingerprint(&callSite, 1 << 20)).empty());
+}
+
+TEST(CallSiteCacheTest, FullCacheKeepsItsEntries) {
+    // One entry per shard.
+    CallSiteCache cache(16);
+    InternedStackTrace stackTrace = captureFromA();
+    for (uintptr_t callSite = 0x1000; callSite < 0x1000 + 1000 * 16; callSite += 16)
+        cache.insert(CallSiteCache::fingerprint(reinterpret_cast<void*>(callSite), 4096), stackTrace);
+    EXPECT_EQ(cache.size(), 16);
+}
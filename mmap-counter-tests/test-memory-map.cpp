@@ -1,6 +1,9 @@
 #define MMAP_COUNTER_TESTS
 #include "memory-map.h"
 #include <gtest/gtest.h>
+#include <random>
+#include <set>
+#include <vector>
 
 class MemoryMapTest: public ::testing::Test {
 };
@@ -154,6 +157,241 @@ TEST_F(MemoryMapTest, DoubleDeallocationWithHolePartialEnd) {
     EXPECT_EQ(map.at(25).end(), 30);
 }
 
+TEST_F(MemoryMapTest, MapReplacesOverlappingSlices) {
+    MemoryMap map;
+    map.registerMap(MMapAllocation(10, 20));
+    EXPECT_TRUE(map.registerMap(MMapAllocation(20, 20)));
+    EXPECT_EQ(map.size(), 2);
+    EXPECT_EQ(map.at(10).end(), 20);
+    EXPECT_EQ(map.at(20).end(), 40);
+    EXPECT_FALSE(map.registerMap(MMapAllocation(50, 10)));
+}
+
+TEST_F(MemoryMapTest, ReservedMemoryIsNotCounted) {
+    MemoryMap map;
+    map.registerMap(MMapAllocation(10, 20), MemorySlice::Reserved);
+    EXPECT_FALSE(map.at(10).counted());
+    EXPECT_FALSE(map.registerUnmap(10, 20));
+    EXPECT_EQ(map.size(), 0);
+}
+
+TEST_F(MemoryMapTest, CommittingPartOfAReservation) {
+    MemoryMap map;
+    map.registerMap(MMapAllocation(10, 20), MemorySlice::Reserved);
+    EXPECT_TRUE(map.containsSlicesIn(15, 5, MemorySlice::Reserved));
+    EXPECT_FALSE(map.containsSlicesIn(15, 5, MemorySlice::Committed));
+    MMapAllocation allocation(15, 5);
+    auto committed = map.changeState(15, 5, MemorySlice::Reserved, MemorySlice::Committed, &allocation);
+    ASSERT_EQ(committed.size(), 1);
+    EXPECT_EQ(committed[0].start, 15);
+    EXPECT_EQ(committed[0].size, 5);
+    EXPECT_EQ(map.size(), 3);
+    EXPECT_EQ(map.at(10).state, MemorySlice::Reserved);
+    EXPECT_EQ(map.at(15).state, MemorySlice::Committed);
+    EXPECT_NE(map.at(15).allocation, map.at(10).allocation);
+    EXPECT_EQ(map.allocation(map.at(15)).originalStart, 15);
+    EXPECT_EQ(map.allocationCount(), 2);
+    EXPECT_EQ(map.at(20).state, MemorySlice::Reserved);
+    EXPECT_EQ(map.at(20).end(), 30);
+}
+
+TEST_F(MemoryMapTest, ReleasingSkipsUncountedSlices) {
+    MemoryMap map;
+    map.registerMap(MMapAllocation(10, 10));
+    map.registerMap(MMapAllocation(20, 10), MemorySlice::Reserved);
+    auto released = map.changeState(15, 10, MemorySlice::Committed, MemorySlice::Released);
+    ASSERT_EQ(released.size(), 1);
+    EXPECT_EQ(released[0].start, 15);
+    EXPECT_EQ(released[0].size, 5);
+    EXPECT_EQ(map.at(20).state, MemorySlice::Reserved);
+    EXPECT_TRUE(map.changeState(15, 10, MemorySlice::Committed, MemorySlice::Released).empty());
+}
+
+TEST_F(MemoryMapTest, RemapMovesSlices) {
+    MemoryMap map;
+    map.registerMap(MMapAllocation(10, 10));
+    map.registerMap(MMapAllocation(20, 10));
+    auto firstAllocation = map.at(10).allocation;
+    MemoryMap::Remap remap = map.registerRemap(10, 20, 100, 30, false);
+    EXPECT_TRUE(remap.unmappedCountedMemory);
+    EXPECT_FALSE(remap.replacedCountedMemory);
+    ASSERT_EQ(remap.movedSlices.size(), 2);
+    EXPECT_EQ(map.size(), 2);
+    EXPECT_EQ(map.at(100).end(), 110);
+    EXPECT_EQ(map.at(100).allocation, firstAllocation);
+    EXPECT_EQ(map.at(110).end(), 120);
+    EXPECT_EQ(map.find(10), map.end());
+}
+
+TEST_F(MemoryMapTest, RemapShrinksInPlace) {
+    MemoryMap map;
+    map.registerMap(MMapAllocation(10, 10));
+    map.registerMap(MMapAllocation(20, 10));
+    MemoryMap::Remap remap = map.registerRemap(10, 20, 10, 15, false);
+    ASSERT_EQ(remap.movedSlices.size(), 2);
+    EXPECT_EQ(remap.movedSlices[1].size, 5);
+    EXPECT_EQ(map.size(), 2);
+    EXPECT_EQ(map.at(10).end(), 20);
+    EXPECT_EQ(map.at(20).end(), 25);
+}
+
+TEST_F(MemoryMapTest, RemapKeepingTheOldRange) {
+    MemoryMap map;
+    map.registerMap(MMapAllocation(10, 10));
+    map.registerMap(MMapAllocation(100, 10));
+    MemoryMap::Remap remap = map.registerRemap(10, 10, 100, 10, true);
+    EXPECT_TRUE(remap.unmappedCountedMemory);
+    EXPECT_TRUE(remap.replacedCountedMemory);
+    EXPECT_EQ(map.size(), 2);
+    EXPECT_EQ(map.at(10).state, MemorySlice::Released);
+    EXPECT_EQ(map.at(100).state, MemorySlice::Committed);
+}
+
+TEST_F(MemoryMapTest, RemapOfUnknownMemory) {
+    MemoryMap map;
+    MemoryMap::Remap remap = map.registerRemap(10, 10, 100, 20, false);
+    EXPECT_FALSE(remap.unmappedCountedMemory);
+    EXPECT_TRUE(remap.movedSlices.empty());
+    EXPECT_EQ(map.size(), 0);
+}
+
+TEST_F(MemoryMapTest, RandomOperationsMatchAPageModel) {
+    // Enough slices to need several blocks. Every page records the original start of its allocation and its state.
+    const intptr_t pages = 4096;
+    struct Page {
+        intptr_t allocation = -1;
+        MemorySlice::State state = MemorySlice::Committed;
+    };
+    std::vector<Page> model(pages);
+    MemoryMap map;
+    std::mt19937 random(7);
+    for (int operation = 0; operation < 20000; operation++) {
+        intptr_t start = random() % pages;
+        intptr_t size = 1 + random() % std::min<intptr_t>(64, pages - start);
+        switch (random() % 4) {
+        case 0:
+            map.registerMap(MMapAllocation(start, size, NoStackTrace()));
+            for (intptr_t page = start; page < start + size; page++)
+                model[page] = Page { start, MemorySlice::Committed };
+            break;
+        case 1:
+            map.registerUnmap(start, size);
+            for (intptr_t page = start; page < start + size; page++)
+                model[page] = Page();
+            break;
+        case 2:
+            map.changeState(start, size, MemorySlice::Committed, MemorySlice::Released);
+            for (intptr_t page = start; page < start + size; page++) {
+                if (model[page].allocation >= 0)
+                    model[page].state = MemorySlice::Released;
+            }
+            break;
+        case 3: {
+            intptr_t newStart = random() % (pages - size);
+            if (newStart < start + size && start < newStart + size)
+                break;
+            map.registerRemap(start, size, newStart, size, false);
+            std::vector<Page> moved(model.begin() + start, model.begin() + start + size);
+            for (intptr_t page = start; page < start + size; page++)
+                model[page] = Page();
+            std::copy(moved.begin(), moved.end(), model.begin() + newStart);
+            break;
+        }
+        }
+    }
+
+    std::vector<Page> actual(pages);
+    std::set<intptr_t> allocations;
+    intptr_t previousEnd = 0;
+    size_t slices = 0;
+    for (const MemorySlice& slice : map) {
+        ASSERT_GE(slice.start, previousEnd);
+        ASSERT_GT(slice.size, 0);
+        previousEnd = slice.end();
+        allocations.insert(map.allocation(slice).originalStart);
+        for (intptr_t page = slice.start; page < slice.end(); page++)
+            actual[page] = Page { map.allocation(slice).originalStart, slice.state };
+        slices++;
+    }
+    EXPECT_EQ(slices, map.size());
+    for (intptr_t page = 0; page < pages; page++) {
+        EXPECT_EQ(actual[page].allocation, model[page].allocation) << "page " << page;
+        EXPECT_EQ(actual[page].state, model[page].state) << "page " << page;
+    }
+    // Allocations are freed with their last slice. Different allocations may share an original start.
+    EXPECT_GE(map.allocationCount(), allocations.size());
+    EXPECT_LE(map.allocationCount(), map.size());
+
+    // Every released page is in the index of released ranges, pruned or not.
+    for (int pruned = 0; pruned < 2; pruned++) {
+        std::vector<bool> indexed(pages, false);
+        for (const auto& range : map.releasedRanges()) {
+            for (intptr_t page = range.first; page < range.first + static_cast<intptr_t>(range.second); page++)
+                indexed[page] = true;
+        }
+        for (intptr_t page = 0; page < pages; page++) {
+            if (model[page].allocation >= 0 && model[page].state == MemorySlice::Released) {
+                EXPECT_TRUE(indexed[page]) << "page " << page;
+            }
+        }
+        map.pruneReleasedRanges();
+    }
+}
+
+TEST_F(MemoryMapTest, ReleasedRangesAreIndexed) {
+    MemoryMap map;
+    map.registerMap(MMapAllocation(10, 100));
+    map.registerMap(MMapAllocation(200, 100));
+    EXPECT_TRUE(map.releasedRanges().empty());
+
+    map.changeState(20, 10, MemorySlice::Committed, MemorySlice::Released);
+    map.changeState(30, 10, MemorySlice::Committed, MemorySlice::Released);
+    uint64_t releaseCount = map.releaseCount();
+    map.changeState(250, 10, MemorySlice::Committed, MemorySlice::Released);
+    // Neighbouring ranges are merged.
+    typedef std::vector<std::pair<intptr_t, size_t>> Ranges;
+    EXPECT_EQ(map.releasedRanges(), Ranges({ { 20, 20 }, { 250, 10 } }));
+    EXPECT_FALSE(map.releasedSince(20, 20, releaseCount));
+    EXPECT_TRUE(map.releasedSince(255, 1, releaseCount));
+
+    // Reused or unmapped, then forgotten.
+    map.changeState(20, 20, MemorySlice::Released, MemorySlice::Committed);
+    map.registerUnmap(200, 100);
+    EXPECT_EQ(map.releasedRanges().size(), 2u);
+    map.pruneReleasedRanges();
+    EXPECT_TRUE(map.releasedRanges().empty());
+}
+
+TEST_F(MemoryMapTest, ReleasedSlicesMovedByRemapAreIndexed) {
+    MemoryMap map;
+    map.registerMap(MMapAllocation(10, 20));
+    map.changeState(10, 20, MemorySlice::Committed, MemorySlice::Released);
+    uint64_t releaseCount = map.releaseCount();
+    map.registerRemap(10, 20, 100, 20, false);
+    map.pruneReleasedRanges();
+    typedef std::vector<std::pair<intptr_t, size_t>> Ranges;
+    EXPECT_EQ(map.releasedRanges(), Ranges({ { 100, 20 } }));
+    // The pages at the new address were not polled before the move.
+    EXPECT_TRUE(map.releasedSince(100, 20, releaseCount));
+}
+
+TEST_F(MemoryMapTest, ForEachSliceIn) {
+    MemoryMap map;
+    map.registerMap(MMapAllocation(10, 10, 1u));
+    map.registerMap(MMapAllocation(30, 10, 2u));
+    map.registerMap(MMapAllocation(50, 10, 3u));
+    std::vector<uint32_t> stackIds;
+    map.forEachSliceIn(15, 20, [&](const MemorySlice& slice, const MMapAllocation& allocation) {
+        stackIds.push_back(allocation.stackId);
+    });
+    EXPECT_EQ(stackIds, std::vector<uint32_t>({ 1, 2 }));
+    stackIds.clear();
+    map.forEachSliceIn(20, 10, [&](const MemorySlice& slice, const MMapAllocation& allocation) {
+        stackIds.push_back(allocation.stackId);
+    });
+    EXPECT_TRUE(stackIds.empty());
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -0,0 +1,139 @@
+#include "mmap-log-reader.h"
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+class MmapLogReaderTest: public ::testing::Test {
+protected:
+    void SetUp() override {
+        char path[] = "/tmp/mmap-log-reader-test-XXXXXX";
+        int fd = mkstemp(path);
+        ASSERT_GE(fd, 0);
+        close(fd);
+        m_path = path;
+    }
+    void TearDown() override {
+        unlink(m_path.c_str());
+    }
+
+    void write(const void* data, size_t size) {
+        FILE* file = fopen(m_path.c_str(), "wb");
+        ASSERT_EQ(fwrite(data, 1, size, file), size);
+        fclose(file);
+    }
+
+    vector<MmapEventRecord> readAll(unsigned threads, string* error = nullptr) {
+        string openError;
+        unique_ptr<MmapLogReader> reader = MmapLogReader::open(m_path, threads, &openError);
+        EXPECT_TRUE(reader) << openError;
+        vector<MmapEventRecord> all;
+        vector<MmapEventRecord> batch;
+        while (reader && reader->readBatch(batch))
+            all.insert(all.end(), batch.begin(), batch.end());
+        if (error && reader)
+            *error = reader->error();
+        return all;
+    }
+
+    string m_path;
+};
+
+static bool parse(const char* line, MmapEventRecord* record) {
+    return MmapLogReader::parseLine(line, line + strlen(line), record);
+}
+
+TEST(MmapLogParseLineTest, Map) {
+    MmapEventRecord record;
+    ASSERT_TRUE(parse("12.500000 MAP: 0x7f0000001000 (8192 bytes) stackTrace=3", &record));
+    EXPECT_EQ(record.type, MmapEventType::Map);
+    EXPECT_EQ(record.timestamp, 12500000000u);
+    EXPECT_EQ(record.address, 0x7f0000001000u);
+    EXPECT_EQ(record.length, 8192u);
+    EXPECT_EQ(record.stackId, 3u);
+    EXPECT_EQ(record.origin, MmapEventOrigin::Mmap);
+}
+
+TEST(MmapLogParseLineTest, UnmapWithOrigin) {
+    MmapEventRecord record;
+    ASSERT_TRUE(parse("1.23457e+06 UNMAP: 0xABC000 (4096 bytes) (madvise)", &record));
+    EXPECT_EQ(record.type, MmapEventType::Unmap);
+    EXPECT_EQ(record.timestamp, 1234570000000000u);
+    EXPECT_EQ(record.address, 0xabc000u);
+    EXPECT_EQ(record.origin, MmapEventOrigin::Madvise);
+}
+
+TEST(MmapLogParseLineTest, UnmapFailed) {
+    MmapEventRecord record;
+    ASSERT_TRUE(parse("3.000000 ERROR: UNMAP FAILED: 0x1000 (10 bytes)", &record));
+    EXPECT_EQ(record.type, MmapEventType::UnmapFailed);
+}
+
+TEST(MmapLogParseLineTest, Garbage) {
+    MmapEventRecord record;
+    EXPECT_FALSE(parse("", &record));
+    EXPECT_FALSE(parse("MAP: 0x1000 (10 bytes) stackTrace=1", &record));
+    EXPECT_FALSE(parse("1.0 MAP: 0x1000 (10 bytes)", &record));
+    EXPECT_FALSE(parse("1.0 MAP: 0x1000 (10 bytes) stackTrace=1 (nowhere)", &record));
+    EXPECT_FALSE(parse("1.0 UNMAP: 0x1000 (10 bytes) trailing", &record));
+}
+
+TEST_F(MmapLogReaderTest, TextLogInOrderWithManyThreads) {
+    string text;
+    for (int i = 0; i < 10000; i++) {
+        char line[128];
+        snprintf(line, sizeof(line), "%d.000000 %s: 0x%x (4096 bytes)%s\n", i, i % 2 ? "UNMAP" : "MAP", i * 4096,
+                 i % 2 ? "" : " stackTrace=1");
+        text += line;
+        if (i == 500)
+            text += "1.0 ERROR: UNMAP FAILED: 0x1000 (10 bytes)\n\n";
+    }
+    // The last line doesn't need a line feed.
+    text.pop_back();
+    write(text.data(), text.size());
+
+    vector<MmapEventRecord> events = readAll(7);
+    ASSERT_EQ(events.size(), 10000u);
+    for (uint64_t i = 0; i < events.size(); i++) {
+        EXPECT_EQ(events[i].timestamp, i * 1000000000);
+        EXPECT_EQ(events[i].address, i * 4096);
+        EXPECT_EQ(events[i].type, i % 2 ? MmapEventType::Unmap : MmapEventType::Map);
+    }
+}
+
+TEST_F(MmapLogReaderTest, TextLogErrorsSayWhichLine) {
+    const char text[] = "1.000000 MAP: 0x1000 (4096 bytes) stackTrace=1\nNew stack trace: 1\n";
+    write(text, strlen(text));
+    string error;
+    readAll(2, &error);
+    EXPECT_EQ(error, "line 2 is not an event: New stack trace: 1");
+}
+
+TEST_F(MmapLogReaderTest, BinaryLog) {
+    MmapEventLogHeader header;
+    memcpy(header.magic, MmapEventLogMagic, sizeof(header.magic));
+    header.version = MmapEventLogVersion;
+    header.recordSize = sizeof(MmapEventRecord);
+    MmapEventRecord records[3] = {
+        { 1, 0x1000, 4096, 1, MmapEventType::Map, MmapEventOrigin::Mmap },
+        { 2, 0x1000, 4096, 0, MmapEventType::UnmapFailed, MmapEventOrigin::Mmap },
+        { 3, 0x1000, 4096, 0, MmapEventType::Unmap, MmapEventOrigin::Mremap },
+    };
+    string data(reinterpret_cast<const char*>(&header), sizeof(header));
+    data.append(reinterpret_cast<const char*>(records), sizeof(records));
+    // Truncated by a crash.
+    data.append(10, '\0');
+    write(data.data(), data.size());
+
+    vector<MmapEventRecord> events = readAll(4);
+    ASSERT_EQ(events.size(), 2u);
+    EXPECT_EQ(events[0].timestamp, 1u);
+    EXPECT_EQ(events[1].timestamp, 3u);
+    EXPECT_EQ(events[1].origin, MmapEventOrigin::Mremap);
+}
+
+TEST_F(MmapLogReaderTest, EmptyLog) {
+    write("", 0);
+    EXPECT_TRUE(readAll(2).empty());
+}
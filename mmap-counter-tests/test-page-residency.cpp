@@ -0,0 +1,52 @@
+#include "page-residency.h"
+#include <gtest/gtest.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstring>
+
+class PageResidencyTest: public ::testing::Test {
+protected:
+    void SetUp() override {
+        memory = static_cast<char*>(mmap(nullptr, 4 * pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                                         -1, 0));
+        ASSERT_NE(memory, MAP_FAILED);
+        memset(memory, 1, 4 * pageSize);
+    }
+
+    void TearDown() override {
+        munmap(memory, 4 * pageSize);
+    }
+
+    std::vector<std::pair<intptr_t, size_t>> poll() {
+        return findResidentRanges({ { reinterpret_cast<intptr_t>(memory), 4 * pageSize } });
+    }
+
+    const size_t pageSize = sysconf(_SC_PAGE_SIZE);
+    char* memory = nullptr;
+};
+
+TEST_F(PageResidencyTest, ReleasedPagesAreFoundWhenTouchedAgain) {
+    ASSERT_TRUE(adviceReleasesPages(MADV_DONTNEED));
+    ASSERT_EQ(madvise(memory, 4 * pageSize, MADV_DONTNEED), 0);
+    EXPECT_TRUE(poll().empty());
+
+    memory[pageSize] = 1;
+    memory[2 * pageSize] = 1;
+    std::vector<std::pair<intptr_t, size_t>> resident = poll();
+    ASSERT_EQ(resident.size(), 1u);
+    EXPECT_EQ(resident[0].first, reinterpret_cast<intptr_t>(memory + pageSize));
+    EXPECT_EQ(resident[0].second, 2 * pageSize);
+}
+
+#ifdef MADV_FREE
+// The pages stay resident until the kernel needs them: were they counted as released, the next poll would log them
+// as reused, though nothing touched them.
+TEST_F(PageResidencyTest, FreedPagesAreNotReleased) {
+    if (madvise(memory, 4 * pageSize, MADV_FREE) != 0)
+        GTEST_SKIP() << "MADV_FREE is not supported";
+    EXPECT_FALSE(adviceReleasesPages(MADV_FREE));
+    std::vector<std::pair<intptr_t, size_t>> resident = poll();
+    ASSERT_EQ(resident.size(), 1u);
+    EXPECT_EQ(resident[0].second, 4 * pageSize);
+}
+#endif
@@ -0,0 +1,37 @@
+#include "call-site-cache.h"
+
+CallSiteCache::CallSiteCache(size_t capacity)
+    : m_shardCapacity(capacity / ShardCount)
+    , m_shards(new Shard[ShardCount])
+{}
+
+uint64_t CallSiteCache::fingerprint(const void* returnAddress, size_t size) {
+    // User space addresses fit in 56 bits, which leaves the top byte for the size class.
+    uint64_t sizeClass = 63 - __builtin_clzll(size | 1);
+    return reinterpret_cast<uintptr_t>(returnAddress) ^ (sizeClass << 56);
+}
+
+InternedStackTrace CallSiteCache::find(uint64_t fingerprint) {
+    Shard& shard = shardFor(fingerprint);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto iter = shard.stackTraces.find(fingerprint);
+    if (iter == shard.stackTraces.end())
+        return InternedStackTrace(NoStackTrace());
+    return iter->second;
+}
+
+void CallSiteCache::insert(uint64_t fingerprint, const InternedStackTrace& stackTrace) {
+    Shard& shard = shardFor(fingerprint);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.stackTraces.size() < m_shardCapacity)
+        shard.stackTraces.emplace(fingerprint, stackTrace);
+}
+
+size_t CallSiteCache::size() {
+    size_t size = 0;
+    for (size_t i = 0; i < ShardCount; i++) {
+        std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+        size += m_shards[i].stackTraces.size();
+    }
+    return size;
+}
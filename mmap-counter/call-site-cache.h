@@ -0,0 +1,46 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "interned-stack-trace.h"
+
+/** Interned stack traces of the call sites of mmap() already seen, so that mappings made again from them don't walk
+ * the stack.
+ *
+ * Call sites are told apart by a fingerprint of the return address of the wrapper and the size class of the mapping
+ * (its size rounded down to a power of two). This is much cheaper than unwinding, but all the mappings of similar
+ * size made by one call site get the stack trace of the first one, even if they were reached from other callers:
+ * an arena allocator or pthread_create() gets a single trace per size class. Hence it's only used with
+ * MMAP_CALL_SITE_CACHE=1.
+ *
+ * Entries are never evicted: once the cache is full, new call sites are always unwound. */
+class CallSiteCache {
+public:
+    // Rounded down to a multiple of the number of shards.
+    explicit CallSiteCache(size_t capacity);
+    CallSiteCache(const CallSiteCache&) = delete;
+    CallSiteCache& operator=(const CallSiteCache&) = delete;
+
+    static uint64_t fingerprint(const void* returnAddress, size_t size);
+
+    // The stack trace of the call site, or an empty one if it's not known.
+    InternedStackTrace find(uint64_t fingerprint);
+    void insert(uint64_t fingerprint, const InternedStackTrace& stackTrace);
+
+    size_t size();
+
+private:
+    static const size_t ShardCount = 16;
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, InternedStackTrace> stackTraces;
+    };
+
+    Shard& shardFor(uint64_t fingerprint) { return m_shards[(fingerprint * 0x9E3779B97F4A7C15ull) >> 60]; }
+
+    size_t m_shardCapacity;
+    std::unique_ptr<Shard[]> m_shards;
+};
@@ -0,0 +1,155 @@
+#include "event-log.h"
+#include "environment.h"
+#include "library-context.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <thread>
+#include <chrono>
+
+static uint64_t monotonicTimeNs() {
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec * 1000000000ull + tv.tv_nsec;
+}
+
+EventLog& EventLog::instance() {
+    // Leaked: mmap() and munmap() can still be called by other atexit handlers and destructors of static objects.
+    static EventLog* s_instance = new EventLog();
+    return *s_instance;
+}
+
+EventLog::EventLog()
+    : m_capacity(environment.mmapLogBufferCapacity)
+    , m_slots(new Slot[environment.mmapLogBufferCapacity])
+{
+    for (size_t i = 0; i < m_capacity; i++)
+        m_slots[i].sequence.store(i, memory_order_relaxed);
+    m_batch.reserve(m_capacity);
+
+    m_eventFd = open("/tmp/mmap-event-log.bin", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    m_stackFd = open("/tmp/mmap-stack-log", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_eventFd < 0 || m_stackFd < 0)
+        perror("mmap-counter: open log");
+
+    MmapEventLogHeader header;
+    memcpy(header.magic, MmapEventLogMagic, sizeof(header.magic));
+    header.version = MmapEventLogVersion;
+    header.recordSize = sizeof(MmapEventRecord);
+    writeAll(m_eventFd, &header, sizeof(header));
+
+    thread writer([this]() {
+        LibraryContext ctx;
+        writerMain();
+    });
+    pthread_setname_np(writer.native_handle(), "mmap-log-writer");
+    writer.detach();
+
+    atexit([]() {
+        LibraryContext ctx;
+        EventLog& eventLog = EventLog::instance();
+        if (auto task = eventLog.m_periodicTask.load())
+            task();
+        eventLog.flush();
+    });
+}
+
+bool EventLog::tryPush(const MmapEventRecord& record) {
+    size_t position = m_tail.load(memory_order_relaxed);
+    while (true) {
+        Slot& slot = m_slots[position & (m_capacity - 1)];
+        size_t sequence = slot.sequence.load(memory_order_acquire);
+        intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+        if (difference == 0) {
+            if (m_tail.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                slot.record = record;
+                slot.sequence.store(position + 1, memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            // The consumer has not freed this slot yet: the ring is full.
+            return false;
+        } else {
+            position = m_tail.load(memory_order_relaxed);
+        }
+    }
+}
+
+void EventLog::log(MmapEventType type, const void* address, size_t length, uint32_t stackId, MmapEventOrigin origin) {
+    MmapEventRecord record;
+    record.timestamp = monotonicTimeNs();
+    record.address = reinterpret_cast<uintptr_t>(address);
+    record.length = length;
+    record.stackId = stackId;
+    record.type = type;
+    record.origin = origin;
+    while (!tryPush(record))
+        flush();
+}
+
+void EventLog::logNewStackTrace(uint32_t stackId, const StackTrace& stackTrace) {
+    lock_guard<mutex> lock(m_newStackTracesMutex);
+    m_newStackTraces.emplace_back(stackId, stackTrace);
+}
+
+void EventLog::flush() {
+    lock_guard<mutex> lock(m_flushMutex);
+
+    vector<pair<uint32_t, StackTrace>> newStackTraces;
+    {
+        lock_guard<mutex> lock(m_newStackTracesMutex);
+        newStackTraces.swap(m_newStackTraces);
+    }
+    if (!newStackTraces.empty()) {
+        ostringstream text;
+        for (const auto& pair : newStackTraces)
+            text << "New stack trace: " << pair.first << "\n" << pair.second << "\n";
+        string lines = text.str();
+        writeAll(m_stackFd, lines.data(), lines.size());
+    }
+
+    // Records are consumed in order and the first one not written yet (by a producer that claimed its slot) ends the
+    // batch.
+    m_batch.clear();
+    while (true) {
+        Slot& slot = m_slots[m_head & (m_capacity - 1)];
+        if (slot.sequence.load(memory_order_acquire) != m_head + 1)
+            break;
+        m_batch.push_back(slot.record);
+        slot.sequence.store(m_head + m_capacity, memory_order_release);
+        m_head++;
+    }
+    if (!m_batch.empty())
+        writeAll(m_eventFd, m_batch.data(), m_batch.size() * sizeof(MmapEventRecord));
+}
+
+void EventLog::writerMain() {
+    while (true) {
+        this_thread::sleep_for(chrono::milliseconds(environment.mmapLogFlushInterval));
+        if (auto task = m_periodicTask.load())
+            task();
+        flush();
+    }
+}
+
+void EventLog::writeAll(int fd, const void* data, size_t size) {
+    if (fd < 0)
+        return;
+    const char* position = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t written = write(fd, position, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("mmap-counter: write log");
+            return;
+        }
+        position += written;
+        size -= written;
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "mmap-event-record.h"
+#include "stack-trace.h"
+using namespace std;
+
+/** Event log of mmap-counter.
+ *
+ * The wrappers only append fixed size binary records to a lock-free ring buffer. A writer thread wakes up every
+ * MMAP_LOG_FLUSH_INTERVAL_MS milliseconds and appends the records buffered since to /tmp/mmap-event-log.bin, with one
+ * write() for the whole batch, and the new stack traces to /tmp/mmap-stack-log. So the threads of the application
+ * calling mmap() never wait for the disk, except when the ring (MMAP_LOG_BUFFER_SIZE records) is full: then the
+ * caller writes the buffered records itself.
+ *
+ * The log is flushed at exit too. Must be used in library context. */
+class EventLog {
+public:
+    static EventLog& instance();
+
+    void log(MmapEventType type, const void* address, size_t length, uint32_t stackId = 0,
+             MmapEventOrigin origin = MmapEventOrigin::Mmap);
+
+    // Written to the stack log by the writer thread, in the text format it always had.
+    void logNewStackTrace(uint32_t stackId, const StackTrace& stackTrace);
+
+    // Writes everything buffered so far.
+    void flush();
+
+    // Called by the writer thread before every flush, and at exit, in library context.
+    void setPeriodicTask(void (*task)()) { m_periodicTask.store(task); }
+
+private:
+    EventLog();
+
+    // Multi-producer single-consumer bounded queue: each slot has a sequence number telling whether it is free for
+    // the producer of a given position or filled for the consumer (see Dmitry Vyukov's bounded MPMC queue).
+    struct Slot {
+        atomic<size_t> sequence;
+        MmapEventRecord record;
+    };
+
+    bool tryPush(const MmapEventRecord& record);
+    void writerMain();
+    void writeAll(int fd, const void* data, size_t size);
+
+    const size_t m_capacity;
+    Slot* const m_slots;
+    atomic<size_t> m_tail { 0 };
+
+    mutex m_flushMutex;
+    size_t m_head = 0; // Guarded by m_flushMutex.
+    int m_eventFd;
+    int m_stackFd;
+    vector<MmapEventRecord> m_batch;
+
+    atomic<void (*)()> m_periodicTask { nullptr };
+
+    mutex m_newStackTracesMutex;
+    vector<pair<uint32_t, StackTrace>> m_newStackTraces;
+};
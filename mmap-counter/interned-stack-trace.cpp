@@ -1,3 +1,71 @@
 #include "interned-stack-trace.h"
+#include <mutex>
+#include <unordered_map>
 
-std::unordered_map<size_t, std::shared_ptr<StackTrace>> InternedStackTrace::s_stackTraces;
+namespace {
+
+const size_t ShardCount = 16;
+
+struct Shard {
+    std::mutex mutex;
+    std::unordered_multimap<size_t, std::shared_ptr<StackTrace>> stackTraces;
+};
+
+Shard* shards() {
+    // Leaked: mappings may be unmapped by other threads while static objects are destroyed.
+    static Shard* shards = new Shard[ShardCount];
+    return shards;
+}
+
+Shard& shardFor(size_t hash) {
+    // Similar stacks have close hashes: mix them before picking the shard.
+    return shards()[(hash * 0x9E3779B97F4A7C15ull) >> 60];
+}
+
+}
+
+InternedStackTrace::InternedStackTrace() {
+    // The stack is walked before taking any lock.
+    StackTrace stackTrace;
+    Shard& shard = shardFor(stackTrace.hash());
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto range = shard.stackTraces.equal_range(stackTrace.hash());
+    for (auto iter = range.first; iter != range.second; ++iter) {
+        if (*iter->second == stackTrace) {
+            m_stackTrace = iter->second;
+            return;
+        }
+    }
+    m_stackTrace = std::make_shared<StackTrace>(std::move(stackTrace));
+    shard.stackTraces.emplace(m_stackTrace->hash(), m_stackTrace);
+}
+
+InternedStackTrace::~InternedStackTrace() {
+    if (!m_stackTrace)
+        return;
+    // New references are only taken from the table under the lock of the shard, or from a live InternedStackTrace,
+    // so the count can't go up from 2 while the lock is held.
+    Shard& shard = shardFor(m_stackTrace->hash());
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    assert(m_stackTrace.use_count() >= 2);
+    if (m_stackTrace.use_count() != 2)
+        return;
+    auto range = shard.stackTraces.equal_range(m_stackTrace->hash());
+    for (auto iter = range.first; iter != range.second; ++iter) {
+        if (iter->second == m_stackTrace) {
+            shard.stackTraces.erase(iter);
+            break;
+        }
+    }
+    assert(m_stackTrace.use_count() == 1);
+}
+
+size_t InternedStackTrace::internedCount() {
+    size_t count = 0;
+    for (size_t i = 0; i < ShardCount; i++) {
+        Shard& shard = shards()[i];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        count += shard.stackTraces.size();
+    }
+    return count;
+}
@@ -1,29 +1,32 @@
 #pragma once
 #include <memory>
-#include <unordered_map>
 #include <cassert>
 #include "stack-trace.h"
 
+// Tag for memory not attributed to any call, e.g. heap growth found by polling the program break.
+struct NoStackTrace {};
+
+/** Stack trace shared by all the mappings made from the same stack.
+ *
+ * The intern table is split in independently locked shards, so traces can be captured by several threads at once
+ * and without holding the lock of the memory map. Traces are compared in full: two stacks with the same hash don't
+ * share an entry. */
 class InternedStackTrace
 {
 public:
-    explicit InternedStackTrace() {
-        StackTrace stackTrace;
-        auto iter = s_stackTraces.find(stackTrace.hash());
-        if (iter != s_stackTraces.end()) {
-            m_stackTrace = iter->second;
-        } else {
-            m_stackTrace = std::make_shared<StackTrace>(std::move(stackTrace));
-            assert(stackTrace.hash() == m_stackTrace->hash());
-            s_stackTraces[m_stackTrace->hash()] = m_stackTrace;
-        }
-    }
-    ~InternedStackTrace() {
-        assert(!m_stackTrace || m_stackTrace.use_count() >= 2);
-        if (m_stackTrace && m_stackTrace.use_count() == 2) {
-            s_stackTraces.erase(m_stackTrace->hash());
-            assert(m_stackTrace.use_count() == 1);
-        }
+    explicit InternedStackTrace(NoStackTrace) {}
+    // Walks the current stack, then finds it in the intern table or adds it.
+    explicit InternedStackTrace();
+    InternedStackTrace(InternedStackTrace&& other) noexcept
+        : m_stackTrace(std::move(other.m_stackTrace))
+    {}
+    // Copies share the interned trace.
+    InternedStackTrace(const InternedStackTrace&) = default;
+    InternedStackTrace& operator=(const InternedStackTrace&) = delete;
+    ~InternedStackTrace();
+
+    bool empty() const {
+        return !m_stackTrace;
     }
 
     const StackTrace& get() const {
@@ -34,8 +37,9 @@ public:
         return m_stackTrace;
     }
 
+    // Number of distinct stack traces in the intern table.
+    static size_t internedCount();
+
 private:
     std::shared_ptr<StackTrace> m_stackTrace;
-
-    static std::unordered_map<size_t, std::shared_ptr<StackTrace>> s_stackTraces;
 };
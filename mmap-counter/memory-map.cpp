@@ -0,0 +1,338 @@
+#include "memory-map.h"
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+MMapAllocationPool::~MMapAllocationPool() {
+    for (Id id = 0; id < m_nextId; id++) {
+        if (chunk(id).references[id % ChunkSize])
+            reinterpret_cast<MMapAllocation*>(&chunk(id).allocations[id % ChunkSize])->~MMapAllocation();
+    }
+}
+
+MMapAllocationPool::Id MMapAllocationPool::create(MMapAllocation&& allocation) {
+    Id id;
+    if (!m_freeIds.empty()) {
+        id = m_freeIds.back();
+        m_freeIds.pop_back();
+    } else {
+        id = m_nextId++;
+        if (id % ChunkSize == 0)
+            m_chunks.emplace_back(new Chunk);
+    }
+    new (&chunk(id).allocations[id % ChunkSize]) MMapAllocation(std::move(allocation));
+    chunk(id).references[id % ChunkSize] = 1;
+    return id;
+}
+
+void MMapAllocationPool::deref(Id id) {
+    if (--chunk(id).references[id % ChunkSize])
+        return;
+    reinterpret_cast<MMapAllocation*>(&chunk(id).allocations[id % ChunkSize])->~MMapAllocation();
+    m_freeIds.push_back(id);
+}
+
+static bool startsBefore(const MemorySlice& slice, intptr_t pointer) {
+    return slice.start < pointer;
+}
+
+MemoryMap::Position MemoryMap::lowerBound(intptr_t pointer) const {
+    // The last block starting at or before pointer is the only one that may have slices on both sides of it.
+    size_t block = std::upper_bound(m_blockStarts.begin(), m_blockStarts.end(), pointer) - m_blockStarts.begin();
+    if (block > 0)
+        block--;
+    if (block == m_blocks.size())
+        return Position { block, 0 };
+    const Block& b = *m_blocks[block];
+    size_t index = std::lower_bound(b.slices, b.slices + b.count, pointer, startsBefore) - b.slices;
+    if (index == b.count)
+        return Position { block + 1, 0 };
+    return Position { block, index };
+}
+
+MemoryMap::Position MemoryMap::firstOverlapping(intptr_t pointer) const {
+    Position position = lowerBound(pointer);
+    // The slice before may contain pointer.
+    if (position.index > 0) {
+        if (m_blocks[position.block]->slices[position.index - 1].end() > pointer)
+            position.index--;
+    } else if (position.block > 0) {
+        const Block& previousBlock = *m_blocks[position.block - 1];
+        if (previousBlock.slices[previousBlock.count - 1].end() > pointer)
+            return Position { position.block - 1, previousBlock.count - 1 };
+    }
+    return position;
+}
+
+void MemoryMap::advance(Position& position) const {
+    if (++position.index == m_blocks[position.block]->count) {
+        position.block++;
+        position.index = 0;
+    }
+}
+
+MemorySlice* MemoryMap::sliceContaining(intptr_t pointer) {
+    size_t block = std::upper_bound(m_blockStarts.begin(), m_blockStarts.end(), pointer) - m_blockStarts.begin();
+    if (block == 0)
+        return nullptr;
+    Block& b = *m_blocks[block - 1];
+    // b.slices[0] starts at or before pointer, so the index found is at least 1.
+    size_t index = std::upper_bound(b.slices, b.slices + b.count, pointer, [](intptr_t value, const MemorySlice& slice) {
+        return value < slice.start;
+    }) - b.slices;
+    MemorySlice& slice = b.slices[index - 1];
+    return pointer < slice.end() ? &slice : nullptr;
+}
+
+MemoryMap::const_iterator MemoryMap::find(intptr_t start) const {
+    Position position = lowerBound(start);
+    if (isEnd(position) || m_blocks[position.block]->slices[position.index].start != start)
+        return end();
+    return const_iterator(this, position.block, position.index);
+}
+
+const MemorySlice& MemoryMap::at(intptr_t start) const {
+    const_iterator iter = find(start);
+    if (iter == end())
+        throw std::out_of_range("MemoryMap::at");
+    return *iter;
+}
+
+void MemoryMap::insert(const MemorySlice& slice) {
+    if (m_blocks.empty()) {
+        m_blocks.emplace_back(new Block);
+        m_blockStarts.push_back(slice.start);
+    }
+    size_t block = std::upper_bound(m_blockStarts.begin(), m_blockStarts.end(), slice.start) - m_blockStarts.begin();
+    if (block > 0)
+        block--;
+
+    if (m_blocks[block]->count == BlockCapacity) {
+        // Split the block in two halves.
+        std::unique_ptr<Block> upperHalf(new Block);
+        Block& lowerHalf = *m_blocks[block];
+        upperHalf->count = BlockCapacity / 2;
+        std::copy(lowerHalf.slices + BlockCapacity / 2, lowerHalf.slices + BlockCapacity, upperHalf->slices);
+        lowerHalf.count = BlockCapacity / 2;
+        m_blockStarts.insert(m_blockStarts.begin() + block + 1, upperHalf->slices[0].start);
+        m_blocks.insert(m_blocks.begin() + block + 1, std::move(upperHalf));
+        if (slice.start > m_blockStarts[block + 1])
+            block++;
+    }
+
+    Block& b = *m_blocks[block];
+    MemorySlice* position = std::lower_bound(b.slices, b.slices + b.count, slice.start, startsBefore);
+    std::copy_backward(position, b.slices + b.count, b.slices + b.count + 1);
+    *position = slice;
+    b.count++;
+    m_blockStarts[block] = b.slices[0].start;
+    m_size++;
+    // Moved by mremap() or split, already indexed in the latter case.
+    if (slice.state == MemorySlice::Released)
+        addReleasedRange(slice.start, slice.end());
+}
+
+void MemoryMap::removeBlock(size_t block) {
+    m_blocks.erase(m_blocks.begin() + block);
+    m_blockStarts.erase(m_blockStarts.begin() + block);
+}
+
+void MemoryMap::eraseRange(intptr_t start, intptr_t end) {
+    Position position = lowerBound(start);
+    size_t block = position.block;
+    size_t first = position.index;
+    while (block < m_blocks.size()) {
+        Block& b = *m_blocks[block];
+        size_t last = first;
+        while (last < b.count && b.slices[last].start < end) {
+            m_allocations.deref(b.slices[last].allocation);
+            last++;
+        }
+        std::copy(b.slices + last, b.slices + b.count, b.slices + first);
+        b.count -= last - first;
+        m_size -= last - first;
+        bool reachedEnd = last < b.count + (last - first);
+        if (!b.count) {
+            removeBlock(block);
+        } else {
+            m_blockStarts[block] = b.slices[0].start;
+            if (reachedEnd) {
+                // Keep blocks from getting sparse, merging the next block in if both fit in half a block.
+                if (block + 1 < m_blocks.size() && b.count + m_blocks[block + 1]->count <= BlockCapacity / 2) {
+                    Block& next = *m_blocks[block + 1];
+                    std::copy(next.slices, next.slices + next.count, b.slices + b.count);
+                    b.count += next.count;
+                    removeBlock(block + 1);
+                }
+                break;
+            }
+            block++;
+        }
+        if (reachedEnd)
+            break;
+        first = 0;
+    }
+}
+
+void MemoryMap::splitAt(intptr_t pointer) {
+    MemorySlice* slice = sliceContaining(pointer);
+    if (!slice || slice->start == pointer)
+        return;
+    MemorySlice upperPart(pointer, slice->end() - pointer, slice->allocation, slice->state);
+    slice->size = pointer - slice->start;
+    m_allocations.ref(upperPart.allocation);
+    insert(upperPart);
+}
+
+bool MemoryMap::registerMap(MMapAllocation&& allocation, MemorySlice::State state) {
+    intptr_t start = allocation.originalStart;
+    size_t size = allocation.originalSize;
+    bool replacedCountedMemory = registerUnmap(start, size);
+    if (state == MemorySlice::Released)
+        m_releaseCount++;
+    insert(MemorySlice(start, size, m_allocations.create(std::move(allocation)), state));
+    return replacedCountedMemory;
+}
+
+bool MemoryMap::registerUnmap(intptr_t start, size_t size) {
+    intptr_t end = start + size;
+    // Most new mappings don't replace any.
+    Position first = firstOverlapping(start);
+    if (isEnd(first) || sliceAt(first).start >= end)
+        return false;
+    splitAt(start);
+    splitAt(end);
+
+    bool unmappedCountedMemory = false;
+    for (Position position = lowerBound(start); !isEnd(position) && sliceAt(position).start < end; advance(position))
+        unmappedCountedMemory |= sliceAt(position).counted();
+    eraseRange(start, end);
+    return unmappedCountedMemory;
+}
+
+MemoryMap::Remap MemoryMap::registerRemap(intptr_t oldStart, size_t oldSize, intptr_t newStart, size_t newSize,
+                                          bool keepOldRange) {
+    Remap remap;
+    intptr_t oldEnd = oldStart + oldSize;
+    splitAt(oldStart);
+    splitAt(oldEnd);
+    bool released = false;
+    for (Position position = lowerBound(oldStart); !isEnd(position) && sliceAt(position).start < oldEnd;
+         advance(position)) {
+        MemorySlice& slice = sliceAt(position);
+        remap.unmappedCountedMemory |= slice.counted();
+        size_t offset = slice.start - oldStart;
+        if (offset < newSize) {
+            remap.movedSlices.push_back(slice);
+            remap.movedSlices.back().start = newStart + offset;
+            remap.movedSlices.back().size = std::min(slice.size, newSize - offset);
+            m_allocations.ref(slice.allocation);
+            released |= slice.state == MemorySlice::Released;
+        }
+        if (keepOldRange && slice.counted()) {
+            slice.state = MemorySlice::Released;
+            released = true;
+        }
+    }
+    if (released) {
+        m_releaseCount++;
+        if (keepOldRange)
+            addReleasedRange(oldStart, oldEnd);
+    }
+    if (!keepOldRange)
+        eraseRange(oldStart, oldEnd);
+
+    remap.replacedCountedMemory = registerUnmap(newStart, newSize);
+    // The references taken above are handed over to the moved slices.
+    for (const MemorySlice& slice : remap.movedSlices)
+        insert(slice);
+    return remap;
+}
+
+bool MemoryMap::containsSlicesIn(intptr_t start, size_t size, MemorySlice::State state) const {
+    intptr_t end = start + size;
+    for (Position position = firstOverlapping(start); !isEnd(position); advance(position)) {
+        const MemorySlice& slice = m_blocks[position.block]->slices[position.index];
+        if (slice.start >= end)
+            break;
+        if (slice.state == state)
+            return true;
+    }
+    return false;
+}
+
+std::vector<MemorySlice> MemoryMap::changeState(intptr_t start, size_t size, MemorySlice::State from,
+                                                MemorySlice::State to, MMapAllocation* newAllocation) {
+    std::vector<MemorySlice> changedSlices;
+    if (!containsSlicesIn(start, size, from))
+        return changedSlices;
+    intptr_t end = start + size;
+    splitAt(start);
+    splitAt(end);
+
+    MMapAllocationPool::Id newAllocationId = 0;
+    if (newAllocation)
+        newAllocationId = m_allocations.create(std::move(*newAllocation));
+    if (to == MemorySlice::Released) {
+        m_releaseCount++;
+        addReleasedRange(start, end);
+    }
+    for (Position position = lowerBound(start); !isEnd(position) && sliceAt(position).start < end; advance(position)) {
+        MemorySlice& slice = sliceAt(position);
+        if (slice.state != from)
+            continue;
+        slice.state = to;
+        if (newAllocation) {
+            m_allocations.ref(newAllocationId);
+            m_allocations.deref(slice.allocation);
+            slice.allocation = newAllocationId;
+        }
+        changedSlices.push_back(slice);
+    }
+    if (newAllocation)
+        m_allocations.deref(newAllocationId);
+    return changedSlices;
+}
+
+void MemoryMap::addReleasedRange(intptr_t start, intptr_t end) {
+    ReleasedRange range = { end, m_releaseCount };
+    auto iter = m_releasedRanges.upper_bound(start);
+    if (iter != m_releasedRanges.begin() && std::prev(iter)->second.end >= start)
+        --iter;
+    while (iter != m_releasedRanges.end() && iter->first <= end) {
+        start = std::min(start, iter->first);
+        range.end = std::max(range.end, iter->second.end);
+        range.releaseCount = std::max(range.releaseCount, iter->second.releaseCount);
+        iter = m_releasedRanges.erase(iter);
+    }
+    m_releasedRanges.emplace_hint(iter, start, range);
+}
+
+std::vector<std::pair<intptr_t, size_t>> MemoryMap::releasedRanges() const {
+    std::vector<std::pair<intptr_t, size_t>> ranges;
+    ranges.reserve(m_releasedRanges.size());
+    for (const auto& range : m_releasedRanges)
+        ranges.emplace_back(range.first, range.second.end - range.first);
+    return ranges;
+}
+
+bool MemoryMap::releasedSince(intptr_t start, size_t size, uint64_t releaseCount) const {
+    intptr_t end = start + size;
+    auto iter = m_releasedRanges.upper_bound(start);
+    if (iter != m_releasedRanges.begin() && std::prev(iter)->second.end > start)
+        --iter;
+    for (; iter != m_releasedRanges.end() && iter->first < end; ++iter) {
+        if (iter->second.releaseCount > releaseCount)
+            return true;
+    }
+    return false;
+}
+
+void MemoryMap::pruneReleasedRanges() {
+    for (auto iter = m_releasedRanges.begin(); iter != m_releasedRanges.end(); ) {
+        if (containsSlicesIn(iter->first, iter->second.end - iter->first, MemorySlice::Released))
+            ++iter;
+        else
+            iter = m_releasedRanges.erase(iter);
+    }
+}
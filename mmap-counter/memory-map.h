@@ -1,5 +1,9 @@
-#include <memory>
+#pragma once
 #include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <type_traits>
 #include "interned-stack-trace.h"
 
 #ifndef MMAP_COUNTER_TESTS
@@ -12,68 +16,226 @@ struct MMapAllocation {
     explicit MMapAllocation(intptr_t originalStart, intptr_t originalSize)
         : originalStart(originalStart), originalSize(originalSize)
     {}
+    explicit MMapAllocation(intptr_t originalStart, intptr_t originalSize, NoStackTrace)
+        : stackTrace(NoStackTrace()), originalStart(originalStart), originalSize(originalSize)
+    {}
+    // With a stack trace captured beforehand, e.g. before taking the lock of the memory map.
+    explicit MMapAllocation(intptr_t originalStart, intptr_t originalSize, InternedStackTrace&& stackTrace)
+        : stackTrace(std::move(stackTrace)), originalStart(originalStart), originalSize(originalSize)
+    {}
+    // Replayed from an event log, which only has the ID of the stack trace.
+    explicit MMapAllocation(intptr_t originalStart, intptr_t originalSize, uint32_t stackId)
+        : stackTrace(NoStackTrace()), originalStart(originalStart), originalSize(originalSize), stackId(stackId)
+    {}
 
     InternedStackTrace stackTrace;
     intptr_t originalStart;
     size_t originalSize;
+    uint32_t stackId = 0;
 
     intptr_t originalEnd() const { return originalStart + originalSize; }
 };
 
+/** Pool of the MMapAllocations referenced by the slices of a MemoryMap. Allocations are kept in chunks that never
+ * move, identified by their index, and counted references are plain integers: the map is only used under a lock. */
+class MMapAllocationPool {
+public:
+    typedef uint32_t Id;
+
+    MMapAllocationPool() = default;
+    MMapAllocationPool(const MMapAllocationPool&) = delete;
+    MMapAllocationPool& operator=(const MMapAllocationPool&) = delete;
+    ~MMapAllocationPool();
+
+    // The new allocation has one reference, owned by the caller.
+    Id create(MMapAllocation&& allocation);
+
+    void ref(Id id) { chunk(id).references[id % ChunkSize]++; }
+    void deref(Id id);
+
+    const MMapAllocation& operator[](Id id) const {
+        return *reinterpret_cast<const MMapAllocation*>(&chunk(id).allocations[id % ChunkSize]);
+    }
+
+    size_t liveCount() const { return m_nextId - m_freeIds.size(); }
+
+private:
+    static const size_t ChunkSize = 1024;
+    struct Chunk {
+        typename std::aligned_storage<sizeof(MMapAllocation), alignof(MMapAllocation)>::type allocations[ChunkSize];
+        uint32_t references[ChunkSize];
+    };
+
+    Chunk& chunk(Id id) const { return *m_chunks[id / ChunkSize]; }
+
+    std::vector<std::unique_ptr<Chunk>> m_chunks;
+    std::vector<Id> m_freeIds;
+    Id m_nextId = 0;
+};
+
 struct MemorySlice {
-    explicit MemorySlice(intptr_t start, size_t size, std::shared_ptr<MMapAllocation> allocation)
-        : start(start), size(size), allocation(std::move(allocation))
+    enum State : uint8_t {
+        // Accessible memory, counted in the event log.
+        Committed,
+        // Mapped with PROT_NONE and not made accessible since: the kernel doesn't charge it.
+        Reserved,
+        // Given back with madvise(MADV_DONTNEED) and not found resident since.
+        Released
+    };
+
+    MemorySlice() = default;
+    explicit MemorySlice(intptr_t start, size_t size, MMapAllocationPool::Id allocation, State state = Committed)
+        : start(start), size(size), allocation(allocation), state(state)
     {}
     intptr_t start;
     size_t size;
-    std::shared_ptr<MMapAllocation> allocation;
+    MMapAllocationPool::Id allocation;
+    State state;
 
     intptr_t end() const { return start + size; }
+    bool counted() const { return state == Committed; }
 };
 
-class MemoryMap: public std::map<intptr_t, MemorySlice> {
+/** Slices of anonymous memory mapped by the application, sorted by address.
+ *
+ * Processes may have hundreds of thousands of them, so they are stored in a two-level structure: fixed capacity
+ * blocks of contiguous slices, and a sorted array of the first address of every block, which is binary searched.
+ * Inserting or erasing a slice moves at most one block worth of slices, and splitting a full block moves one pointer
+ * per block. */
+class MemoryMap {
 public:
-    void registerMap(MMapAllocation&& allocation) {
-        // Initially all mmap() allocations create one MemorySlice, which may be sliced if a partial munmap() is made.
-        intptr_t start = allocation.originalStart;
-        size_t size = allocation.originalSize;
-        insert(std::make_pair(start, MemorySlice(start, size, std::make_shared<MMapAllocation>(std::move(allocation)))));
-    }
+    static const size_t BlockCapacity = 64;
 
-    bool registerUnmap(intptr_t start, size_t size) {
-        // Returns true if known anonymous memory is unmapped.
-        intptr_t end = start + size;
-        splitAt(start);
-        splitAt(end);
+    struct Remap {
+        // Counted memory was in the old range, or was replaced at the new one (MREMAP_FIXED).
+        bool unmappedCountedMemory = false;
+        bool replacedCountedMemory = false;
+        // The slices now in the new range, in order.
+        std::vector<MemorySlice> movedSlices;
+    };
+
+    class const_iterator {
+    public:
+        const MemorySlice& operator*() const { return m_map->m_blocks[m_block]->slices[m_index]; }
+        const MemorySlice* operator->() const { return &**this; }
+        const_iterator& operator++() {
+            if (++m_index == m_map->m_blocks[m_block]->count) {
+                m_block++;
+                m_index = 0;
+            }
+            return *this;
+        }
+        bool operator==(const const_iterator& other) const { return m_block == other.m_block && m_index == other.m_index; }
+        bool operator!=(const const_iterator& other) const { return !(*this == other); }
+
+    private:
+        friend class MemoryMap;
+        const_iterator(const MemoryMap* map, size_t block, size_t index) : m_map(map), m_block(block), m_index(index) {}
+
+        const MemoryMap* m_map;
+        size_t m_block;
+        size_t m_index;
+    };
+
+    MemoryMap() = default;
+    MemoryMap(const MemoryMap&) = delete;
+    MemoryMap& operator=(const MemoryMap&) = delete;
+
+    size_t size() const { return m_size; }
+    const_iterator begin() const { return const_iterator(this, 0, 0); }
+    const_iterator end() const { return const_iterator(this, m_blocks.size(), 0); }
+    // The slice starting at `start`, or end().
+    const_iterator find(intptr_t start) const;
+    // Like find(), but throws std::out_of_range if there is none.
+    const MemorySlice& at(intptr_t start) const;
+
+    const MMapAllocation& allocation(const MemorySlice& slice) const { return m_allocations[slice.allocation]; }
+    size_t allocationCount() const { return m_allocations.liveCount(); }
 
-        auto eraseStart = lower_bound(start);
-        auto eraseEnd = lower_bound(end);
-        erase(eraseStart, eraseEnd);
-        return eraseStart != eraseEnd;
+    // Initially all mmap() allocations create one MemorySlice, which may be sliced if a partial munmap() is made.
+    // mmap() with MAP_FIXED replaces any mapping in the range. Returns true if that was counted memory.
+    bool registerMap(MMapAllocation&& allocation, MemorySlice::State state = MemorySlice::Committed);
+
+    // Returns true if counted memory is unmapped.
+    bool registerUnmap(intptr_t start, size_t size);
+
+    // mremap() moves the slices of the old range, keeping their allocations, and cuts them to the new size. The caller
+    // registers the growth, if any. With MREMAP_DONTUNMAP (keepOldRange), the old range stays mapped but its pages are
+    // moved: it's left Released.
+    Remap registerRemap(intptr_t oldStart, size_t oldSize, intptr_t newStart, size_t newSize, bool keepOldRange);
+
+    bool containsSlicesIn(intptr_t start, size_t size, MemorySlice::State state) const;
+
+    // Calls function(slice, allocation) for every slice overlapping the range, in order. Slices are not cut at the
+    // ends of the range.
+    template<typename Function>
+    void forEachSliceIn(intptr_t start, size_t size, Function function) const {
+        intptr_t end = start + size;
+        for (Position position = firstOverlapping(start); !isEnd(position) && sliceAt(position).start < end;
+             advance(position))
+            function(sliceAt(position), m_allocations[sliceAt(position).allocation]);
     }
 
+    // Moves the slices in the range that are in state `from` to state `to` (and to a new allocation, if given),
+    // splitting them at the ends of the range. Returns the changed slices.
+    std::vector<MemorySlice> changeState(intptr_t start, size_t size, MemorySlice::State from, MemorySlice::State to,
+                                         MMapAllocation* newAllocation = nullptr);
+
+    /** Released slices are polled for resident pages. So that the map is neither walked nor locked meanwhile, the
+     * ranges where slices were released are indexed apart, along with the value of releaseCount() when they were last
+     * released in. Ranges are only forgotten by pruneReleasedRanges(), so they may cover slices no longer released. */
+
+    // The indexed ranges, as (start, size) pairs in order.
+    std::vector<std::pair<intptr_t, size_t>> releasedRanges() const;
+    // Counts the changes of slices to Released (or their moves, for mremap()).
+    uint64_t releaseCount() const { return m_releaseCount; }
+    // Whether slices in the range may have been released after releaseCount() was `releaseCount`.
+    bool releasedSince(intptr_t start, size_t size, uint64_t releaseCount) const;
+    // Forgets the ranges without Released slices left.
+    void pruneReleasedRanges();
+
 MMAP_COUNTER_PRIVATE:
-    void splitAt(intptr_t pointer) {
-        // upper_bound() finds the first element that starts STRICTLY after pointer.
-        // We are interested in the element that is immediately before that one: if it contains
-        // pointer, we will split it.
-        auto iterNext = upper_bound(pointer);
-        if (iterNext == begin())
-            return;
-        auto iter = std::prev(iterNext);
-        if (iter == end())
-            return;
-
-        MemorySlice& greatestElementThatStartsBeforePointer = iter->second;
-        assert(greatestElementThatStartsBeforePointer.start <= pointer);
-        if (pointer == greatestElementThatStartsBeforePointer.start
-                || pointer >= greatestElementThatStartsBeforePointer.end()) {
-            return;
-        }
+    void splitAt(intptr_t pointer);
 
-        // Let's split
-        intptr_t newSliceEnd = greatestElementThatStartsBeforePointer.end();
-        greatestElementThatStartsBeforePointer.size = pointer - greatestElementThatStartsBeforePointer.start;
-        insert(std::make_pair(pointer, MemorySlice(pointer, newSliceEnd - pointer, greatestElementThatStartsBeforePointer.allocation)));
-    }
+private:
+    struct Block {
+        size_t count = 0;
+        MemorySlice slices[BlockCapacity];
+    };
+
+    struct Position {
+        size_t block;
+        size_t index;
+    };
+
+    // Position of the first slice starting at or after `pointer`.
+    Position lowerBound(intptr_t pointer) const;
+    // Position of the first slice ending after `pointer`.
+    Position firstOverlapping(intptr_t pointer) const;
+    MemorySlice& sliceAt(Position position) const { return m_blocks[position.block]->slices[position.index]; }
+    bool isEnd(Position position) const { return position.block == m_blocks.size(); }
+    void advance(Position& position) const;
+    // The slice containing `pointer`, or nullptr.
+    MemorySlice* sliceContaining(intptr_t pointer);
+
+    // Takes over a reference to the allocation of the slice, which must not overlap any other.
+    void insert(const MemorySlice& slice);
+    // Removes the slices starting in [start, end), dropping their references.
+    void eraseRange(intptr_t start, intptr_t end);
+    void removeBlock(size_t block);
+    // Indexes [start, end), merging it with the ranges it overlaps or touches.
+    void addReleasedRange(intptr_t start, intptr_t end);
+
+    std::vector<std::unique_ptr<Block>> m_blocks;
+    std::vector<intptr_t> m_blockStarts; // Start of the first slice of every block.
+    size_t m_size = 0;
+    MMapAllocationPool m_allocations;
+
+    struct ReleasedRange {
+        intptr_t end;
+        uint64_t releaseCount;
+    };
+    // By start. Ranges neither overlap nor touch.
+    std::map<intptr_t, ReleasedRange> m_releasedRanges;
+    uint64_t m_releaseCount = 0;
 };
@@ -0,0 +1,55 @@
+#pragma once
+#include <cstdint>
+using namespace std;
+
+/** Binary format of the mmap-counter event log (/tmp/mmap-event-log.bin): a MmapEventLogHeader followed by
+ * MmapEventRecords, in the byte order of the host. mmap-log-convert turns it into the text format that
+ * parse-mmap-log.py reads. */
+
+static const char MmapEventLogMagic[8] = { 'M', 'M', 'A', 'P', 'L', 'O', 'G', '\0' };
+static const uint32_t MmapEventLogVersion = 1;
+
+struct MmapEventLogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+};
+
+enum class MmapEventType : uint16_t {
+    Map = 0,
+    Unmap = 1,
+    UnmapFailed = 2
+};
+
+// The call that caused the event. Map and Unmap events of every origin are applied alike to the memory map.
+enum class MmapEventOrigin : uint16_t {
+    Mmap = 0, // mmap() and munmap()
+    Mremap = 1,
+    Brk = 2, // brk() and sbrk(), or a change of the program break found by polling it
+    Mprotect = 3, // PROT_NONE memory made accessible
+    Madvise = 4, // madvise(MADV_DONTNEED)
+    Reuse = 5 // memory given back with madvise() found resident again
+};
+
+static inline const char* mmapEventOriginName(MmapEventOrigin origin) {
+    switch (origin) {
+    case MmapEventOrigin::Mmap: return "mmap";
+    case MmapEventOrigin::Mremap: return "mremap";
+    case MmapEventOrigin::Brk: return "brk";
+    case MmapEventOrigin::Mprotect: return "mprotect";
+    case MmapEventOrigin::Madvise: return "madvise";
+    case MmapEventOrigin::Reuse: return "reuse";
+    }
+    return "unknown";
+}
+
+struct MmapEventRecord {
+    uint64_t timestamp; // CLOCK_MONOTONIC, in nanoseconds
+    uint64_t address;
+    uint64_t length;
+    uint32_t stackId; // 0 if the event has no stack trace
+    MmapEventType type;
+    MmapEventOrigin origin;
+};
+
+static_assert(sizeof(MmapEventRecord) == 32, "MmapEventRecord should be packed in 32 bytes");
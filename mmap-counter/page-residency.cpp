@@ -0,0 +1,39 @@
+#include "page-residency.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+
+bool adviceReleasesPages(int advice) {
+    return advice == MADV_DONTNEED;
+}
+
+std::vector<std::pair<intptr_t, size_t>> findResidentRanges(const std::vector<std::pair<intptr_t, size_t>>& ranges) {
+    const size_t pageSize = sysconf(_SC_PAGE_SIZE);
+    std::vector<std::pair<intptr_t, size_t>> residentRanges;
+    unsigned char residency[4096];
+    for (const auto& range : ranges) {
+        size_t pages = range.second / pageSize;
+        intptr_t runStart = 0;
+        intptr_t end = range.first + range.second;
+        for (size_t firstPage = 0; firstPage < pages; firstPage += sizeof(residency)) {
+            size_t chunkPages = std::min(pages - firstPage, sizeof(residency));
+            intptr_t chunkStart = range.first + firstPage * pageSize;
+            if (mincore(reinterpret_cast<void*>(chunkStart), chunkPages * pageSize, residency) != 0) {
+                end = chunkStart;
+                break;
+            }
+            for (size_t i = 0; i < chunkPages; i++) {
+                intptr_t page = chunkStart + i * pageSize;
+                if ((residency[i] & 1) && !runStart) {
+                    runStart = page;
+                } else if (!(residency[i] & 1) && runStart) {
+                    residentRanges.emplace_back(runStart, page - runStart);
+                    runStart = 0;
+                }
+            }
+        }
+        if (runStart)
+            residentRanges.emplace_back(runStart, end - runStart);
+    }
+    return residentRanges;
+}
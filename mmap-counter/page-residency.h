@@ -0,0 +1,19 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/** Memory given back to the kernel with madvise() is charged again as soon as it's touched, which doesn't go through
+ * any call that could be wrapped, so mmap-counter polls the residency of the pages it was told were given back.
+ *
+ * Only MADV_DONTNEED counts: pages given with MADV_FREE stay resident, and charged, until the kernel needs them under
+ * memory pressure, and a write to them cancels the advice. mincore() can't tell them apart from pages in use, so they
+ * would be seen as reused at the next poll. */
+
+// Whether madvise() with `advice` gives the pages back, zero filled on the next access.
+bool adviceReleasesPages(int advice);
+
+// The runs of resident pages in the page aligned ranges, as (start, size) pairs in order. A range is only looked at up
+// to the first batch of 4096 pages with pages no longer mapped: it's being unmapped anyway.
+std::vector<std::pair<intptr_t, size_t>> findResidentRanges(const std::vector<std::pair<intptr_t, size_t>>& ranges);
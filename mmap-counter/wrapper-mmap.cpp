@@ -1,16 +1,20 @@
 #include <sys/mman.h>
 #include <dlfcn.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <unordered_map>
 #include <unordered_set>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <vector>
 #include <unistd.h>
 #include <cassert>
-#include <fstream>
-#include <mutex>
 #include "memory-map.h"
+#include "page-residency.h"
+#include "call-site-cache.h"
+#include "environment.h"
+#include "event-log.h"
 #include "library-context.h"
 
 #ifdef MMAP_COUNTER_LOG_ENABLED
@@ -19,41 +23,153 @@
 #define LOG(...)
 #endif
 
-static uint32_t roundUpToPageMultiple(size_t size) {
+static size_t roundUpToPageMultiple(size_t size) {
     const size_t pageSize = sysconf(_SC_PAGE_SIZE);
     return (size + (pageSize - 1)) & ~(pageSize - 1);
 }
 
-static double getTime() {
-    timespec tv;
-    clock_gettime(CLOCK_MONOTONIC, &tv);
-    return tv.tv_sec + tv.tv_nsec / 1e9;
-}
-
 static void* (*real_mmap)(void*, size_t, int, int, int, off_t) = nullptr;
 static int (*real_munmap)(void*, size_t) = nullptr;
+static void* (*real_mremap)(void*, size_t, size_t, int, ...) = nullptr;
+static int (*real_mprotect)(void*, size_t, int) = nullptr;
+static int (*real_madvise)(void*, size_t, int) = nullptr;
+static int (*real_brk)(void*) = nullptr;
+static void* (*real_sbrk)(intptr_t) = nullptr;
 
 extern "C" {
 
-static MemoryMap memoryMap;
+// Leaked: the writer thread of the event log keeps polling the memory map while static objects are destroyed.
+static MemoryMap& memoryMap = *new MemoryMap;
 static std::mutex wrappedMmapMutex;
-static std::unordered_map<size_t, size_t> knownStackTraceHashToId;
+// Keyed by the interned trace, which the map keeps in the intern table: stacks with the same hash get different IDs, and
+// a stack gets the same ID every time.
+static std::unordered_map<std::shared_ptr<StackTrace>, size_t>& knownStackTraceToId =
+    *new std::unordered_map<std::shared_ptr<StackTrace>, size_t>;
+// Last known program break, guarded by wrappedMmapMutex. The heap below it when the library was loaded is not counted.
+static intptr_t knownProgramBreak = 0;
 
-std::pair<size_t, bool> getOrAssignStackId(const StackTrace& stackTrace) {
-    auto pair = knownStackTraceHashToId.insert(std::make_pair(stackTrace.hash(), knownStackTraceHashToId.size() + 1));
+std::pair<size_t, bool> getOrAssignStackId(const InternedStackTrace& stackTrace) {
+    auto pair = knownStackTraceToId.insert(std::make_pair(stackTrace.getShared(), knownStackTraceToId.size() + 1));
     return std::make_pair(pair.first->second, pair.second);
 }
 
-static ofstream& openEventLogFile() {
-    static ofstream logFile("/tmp/mmap-event-log", ofstream::trunc);
-    return logFile;
 }
 
-static ofstream& openStackLogFile() {
-    static ofstream logFile("/tmp/mmap-stack-log", ofstream::trunc);
-    return logFile;
+static CallSiteCache& callSiteCache() {
+    static CallSiteCache* cache = new CallSiteCache(environment.mmapCallSiteCacheCapacity);
+    return *cache;
+}
+
+// Walking the stack is by far the slowest part of the wrappers: it's done before taking wrappedMmapMutex and, with
+// MMAP_CALL_SITE_CACHE=1, only the first time a call site maps memory of a given size class.
+static InternedStackTrace captureStackTrace(const void* returnAddress, size_t size) {
+    if (!environment.mmapCallSiteCache)
+        return InternedStackTrace();
+    uint64_t fingerprint = CallSiteCache::fingerprint(returnAddress, size);
+    InternedStackTrace cached = callSiteCache().find(fingerprint);
+    if (!cached.empty())
+        return cached;
+    InternedStackTrace stackTrace;
+    callSiteCache().insert(fingerprint, stackTrace);
+    return stackTrace;
+}
+
+// The following helpers must be called with wrappedMmapMutex held.
+
+static uint32_t stackIdOf(const MMapAllocation& allocation) {
+    if (allocation.stackTrace.empty())
+        return 0;
+    auto pair = getOrAssignStackId(allocation.stackTrace);
+    if (pair.second)
+        EventLog::instance().logNewStackTrace(pair.first, allocation.stackTrace.get());
+    return pair.first;
+}
+
+static void logCountedSlices(const std::vector<MemorySlice>& slices, MmapEventOrigin origin) {
+    for (const MemorySlice& slice : slices) {
+        if (slice.counted()) {
+            EventLog::instance().log(MmapEventType::Map, reinterpret_cast<void*>(slice.start), slice.size,
+                                     stackIdOf(memoryMap.allocation(slice)), origin);
+        }
+    }
+}
+
+static void registerMap(MMapAllocation&& allocation, MemorySlice::State state, MmapEventOrigin origin) {
+    void* start = reinterpret_cast<void*>(allocation.originalStart);
+    size_t size = allocation.originalSize;
+    // Records are pushed under wrappedMmapMutex so that they are in the same order as the changes to memoryMap.
+    if (state == MemorySlice::Committed)
+        EventLog::instance().log(MmapEventType::Map, start, size, stackIdOf(allocation), origin);
+    bool replacedCountedMemory = memoryMap.registerMap(std::move(allocation), state);
+    // A counted map replaces the old one in the log too.
+    if (state != MemorySlice::Committed && replacedCountedMemory)
+        EventLog::instance().log(MmapEventType::Unmap, start, size, 0, origin);
+}
+
+static void registerProgramBreak(intptr_t programBreak, InternedStackTrace&& stackTrace) {
+    // The kernel maps the heap up to the page containing the break.
+    intptr_t oldEnd = roundUpToPageMultiple(knownProgramBreak);
+    intptr_t newEnd = roundUpToPageMultiple(programBreak);
+    bool firstBreak = !knownProgramBreak;
+    knownProgramBreak = programBreak;
+    if (firstBreak || newEnd == oldEnd)
+        return;
+
+    if (newEnd > oldEnd) {
+        registerMap(MMapAllocation(oldEnd, newEnd - oldEnd, std::move(stackTrace)), MemorySlice::Committed,
+                    MmapEventOrigin::Brk);
+    } else if (memoryMap.registerUnmap(newEnd, oldEnd - newEnd)) {
+        EventLog::instance().log(MmapEventType::Unmap, reinterpret_cast<void*>(newEnd), oldEnd - newEnd, 0,
+                                 MmapEventOrigin::Brk);
+    }
+}
+
+// Takes wrappedMmapMutex, but not while mincore() goes through the pages.
+static void countResidentReleasedMemory() {
+    std::vector<std::pair<intptr_t, size_t>> releasedRanges;
+    uint64_t releaseCount;
+    {
+        std::lock_guard<std::mutex> lock(wrappedMmapMutex);
+        releasedRanges = memoryMap.releasedRanges();
+        releaseCount = memoryMap.releaseCount();
+    }
+    if (releasedRanges.empty())
+        return;
+    std::vector<std::pair<intptr_t, size_t>> residentRanges = findResidentRanges(releasedRanges);
+
+    std::lock_guard<std::mutex> lock(wrappedMmapMutex);
+    for (const auto& range : residentRanges) {
+        // Released again since, the pages found resident may be gone: left for the next poll.
+        if (memoryMap.releasedSince(range.first, range.second, releaseCount))
+            continue;
+        logCountedSlices(memoryMap.changeState(range.first, range.second, MemorySlice::Released, MemorySlice::Committed),
+                         MmapEventOrigin::Reuse);
+    }
+    memoryMap.pruneReleasedRanges();
+}
+
+static void pollMemoryChanges() {
+    {
+        // glibc's malloc() moves the program break with its internal alias of sbrk(), so the wrapper doesn't see it.
+        std::lock_guard<std::mutex> lock(wrappedMmapMutex);
+        registerProgramBreak(reinterpret_cast<intptr_t>(real_sbrk(0)), InternedStackTrace(NoStackTrace()));
+    }
+    countResidentReleasedMemory();
+}
+
+__attribute__((constructor)) static void mmapCounterInit() {
+    LibraryContext ctx;
+    if (!real_sbrk)
+        real_sbrk = (void*(*)(intptr_t)) dlsym(RTLD_NEXT, "sbrk");
+    {
+        std::lock_guard<std::mutex> lock(wrappedMmapMutex);
+        registerProgramBreak(reinterpret_cast<intptr_t>(real_sbrk(0)), InternedStackTrace(NoStackTrace()));
+    }
+    EventLog::instance().setPeriodicTask(pollMemoryChanges);
 }
 
+extern "C" {
+
 __attribute__((visibility("default")))
 void* mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset) {
     LOG("mmap\n");
@@ -73,20 +189,18 @@ void* mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset) {
     }
 
     LibraryContext ctx;
-    if (ret != nullptr && flags & MAP_ANONYMOUS) {
-        std::lock_guard<std::mutex> lock(wrappedMmapMutex);
+    if (ret != MAP_FAILED && flags & MAP_ANONYMOUS) {
         intptr_t start = reinterpret_cast<intptr_t>(ret);
-        MMapAllocation allocation(start, roundUpToPageMultiple(len));
-        auto pair = getOrAssignStackId(allocation.stackTrace.get());
-        size_t stackTraceId = pair.first;
-        bool stackTraceIsNew = pair.second;
-        if (stackTraceIsNew) {
-            openStackLogFile() << "New stack trace: " << stackTraceId << "\n"
-                               << allocation.stackTrace.get() << endl;
-        }
-        openEventLogFile() << getTime() << " MAP: " << ret << " ("
-                           << len << " bytes) stackTrace=" << stackTraceId << endl;
-        memoryMap.registerMap(std::move(allocation));
+        size_t size = roundUpToPageMultiple(len);
+        InternedStackTrace stackTrace = captureStackTrace(__builtin_return_address(0), size);
+        std::lock_guard<std::mutex> lock(wrappedMmapMutex);
+        // PROT_NONE mappings are usually address space reservations, only counted once mprotect() commits them.
+        registerMap(MMapAllocation(start, size, std::move(stackTrace)),
+                    prot == PROT_NONE ? MemorySlice::Reserved : MemorySlice::Committed, MmapEventOrigin::Mmap);
+    } else if (ret != MAP_FAILED && flags & MAP_FIXED) {
+        std::lock_guard<std::mutex> lock(wrappedMmapMutex);
+        if (memoryMap.registerUnmap(reinterpret_cast<intptr_t>(ret), roundUpToPageMultiple(len)))
+            EventLog::instance().log(MmapEventType::Unmap, ret, len);
     }
     LOG("return from mmap\n");
     return ret;
@@ -113,13 +227,140 @@ int munmap(void *addr, size_t length) {
         const size_t pageSize = sysconf(_SC_PAGE_SIZE);
         assert((start & (pageSize - 1)) == 0); // addr is multiple of pageSize
         if (memoryMap.registerUnmap(start, roundUpToPageMultiple(length))) {
-            openEventLogFile() << getTime() << " UNMAP: " << addr << " (" << length << " bytes)" << endl;
+            EventLog::instance().log(MmapEventType::Unmap, addr, length);
         }
     } else {
-        openEventLogFile() << getTime() << " ERROR: UNMAP FAILED: " << addr << " (" << length << " bytes)" << endl;
+        EventLog::instance().log(MmapEventType::UnmapFailed, addr, length);
     }
     LOG("return from munmap\n");
     return ret;
 }
 
+__attribute__((visibility("default")))
+void* mremap(void* oldAddress, size_t oldSize, size_t newSize, int flags, ...) {
+    LOG("mremap\n");
+    void* newAddress = nullptr;
+    if (flags & MREMAP_FIXED) {
+        va_list arguments;
+        va_start(arguments, flags);
+        newAddress = va_arg(arguments, void*);
+        va_end(arguments);
+    }
+    if (!real_mremap) {
+        real_mremap = (void*(*)(void*, size_t, size_t, int, ...)) dlsym(RTLD_NEXT, "mremap");
+    }
+    void* ret = real_mremap(oldAddress, oldSize, newSize, flags, newAddress);
+    if (LibraryContext::inLibrary() || ret == MAP_FAILED || !oldSize)
+        return ret;
+
+    LibraryContext ctx;
+#ifdef MREMAP_DONTUNMAP
+    bool keepOldRange = flags & MREMAP_DONTUNMAP;
+#else
+    bool keepOldRange = false;
+#endif
+    intptr_t start = reinterpret_cast<intptr_t>(ret);
+    size_t oldMappedSize = roundUpToPageMultiple(oldSize);
+    size_t newMappedSize = roundUpToPageMultiple(newSize);
+    InternedStackTrace stackTrace = newMappedSize > oldMappedSize
+        ? captureStackTrace(__builtin_return_address(0), newMappedSize - oldMappedSize)
+        : InternedStackTrace(NoStackTrace());
+    std::lock_guard<std::mutex> lock(wrappedMmapMutex);
+    MemoryMap::Remap remap = memoryMap.registerRemap(reinterpret_cast<intptr_t>(oldAddress), oldMappedSize,
+                                                     start, newMappedSize, keepOldRange);
+    if (remap.unmappedCountedMemory)
+        EventLog::instance().log(MmapEventType::Unmap, oldAddress, oldSize, 0, MmapEventOrigin::Mremap);
+    if (remap.replacedCountedMemory)
+        EventLog::instance().log(MmapEventType::Unmap, ret, newSize, 0, MmapEventOrigin::Mremap);
+    logCountedSlices(remap.movedSlices, MmapEventOrigin::Mremap);
+    // The growth is attributed to the caller of mremap() (e.g. realloc()), not to the original mmap().
+    if (newMappedSize > oldMappedSize && !remap.movedSlices.empty()) {
+        bool reserved = remap.movedSlices.back().state == MemorySlice::Reserved;
+        registerMap(MMapAllocation(start + oldMappedSize, newMappedSize - oldMappedSize, std::move(stackTrace)),
+                    reserved ? MemorySlice::Reserved : MemorySlice::Committed, MmapEventOrigin::Mremap);
+    }
+    LOG("return from mremap\n");
+    return ret;
+}
+
+__attribute__((visibility("default")))
+int mprotect(void* addr, size_t length, int prot) {
+    if (!real_mprotect) {
+        real_mprotect = (int(*)(void*, size_t, int)) dlsym(RTLD_NEXT, "mprotect");
+    }
+    int ret = real_mprotect(addr, length, prot);
+    if (LibraryContext::inLibrary() || ret != 0 || prot == PROT_NONE)
+        return ret;
+
+    // Revoking access doesn't give the pages back, so only PROT_NONE reservations being committed are counted.
+    LibraryContext ctx;
+    intptr_t start = reinterpret_cast<intptr_t>(addr);
+    size_t size = roundUpToPageMultiple(length);
+    {
+        std::lock_guard<std::mutex> lock(wrappedMmapMutex);
+        if (!memoryMap.containsSlicesIn(start, size, MemorySlice::Reserved))
+            return ret;
+    }
+    // Like the growth of mremap(), committed memory is attributed to the caller of mprotect(). The stack is walked
+    // without the lock, so the range is looked up again: changeState() skips it if it's no longer reserved.
+    MMapAllocation allocation(start, size, captureStackTrace(__builtin_return_address(0), size));
+    std::lock_guard<std::mutex> lock(wrappedMmapMutex);
+    logCountedSlices(memoryMap.changeState(start, size, MemorySlice::Reserved, MemorySlice::Committed, &allocation),
+                     MmapEventOrigin::Mprotect);
+    return ret;
+}
+
+__attribute__((visibility("default")))
+int madvise(void* addr, size_t length, int advice) {
+    if (!real_madvise) {
+        real_madvise = (int(*)(void*, size_t, int)) dlsym(RTLD_NEXT, "madvise");
+    }
+    int ret = real_madvise(addr, length, advice);
+    if (LibraryContext::inLibrary() || ret != 0 || !adviceReleasesPages(advice))
+        return ret;
+
+    LibraryContext ctx;
+    std::lock_guard<std::mutex> lock(wrappedMmapMutex);
+    intptr_t start = reinterpret_cast<intptr_t>(addr);
+    for (const MemorySlice& slice : memoryMap.changeState(start, roundUpToPageMultiple(length),
+                                                          MemorySlice::Committed, MemorySlice::Released)) {
+        EventLog::instance().log(MmapEventType::Unmap, reinterpret_cast<void*>(slice.start), slice.size, 0,
+                                 MmapEventOrigin::Madvise);
+    }
+    return ret;
+}
+
+__attribute__((visibility("default")))
+int brk(void* addr) {
+    if (!real_brk) {
+        real_brk = (int(*)(void*)) dlsym(RTLD_NEXT, "brk");
+    }
+    int ret = real_brk(addr);
+    if (LibraryContext::inLibrary() || ret != 0)
+        return ret;
+
+    LibraryContext ctx;
+    InternedStackTrace stackTrace = captureStackTrace(__builtin_return_address(0), 0);
+    std::lock_guard<std::mutex> lock(wrappedMmapMutex);
+    registerProgramBreak(reinterpret_cast<intptr_t>(addr), std::move(stackTrace));
+    return ret;
+}
+
+__attribute__((visibility("default")))
+void* sbrk(intptr_t increment) {
+    if (!real_sbrk) {
+        real_sbrk = (void*(*)(intptr_t)) dlsym(RTLD_NEXT, "sbrk");
+    }
+    void* ret = real_sbrk(increment);
+    if (LibraryContext::inLibrary() || ret == reinterpret_cast<void*>(-1) || !increment)
+        return ret;
+
+    LibraryContext ctx;
+    InternedStackTrace stackTrace = increment > 0 ? captureStackTrace(__builtin_return_address(0), increment)
+                                                  : InternedStackTrace(NoStackTrace());
+    std::lock_guard<std::mutex> lock(wrappedMmapMutex);
+    registerProgramBreak(reinterpret_cast<intptr_t>(ret) + increment, std::move(stackTrace));
+    return ret;
+}
+
 }
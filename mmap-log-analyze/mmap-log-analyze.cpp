@@ -0,0 +1,235 @@
+/* Replays an mmap-counter event log to find the stack traces holding the mapped memory, like parse-mmap-log.py, but
+ * streaming the log and with the MemoryMap of the library itself, so that logs of runs of days can be analyzed in
+ * about the memory the application had mapped:
+ *
+ *   mmap-log-analyze [options] [/tmp/mmap-event-log.bin]
+ *
+ * The ranking (growth of the memory of every stack trace) and the time series (mapped memory at every timestamp,
+ * optionally only of some stack traces) are those of generate_ranking() and generate_memory_log(). Both the binary
+ * log and its text form are read. */
+#include "memory-map.h"
+#include "mmap-log-reader.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+// Like parse-mmap-log.py, sizes are rounded up to 4 KiB pages, whatever the machine that wrote the log.
+static const uint64_t PageSize = 4096;
+static const uint64_t NanosecondsPerSecond = 1000000000;
+
+/** Memory mapped by each stack trace along the log. */
+class Replay {
+public:
+    explicit Replay(const unordered_set<uint32_t>& stackFilter) : m_stackFilter(stackFilter) {}
+
+    void apply(const MmapEventRecord& record) {
+        intptr_t start = record.address;
+        size_t size = (record.length + PageSize - 1) & ~(PageSize - 1);
+        bool unmappedAnything = forget(start, size);
+        if (record.type == MmapEventType::Map) {
+            m_memoryMap.registerMap(MMapAllocation(start, size, record.stackId));
+            account(record.stackId, size);
+        } else {
+            // The library only logs unmaps of memory it logged as mapped.
+            if (!unmappedAnything)
+                m_unknownUnmaps++;
+            m_memoryMap.registerUnmap(start, size);
+        }
+    }
+
+    // Memory of the stack traces of the filter, or of all of them.
+    int64_t filteredMemory() const { return m_filteredMemory; }
+    const unordered_map<uint32_t, int64_t>& memoryByStack() const { return m_memoryByStack; }
+    size_t unknownUnmaps() const { return m_unknownUnmaps; }
+
+private:
+    // Accounts the memory of the range as unmapped. Returns false if nothing was mapped there.
+    bool forget(intptr_t start, size_t size) {
+        intptr_t end = start + size;
+        bool found = false;
+        m_memoryMap.forEachSliceIn(start, size, [&](const MemorySlice& slice, const MMapAllocation& allocation) {
+            account(allocation.stackId, -(min(slice.end(), end) - max(slice.start, start)));
+            found = true;
+        });
+        return found;
+    }
+
+    void account(uint32_t stackId, int64_t bytes) {
+        int64_t& memory = m_memoryByStack[stackId];
+        memory += bytes;
+        if (!memory)
+            m_memoryByStack.erase(stackId);
+        if (m_stackFilter.empty() || m_stackFilter.count(stackId))
+            m_filteredMemory += bytes;
+    }
+
+    const unordered_set<uint32_t>& m_stackFilter;
+    MemoryMap m_memoryMap;
+    unordered_map<uint32_t, int64_t> m_memoryByStack;
+    int64_t m_filteredMemory = 0;
+    size_t m_unknownUnmaps = 0;
+};
+
+static void printTime(FILE* file, uint64_t time) {
+    // Rounded to the microsecond, like mmap-log-convert does.
+    uint64_t microseconds = (time + 500) / 1000;
+    fprintf(file, "%" PRIu64 ".%06" PRIu64, microseconds / 1000000, microseconds % 1000000);
+}
+
+static void printRanking(const unordered_map<uint32_t, int64_t>& baseline, const unordered_map<uint32_t, int64_t>& end) {
+    // Only stack traces still holding memory at the end are ranked.
+    vector<pair<uint32_t, int64_t>> increases;
+    for (const auto& stack : end) {
+        auto baselineMemory = baseline.find(stack.first);
+        increases.emplace_back(stack.first, stack.second - (baselineMemory != baseline.end() ? baselineMemory->second : 0));
+    }
+    sort(increases.begin(), increases.end(), [](const pair<uint32_t, int64_t>& a, const pair<uint32_t, int64_t>& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+    for (const auto& increase : increases)
+        printf("%" PRIu32 "\t%" PRId64 " (%.6f MB)\n", increase.first, increase.second, increase.second / 1e6);
+}
+
+static bool parseSeconds(const char* text, uint64_t* nanoseconds) {
+    char* end;
+    double seconds = strtod(text, &end);
+    if (*end || seconds < 0)
+        return false;
+    *nanoseconds = static_cast<uint64_t>(seconds * NanosecondsPerSecond + 0.5);
+    return true;
+}
+
+static bool parseStackIds(const char* text, unordered_set<uint32_t>* stackIds) {
+    while (*text) {
+        char* end;
+        unsigned long stackId = strtoul(text, &end, 10);
+        if (end == text || (*end && *end != ','))
+            return false;
+        stackIds->insert(stackId);
+        text = *end ? end + 1 : end;
+    }
+    return true;
+}
+
+static void usage() {
+    fprintf(stderr,
+            "Usage: mmap-log-analyze [--ranking] [--series <file>] [--stacks <id,...>] [--from <seconds>]\n"
+            "                        [--to <seconds>] [--threads <n>] [log file]\n"
+            "Replays an mmap-counter event log (default: /tmp/mmap-event-log.bin), binary or text.\n"
+            "  --ranking          print the growth of the memory of every stack trace, biggest first (the default)\n"
+            "  --series <file>    write the mapped memory at every timestamp, as TSV ('-' for the standard output)\n"
+            "  --stacks <id,...>  only count the memory of these stack traces in the series\n"
+            "  --from <seconds>   start of the time window: the series starts there, and the ranking measures the\n"
+            "                     growth since then (default: 7200, like parse-mmap-log.py)\n"
+            "  --to <seconds>     end of the time window: the rest of the log is not read\n"
+            "  --threads <n>      threads parsing text logs (default: one per CPU)\n");
+}
+
+int main(int argc, char** argv) {
+    const char* logPath = "/tmp/mmap-event-log.bin";
+    const char* seriesPath = nullptr;
+    bool ranking = false;
+    unordered_set<uint32_t> stackFilter;
+    bool hasFrom = false;
+    uint64_t from = 0;
+    uint64_t to = UINT64_MAX;
+    unsigned threads = thread::hardware_concurrency();
+    for (int i = 1; i < argc; i++) {
+        bool valid = true;
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--ranking")) {
+            ranking = true;
+        } else if (!strcmp(argv[i], "--series") && hasValue) {
+            seriesPath = argv[++i];
+        } else if (!strcmp(argv[i], "--stacks") && hasValue) {
+            valid = parseStackIds(argv[++i], &stackFilter);
+        } else if (!strcmp(argv[i], "--from") && hasValue) {
+            valid = hasFrom = parseSeconds(argv[++i], &from);
+        } else if (!strcmp(argv[i], "--to") && hasValue) {
+            valid = parseSeconds(argv[++i], &to);
+        } else if (!strcmp(argv[i], "--threads") && hasValue) {
+            threads = atoi(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            logPath = argv[i];
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            usage();
+            return strcmp(argv[i], "-h") && strcmp(argv[i], "--help") ? 1 : 0;
+        }
+    }
+    if (!seriesPath)
+        ranking = true;
+    uint64_t baselineTime = hasFrom ? from : 7200 * NanosecondsPerSecond;
+
+    string error;
+    unique_ptr<MmapLogReader> reader = MmapLogReader::open(logPath, threads, &error);
+    if (!reader) {
+        fprintf(stderr, "mmap-log-analyze: %s\n", error.c_str());
+        return 1;
+    }
+    FILE* series = nullptr;
+    if (seriesPath) {
+        series = strcmp(seriesPath, "-") ? fopen(seriesPath, "w") : stdout;
+        if (!series) {
+            perror(seriesPath);
+            return 1;
+        }
+        fprintf(series, "Time\tMemory\n");
+    }
+
+    Replay replay(stackFilter);
+    unordered_map<uint32_t, int64_t> baseline;
+    bool baselineTaken = false;
+    // One line per timestamp, with the memory once all its events are applied.
+    uint64_t lastTime = 0;
+    auto printSeries = [&]() {
+        if (series && lastTime >= from) {
+            printTime(series, lastTime);
+            fprintf(series, "\t%" PRId64 "\n", replay.filteredMemory());
+        }
+    };
+    vector<MmapEventRecord> events;
+    bool reachedEnd = false;
+    while (!reachedEnd && reader->readBatch(events)) {
+        for (const MmapEventRecord& event : events) {
+            if (event.timestamp > to) {
+                reachedEnd = true;
+                break;
+            }
+            if (event.timestamp > lastTime) {
+                printSeries();
+                lastTime = event.timestamp;
+            }
+            if (ranking && !baselineTaken && event.timestamp >= baselineTime) {
+                baseline = replay.memoryByStack();
+                baselineTaken = true;
+            }
+            replay.apply(event);
+        }
+    }
+    if (!reader->error().empty()) {
+        fprintf(stderr, "mmap-log-analyze: %s: %s\n", logPath, reader->error().c_str());
+        return 1;
+    }
+    printSeries();
+    if (series && series != stdout)
+        fclose(series);
+
+    if (replay.unknownUnmaps())
+        fprintf(stderr, "mmap-log-analyze: %zu unmaps of memory that wasn't mapped\n", replay.unknownUnmaps());
+    if (ranking) {
+        if (!baselineTaken) {
+            fprintf(stderr, "mmap-log-analyze: the log ends before %.0f s, ranking the growth since its start\n",
+                    baselineTime / 1e9);
+        }
+        printRanking(baseline, replay.memoryByStack());
+    }
+    return 0;
+}
@@ -0,0 +1,255 @@
+#include "mmap-log-reader.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+// Text parsed per batch, split among the threads, and records per batch of a binary log.
+static const size_t TextBatchSize = 64 << 20;
+static const size_t BinaryBatchRecords = 1 << 20;
+
+namespace {
+
+// Walks a line of the text log. All the reads are bounded by the end of the line: the last one of the file may not
+// have a line feed, and nothing follows it in the mapping.
+struct Cursor {
+    const char* position;
+    const char* end;
+
+    bool literal(const char* text) {
+        size_t length = strlen(text);
+        if (static_cast<size_t>(end - position) < length || memcmp(position, text, length) != 0)
+            return false;
+        position += length;
+        return true;
+    }
+
+    bool decimal(uint64_t* value) {
+        const char* start = position;
+        *value = 0;
+        while (position < end && *position >= '0' && *position <= '9')
+            *value = *value * 10 + (*position++ - '0');
+        return position != start;
+    }
+
+    bool hexadecimal(uint64_t* value) {
+        const char* start = position;
+        *value = 0;
+        for (; position < end; position++) {
+            char c = *position;
+            if (c >= '0' && c <= '9')
+                *value = *value * 16 + (c - '0');
+            else if (c >= 'a' && c <= 'f')
+                *value = *value * 16 + (c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F')
+                *value = *value * 16 + (c - 'A' + 10);
+            else
+                break;
+        }
+        return position != start;
+    }
+
+    // Seconds, as written by mmap-log-convert ("%.6f") or by the ostream of older versions (e.g. "1.23457e+06").
+    bool timestamp(uint64_t* nanoseconds) {
+        char buffer[32];
+        size_t length = 0;
+        while (position < end && length < sizeof(buffer) - 1 && *position != ' ')
+            buffer[length++] = *position++;
+        buffer[length] = '\0';
+        char* parsedEnd;
+        double seconds = strtod(buffer, &parsedEnd);
+        if (!length || *parsedEnd || seconds < 0)
+            return false;
+        *nanoseconds = static_cast<uint64_t>(seconds * 1e9 + 0.5);
+        return true;
+    }
+
+    bool origin(MmapEventOrigin* origin) {
+        *origin = MmapEventOrigin::Mmap;
+        if (position == end)
+            return true;
+        if (!literal(" ("))
+            return false;
+        for (uint16_t value = 0; value <= static_cast<uint16_t>(MmapEventOrigin::Reuse); value++) {
+            MmapEventOrigin candidate = static_cast<MmapEventOrigin>(value);
+            if (literal(mmapEventOriginName(candidate)) && literal(")")) {
+                *origin = candidate;
+                return position == end;
+            }
+        }
+        return false;
+    }
+};
+
+}
+
+bool MmapLogReader::parseLine(const char* begin, const char* end, MmapEventRecord* record) {
+    Cursor cursor { begin, end };
+    memset(record, 0, sizeof(*record));
+    uint64_t stackId;
+    if (!cursor.timestamp(&record->timestamp) || !cursor.literal(" "))
+        return false;
+    if (cursor.literal("MAP: 0x")) {
+        record->type = MmapEventType::Map;
+        if (!cursor.hexadecimal(&record->address) || !cursor.literal(" (") || !cursor.decimal(&record->length)
+            || !cursor.literal(" bytes) stackTrace=") || !cursor.decimal(&stackId))
+            return false;
+        record->stackId = stackId;
+        return cursor.origin(&record->origin);
+    }
+    if (cursor.literal("UNMAP: 0x")) {
+        record->type = MmapEventType::Unmap;
+        return cursor.hexadecimal(&record->address) && cursor.literal(" (") && cursor.decimal(&record->length)
+            && cursor.literal(" bytes)") && cursor.origin(&record->origin);
+    }
+    if (cursor.literal("ERROR: UNMAP FAILED: 0x")) {
+        record->type = MmapEventType::UnmapFailed;
+        return cursor.hexadecimal(&record->address) && cursor.literal(" (") && cursor.decimal(&record->length)
+            && cursor.literal(" bytes)") && cursor.position == end;
+    }
+    return false;
+}
+
+unique_ptr<MmapLogReader> MmapLogReader::open(const string& path, unsigned threads, string* error) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) {
+        *error = path + ": " + strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        return nullptr;
+    }
+    size_t size = status.st_size;
+    const char* data = nullptr;
+    if (size) {
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            *error = path + ": " + strerror(errno);
+            close(fd);
+            return nullptr;
+        }
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        data = static_cast<const char*>(mapping);
+    }
+    close(fd);
+
+    MmapEventLogHeader header;
+    bool binary = size >= sizeof(header) && memcmp(data, MmapEventLogMagic, sizeof(header.magic)) == 0;
+    if (binary) {
+        memcpy(&header, data, sizeof(header));
+        if (header.version != MmapEventLogVersion || header.recordSize != sizeof(MmapEventRecord)) {
+            *error = path + ": unsupported version " + to_string(header.version) + " (record size "
+                + to_string(header.recordSize) + ")";
+            munmap(const_cast<char*>(data), size);
+            return nullptr;
+        }
+    }
+    return unique_ptr<MmapLogReader>(new MmapLogReader(data, size, binary ? sizeof(header) : 0, binary,
+                                                       max(threads, 1u)));
+}
+
+MmapLogReader::MmapLogReader(const char* data, size_t size, size_t offset, bool binary, unsigned threads)
+    : m_data(data), m_size(size), m_offset(offset), m_binary(binary), m_threads(threads), m_threadEvents(threads)
+{}
+
+MmapLogReader::~MmapLogReader() {
+    if (m_size)
+        munmap(const_cast<char*>(m_data), m_size);
+}
+
+bool MmapLogReader::readBatch(vector<MmapEventRecord>& events) {
+    events.clear();
+    if (!m_error.empty())
+        return false;
+    releaseReadPages();
+    return m_binary ? readBinaryBatch(events) : readTextBatch(events);
+}
+
+void MmapLogReader::releaseReadPages() {
+    // The mapping is read-only: dropping the pages already parsed only drops them from the page tables of the
+    // analyzer, so that its memory doesn't grow with the size of the log.
+    const size_t pageSize = sysconf(_SC_PAGE_SIZE);
+    size_t releasedEnd = m_offset & ~(pageSize - 1);
+    if (releasedEnd > m_releasedOffset) {
+        madvise(const_cast<char*>(m_data) + m_releasedOffset, releasedEnd - m_releasedOffset, MADV_DONTNEED);
+        m_releasedOffset = releasedEnd;
+    }
+}
+
+bool MmapLogReader::readBinaryBatch(vector<MmapEventRecord>& events) {
+    // A truncated record at the end means the application was killed while the log was being written.
+    size_t count = min(BinaryBatchRecords, (m_size - m_offset) / sizeof(MmapEventRecord));
+    if (!count)
+        return false;
+    events.resize(count);
+    memcpy(events.data(), m_data + m_offset, count * sizeof(MmapEventRecord));
+    m_offset += count * sizeof(MmapEventRecord);
+    events.erase(remove_if(events.begin(), events.end(), [](const MmapEventRecord& record) {
+        return record.type == MmapEventType::UnmapFailed;
+    }), events.end());
+    return true;
+}
+
+const char* MmapLogReader::parseLines(const char* begin, const char* end, vector<MmapEventRecord>& events) {
+    events.clear();
+    while (begin < end) {
+        const char* lineEnd = static_cast<const char*>(memchr(begin, '\n', end - begin));
+        if (!lineEnd)
+            lineEnd = end;
+        MmapEventRecord record;
+        if (lineEnd != begin) {
+            if (!parseLine(begin, lineEnd, &record))
+                return begin;
+            if (record.type != MmapEventType::UnmapFailed)
+                events.push_back(record);
+        }
+        begin = lineEnd + 1;
+    }
+    return nullptr;
+}
+
+bool MmapLogReader::readTextBatch(vector<MmapEventRecord>& events) {
+    if (m_offset >= m_size)
+        return false;
+    auto nextLine = [this](size_t offset) {
+        if (offset >= m_size)
+            return m_size;
+        const char* lineFeed = static_cast<const char*>(memchr(m_data + offset, '\n', m_size - offset));
+        return lineFeed ? lineFeed - m_data + 1 : m_size;
+    };
+    size_t batchEnd = nextLine(min(m_offset + TextBatchSize, m_size));
+
+    // Every thread parses whole lines, so the chunks are cut after a line feed.
+    vector<size_t> bounds { m_offset };
+    for (unsigned i = 1; i < m_threads; i++)
+        bounds.push_back(max(bounds.back(), min(batchEnd, nextLine(m_offset + (batchEnd - m_offset) * i / m_threads))));
+    bounds.push_back(batchEnd);
+
+    vector<const char*> failedLines(m_threads);
+    auto parseChunk = [&](unsigned i) {
+        failedLines[i] = parseLines(m_data + bounds[i], m_data + bounds[i + 1], m_threadEvents[i]);
+    };
+    vector<thread> workers;
+    for (unsigned i = 1; i < m_threads; i++)
+        workers.emplace_back(parseChunk, i);
+    parseChunk(0);
+    for (thread& worker : workers)
+        worker.join();
+
+    for (unsigned i = 0; i < m_threads; i++) {
+        if (failedLines[i]) {
+            const char* lineEnd = static_cast<const char*>(memchr(failedLines[i], '\n', m_data + m_size - failedLines[i]));
+            m_error = "line " + to_string(count(m_data, failedLines[i], '\n') + 1) + " is not an event: "
+                + string(failedLines[i], lineEnd ? lineEnd : m_data + m_size);
+            return false;
+        }
+        events.insert(events.end(), m_threadEvents[i].begin(), m_threadEvents[i].end());
+    }
+    m_offset = batchEnd;
+    return true;
+}
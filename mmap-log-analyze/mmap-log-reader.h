@@ -0,0 +1,48 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "mmap-event-record.h"
+using namespace std;
+
+/** Reads the events of an mmap-counter log in batches, from a read-only mapping of the file, so that logs much bigger
+ * than the memory of the machine can be streamed. The pages of the batches already read are given back to the kernel.
+ *
+ * Both the binary log written by libmmap-counter.so and its text form (mmap-log-convert, or the log written by older
+ * versions of the library) are read. The lines of a text batch are split in as many chunks as there are threads, and
+ * parsed in parallel; events come out in the order of the log anyway. */
+class MmapLogReader {
+public:
+    // Returns nullptr, with the reason in `error`, if the file can't be read.
+    static unique_ptr<MmapLogReader> open(const string& path, unsigned threads, string* error);
+    ~MmapLogReader();
+
+    /** Replaces `events` with the next batch. Returns false at the end of the log, or if a line can't be parsed: then
+     * `error()` says which one. Events of failed munmap() calls are skipped. */
+    bool readBatch(vector<MmapEventRecord>& events);
+
+    const string& error() const { return m_error; }
+
+    // Parses one line of the text log, without its line feed. Returns false if it's not an event.
+    static bool parseLine(const char* begin, const char* end, MmapEventRecord* record);
+
+private:
+    MmapLogReader(const char* data, size_t size, size_t offset, bool binary, unsigned threads);
+
+    bool readBinaryBatch(vector<MmapEventRecord>& events);
+    bool readTextBatch(vector<MmapEventRecord>& events);
+    // Parses the lines of [begin, end), which ends at a line boundary. Returns the offending line, or nullptr.
+    static const char* parseLines(const char* begin, const char* end, vector<MmapEventRecord>& events);
+    void releaseReadPages();
+
+    const char* m_data;
+    size_t m_size;
+    size_t m_offset;
+    size_t m_releasedOffset = 0;
+    bool m_binary;
+    unsigned m_threads;
+    vector<vector<MmapEventRecord>> m_threadEvents;
+    string m_error;
+};
@@ -0,0 +1,66 @@
+/* Converts the binary event log of mmap-counter to the text format read by parse-mmap-log.py:
+ *
+ *   mmap-log-convert [/tmp/mmap-event-log.bin] > mmap-event-log
+ */
+#include "mmap-event-record.h"
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+static void printOrigin(const MmapEventRecord& record) {
+    // Events of munmap() and mmap() keep their original format.
+    if (record.origin != MmapEventOrigin::Mmap)
+        printf(" (%s)", mmapEventOriginName(record.origin));
+    printf("\n");
+}
+
+static void printRecord(const MmapEventRecord& record) {
+    double time = record.timestamp / 1e9;
+    switch (record.type) {
+    case MmapEventType::Map:
+        printf("%.6f MAP: 0x%" PRIx64 " (%" PRIu64 " bytes) stackTrace=%" PRIu32,
+               time, record.address, record.length, record.stackId);
+        printOrigin(record);
+        break;
+    case MmapEventType::Unmap:
+        printf("%.6f UNMAP: 0x%" PRIx64 " (%" PRIu64 " bytes)", time, record.address, record.length);
+        printOrigin(record);
+        break;
+    case MmapEventType::UnmapFailed:
+        printf("%.6f ERROR: UNMAP FAILED: 0x%" PRIx64 " (%" PRIu64 " bytes)\n", time, record.address, record.length);
+        break;
+    default:
+        fprintf(stderr, "Unknown event type %u at %.6f\n", static_cast<unsigned>(record.type), time);
+        break;
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* path = argc > 1 ? argv[1] : "/tmp/mmap-event-log.bin";
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        return 1;
+    }
+
+    MmapEventLogHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, MmapEventLogMagic, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s: not an mmap-counter event log\n", path);
+        return 1;
+    }
+    if (header.version != MmapEventLogVersion || header.recordSize != sizeof(MmapEventRecord)) {
+        fprintf(stderr, "%s: unsupported version %u (record size %u)\n", path, header.version, header.recordSize);
+        return 1;
+    }
+
+    static MmapEventRecord records[4096];
+    size_t count;
+    while ((count = fread(records, sizeof(MmapEventRecord), sizeof(records) / sizeof(records[0]), file)) > 0) {
+        for (size_t i = 0; i < count; i++)
+            printRecord(records[i]);
+    }
+    // A truncated record at the end means the application was killed while the log was being written.
+    fclose(file);
+    return 0;
+}
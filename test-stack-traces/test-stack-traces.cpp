@@ -1,13 +1,71 @@
+// Prints the distinct stacks found in the comparator of a sort(), then measures each unwinder (see
+// Environment::Unwinder): the time it takes per frame, and how many frames it gets right compared to libunwind, at
+// several depths of calls through dummy-lib.
+//
+// Usage: test-stack-traces [<traces-per-measurement>]
 #include "stack-trace.h"
+#include "environment.h"
 #include "dummy-lib.h"
 #include <vector>
 #include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <initializer_list>
 #include <unordered_map>
 using namespace std;
 
 std::unordered_map<StackTrace, int> myMap;
 
-int main() {
+struct UnwinderResult {
+    double nanosecondsPerFrame;
+    size_t frames;
+    // Frames equal to those found by libunwind, from the top until the first difference.
+    size_t matchingFrames;
+};
+
+// Takes `count` traces with `unwinder` and returns the last one.
+__attribute__((noinline)) static StackTrace takeTraces(Environment::Unwinder unwinder, unsigned long count) {
+    environment.unwinder = unwinder;
+    for (unsigned long i = 1; i < count; i++)
+        StackTrace discarded;
+    StackTrace trace;
+    environment.unwinder = Environment::Unwinder::Libunwind;
+    return trace;
+}
+
+// Measures `unwinder` at the end of `depth` nested calls through callMeBack().
+static UnwinderResult measure(Environment::Unwinder unwinder, unsigned int depth, unsigned long count) {
+    UnwinderResult result = {};
+    if (depth > 0) {
+        callMeBack([&]() {
+            result = measure(unwinder, depth - 1, count);
+        });
+        return result;
+    }
+
+    // Both traces are taken from the same call site, so they should be equal.
+    vector<StackTrace> traces;
+    chrono::duration<double, nano> elapsed;
+    for (Environment::Unwinder current : { Environment::Unwinder::Libunwind, unwinder }) {
+        auto start = chrono::steady_clock::now();
+        traces.push_back(takeTraces(current, count));
+        elapsed = chrono::steady_clock::now() - start;
+    }
+
+    const vector<void*>& expected = traces[0].returnAddresses();
+    const vector<void*>& found = traces[1].returnAddresses();
+    result.frames = found.size();
+    result.nanosecondsPerFrame = elapsed.count() / count / max(found.size(), static_cast<size_t>(1));
+    while (result.matchingFrames < min(expected.size(), found.size())
+           && expected[result.matchingFrames] == found[result.matchingFrames])
+        result.matchingFrames++;
+    return result;
+}
+
+int main(int argc, char** argv) {
+    unsigned long count = argc > 1 ? atol(argv[1]) : 2000;
+
     std::vector<int> v = {{1, 2, 3, 4, 5, 6, 7}};
     sort(v.begin(), v.end(), [](int a, int b) {
         callMeBack([]() {
@@ -25,5 +83,16 @@ int main() {
         cerr << kv.second << " calls at:" << endl;
         cerr << kv.first << endl;
     }
+
+    printf("%-14s %-7s %-8s %-10s %s\n", "unwinder", "depth", "frames", "matching", "ns per frame");
+    for (Environment::Unwinder unwinder : { Environment::Unwinder::Libunwind, Environment::Unwinder::Backtrace,
+                                            Environment::Unwinder::FramePointer }) {
+        static const char* const names[] = { "libunwind", "backtrace", "framepointer" };
+        for (unsigned int depth : { 1, 8, 32, 128 }) {
+            UnwinderResult result = measure(unwinder, depth, count);
+            printf("%-14s %-7u %-8zu %-10zu %.1f\n", names[static_cast<int>(unwinder)], depth, result.frames,
+                   result.matchingFrames, result.nanosecondsPerFrame);
+        }
+    }
     return 0;
 }